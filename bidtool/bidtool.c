@@ -71,10 +71,44 @@ BIDPrintTicketFlags(uint32_t ulTicketFlags)
     printf("\n");
 }
 
+/*
+ * The most recent ticket for each audience is also stored without the
+ * subject in its key; don't list it twice.
+ */
+static int
+BIDIsDefaultTicketCacheEntryP(
+    BIDContext context,
+    BIDCache cache,
+    const char *k,
+    json_t *j)
+{
+    const char *crv = _BIDJsonStringValue(_BIDJsonObjectGet(context, j, "crv"));
+    const char *aud = _BIDJsonStringValue(_BIDJsonObjectGet(context, j, "aud"));
+    const char *sub = _BIDJsonStringValue(_BIDJsonObjectGet(context, j, "sub"));
+    char *szKey = NULL;
+    json_t *other = NULL;
+    int bDefault = 0;
+
+    if (crv == NULL || aud == NULL || sub == NULL)
+        return 0;
+
+    if (_BIDMakeTicketCacheKey(context, crv, aud, sub, &szKey) != BID_S_OK)
+        return 0;
+
+    if (strcmp(k, szKey) != 0 &&
+        _BIDGetCacheObject(context, cache, szKey, &other) == BID_S_OK)
+        bDefault = 1;
+
+    BIDFree(szKey);
+    json_decref(other);
+
+    return bDefault;
+}
+
 static BIDError
 BIDPrintVerboseTicketCacheEntry(
     BIDContext context,
-    BIDCache cache BID_UNUSED,
+    BIDCache cache,
     const char *k,
     json_t *j,
     void *data BID_UNUSED)
@@ -85,6 +119,9 @@ BIDPrintVerboseTicketCacheEntry(
     json_t *tkt = _BIDJsonObjectGet(context, j, "tkt");
     uint32_t ulTicketFlags = (uint32_t)_BIDJsonIntegerValue(_BIDJsonObjectGet(context, j, "flags"));
 
+    if (BIDIsDefaultTicketCacheEntryP(context, cache, k, j))
+        return BID_S_OK;
+
     _BIDGetJsonTimestampValue(gContext, j, "iat", &issueTime);
     _BIDGetJsonTimestampValue(gContext, j, "exp", &certExpiryTime);
     _BIDGetJsonTimestampValue(gContext, tkt, "exp", &tktExpiryTime);
@@ -111,7 +148,7 @@ BIDPrintVerboseTicketCacheEntry(
 static BIDError
 BIDPrintTicketCacheEntry(
     BIDContext context,
-    BIDCache cache BID_UNUSED,
+    BIDCache cache,
     const char *k,
     json_t *j,
     void *data BID_UNUSED)
@@ -121,6 +158,9 @@ BIDPrintTicketCacheEntry(
     json_t *tkt = _BIDJsonObjectGet(context, j, "tkt");
     const char *aud = _BIDJsonStringValue(_BIDJsonObjectGet(context, j, "aud"));
 
+    if (BIDIsDefaultTicketCacheEntryP(context, cache, k, j))
+        return BID_S_OK;
+
     _BIDGetJsonTimestampValue(gContext, tkt, "exp", &expiryTime);
 
     szExpiry = gNow < expiryTime ? ctime(&expiryTime) : ">>> Expired <<<";
@@ -45,6 +45,458 @@ _BIDAcquireDefaultAuthorityCache(BIDContext context)
     return _BIDAcquireCacheForUser(context, "browserid.authority", &context->AuthorityCache);
 }
 
+static int
+_BIDAuthorityEqual(
+    const char *a1,
+    const char *a2)
+{
+    return (strcasecmp(a1, a2) == 0);
+}
+
+/*
+ * Authority documents being retrieved, so that concurrent lookups of the
+ * same hostname share a single fetch rather than each making their own.
+ */
+struct BIDAuthorityFetchDesc {
+    struct BIDAuthorityFetchDesc *Next;
+    char *Hostname;
+    unsigned long cRefs;
+    int bStarted;
+    int bComplete;
+    BIDError Error;
+    json_t *Authority;
+};
+
+static struct {
+    BID_MUTEX Mutex;
+    BID_COND Complete;
+    struct BIDAuthorityFetchDesc *Fetches;
+} _BIDAuthorityFetches;
+
+void
+_BIDAuthorityInit(void)
+{
+    BID_MUTEX_INIT(&_BIDAuthorityFetches.Mutex);
+    BID_COND_INIT(&_BIDAuthorityFetches.Complete);
+}
+
+/*
+ * The following functions must be called with _BIDAuthorityFetches.Mutex held.
+ */
+static struct BIDAuthorityFetchDesc *
+_BIDFindAuthorityFetch(const char *szHostname)
+{
+    struct BIDAuthorityFetchDesc *fetch;
+
+    for (fetch = _BIDAuthorityFetches.Fetches; fetch != NULL; fetch = fetch->Next) {
+        if (_BIDAuthorityEqual(fetch->Hostname, szHostname))
+            break;
+    }
+
+    return fetch;
+}
+
+static BIDError
+_BIDAllocAuthorityFetch(
+    BIDContext context,
+    const char *szHostname,
+    struct BIDAuthorityFetchDesc **pFetch)
+{
+    struct BIDAuthorityFetchDesc *fetch;
+
+    *pFetch = NULL;
+
+    fetch = BIDCalloc(1, sizeof(*fetch));
+    if (fetch == NULL ||
+        _BIDDuplicateString(context, szHostname, &fetch->Hostname) != BID_S_OK) {
+        BIDFree(fetch);
+        return BID_S_NO_MEMORY;
+    }
+
+    fetch->cRefs = 1;
+    fetch->bStarted = 1;
+    fetch->Next = _BIDAuthorityFetches.Fetches;
+    _BIDAuthorityFetches.Fetches = fetch;
+
+    *pFetch = fetch;
+
+    return BID_S_OK;
+}
+
+static void
+_BIDCompleteAuthorityFetch(struct BIDAuthorityFetchDesc *fetch)
+{
+    struct BIDAuthorityFetchDesc **pFetch;
+
+    for (pFetch = &_BIDAuthorityFetches.Fetches; *pFetch != fetch; pFetch = &(*pFetch)->Next)
+        ;
+    *pFetch = fetch->Next;
+
+    fetch->bComplete = 1;
+    BID_COND_BROADCAST(&_BIDAuthorityFetches.Complete);
+}
+
+static void
+_BIDReleaseAuthorityFetch(struct BIDAuthorityFetchDesc *fetch)
+{
+    if (--fetch->cRefs != 0)
+        return;
+
+    json_decref(fetch->Authority);
+    BIDFree(fetch->Hostname);
+    BIDFree(fetch);
+}
+
+/*
+ * Remember that an authority could not be retrieved. A stale document in
+ * the cache continues to be used until the end of its stale window, but
+ * is not refreshed again before its retry time; otherwise the error itself
+ * is cached. Either way the interval doubles with each consecutive failure.
+ */
+static void
+_BIDCacheAuthorityFailure(
+    BIDContext context,
+    const char *szHostname,
+    time_t verificationTime,
+    BIDError retrieveErr)
+{
+    BIDError err;
+    json_t *cached = NULL;
+    json_t *entry = NULL;
+    json_int_t cFailures = 0, i;
+    time_t backoff = BID_AUTHORITY_RETRY_MIN;
+
+    if ((context->ContextOptions & BID_CONTEXT_AUTHORITY_CACHE) == 0 ||
+        retrieveErr == BID_S_NO_MEMORY)
+        return;
+
+    if (_BIDGetCacheObject(context, context->AuthorityCache, szHostname, &cached) == BID_S_OK) {
+        time_t expiryTime = 0;
+
+        cFailures = json_integer_value(json_object_get(cached, "failures"));
+
+        /* cache objects may be shared, so modify a copy */
+        _BIDGetJsonTimestampValue(context, cached, "exp", &expiryTime);
+        if (json_object_get(cached, "err") == NULL &&
+            verificationTime - expiryTime <= context->Skew + context->AuthorityStaleWindow)
+            entry = json_copy(cached);
+    }
+
+    for (i = 0; i < cFailures && backoff < BID_AUTHORITY_RETRY_MAX; i++)
+        backoff *= 2;
+    if (backoff > BID_AUTHORITY_RETRY_MAX)
+        backoff = BID_AUTHORITY_RETRY_MAX;
+
+    if (entry != NULL) {
+        err = _BIDSetJsonTimestampValue(context, entry, "retry", verificationTime + backoff);
+        BID_BAIL_ON_ERROR(err);
+    } else {
+        entry = json_object();
+        if (entry == NULL)
+            goto cleanup;
+
+        err = _BIDJsonObjectSet(context, entry, "err", json_integer(retrieveErr),
+                                BID_JSON_FLAG_REQUIRED | BID_JSON_FLAG_CONSUME_REF);
+        BID_BAIL_ON_ERROR(err);
+
+        err = _BIDSetJsonTimestampValue(context, entry, "exp", verificationTime + backoff);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    err = _BIDJsonObjectSet(context, entry, "failures", json_integer(cFailures + 1),
+                            BID_JSON_FLAG_REQUIRED | BID_JSON_FLAG_CONSUME_REF);
+    BID_BAIL_ON_ERROR(err);
+
+    _BIDSetCacheObject(context, context->AuthorityCache, szHostname, entry);
+
+cleanup:
+    json_decref(cached);
+    json_decref(entry);
+}
+
+/*
+ * Retrieve an authority document. If the cache holds an earlier copy, it is
+ * revalidated with a conditional request and, if unmodified, only its expiry
+ * time is updated.
+ */
+static BIDError
+_BIDRetrieveAuthority(
+    BIDContext context,
+    const char *szHostname,
+    time_t verificationTime,
+    BIDAuthority *pAuthority)
+{
+    BIDError err;
+    json_t *authority = NULL;
+    json_t *cached = NULL;
+    json_t *cacheMetadata = NULL;
+    time_t expiryTime = 0;
+
+    if (context->ContextOptions & BID_CONTEXT_AUTHORITY_CACHE) {
+        cacheMetadata = json_object();
+        if (cacheMetadata == NULL) {
+            err = BID_S_NO_MEMORY;
+            goto cleanup;
+        }
+
+        _BIDGetCacheObject(context, context->AuthorityCache, szHostname, &cached);
+
+        /* a cached failure has nothing to revalidate */
+        if (json_object_get(cached, "err") != NULL) {
+            json_decref(cached);
+            cached = NULL;
+        }
+
+        if (json_object_get(cached, "last-modified") != NULL)
+            json_object_set(cacheMetadata, "last-modified", json_object_get(cached, "last-modified"));
+        if (json_object_get(cached, "etag") != NULL)
+            json_object_set(cacheMetadata, "etag", json_object_get(cached, "etag"));
+    }
+
+    err = _BIDRetrieveDocument(context, szHostname, BID_WELL_KNOWN_URL, cacheMetadata,
+                               &authority, &expiryTime);
+    if (err == BID_S_DOCUMENT_NOT_MODIFIED && cached != NULL) {
+        /* cache objects may be shared, so modify a copy */
+        authority = json_copy(cached);
+        if (authority == NULL) {
+            err = BID_S_NO_MEMORY;
+            goto cleanup;
+        }
+
+        json_object_del(authority, "failures");
+        json_object_del(authority, "retry");
+
+        err = BID_S_OK;
+    }
+    BID_BAIL_ON_ERROR(err);
+
+    if (cacheMetadata != NULL && json_object_update(authority, cacheMetadata) != 0) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    err = _BIDSetJsonTimestampValue(context, authority, "exp", expiryTime);
+    BID_BAIL_ON_ERROR(err);
+
+    if (context->ContextOptions & BID_CONTEXT_AUTHORITY_CACHE)
+        _BIDSetCacheObject(context, context->AuthorityCache, szHostname, authority);
+
+    *pAuthority = authority;
+    authority = NULL;
+
+cleanup:
+    if (err != BID_S_OK)
+        _BIDCacheAuthorityFailure(context, szHostname, verificationTime, err);
+    json_decref(authority);
+    json_decref(cached);
+    json_decref(cacheMetadata);
+
+    return err;
+}
+
+/*
+ * Retrieve an authority document, waiting for the result of any fetch of
+ * the same hostname that is already in progress. A background refresh
+ * that is still queued is performed here instead, so that the caller does
+ * not wait behind unrelated work.
+ */
+static BIDError
+_BIDRetrieveAuthorityCoalesced(
+    BIDContext context,
+    const char *szHostname,
+    time_t verificationTime,
+    BIDAuthority *pAuthority)
+{
+    BIDError err;
+    struct BIDAuthorityFetchDesc *fetch;
+
+    BID_MUTEX_LOCK(&_BIDAuthorityFetches.Mutex);
+
+    fetch = _BIDFindAuthorityFetch(szHostname);
+    if (fetch != NULL && fetch->bStarted) {
+        fetch->cRefs++;
+
+        while (!fetch->bComplete)
+            BID_COND_WAIT(&_BIDAuthorityFetches.Complete, &_BIDAuthorityFetches.Mutex);
+    } else {
+        if (fetch != NULL) {
+            fetch->cRefs++;
+            fetch->bStarted = 1;
+        } else {
+            err = _BIDAllocAuthorityFetch(context, szHostname, &fetch);
+            if (err != BID_S_OK) {
+                BID_MUTEX_UNLOCK(&_BIDAuthorityFetches.Mutex);
+                return err;
+            }
+        }
+
+        BID_MUTEX_UNLOCK(&_BIDAuthorityFetches.Mutex);
+
+        fetch->Error = _BIDRetrieveAuthority(context, szHostname, verificationTime,
+                                             &fetch->Authority);
+
+        BID_MUTEX_LOCK(&_BIDAuthorityFetches.Mutex);
+
+        _BIDCompleteAuthorityFetch(fetch);
+    }
+
+    err = fetch->Error;
+    if (err == BID_S_OK)
+        *pAuthority = json_incref(fetch->Authority);
+
+    _BIDReleaseAuthorityFetch(fetch);
+
+    BID_MUTEX_UNLOCK(&_BIDAuthorityFetches.Mutex);
+
+    return err;
+}
+
+struct BIDRefreshArgsDesc {
+    BIDContext Context;
+    struct BIDAuthorityFetchDesc *Fetch;
+    time_t VerificationTime;
+};
+
+static void
+_BIDRefreshAuthorityThread(void *arg)
+{
+    struct BIDRefreshArgsDesc *args = (struct BIDRefreshArgsDesc *)arg;
+    struct BIDAuthorityFetchDesc *fetch = args->Fetch;
+    int bStarted;
+
+    BID_MUTEX_LOCK(&_BIDAuthorityFetches.Mutex);
+    bStarted = fetch->bStarted;
+    fetch->bStarted = 1;
+    BID_MUTEX_UNLOCK(&_BIDAuthorityFetches.Mutex);
+
+    /* a caller that needed the document may already have fetched it */
+    if (!bStarted)
+        fetch->Error = _BIDRetrieveAuthority(args->Context, fetch->Hostname,
+                                             args->VerificationTime, &fetch->Authority);
+
+    BID_MUTEX_LOCK(&_BIDAuthorityFetches.Mutex);
+    if (!bStarted)
+        _BIDCompleteAuthorityFetch(fetch);
+    _BIDReleaseAuthorityFetch(fetch);
+    BID_MUTEX_UNLOCK(&_BIDAuthorityFetches.Mutex);
+
+    BIDReleaseContext(args->Context);
+    BIDFree(args);
+}
+
+/*
+ * Start refreshing a stale authority document in the background, unless
+ * a fetch of the same hostname is already in progress. Callers that need
+ * the document before it has been refreshed share this fetch.
+ */
+static BIDError
+_BIDRefreshAuthority(
+    BIDContext context,
+    const char *szHostname,
+    time_t verificationTime)
+{
+    BIDError err = BID_S_OK;
+    struct BIDRefreshArgsDesc *args = NULL;
+    struct BIDAuthorityFetchDesc *fetch = NULL;
+
+    BID_MUTEX_LOCK(&_BIDAuthorityFetches.Mutex);
+
+    if (_BIDFindAuthorityFetch(szHostname) == NULL) {
+        err = _BIDAllocAuthorityFetch(context, szHostname, &fetch);
+        if (err == BID_S_OK)
+            fetch->bStarted = 0;
+    }
+
+    BID_MUTEX_UNLOCK(&_BIDAuthorityFetches.Mutex);
+
+    if (fetch == NULL)
+        return err;
+
+    args = BIDCalloc(1, sizeof(*args));
+    if (args == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    args->Fetch = fetch;
+    args->VerificationTime = verificationTime;
+
+    /* the fetch runs on a private clone, as the caller may modify its context */
+    err = BIDCloneContext(context, context->ContextOptions | BID_CONTEXT_THREAD_SAFE,
+                          &args->Context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDRunAsync(context, _BIDRefreshAuthorityThread, args);
+    BID_BAIL_ON_ERROR(err);
+
+    args = NULL;
+    fetch = NULL;
+
+cleanup:
+    if (fetch != NULL) {
+        BID_MUTEX_LOCK(&_BIDAuthorityFetches.Mutex);
+        if (!fetch->bStarted) {
+            fetch->bStarted = 1;
+            fetch->Error = err;
+            _BIDCompleteAuthorityFetch(fetch);
+        }
+        _BIDReleaseAuthorityFetch(fetch);
+        BID_MUTEX_UNLOCK(&_BIDAuthorityFetches.Mutex);
+    }
+    if (args != NULL) {
+        if (args->Context != BID_C_NO_CONTEXT)
+            BIDReleaseContext(args->Context);
+        BIDFree(args);
+    }
+
+    return err;
+}
+
+/*
+ * Check an authority cache entry, which may be a document or a failed
+ * retrieval. An expired document may be used while it is in its stale
+ * window, in which case a background refresh is started. On failure,
+ * *pbRetrieve is set if the authority should be retrieved again.
+ */
+static BIDError
+_BIDValidateCachedAuthority(
+    BIDContext context,
+    const char *szHostname,
+    time_t verificationTime,
+    json_t *authority,
+    int *pbRetrieve)
+{
+    BIDError err;
+    json_t *cachedErr;
+    time_t expiryTime = 0, retryTime = 0;
+
+    *pbRetrieve = 1;
+
+    _BIDGetJsonTimestampValue(context, authority, "exp", &expiryTime);
+
+    cachedErr = json_object_get(authority, "err");
+    if (cachedErr != NULL) {
+        if (verificationTime >= expiryTime)
+            return BID_S_EXPIRED_CERT;
+
+        *pbRetrieve = 0;
+        return (BIDError)json_integer_value(cachedErr);
+    }
+
+    err = _BIDValidateExpiry(context, verificationTime, authority);
+    if (err != BID_S_EXPIRED_ASSERTION)
+        return err;
+
+    if (verificationTime - expiryTime > context->Skew + context->AuthorityStaleWindow)
+        return BID_S_EXPIRED_CERT;
+
+    _BIDGetJsonTimestampValue(context, authority, "retry", &retryTime);
+    if (verificationTime >= retryTime)
+        _BIDRefreshAuthority(context, szHostname, verificationTime);
+
+    return BID_S_OK;
+}
+
 BIDError
 _BIDAcquireAuthority(
     BIDContext context,
@@ -54,7 +506,7 @@ _BIDAcquireAuthority(
 {
     BIDError err = BID_S_CACHE_NOT_FOUND;
     json_t *authority = NULL;
-    time_t expiryTime = 0;
+    int bRetrieve = 1;
 
     *pAuthority = NULL;
 
@@ -62,22 +514,19 @@ _BIDAcquireAuthority(
 
     if (context->ContextOptions & BID_CONTEXT_AUTHORITY_CACHE) {
         err = _BIDGetCacheObject(context, context->AuthorityCache, szHostname, &authority);
-        if (err == BID_S_OK) {
-            err = _BIDValidateExpiry(context, verificationTime, authority);
-            if (err == BID_S_EXPIRED_ASSERTION)
-                err = BID_S_EXPIRED_CERT;
-        }
+        if (err == BID_S_OK)
+            err = _BIDValidateCachedAuthority(context, szHostname, verificationTime,
+                                              authority, &bRetrieve);
     }
 
     if (err != BID_S_OK) {
-        err = _BIDRetrieveDocument(context, szHostname, BID_WELL_KNOWN_URL, 0, &authority, &expiryTime);
-        BID_BAIL_ON_ERROR(err);
+        json_decref(authority);
+        authority = NULL;
 
-        err = _BIDSetJsonTimestampValue(context, authority, "exp", expiryTime);
+        if (bRetrieve)
+            err = _BIDRetrieveAuthorityCoalesced(context, szHostname, verificationTime,
+                                                 &authority);
         BID_BAIL_ON_ERROR(err);
-
-        if (context->ContextOptions & BID_CONTEXT_AUTHORITY_CACHE)
-            _BIDSetCacheObject(context, context->AuthorityCache, szHostname, authority);
     }
 
     *pAuthority = authority;
@@ -103,14 +552,6 @@ _BIDGetAuthorityPublicKey(
     return BID_S_OK;
 }
 
-static int
-_BIDAuthorityEqual(
-    const char *a1,
-    const char *a2)
-{
-    return (strcasecmp(a1, a2) == 0);
-}
-
 /*
  * From https://github.com/mozilla/id-specs/blob/prod/browserid/index.md:
  *
@@ -209,3 +650,95 @@ _BIDReleaseAuthority(
     json_decref(authority);
     return BID_S_OK;
 }
+
+struct BIDPrefetchArgsDesc {
+    BIDContext Context;
+    BIDBackedAssertion BackedAssertion;
+    time_t VerificationTime;
+    uint32_t ulReqFlags;
+    BIDPrefetchCallback Callback;
+    void *CallbackArg;
+};
+
+static void
+_BIDReleasePrefetchArgs(struct BIDPrefetchArgsDesc *args)
+{
+    if (args->BackedAssertion != NULL)
+        _BIDReleaseBackedAssertion(args->Context, args->BackedAssertion);
+    if (args->Context != BID_C_NO_CONTEXT)
+        BIDReleaseContext(args->Context);
+    BIDFree(args);
+}
+
+static void
+_BIDPrefetchAuthoritiesThread(void *arg)
+{
+    struct BIDPrefetchArgsDesc *args = (struct BIDPrefetchArgsDesc *)arg;
+    BIDError err;
+
+    err = _BIDPrefetchCertAuthorities(args->Context, args->BackedAssertion,
+                                      args->VerificationTime, args->ulReqFlags);
+
+    args->Callback(args->Context, err, args->CallbackArg);
+
+    _BIDReleasePrefetchArgs(args);
+}
+
+BIDError
+BIDPrefetchAuthorities(
+    BIDContext context,
+    const char *szAssertion,
+    time_t verificationTime,
+    uint32_t ulReqFlags,
+    BIDPrefetchCallback callback,
+    void *callbackArg)
+{
+    BIDError err;
+    struct BIDPrefetchArgsDesc *args = NULL;
+
+    BID_CONTEXT_VALIDATE(context);
+
+    if (szAssertion == NULL || callback == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    if ((context->ContextOptions & BID_CONTEXT_RP) == 0)
+        return BID_S_INVALID_USAGE;
+
+    /* remote verification does not consult authorities locally */
+    if (context->ContextOptions & BID_CONTEXT_VERIFY_REMOTE) {
+        callback(context, BID_S_OK, callbackArg);
+        return BID_S_OK;
+    }
+
+    /* without a cache there is nowhere to keep the result */
+    if ((context->ContextOptions & BID_CONTEXT_AUTHORITY_CACHE) == 0)
+        return BID_S_INVALID_USAGE;
+
+    args = BIDCalloc(1, sizeof(*args));
+    if (args == NULL)
+        return BID_S_NO_MEMORY;
+
+    /* the fetch runs on a private clone, as the caller may modify its context */
+    err = BIDCloneContext(context, context->ContextOptions | BID_CONTEXT_THREAD_SAFE,
+                          &args->Context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDUnpackBackedAssertion(args->Context, szAssertion, &args->BackedAssertion);
+    BID_BAIL_ON_ERROR(err);
+
+    args->VerificationTime  = verificationTime;
+    args->ulReqFlags        = ulReqFlags;
+    args->Callback          = callback;
+    args->CallbackArg       = callbackArg;
+
+    err = _BIDRunAsync(context, _BIDPrefetchAuthoritiesThread, args);
+    BID_BAIL_ON_ERROR(err);
+
+    args = NULL;
+
+cleanup:
+    if (args != NULL)
+        _BIDReleasePrefetchArgs(args);
+
+    return err;
+}
@@ -80,22 +80,170 @@ static const char base64_chars[] =
 
 #define DECODE_ERROR ((ssize_t)-1)
 
-static ssize_t
-pos(char c)
+/*
+ * Maps an input character to its 6-bit value, or -1 if it is not part of
+ * either the URL or the standard alphabet.
+ */
+static const signed char base64_decode_table[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, 62, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+    -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, 63,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+#define pos(c)                  (base64_decode_table[(unsigned char)(c)])
+
+/*
+ * Vectorized decoding of runs of complete, unpadded quanta. Each vector is
+ * classified by character range, so both alphabets are accepted as with
+ * the table. A block containing anything else (padding, a JWT separator or
+ * garbage) ends the run and is left for the scalar decoder to handle, so
+ * the results are identical.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(BID_BASE64_NO_SIMD)
+#define BID_BASE64_X86_SIMD 1
+#include <immintrin.h>
+
+#define BASE64_IN_RANGE_128(c, lo, hi)                                      \
+    _mm_and_si128(_mm_cmpgt_epi8((c), _mm_set1_epi8((lo) - 1)),            \
+                  _mm_cmplt_epi8((c), _mm_set1_epi8((hi) + 1)))
+
+#define BASE64_IN_RANGE_256(c, lo, hi)                                      \
+    _mm256_and_si256(_mm256_cmpgt_epi8((c), _mm256_set1_epi8((lo) - 1)),   \
+                     _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), (c)))
+
+__attribute__((target("ssse3")))
+static size_t
+_BIDBase64DecodeBlocksSSSE3(const char *src, size_t cchSrc, unsigned char *dst)
 {
-    const char *p;
-
-    /* Also accept non-URL encoding */
-    if (c == '+')
-        c = '-';
-    else if (c == '/')
-        c = '_';
-    for (p = base64url_chars; *p != '\0'; p++) {
-	if (*p == c)
-	    return p - base64url_chars;
+    size_t i;
+
+    for (i = 0; i + 16 <= cchSrc; i += 16) {
+        __m128i c, m, valid, offset;
+        unsigned char out[16];
+
+        c = _mm_loadu_si128((const __m128i *)(src + i));
+
+        m = BASE64_IN_RANGE_128(c, 'A', 'Z');
+        valid = m;
+        offset = _mm_and_si128(m, _mm_set1_epi8(-'A'));
+        m = BASE64_IN_RANGE_128(c, 'a', 'z');
+        valid = _mm_or_si128(valid, m);
+        offset = _mm_or_si128(offset, _mm_and_si128(m, _mm_set1_epi8(26 - 'a')));
+        m = BASE64_IN_RANGE_128(c, '0', '9');
+        valid = _mm_or_si128(valid, m);
+        offset = _mm_or_si128(offset, _mm_and_si128(m, _mm_set1_epi8(52 - '0')));
+        m = _mm_cmpeq_epi8(c, _mm_set1_epi8('-'));
+        valid = _mm_or_si128(valid, m);
+        offset = _mm_or_si128(offset, _mm_and_si128(m, _mm_set1_epi8(62 - '-')));
+        m = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+        valid = _mm_or_si128(valid, m);
+        offset = _mm_or_si128(offset, _mm_and_si128(m, _mm_set1_epi8(62 - '+')));
+        m = _mm_cmpeq_epi8(c, _mm_set1_epi8('_'));
+        valid = _mm_or_si128(valid, m);
+        offset = _mm_or_si128(offset, _mm_and_si128(m, _mm_set1_epi8(63 - '_')));
+        m = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+        valid = _mm_or_si128(valid, m);
+        offset = _mm_or_si128(offset, _mm_and_si128(m, _mm_set1_epi8(63 - '/')));
+
+        if (_mm_movemask_epi8(valid) != 0xFFFF)
+            break;
+
+        /* pack four 6-bit values per 32-bit lane into three bytes */
+        c = _mm_add_epi8(c, offset);
+        c = _mm_maddubs_epi16(c, _mm_set1_epi32(0x01400140));
+        c = _mm_madd_epi16(c, _mm_set1_epi32(0x00011000));
+        c = _mm_shuffle_epi8(c, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                              14, 13, 12, -1, -1, -1, -1));
+        _mm_storeu_si128((__m128i *)out, c);
+        memcpy(dst, out, 12);
+        dst += 12;
     }
 
-    return DECODE_ERROR;
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t
+_BIDBase64DecodeBlocksAVX2(const char *src, size_t cchSrc, unsigned char *dst)
+{
+    size_t i;
+
+    for (i = 0; i + 32 <= cchSrc; i += 32) {
+        __m256i c, m, valid, offset;
+        unsigned char out[32];
+
+        c = _mm256_loadu_si256((const __m256i *)(src + i));
+
+        m = BASE64_IN_RANGE_256(c, 'A', 'Z');
+        valid = m;
+        offset = _mm256_and_si256(m, _mm256_set1_epi8(-'A'));
+        m = BASE64_IN_RANGE_256(c, 'a', 'z');
+        valid = _mm256_or_si256(valid, m);
+        offset = _mm256_or_si256(offset, _mm256_and_si256(m, _mm256_set1_epi8(26 - 'a')));
+        m = BASE64_IN_RANGE_256(c, '0', '9');
+        valid = _mm256_or_si256(valid, m);
+        offset = _mm256_or_si256(offset, _mm256_and_si256(m, _mm256_set1_epi8(52 - '0')));
+        m = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('-'));
+        valid = _mm256_or_si256(valid, m);
+        offset = _mm256_or_si256(offset, _mm256_and_si256(m, _mm256_set1_epi8(62 - '-')));
+        m = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('+'));
+        valid = _mm256_or_si256(valid, m);
+        offset = _mm256_or_si256(offset, _mm256_and_si256(m, _mm256_set1_epi8(62 - '+')));
+        m = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_'));
+        valid = _mm256_or_si256(valid, m);
+        offset = _mm256_or_si256(offset, _mm256_and_si256(m, _mm256_set1_epi8(63 - '_')));
+        m = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('/'));
+        valid = _mm256_or_si256(valid, m);
+        offset = _mm256_or_si256(offset, _mm256_and_si256(m, _mm256_set1_epi8(63 - '/')));
+
+        if (_mm256_movemask_epi8(valid) != -1)
+            break;
+
+        c = _mm256_add_epi8(c, offset);
+        c = _mm256_maddubs_epi16(c, _mm256_set1_epi32(0x01400140));
+        c = _mm256_madd_epi16(c, _mm256_set1_epi32(0x00011000));
+        c = _mm256_shuffle_epi8(c, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                                    14, 13, 12, -1, -1, -1, -1,
+                                                    2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                                    14, 13, 12, -1, -1, -1, -1));
+        /* close the gap between the two 12-byte lanes */
+        c = _mm256_permutevar8x32_epi32(c, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256((__m256i *)out, c);
+        memcpy(dst, out, 24);
+        dst += 24;
+    }
+
+    return i;
+}
+#endif /* BID_BASE64_X86_SIMD */
+
+/*
+ * Returns the number of characters consumed, always a multiple of four.
+ */
+static size_t
+_BIDBase64DecodeBlocks(const char *src, size_t cchSrc, unsigned char *dst)
+{
+#ifdef BID_BASE64_X86_SIMD
+    if (__builtin_cpu_supports("avx2"))
+        return _BIDBase64DecodeBlocksAVX2(src, cchSrc, dst);
+    else if (__builtin_cpu_supports("ssse3"))
+        return _BIDBase64DecodeBlocksSSSE3(src, cchSrc, dst);
+#endif
+
+    return 0;
 }
 
 BIDError
@@ -118,8 +266,8 @@ _BIDBase64Encode(
 {
     char *s, *p;
     const char *chars;
-    size_t i;
-    int c;
+    size_t i, rem;
+    uint32_t c;
     const unsigned char *q;
     int urlEncode = 0;
 
@@ -140,30 +288,34 @@ _BIDBase64Encode(
     }
     q = data;
     chars = urlEncode ? base64url_chars : base64_chars;
+    rem = size % 3;
 
-    for (i = 0; i < size;) {
-	c = q[i++];
-	c *= 256;
-	if (i < size)
-	    c += q[i];
-	i++;
-	c *= 256;
-	if (i < size)
-	    c += q[i];
-	i++;
-	p[0] = chars[(c & 0x00fc0000) >> 18];
-	p[1] = chars[(c & 0x0003f000) >> 12];
-	p[2] = chars[(c & 0x00000fc0) >> 6];
-	p[3] = chars[(c & 0x0000003f) >> 0];
-	if (i > size + 1)
-	    p[2] = urlEncode ? '\0' : '=';
-	else if (i > size)
-	    p[3] = urlEncode ? '\0' : '=';
+    for (i = 0; i < size - rem; i += 3) {
+        c = (q[i] << 16) | (q[i + 1] << 8) | q[i + 2];
+	p[0] = chars[(c >> 18) & 0x3f];
+	p[1] = chars[(c >> 12) & 0x3f];
+	p[2] = chars[(c >>  6) & 0x3f];
+	p[3] = chars[(c >>  0) & 0x3f];
 	p += 4;
     }
+
+    /* URL encoding omits the padding */
+    if (rem != 0) {
+        c = q[i] << 16;
+        if (rem == 2)
+            c |= q[i + 1] << 8;
+        *p++ = chars[(c >> 18) & 0x3f];
+        *p++ = chars[(c >> 12) & 0x3f];
+        if (rem == 2)
+            *p++ = chars[(c >> 6) & 0x3f];
+        else if (!urlEncode)
+            *p++ = '=';
+        if (!urlEncode)
+            *p++ = '=';
+    }
     *p = '\0';
     *str = s;
-    *pcchStr = strlen(s);
+    *pcchStr = p - s;
     return BID_S_OK;
 }
 
@@ -171,13 +323,12 @@ _BIDBase64Encode(
  * This attempts to deal with both URL and non-URL encoded base64.
  */
 static ssize_t
-_BIDBase64UrlTokenDecode(const char *token)
+_BIDBase64UrlTokenDecode(const char *token, size_t toklen)
 {
-    size_t i, toklen;
+    size_t i;
     size_t val = 0;
     size_t marker = 0;
 
-    toklen = strlen(token);
     if (toklen < 2)
         return DECODE_ERROR;
     else if (toklen > 4)
@@ -213,13 +364,23 @@ _BIDBase64UrlTokenDecode(const char *token)
 BIDError
 _BIDBase64UrlDecode(const char *str, unsigned char **pData, size_t *pcbData)
 {
-    const char *p;
+    return _BIDBase64UrlDecodeLength(str, strlen(str), pData, pcbData);
+}
+
+BIDError
+_BIDBase64UrlDecodeLength(
+    const char *str,
+    size_t cchStr,
+    unsigned char **pData,
+    size_t *pcbData)
+{
+    const char *p, *end;
     unsigned char *data, *q;
-    size_t maxLength;
+    size_t maxLength, cchBlocks;
     BIDError err;
 
     if (*pData == NULL) {
-        maxLength = strlen(str) + 1;
+        maxLength = cchStr + 1;
         data = BIDMalloc(maxLength);
         if (data == NULL)
             return BID_S_NO_MEMORY;
@@ -230,20 +391,39 @@ _BIDBase64UrlDecode(const char *str, unsigned char **pData, size_t *pcbData)
 
     q = data;
     p = str;
+    end = str + cchStr;
+
+    cchBlocks = cchStr;
+    if (cchBlocks > maxLength / 3 * 4)
+        cchBlocks = maxLength / 3 * 4;
+    cchBlocks = _BIDBase64DecodeBlocks(p, cchBlocks, q);
+    p += cchBlocks;
+    q += cchBlocks / 4 * 3;
 
-    while (*p != '\0' && *p != '=') {
+    while (p < end && *p != '=') {
 	ssize_t val;
 	uint8_t marker;
 
-        BID_ASSERT(p < str + maxLength);
-        BID_ASSERT(*pData != NULL || q - data <= maxLength);
+        /* fast path for a complete quantum */
+        if (end - p >= 4) {
+            int a = pos(p[0]), b = pos(p[1]), c = pos(p[2]), d = pos(p[3]);
 
-        if (q - data > maxLength) {
-	    err = BID_S_BUFFER_TOO_SMALL;
-            goto cleanup;
+            if ((a | b | c | d) >= 0) {
+                if (maxLength - (q - data) < 3) {
+                    err = BID_S_BUFFER_TOO_SMALL;
+                    goto cleanup;
+                }
+                val = (a << 18) | (b << 12) | (c << 6) | d;
+                q[0] = (val >> 16) & 0xff;
+                q[1] = (val >> 8) & 0xff;
+                q[2] = val & 0xff;
+                q += 3;
+                p += 4;
+                continue;
+            }
         }
 
-        val = _BIDBase64UrlTokenDecode(p);
+        val = _BIDBase64UrlTokenDecode(p, end - p);
 	if (val == DECODE_ERROR) {
 	    err = BID_S_INVALID_BASE64;
             goto cleanup;
@@ -251,6 +431,12 @@ _BIDBase64UrlDecode(const char *str, unsigned char **pData, size_t *pcbData)
 
         marker = (val >> 24) & 0xff;
         BID_ASSERT(marker < 3);
+
+        if (maxLength - (q - data) < 3 - marker) {
+	    err = BID_S_BUFFER_TOO_SMALL;
+            goto cleanup;
+        }
+
 	*q++ = (val >> 16) & 0xff;
 	if (marker < 2)
 	    *q++ = (val >> 8) & 0xff;
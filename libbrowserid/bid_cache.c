@@ -44,21 +44,58 @@
 #include <sys/stat.h>
 #endif
 
+/*
+ * Optional in-memory min-heap of cache entries ordered by expiry time, so
+ * that expired entries can be evicted a few at a time as new entries are
+ * stored rather than by walking the entire cache. Keys maps each live key
+ * to its current expiry time; heap entries that no longer match it were
+ * replaced or removed, and are discarded when they reach the top or when
+ * the heap is compacted.
+ */
+struct BIDCacheExpiryDesc {
+    time_t ExpiryTime;
+    char *Key;
+};
+
+struct BIDCacheExpiryIndexDesc {
+    time_t (*GetExpiryTime)(BIDContext, json_t *);
+    json_t *Keys;
+    size_t cEntries;
+    size_t cAllocated;
+    struct BIDCacheExpiryDesc *Entries;
+};
+
 struct BIDCacheDesc {
 #ifdef __APPLE__
     CFRuntimeBase Base;
 #endif
     struct BIDCacheOps *Ops;
     void *Data;
+#ifndef __APPLE__
+    volatile long References;
+#endif
+    BID_MUTEX ExpiryMutex;
+    struct BIDCacheExpiryIndexDesc *ExpiryIndex;
 };
 
+static void
+_BIDUpdateCacheExpiryIndex(
+    BIDContext context,
+    BIDCache cache,
+    const char *key,
+    json_t *value);
+
 static struct BIDCacheOps *_BIDCacheOps[] = {
 #ifdef WIN32
     &_BIDRegistryCache,
 #else
     &_BIDFileCache,
 #endif
-    &_BIDMemoryCache
+    &_BIDMemoryCache,
+#ifndef WIN32
+    &_BIDLogCache,
+    &_BIDMappedCache,
+#endif
 };
 
 BIDError
@@ -109,6 +146,11 @@ _BIDAcquireCache(
 
     cache->Ops = ops;
     cache->Data = NULL;
+#ifndef __APPLE__
+    cache->References = 1;
+#endif
+    BID_MUTEX_INIT(&cache->ExpiryMutex);
+    cache->ExpiryIndex = NULL;
 
     err = cache->Ops->Acquire(cache->Ops, context, &cache->Data, szCacheName, ulFlags);
     BID_BAIL_ON_ERROR(err);
@@ -123,12 +165,53 @@ cleanup:
     return err;
 }
 
+static void
+_BIDFreeCacheExpiryIndex(struct BIDCacheExpiryIndexDesc *index)
+{
+    size_t i;
+
+    if (index == NULL)
+        return;
+
+    for (i = 0; i < index->cEntries; i++)
+        BIDFree(index->Entries[i].Key);
+    BIDFree(index->Entries);
+    json_decref(index->Keys);
+    BIDFree(index);
+}
+
 void
 _BIDFinalizeCache(
     BIDCache cache)
 {
     if (cache->Ops->Release != NULL)
         cache->Ops->Release(cache->Ops, BID_C_NO_CONTEXT, cache->Data);
+
+    _BIDFreeCacheExpiryIndex(cache->ExpiryIndex);
+    BID_MUTEX_DESTROY(&cache->ExpiryMutex);
+}
+
+/*
+ * Cache handles are reference counted so that they can be shared between
+ * contexts, such as those cloned from a template with BIDCloneContext().
+ */
+BIDError
+_BIDRetainCache(
+    BIDContext context,
+    BIDCache cache)
+{
+    BID_CONTEXT_VALIDATE(context);
+
+    if (cache == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+#ifdef __APPLE__
+    CFRetain(cache);
+#else
+    BID_ATOMIC_INCREMENT(&cache->References);
+#endif
+
+    return BID_S_OK;
 }
 
 BIDError
@@ -147,8 +230,10 @@ _BIDReleaseCache(
 #ifdef __APPLE__
     CFRelease(cache);
 #else
-    _BIDFinalizeCache(cache);
-    BIDFree(cache);
+    if (BID_ATOMIC_DECREMENT(&cache->References) == 0) {
+        _BIDFinalizeCache(cache);
+        BIDFree(cache);
+    }
 #endif
 
     return BID_S_OK;
@@ -191,6 +276,11 @@ _BIDDestroyCache(
 
     err = cache->Ops->Destroy(cache->Ops, context, cache->Data);
 
+    BID_MUTEX_LOCK(&cache->ExpiryMutex);
+    _BIDFreeCacheExpiryIndex(cache->ExpiryIndex);
+    cache->ExpiryIndex = NULL;
+    BID_MUTEX_UNLOCK(&cache->ExpiryMutex);
+
     return err;
 }
 
@@ -302,6 +392,8 @@ _BIDSetCacheObject(
         return BID_S_NOT_IMPLEMENTED;
 
     err = cache->Ops->SetObject(cache->Ops, context, cache->Data, key, value);
+    if (err == BID_S_OK)
+        _BIDUpdateCacheExpiryIndex(context, cache, key, value);
 
     return err;
 }
@@ -326,6 +418,49 @@ _BIDRemoveCacheObject(
         return BID_S_NOT_IMPLEMENTED;
 
     err = cache->Ops->RemoveObject(cache->Ops, context, cache->Data, key);
+    if (err == BID_S_OK)
+        _BIDUpdateCacheExpiryIndex(context, cache, key, NULL);
+
+    return err;
+}
+
+/*
+ * Set key to value only if it is not already present, returning
+ * BID_S_CACHE_KEY_EXISTS otherwise. Backends without an atomic
+ * implementation fall back to a separate lookup and store.
+ */
+BIDError
+_BIDAddCacheObject(
+    BIDContext context,
+    BIDCache cache,
+    const char *key,
+    json_t *value)
+{
+    BIDError err;
+
+    BID_CONTEXT_VALIDATE(context);
+
+    if (cache == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    if (key == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    if (cache->Ops->AddObject != NULL) {
+        err = cache->Ops->AddObject(cache->Ops, context, cache->Data, key, value);
+    } else {
+        if (cache->Ops->GetObject == NULL || cache->Ops->SetObject == NULL)
+            return BID_S_NOT_IMPLEMENTED;
+
+        err = _BIDGetCacheObject(context, cache, key, NULL);
+        if (err == BID_S_OK)
+            return BID_S_CACHE_KEY_EXISTS;
+
+        err = cache->Ops->SetObject(cache->Ops, context, cache->Data, key, value);
+    }
+
+    if (err == BID_S_OK)
+        _BIDUpdateCacheExpiryIndex(context, cache, key, value);
 
     return err;
 }
@@ -483,6 +618,57 @@ _BIDCacheIteratorNext(
     return BID_S_OK;
 }
 
+/*
+ * Build a copy of a cache dictionary without the entries matching the
+ * predicate, for backends that purge by rewriting. If nothing matched,
+ * *pFiltered is NULL and the caller need not rewrite anything.
+ */
+BIDError
+_BIDCacheFilterObjects(
+    BIDContext context,
+    json_t *data,
+    int (*predicate)(BIDContext, const char *, json_t *, void *),
+    void *predicateData,
+    json_t **pFiltered)
+{
+    BIDError err;
+    json_t *filtered = NULL;
+    void *iter;
+    int bPurged = 0;
+
+    *pFiltered = NULL;
+
+    err = _BIDAllocJsonObject(context, &filtered);
+    BID_BAIL_ON_ERROR(err);
+
+    for (iter = json_object_iter(data);
+         iter != NULL;
+         iter = json_object_iter_next(data, iter)) {
+        const char *key = json_object_iter_key(iter);
+        json_t *value = json_object_iter_value(iter);
+
+        if (predicate(context, key, value, predicateData)) {
+            bPurged = 1;
+            continue;
+        }
+
+        err = _BIDJsonObjectSet(context, filtered, key, value, 0);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    if (bPurged) {
+        *pFiltered = filtered;
+        filtered = NULL;
+    }
+
+    err = BID_S_OK;
+
+cleanup:
+    json_decref(filtered);
+
+    return err;
+}
+
 BIDError
 _BIDPerformCacheObjects(
     BIDContext context,
@@ -516,6 +702,7 @@ _BIDPerformCacheObjects(
 struct BIDPurgeCacheArgsDesc {
     int (*Predicate)(BIDContext, BIDCache, const char *, json_t *, void *);
     void *Data;
+    BIDCache Cache;
 };
 
 static BIDError
@@ -534,6 +721,22 @@ _BIDRemoveCacheObjectIfPredicateTrue(
     return BID_S_OK;
 }
 
+static int
+_BIDPurgeCacheObjectP(
+    BIDContext context,
+    const char *szKey,
+    json_t *jsonValue,
+    void *data)
+{
+    struct BIDPurgeCacheArgsDesc *args = data;
+
+    return args->Predicate(context, args->Cache, szKey, jsonValue, args->Data);
+}
+
+/*
+ * Backends that implement PurgeObjects filter every entry under a single
+ * lock and rewrite once; otherwise each matching entry is removed in turn.
+ */
 BIDError
 _BIDPurgeCache(
     BIDContext context,
@@ -541,12 +744,364 @@ _BIDPurgeCache(
     int (*predicate)(BIDContext, BIDCache, const char *, json_t *, void *),
     void *data)
 {
+    BIDError err;
     struct BIDPurgeCacheArgsDesc args;
 
+    if (cache == NULL)
+        return BID_S_INVALID_PARAMETER;
+
     args.Predicate = predicate;
     args.Data = data;
+    args.Cache = cache;
+
+    if (cache->Ops->PurgeObjects != NULL) {
+        err = cache->Ops->PurgeObjects(cache->Ops, context, cache->Data,
+                                       _BIDPurgeCacheObjectP, &args);
+
+        /* the purged keys are not known, so rebuild the index on next use */
+        BID_MUTEX_LOCK(&cache->ExpiryMutex);
+        _BIDFreeCacheExpiryIndex(cache->ExpiryIndex);
+        cache->ExpiryIndex = NULL;
+        BID_MUTEX_UNLOCK(&cache->ExpiryMutex);
+    } else {
+        err = _BIDPerformCacheObjects(context, cache, _BIDRemoveCacheObjectIfPredicateTrue, &args);
+    }
+
+    return err;
+}
+
+static BIDError
+_BIDPushCacheExpiry(
+    struct BIDCacheExpiryIndexDesc *index,
+    time_t expiryTime,
+    char *szKey)
+{
+    struct BIDCacheExpiryDesc entry;
+    size_t i, parent;
+
+    if (index->cEntries == index->cAllocated) {
+        size_t cAllocated = index->cAllocated ? 2 * index->cAllocated : 64;
+        struct BIDCacheExpiryDesc *entries;
+
+        entries = BIDRealloc(index->Entries, cAllocated * sizeof(*entries));
+        if (entries == NULL)
+            return BID_S_NO_MEMORY;
+
+        index->Entries = entries;
+        index->cAllocated = cAllocated;
+    }
+
+    entry.ExpiryTime = expiryTime;
+    entry.Key = szKey;
+
+    for (i = index->cEntries++; i != 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (index->Entries[parent].ExpiryTime <= expiryTime)
+            break;
+        index->Entries[i] = index->Entries[parent];
+    }
+    index->Entries[i] = entry;
+
+    return BID_S_OK;
+}
 
-    return _BIDPerformCacheObjects(context, cache, _BIDRemoveCacheObjectIfPredicateTrue, &args);
+static void
+_BIDPopCacheExpiry(
+    struct BIDCacheExpiryIndexDesc *index,
+    struct BIDCacheExpiryDesc *pEntry)
+{
+    struct BIDCacheExpiryDesc last;
+    size_t i, child;
+
+    BID_ASSERT(index->cEntries != 0);
+
+    *pEntry = index->Entries[0];
+    last = index->Entries[--index->cEntries];
+
+    for (i = 0; (child = 2 * i + 1) < index->cEntries; i = child) {
+        if (child + 1 < index->cEntries &&
+            index->Entries[child + 1].ExpiryTime < index->Entries[child].ExpiryTime)
+            child++;
+        if (last.ExpiryTime <= index->Entries[child].ExpiryTime)
+            break;
+        index->Entries[i] = index->Entries[child];
+    }
+    if (index->cEntries != 0)
+        index->Entries[i] = last;
+}
+
+/*
+ * Add an entry to the index, replacing any earlier entry for the key.
+ * Called with the expiry mutex held; takes ownership of szKey.
+ */
+static BIDError
+_BIDIndexCacheExpiry(
+    struct BIDCacheExpiryIndexDesc *index,
+    time_t expiryTime,
+    char *szKey)
+{
+    BIDError err;
+
+    if (json_object_set_new(index->Keys, szKey, json_integer(expiryTime)) < 0) {
+        BIDFree(szKey);
+        return BID_S_NO_MEMORY;
+    }
+
+    err = _BIDPushCacheExpiry(index, expiryTime, szKey);
+    if (err != BID_S_OK)
+        BIDFree(szKey);
+
+    return err;
+}
+
+/*
+ * Returns non-zero if a heap entry is still the current one for its key.
+ */
+static int
+_BIDCacheExpiryCurrentP(
+    struct BIDCacheExpiryIndexDesc *index,
+    struct BIDCacheExpiryDesc *entry)
+{
+    json_t *expiryTime = json_object_get(index->Keys, entry->Key);
+
+    return expiryTime != NULL &&
+           (time_t)json_integer_value(expiryTime) == entry->ExpiryTime;
+}
+
+/*
+ * Rebuild the heap from the live keys once replaced and removed entries
+ * make up more than half of it, so that it stays proportional to the
+ * number of entries in the cache.
+ */
+static BIDError
+_BIDCompactCacheExpiryIndex(
+    BIDContext context,
+    struct BIDCacheExpiryIndexDesc *index)
+{
+    BIDError err;
+    size_t i;
+    void *iter;
+
+    if (index->cEntries <= 2 * json_object_size(index->Keys) + BID_CACHE_EVICT_BATCH)
+        return BID_S_OK;
+
+    for (i = 0; i < index->cEntries; i++)
+        BIDFree(index->Entries[i].Key);
+    index->cEntries = 0;
+
+    for (iter = json_object_iter(index->Keys);
+         iter != NULL;
+         iter = json_object_iter_next(index->Keys, iter)) {
+        char *szKey = NULL;
+
+        err = _BIDDuplicateString(context, json_object_iter_key(iter), &szKey);
+        if (err == BID_S_OK) {
+            err = _BIDPushCacheExpiry(index,
+                                      (time_t)json_integer_value(json_object_iter_value(iter)),
+                                      szKey);
+            if (err != BID_S_OK)
+                BIDFree(szKey);
+        }
+        if (err != BID_S_OK)
+            return err;
+    }
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDLoadCacheExpiryCB(
+    BIDContext context,
+    BIDCache cache,
+    const char *szKey,
+    json_t *jsonValue,
+    void *data BID_UNUSED)
+{
+    BIDError err;
+    char *szKeyCopy = NULL;
+
+    err = _BIDDuplicateString(context, szKey, &szKeyCopy);
+    if (err == BID_S_OK)
+        err = _BIDIndexCacheExpiry(cache->ExpiryIndex,
+                                   cache->ExpiryIndex->GetExpiryTime(context, jsonValue),
+                                   szKeyCopy);
+
+    return err;
+}
+
+/*
+ * Return the expiry index of a cache, creating it on first use from the
+ * entries already present. Called with the expiry mutex held.
+ */
+static BIDError
+_BIDGetCacheExpiryIndex(
+    BIDContext context,
+    BIDCache cache,
+    time_t (*getExpiryTime)(BIDContext, json_t *),
+    struct BIDCacheExpiryIndexDesc **pIndex)
+{
+    BIDError err;
+    struct BIDCacheExpiryIndexDesc *index = cache->ExpiryIndex;
+
+    if (index == NULL) {
+        index = BIDCalloc(1, sizeof(*index));
+        if (index == NULL)
+            return BID_S_NO_MEMORY;
+
+        index->GetExpiryTime = getExpiryTime;
+        index->Keys = json_object();
+        if (index->Keys == NULL) {
+            BIDFree(index);
+            return BID_S_NO_MEMORY;
+        }
+
+        cache->ExpiryIndex = index;
+
+        err = _BIDPerformCacheObjects(context, cache, _BIDLoadCacheExpiryCB, NULL);
+        if (err == BID_S_NO_MEMORY) {
+            _BIDFreeCacheExpiryIndex(index);
+            cache->ExpiryIndex = NULL;
+            return err;
+        }
+    }
+
+    *pIndex = index;
+
+    return BID_S_OK;
+}
+
+/*
+ * Keep an existing index in step with a store or (if value is NULL) a
+ * removal. The index is dropped if it cannot be updated, and rebuilt
+ * from the cache on next use.
+ */
+static void
+_BIDUpdateCacheExpiryIndex(
+    BIDContext context,
+    BIDCache cache,
+    const char *key,
+    json_t *value)
+{
+    BIDError err = BID_S_OK;
+    struct BIDCacheExpiryIndexDesc *index;
+    char *szKey = NULL;
+
+    BID_MUTEX_LOCK(&cache->ExpiryMutex);
+
+    index = cache->ExpiryIndex;
+    if (index == NULL)
+        goto cleanup;
+
+    if (value == NULL) {
+        json_object_del(index->Keys, key);
+    } else {
+        err = _BIDDuplicateString(context, key, &szKey);
+        if (err == BID_S_OK)
+            err = _BIDIndexCacheExpiry(index, index->GetExpiryTime(context, value), szKey);
+    }
+
+    if (err == BID_S_OK)
+        err = _BIDCompactCacheExpiryIndex(context, index);
+
+    if (err != BID_S_OK) {
+        _BIDFreeCacheExpiryIndex(index);
+        cache->ExpiryIndex = NULL;
+    }
+
+cleanup:
+    BID_MUTEX_UNLOCK(&cache->ExpiryMutex);
+}
+
+/*
+ * Take up to BID_CACHE_EVICT_BATCH entries that expired more than the
+ * clock skew ago from the index; entries within the skew must be kept,
+ * as the assertions they record may still be accepted. Superseded heap
+ * entries are discarded along the way without touching the cache.
+ */
+static size_t
+_BIDSelectExpiredCacheEntries(
+    BIDContext context,
+    struct BIDCacheExpiryIndexDesc *index,
+    time_t currentTime,
+    char **evict)
+{
+    size_t cEvict = 0;
+    struct BIDCacheExpiryDesc entry;
+
+    while (cEvict < BID_CACHE_EVICT_BATCH && index->cEntries != 0 &&
+           index->Entries[0].ExpiryTime + (time_t)context->Skew < currentTime) {
+        _BIDPopCacheExpiry(index, &entry);
+
+        if (_BIDCacheExpiryCurrentP(index, &entry)) {
+            json_object_del(index->Keys, entry.Key);
+            evict[cEvict++] = entry.Key;
+        } else {
+            BIDFree(entry.Key);
+        }
+    }
+
+    return cEvict;
+}
+
+static void
+_BIDEvictCacheEntries(
+    BIDContext context,
+    BIDCache cache,
+    char **evict,
+    size_t cEvict)
+{
+    size_t i;
+
+    for (i = 0; i < cEvict; i++) {
+        _BIDRemoveCacheObject(context, cache, evict[i]);
+        BIDFree(evict[i]);
+    }
+}
+
+/*
+ * Evict up to BID_CACHE_EVICT_BATCH expired entries before an entry is
+ * added, so that the cost of keeping the cache bounded is amortized over
+ * insertions. If cMaxEntries is non-zero, a cache that still holds that
+ * many entries returns BID_S_CACHE_FULL rather than evicting entries that
+ * are live. Concurrent callers may each pass the check, so the limit may
+ * be exceeded by the number of threads adding entries.
+ *
+ * Entries already present in a persistent cache are indexed on first use;
+ * entries stored by other processes are evicted only when purged.
+ */
+BIDError
+_BIDCheckCacheCapacity(
+    BIDContext context,
+    BIDCache cache,
+    time_t (*getExpiryTime)(BIDContext, json_t *),
+    size_t cMaxEntries,
+    time_t currentTime)
+{
+    BIDError err;
+    struct BIDCacheExpiryIndexDesc *index;
+    char *evict[BID_CACHE_EVICT_BATCH];
+    size_t cEvict = 0;
+
+    BID_CONTEXT_VALIDATE(context);
+
+    if (cache == NULL || getExpiryTime == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    BID_MUTEX_LOCK(&cache->ExpiryMutex);
+
+    err = _BIDGetCacheExpiryIndex(context, cache, getExpiryTime, &index);
+    if (err == BID_S_OK) {
+        cEvict = _BIDSelectExpiredCacheEntries(context, index, currentTime, evict);
+
+        if (cMaxEntries != 0 && json_object_size(index->Keys) >= cMaxEntries)
+            err = BID_S_CACHE_FULL;
+    }
+
+    BID_MUTEX_UNLOCK(&cache->ExpiryMutex);
+
+    _BIDEvictCacheEntries(context, cache, evict, cEvict);
+
+    return err;
 }
 
 #ifdef __APPLE__
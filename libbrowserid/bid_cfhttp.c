@@ -189,12 +189,63 @@ cleanup:
     return err;
 }
 
+static void
+_BIDGetHttpExpiry(
+    BIDContext context,
+    CFHTTPMessageRef response,
+    time_t *pExpiryTime)
+{
+    if (_BIDHttpMessageGetHeaderDate(context, response, CFSTR("Expires"), pExpiryTime) != BID_S_OK) {
+        if (_BIDHttpMessageGetHeaderDate(context, response, CFSTR("Date"), pExpiryTime) == BID_S_OK)
+            *pExpiryTime += 60 * 60 * 24;
+        else
+            *pExpiryTime = 0;
+    }
+}
+
+/*
+ * Record the response validators, so that the document can later be
+ * revalidated with a conditional request. A full response replaces any
+ * existing validators; a 304 response only updates those it contains.
+ */
+static void
+_BIDPopulateCacheMetadata(
+    BIDContext context,
+    CFHTTPMessageRef response,
+    BIDError httpErr,
+    json_t *cacheMetadata)
+{
+    time_t lastModified;
+    CFStringRef etag;
+    char szETag[256];
+
+    if (cacheMetadata == NULL)
+        return;
+
+    if (httpErr == BID_S_OK) {
+        json_object_del(cacheMetadata, "last-modified");
+        json_object_del(cacheMetadata, "etag");
+    }
+
+    if (_BIDHttpMessageGetHeaderDate(context, response, CFSTR("Last-Modified"), &lastModified) == BID_S_OK)
+        _BIDSetJsonTimestampValue(context, cacheMetadata, "last-modified", lastModified);
+
+    /* an ETag that is too long to keep is simply not used */
+    etag = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("ETag"));
+    if (etag != NULL) {
+        if (CFStringGetCString(etag, szETag, sizeof(szETag), kCFStringEncodingUTF8))
+            json_object_set_new(cacheMetadata, "etag", json_string(szETag));
+        CFRelease(etag);
+    }
+}
+
 static BIDError
 _BIDMakeHttpRequest(
     BIDContext context,
     CFHTTPMessageRef request,
     json_t **pJsonDoc,
-    time_t *pExpiryTime)
+    time_t *pExpiryTime,
+    json_t *cacheMetadata)
 {
     BIDError err;
     CFStringRef userAgent = NULL;
@@ -260,29 +311,24 @@ _BIDMakeHttpRequest(
         err = BID_S_HTTP_ERROR;
         break;
     }
-    BID_BAIL_ON_ERROR(err);
-
-    responseBody = CFHTTPMessageCopyBody(response);
-    responseString = CFStringCreateFromExternalRepresentation(kCFAllocatorDefault,
-                                                              responseBody, kCFStringEncodingUTF8);
-    *pJsonDoc = json_loadcf(responseString, 0, &context->JsonError);
-    if (*pJsonDoc == NULL) {
-        err = BID_S_INVALID_JSON;
+    if (err != BID_S_OK && err != BID_S_DOCUMENT_NOT_MODIFIED)
         goto cleanup;
-    }
 
-    if (pExpiryTime != NULL) {
-        err = _BIDHttpMessageGetHeaderDate(context, response, CFSTR("Expires"), pExpiryTime);
-        if (err != BID_S_OK) {
-            err = _BIDHttpMessageGetHeaderDate(context, response, CFSTR("Date"), pExpiryTime);
-            if (err == BID_S_OK)
-                *pExpiryTime += 60 * 60 * 24;
-            else
-                *pExpiryTime = 0;
+    if (err == BID_S_OK) {
+        responseBody = CFHTTPMessageCopyBody(response);
+        responseString = CFStringCreateFromExternalRepresentation(kCFAllocatorDefault,
+                                                                  responseBody, kCFStringEncodingUTF8);
+        *pJsonDoc = json_loadcf(responseString, 0, BID_JSON_ERROR(context));
+        if (*pJsonDoc == NULL) {
+            err = BID_S_INVALID_JSON;
+            goto cleanup;
         }
     }
 
-    err = BID_S_OK;
+    if (pExpiryTime != NULL)
+        _BIDGetHttpExpiry(context, response, pExpiryTime);
+
+    _BIDPopulateCacheMetadata(context, response, err, cacheMetadata);
 
 cleanup:
     if (userAgent != NULL)
@@ -311,7 +357,7 @@ _BIDRetrieveDocument(
     BIDContext context,
     const char *szHostname,
     const char *szRelativeUrl,
-    time_t tIfModifiedSince,
+    json_t *cacheMetadata,
     json_t **pJsonDoc,
     time_t *pExpiryTime)
 {
@@ -319,6 +365,9 @@ _BIDRetrieveDocument(
     CFStringRef urlString = NULL;
     CFURLRef url = NULL;
     CFHTTPMessageRef request = NULL;
+    CFStringRef etag = NULL;
+    time_t tIfModifiedSince = 0;
+    const char *szETag = NULL;
 
     *pJsonDoc = NULL;
     if (pExpiryTime != NULL)
@@ -343,12 +392,29 @@ _BIDRetrieveDocument(
     err = _BIDAllocHttpMessage(context, CFSTR("GET"), url, &request);
     BID_BAIL_ON_ERROR(err);
 
-    _BIDHttpMessageSetHeaderDate(context, request, CFSTR("If-Modified-Since"), tIfModifiedSince);
+    if (cacheMetadata != NULL) {
+        _BIDGetJsonTimestampValue(context, cacheMetadata, "last-modified", &tIfModifiedSince);
+        szETag = json_string_value(json_object_get(cacheMetadata, "etag"));
+    }
+
+    if (tIfModifiedSince != 0)
+        _BIDHttpMessageSetHeaderDate(context, request, CFSTR("If-Modified-Since"), tIfModifiedSince);
 
-    err = _BIDMakeHttpRequest(context, request, pJsonDoc, pExpiryTime);
-    BID_BAIL_ON_ERROR(err);
+    if (szETag != NULL) {
+        etag = CFStringCreateWithCString(kCFAllocatorDefault, szETag, kCFStringEncodingUTF8);
+        if (etag == NULL) {
+            err = BID_S_NO_MEMORY;
+            goto cleanup;
+        }
+
+        CFHTTPMessageSetHeaderFieldValue(request, CFSTR("If-None-Match"), etag);
+    }
+
+    err = _BIDMakeHttpRequest(context, request, pJsonDoc, pExpiryTime, cacheMetadata);
 
 cleanup:
+    if (etag != NULL)
+        CFRelease(etag);
     if (urlString != NULL)
         CFRelease(urlString);
     if (url != NULL)
@@ -398,7 +464,7 @@ _BIDPostDocument(
     CFHTTPMessageSetHeaderFieldValue(request, CFSTR("Content-Length"), contentLength);
     CFHTTPMessageSetHeaderFieldValue(request, CFSTR("Content-Type"), CFSTR("application/x-www-form-urlencoded"));
 
-    err = _BIDMakeHttpRequest(context, request, pJsonDoc, NULL);
+    err = _BIDMakeHttpRequest(context, request, pJsonDoc, NULL, NULL);
     BID_BAIL_ON_ERROR(err);
 
 cleanup:
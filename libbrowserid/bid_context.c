@@ -158,36 +158,51 @@ cleanup:
     return BID_S_OK;
 }
 
-BIDError
-BIDAcquireContext(
-    const char *szConfig,
+static void
+_BIDReleaseVerifyStats(struct BIDVerifyStatsDesc *stats)
+{
+    if (stats != NULL && BID_ATOMIC_DECREMENT(&stats->References) == 0)
+        BIDFree(stats);
+}
+
+static BIDError
+_BIDAllocContext(
+#ifdef __APPLE__
+    CFAllocatorRef allocator,
+#else
+    void *allocator BID_UNUSED,
+#endif
     uint32_t ulContextOptions,
-    BIDAcquireContextArgs args,
+    BIDContext templateContext,
     BIDContext *pContext)
 {
-    BIDError err;
-    BIDContext context = NULL;
+    BIDContext context;
+    struct BIDVerifyStatsDesc *stats;
 
     *pContext = BID_C_NO_CONTEXT;
 
-    if (args != NULL &&
-        (args->Version != BID_ACQUIRE_CONTEXT_ARGS_VERSION ||
-         args->cbHeaderLength != sizeof(*args) ||
-         args->cbStructureLength < args->cbHeaderLength)) {
-        err = BID_S_INVALID_PARAMETER;
-        goto cleanup;
+    /* clones count rejections against their template */
+    if (templateContext != BID_C_NO_CONTEXT) {
+        stats = templateContext->VerifyStats;
+        BID_ATOMIC_INCREMENT(&stats->References);
+    } else {
+        stats = BIDCalloc(1, sizeof(*stats));
+        if (stats == NULL)
+            return BID_S_NO_MEMORY;
+
+        stats->References = 1;
     }
 
 #ifdef __APPLE__
-    context = (BIDContext)_CFRuntimeCreateInstance(args && args->CFAllocator ? args->CFAllocator : kCFAllocatorDefault,
+    context = (BIDContext)_CFRuntimeCreateInstance(allocator ? allocator : kCFAllocatorDefault,
                                                    BIDContextGetTypeID(),
                                                    sizeof(*context) - sizeof(CFRuntimeBase), NULL);
 #else
     context = BIDMalloc(sizeof(*context));
 #endif
     if (context == NULL) {
-        err = BID_S_NO_MEMORY;
-        goto cleanup;
+        _BIDReleaseVerifyStats(stats);
+        return BID_S_NO_MEMORY;
     }
 
     context->ContextOptions         = ulContextOptions;
@@ -202,8 +217,47 @@ BIDAcquireContext(
     context->ECDHCurve              = 0;
     context->TicketLifetime         = 0;
     context->RenewLifetime          = 0;
+    context->ReplayCacheMaxEntries  = 0;
+    context->AuthorityStaleWindow   = 0;
     context->Config                 = NULL;
     context->ParentWindow           = NULL;
+    context->VerifyStats            = stats;
+
+    if (ulContextOptions & BID_CONTEXT_THREAD_SAFE)
+        _BIDCryptoThreadInit();
+
+    *pContext = context;
+
+    return BID_S_OK;
+}
+
+BIDError
+BIDAcquireContext(
+    const char *szConfig,
+    uint32_t ulContextOptions,
+    BIDAcquireContextArgs args,
+    BIDContext *pContext)
+{
+    BIDError err;
+    BIDContext context = NULL;
+
+    *pContext = BID_C_NO_CONTEXT;
+
+    if (args != NULL &&
+        (args->Version != BID_ACQUIRE_CONTEXT_ARGS_VERSION ||
+         args->cbHeaderLength != sizeof(*args) ||
+         args->cbStructureLength < args->cbHeaderLength)) {
+        err = BID_S_INVALID_PARAMETER;
+        goto cleanup;
+    }
+
+#ifdef __APPLE__
+    err = _BIDAllocContext(args != NULL ? args->CFAllocator : NULL,
+                           ulContextOptions, BID_C_NO_CONTEXT, &context);
+#else
+    err = _BIDAllocContext(NULL, ulContextOptions, BID_C_NO_CONTEXT, &context);
+#endif
+    BID_BAIL_ON_ERROR(err);
 
     if (szConfig != NULL) {
         err = BIDSetContextParam(context, BID_PARAM_CONFIG_NAME, (void *)szConfig);
@@ -224,6 +278,12 @@ BIDAcquireContext(
         /* default renew lifetime is 7 days */
         _BIDGetConfigIntegerValue(context, "maxrenewage",     60 * 60 * 24 * 7,
                                   &context->RenewLifetime);
+        /* the replay cache is unbounded by default */
+        _BIDGetConfigIntegerValue(context, "maxreplaycacheentries", 0,
+                                  &context->ReplayCacheMaxEntries);
+        /* expired authority documents are used for up to an hour */
+        _BIDGetConfigIntegerValue(context, "authoritystalewindow", BID_AUTHORITY_STALE_WINDOW,
+                                  &context->AuthorityStaleWindow);
 
         err = _BIDGetConfigStringValueArray(context, "secondaryauthorities",
                                             _BIDSecondaryAuthorities,
@@ -295,6 +355,144 @@ cleanup:
     return err;
 }
 
+static BIDError
+_BIDCloneCache(
+    BIDContext context,
+    BIDCache templateCache,
+    BIDCache *pCache)
+{
+    BIDError err;
+
+    if (templateCache == NULL)
+        return BID_S_OK;
+
+    err = _BIDRetainCache(context, templateCache);
+    if (err == BID_S_OK)
+        *pCache = templateCache;
+
+    return err;
+}
+
+/*
+ * Options that depend on configuration or caches acquired with the
+ * template context, and so cannot be added to a clone. A ticket cache
+ * may be added: it then belongs to the caller rather than the template.
+ */
+#define BID_CONTEXT_TEMPLATE_OPTIONS    (BID_CONTEXT_RP                 | \
+                                         BID_CONTEXT_AUTHORITY_CACHE    | \
+                                         BID_CONTEXT_REPLAY_CACHE)
+
+BIDError
+BIDCloneContext(
+    BIDContext templateContext,
+    uint32_t ulContextOptions,
+    BIDContext *pContext)
+{
+    BIDError err;
+    BIDContext context = NULL;
+    size_t i;
+
+    *pContext = BID_C_NO_CONTEXT;
+
+    BID_CONTEXT_VALIDATE(templateContext);
+
+    if ((ulContextOptions & BID_CONTEXT_TEMPLATE_OPTIONS) &
+        ~templateContext->ContextOptions) {
+        err = BID_S_INVALID_PARAMETER;
+        goto cleanup;
+    }
+
+    if ((ulContextOptions & BID_CONTEXT_TICKET_CACHE) &&
+        ((ulContextOptions & BID_CONTEXT_REAUTH) == 0 ||
+         (ulContextOptions & BID_CONTEXT_USER_AGENT) == 0)) {
+        err = BID_S_INVALID_PARAMETER;
+        goto cleanup;
+    }
+
+#ifdef __APPLE__
+    err = _BIDAllocContext(CFGetAllocator(templateContext), ulContextOptions,
+                           templateContext, &context);
+#else
+    err = _BIDAllocContext(NULL, ulContextOptions, templateContext, &context);
+#endif
+    BID_BAIL_ON_ERROR(err);
+
+    context->MaxDelegations         = templateContext->MaxDelegations;
+    context->Skew                   = templateContext->Skew;
+    context->TicketLifetime         = templateContext->TicketLifetime;
+    context->RenewLifetime          = templateContext->RenewLifetime;
+    context->ReplayCacheMaxEntries  = templateContext->ReplayCacheMaxEntries;
+    context->AuthorityStaleWindow   = templateContext->AuthorityStaleWindow;
+    context->ParentWindow           = templateContext->ParentWindow;
+
+    if (templateContext->VerifierUrl != NULL) {
+        err = _BIDDuplicateString(context, templateContext->VerifierUrl,
+                                  &context->VerifierUrl);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    if (templateContext->SecondaryAuthorities != NULL) {
+        for (i = 0; templateContext->SecondaryAuthorities[i] != NULL; i++)
+            ;
+
+        context->SecondaryAuthorities = BIDCalloc(i + 1, sizeof(char *));
+        if (context->SecondaryAuthorities == NULL) {
+            err = BID_S_NO_MEMORY;
+            goto cleanup;
+        }
+
+        for (i = 0; templateContext->SecondaryAuthorities[i] != NULL; i++) {
+            err = _BIDDuplicateString(context, templateContext->SecondaryAuthorities[i],
+                                      &context->SecondaryAuthorities[i]);
+            BID_BAIL_ON_ERROR(err);
+        }
+    }
+
+    err = _BIDCloneCache(context, templateContext->Config, &context->Config);
+    BID_BAIL_ON_ERROR(err);
+
+    if (ulContextOptions & BID_CONTEXT_AUTHORITY_CACHE) {
+        err = _BIDCloneCache(context, templateContext->AuthorityCache,
+                             &context->AuthorityCache);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    if (ulContextOptions & BID_CONTEXT_REPLAY_CACHE) {
+        err = _BIDCloneCache(context, templateContext->ReplayCache,
+                             &context->ReplayCache);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    /*
+     * The default ticket cache is per-user, so unless the template has
+     * one to share, acquire the cache for the user cloning the context.
+     */
+    if (ulContextOptions & BID_CONTEXT_TICKET_CACHE) {
+        if (templateContext->TicketCache != BID_C_NO_TICKET_CACHE)
+            err = _BIDCloneCache(context, templateContext->TicketCache,
+                                 &context->TicketCache);
+        else
+            err = _BIDAcquireDefaultTicketCache(context);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    if (ulContextOptions & BID_CONTEXT_ECDH_KEYEX) {
+        if (templateContext->ContextOptions & BID_CONTEXT_ECDH_KEYEX)
+            context->ECDHCurve = templateContext->ECDHCurve;
+        else
+            context->ECDHCurve = BID_CONTEXT_ECDH_CURVE_P256;
+    }
+
+    err = BID_S_OK;
+    *pContext = context;
+
+cleanup:
+    if (err != BID_S_OK)
+        BIDReleaseContext(context);
+
+    return err;
+}
+
 void
 _BIDFinalizeContext(BIDContext context)
 {
@@ -311,6 +509,7 @@ _BIDFinalizeContext(BIDContext context)
     _BIDReleaseCache(context, context->ReplayCache);
     _BIDReleaseCache(context, context->TicketCache);
     _BIDReleaseCache(context, context->Config);
+    _BIDReleaseVerifyStats(context->VerifyStats);
 }
 
 BIDError
@@ -461,7 +660,7 @@ BIDGetContextParam(
         *((uint32_t *)pValue) = context->MaxDelegations;
         break;
     case BID_PARAM_JSON_ERROR_INFO:
-        *pValue = &context->JsonError;
+        *pValue = BID_JSON_ERROR(context);
         break;
     case BID_PARAM_SKEW:
         *((uint32_t *)pValue) = context->Skew;
@@ -130,15 +130,13 @@ _BIDDeriveSessionSubkey(
     BIDContext context,
     BIDIdentity identity,
     const char *szSalt,
-    BIDJWK *pDerivedKey)
+    BIDSecretHandle *pSubkey)
 {
     unsigned char *pbSubkey = NULL;
     size_t cbSubkey = 0;
     BIDError err;
-    BIDJWK derivedKey = NULL;
-    json_t *sk = NULL;
 
-    *pDerivedKey = NULL;
+    *pSubkey = NULL;
 
     BID_ASSERT(szSalt != NULL);
 
@@ -149,26 +147,14 @@ _BIDDeriveSessionSubkey(
                         (unsigned char *)szSalt, strlen(szSalt), &pbSubkey, &cbSubkey);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDAllocJsonObject(context, &derivedKey);
-    BID_BAIL_ON_ERROR(err);
-
-    err = _BIDJsonBinaryValue(context, pbSubkey, cbSubkey, &sk);
-    BID_BAIL_ON_ERROR(err);
-
-    err = _BIDJsonObjectSet(context, derivedKey, "secret-key", sk, 0);
+    err = _BIDImportSecretKeyData(context, pbSubkey, cbSubkey, pSubkey);
     BID_BAIL_ON_ERROR(err);
 
-    *pDerivedKey = derivedKey;
-    err = BID_S_OK;
-
 cleanup:
     if (pbSubkey != NULL) {
         memset(pbSubkey, 0, cbSubkey);
         BIDFree(pbSubkey);
     }
-    json_decref(sk);
-    if (err != BID_S_OK)
-        json_decref(derivedKey);
 
     return err;
 }
@@ -293,6 +279,50 @@ cleanup:
     return err;
 }
 
+/*
+ * Session keys are kept as secret handles; only serialize one to a JWK
+ * when it must be persisted, such as in a ticket or replay cache.
+ */
+BIDError
+_BIDExportSecretKey(
+    BIDContext context,
+    BIDSecretHandle secretHandle,
+    BIDJWK *pJwk)
+{
+    BIDError err;
+    unsigned char *pbSecret = NULL;
+    size_t cbSecret = 0;
+    BIDJWK jwk = NULL;
+    json_t *sk = NULL;
+
+    *pJwk = NULL;
+
+    err = _BIDExportSecretKeyData(context, secretHandle, &pbSecret, &cbSecret);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDAllocJsonObject(context, &jwk);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDJsonBinaryValue(context, pbSecret, cbSecret, &sk);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDJsonObjectSet(context, jwk, "secret-key", sk, 0);
+    BID_BAIL_ON_ERROR(err);
+
+    *pJwk = jwk;
+
+cleanup:
+    if (pbSecret != NULL) {
+        memset(pbSecret, 0, cbSecret);
+        BIDFree(pbSecret);
+    }
+    json_decref(sk);
+    if (err != BID_S_OK)
+        json_decref(jwk);
+
+    return err;
+}
+
 BIDError
 _BIDVerifierKeyAgreement(
     BIDContext context,
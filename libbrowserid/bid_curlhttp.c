@@ -86,9 +86,12 @@ struct BIDCurlBufferDesc {
     size_t Size;
 };
 
+#define BID_CURL_ETAG_MAX           256
+
 struct BIDCurlHeaderDesc {
     time_t Date;
     time_t Expires;
+    char ETag[BID_CURL_ETAG_MAX];
 };
 
 static size_t
@@ -125,18 +128,180 @@ _BIDCurlHeaderCB(void *ptr, size_t size, size_t nmemb, void *stream)
 {
     struct BIDCurlHeaderDesc *headers = (struct BIDCurlHeaderDesc *)stream;
     const char *s = (const char *)ptr;
+    size_t cb = size * nmemb;
+
+    /* only keep the headers of the final response when following redirects */
+    if (cb > 5 && strncmp(s, "HTTP/", 5) == 0) {
+        memset(headers, 0, sizeof(*headers));
+        return cb;
+    }
 
-    if (strncmp(s, "Date: ", 6) == 0)
+    /* HTTP/2 header names are lowercase */
+    if (strncasecmp(s, "Date: ", 6) == 0) {
         headers->Date = curl_getdate(&s[6], NULL);
-    else if (strncmp(s, "Expires: ", 9) == 0)
+    } else if (strncasecmp(s, "Expires: ", 9) == 0) {
         headers->Expires = curl_getdate(&s[9], NULL);
+    } else if (cb > 6 && strncasecmp(s, "ETag: ", 6) == 0) {
+        size_t cchETag = cb - 6;
 
-    return size * nmemb;
+        while (cchETag != 0 && isspace((unsigned char)s[6 + cchETag - 1]))
+            cchETag--;
+
+        /* an ETag that is too long to keep is simply not used */
+        if (cchETag < sizeof(headers->ETag)) {
+            memcpy(headers->ETag, &s[6], cchETag);
+            headers->ETag[cchETag] = '\0';
+        }
+    }
+
+    return cb;
+}
+
+/*
+ * Process-wide pool of idle curl handles. Handles share DNS, TLS session
+ * and (where supported) connection caches, so that repeated requests to
+ * the same host reuse an existing keep-alive connection. The pool is
+ * emptied in a forked child, whose handles would otherwise share TLS
+ * connections with the parent.
+ */
+#define BID_CURL_POOL_SIZE          16
+
+static struct {
+    BID_MUTEX Mutex;
+    CURLSH *Share;
+    BID_MUTEX ShareLocks[CURL_LOCK_DATA_LAST];
+    size_t cHandles;
+    CURL *Handles[BID_CURL_POOL_SIZE];
+} _BIDCurlPool;
+
+static void
+_BIDCurlShareLockCB(
+    CURL *curlHandle BID_UNUSED,
+    curl_lock_data data,
+    curl_lock_access access BID_UNUSED,
+    void *userptr BID_UNUSED)
+{
+    BID_MUTEX_LOCK(&_BIDCurlPool.ShareLocks[data]);
+}
+
+static void
+_BIDCurlShareUnlockCB(
+    CURL *curlHandle BID_UNUSED,
+    curl_lock_data data,
+    void *userptr BID_UNUSED)
+{
+    BID_MUTEX_UNLOCK(&_BIDCurlPool.ShareLocks[data]);
+}
+
+static void
+_BIDCurlShareInit(void)
+{
+    CURLSH *share;
+    int i;
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        BID_MUTEX_INIT(&_BIDCurlPool.ShareLocks[i]);
+
+    share = curl_share_init();
+    if (share == NULL)
+        return;
+
+    if (curl_share_setopt(share, CURLSHOPT_LOCKFUNC, _BIDCurlShareLockCB) != CURLSHE_OK ||
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, _BIDCurlShareUnlockCB) != CURLSHE_OK ||
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) != CURLSHE_OK ||
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK) {
+        curl_share_cleanup(share);
+        return;
+    }
+
+#if LIBCURL_VERSION_NUM >= 0x073900
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
+    _BIDCurlPool.Share = share;
+}
+
+static void
+_BIDCurlAtForkPrepare(void)
+{
+    BID_MUTEX_LOCK(&_BIDCurlPool.Mutex);
+}
+
+static void
+_BIDCurlAtForkParent(void)
+{
+    BID_MUTEX_UNLOCK(&_BIDCurlPool.Mutex);
+}
+
+/*
+ * The inherited handles and share are abandoned rather than cleaned up,
+ * as doing so would shut down TLS connections still used by the parent.
+ */
+static void
+_BIDCurlAtForkChild(void)
+{
+    _BIDCurlPool.cHandles = 0;
+    _BIDCurlPool.Share = NULL;
+    _BIDCurlShareInit();
+
+    BID_MUTEX_UNLOCK(&_BIDCurlPool.Mutex);
+}
+
+static void
+_BIDCurlInit(void) __attribute__((__constructor__));
+
+static void
+_BIDCurlInit(void)
+{
+    if (curl_global_init(CURL_GLOBAL_SSL) != CURLE_OK)
+        return;
+
+    BID_MUTEX_INIT(&_BIDCurlPool.Mutex);
+
+    _BIDCurlShareInit();
+
+    pthread_atfork(_BIDCurlAtForkPrepare, _BIDCurlAtForkParent, _BIDCurlAtForkChild);
+}
+
+static CURL *
+_BIDAcquirePooledCurlHandle(void)
+{
+    CURL *curlHandle = NULL;
+
+    BID_MUTEX_LOCK(&_BIDCurlPool.Mutex);
+    if (_BIDCurlPool.cHandles != 0)
+        curlHandle = _BIDCurlPool.Handles[--_BIDCurlPool.cHandles];
+    BID_MUTEX_UNLOCK(&_BIDCurlPool.Mutex);
+
+    /* resetting options preserves the handle's connection and caches */
+    if (curlHandle != NULL)
+        curl_easy_reset(curlHandle);
+    else
+        curlHandle = curl_easy_init();
+
+    return curlHandle;
+}
+
+static void
+_BIDReleasePooledCurlHandle(CURL *curlHandle)
+{
+    if (curlHandle == NULL)
+        return;
+
+    BID_MUTEX_LOCK(&_BIDCurlPool.Mutex);
+    if (_BIDCurlPool.cHandles < BID_CURL_POOL_SIZE) {
+        _BIDCurlPool.Handles[_BIDCurlPool.cHandles++] = curlHandle;
+        curlHandle = NULL;
+    }
+    BID_MUTEX_UNLOCK(&_BIDCurlPool.Mutex);
+
+    if (curlHandle != NULL)
+        curl_easy_cleanup(curlHandle);
 }
 
 static BIDError
 _BIDInitCurlHandle(
-    BIDContext context BID_UNUSED,
+    BIDContext context,
     struct BIDCurlHeaderDesc *headers,
     struct BIDCurlBufferDesc *buffer,
     CURL **pCurlHandle)
@@ -144,15 +309,27 @@ _BIDInitCurlHandle(
     CURLcode cc;
     CURL *curlHandle = NULL;
     char szUserAgent[64];
+    json_t *caInfo = NULL;
 
     *pCurlHandle = NULL;
 
-    curlHandle = curl_easy_init();
+    curlHandle = _BIDAcquirePooledCurlHandle();
     if (curlHandle == NULL)
         return BID_S_HTTP_ERROR;
 
-    cc = curl_global_init(CURL_GLOBAL_SSL);
-    BID_BAIL_ON_ERROR(cc);
+    if (_BIDCurlPool.Share != NULL) {
+        cc = curl_easy_setopt(curlHandle, CURLOPT_SHARE, _BIDCurlPool.Share);
+        BID_BAIL_ON_ERROR(cc);
+    }
+
+    /* allows the verifier to be tested against a local HTTPS server */
+    if (context->Config != NULL &&
+        _BIDGetCacheObject(context, context->Config,
+                           "https-ca-certificate", &caInfo) == BID_S_OK &&
+        json_is_string(caInfo)) {
+        cc = curl_easy_setopt(curlHandle, CURLOPT_CAINFO, json_string_value(caInfo));
+        BID_BAIL_ON_ERROR(cc);
+    }
 
     cc = curl_easy_setopt(curlHandle, CURLOPT_FOLLOWLOCATION, 1);
     BID_BAIL_ON_ERROR(cc);
@@ -187,29 +364,59 @@ _BIDInitCurlHandle(
     cc = curl_easy_setopt(curlHandle, CURLOPT_PROTOCOLS, CURLPROTO_HTTPS);
     BID_BAIL_ON_ERROR(cc);
 
+#if LIBCURL_VERSION_NUM >= 0x071900
+    cc = curl_easy_setopt(curlHandle, CURLOPT_TCP_KEEPALIVE, 1L);
+    BID_BAIL_ON_ERROR(cc);
+#endif
+
+#if LIBCURL_VERSION_NUM >= 0x072f00
+    /* negotiate HTTP/2 via ALPN, falling back to HTTP/1.1 */
+    if (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2) {
+        cc = curl_easy_setopt(curlHandle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+        BID_BAIL_ON_ERROR(cc);
+    }
+#endif
+
     *pCurlHandle = curlHandle;
 
 cleanup:
+    json_decref(caInfo);
     if (cc != CURLE_OK)
-        curl_easy_cleanup(curlHandle);
+        _BIDReleasePooledCurlHandle(curlHandle);
 
     return CURLcodeToBIDError(cc);
 }
 
-#if 0
-static BIDError
+/*
+ * Record the response validators, so that the document can later be
+ * revalidated with a conditional request. A full response replaces any
+ * existing validators; a 304 response only updates those it contains.
+ */
+static void
 _BIDPopulateCacheMetadata(
     BIDContext context,
-    struct BIDCurlBufferDesc *buffer,
+    struct BIDCurlHeaderDesc *headers,
     CURL *curlHandle,
-    json_t *jsonDoc)
+    BIDError httpErr,
+    json_t *cacheMetadata)
 {
-    CURLcode cc;
+    long lastModified = -1;
 
-cleanup:
-    return CURLcodeToBIDError(cc);
+    if (cacheMetadata == NULL)
+        return;
+
+    if (httpErr == BID_S_OK) {
+        json_object_del(cacheMetadata, "last-modified");
+        json_object_del(cacheMetadata, "etag");
+    }
+
+    if (curl_easy_getinfo(curlHandle, CURLINFO_FILETIME, &lastModified) == CURLE_OK &&
+        lastModified > 0)
+        _BIDSetJsonTimestampValue(context, cacheMetadata, "last-modified", (time_t)lastModified);
+
+    if (headers->ETag[0] != '\0')
+        json_object_set_new(cacheMetadata, "etag", json_string(headers->ETag));
 }
-#endif
 
 static BIDError
 _BIDMakeHttpRequest(
@@ -243,7 +450,7 @@ _BIDMakeHttpRequest(
         err = BID_S_HTTP_ERROR;
     }
 
-    *pJsonDoc = json_loads(buffer->Data, 0, &context->JsonError);
+    *pJsonDoc = json_loads(buffer->Data, 0, BID_JSON_ERROR(context));
     if (*pJsonDoc == NULL) {
         err = BID_S_INVALID_JSON;
         goto cleanup;
@@ -254,27 +461,56 @@ cleanup:
 }
 
 static BIDError
-_BIDSetCurlIfModifiedSince(
-    BIDContext context BID_UNUSED,
+_BIDSetCurlConditionalRequest(
+    BIDContext context,
     CURL *curlHandle,
-    time_t tIfModifiedSince)
+    json_t *cacheMetadata,
+    struct curl_slist **pHttpHeaders)
 {
-    CURLcode cc;
-    long lIfModifiedSince = (long)tIfModifiedSince;
-    curl_TimeCond timeCond;
+    CURLcode cc = CURLE_OK;
+    time_t tIfModifiedSince = 0;
+    const char *szETag;
+    char *szIfNoneMatch = NULL;
+    size_t cchIfNoneMatch;
 
-    if (tIfModifiedSince <= 0)
+    if (cacheMetadata == NULL)
         return BID_S_OK;
 
-    timeCond = CURL_TIMECOND_IFMODSINCE;
+    _BIDGetJsonTimestampValue(context, cacheMetadata, "last-modified", &tIfModifiedSince);
 
-    cc = curl_easy_setopt(curlHandle, CURLOPT_TIMECONDITION, timeCond);
-    BID_BAIL_ON_ERROR(cc);
+    if (tIfModifiedSince > 0) {
+        cc = curl_easy_setopt(curlHandle, CURLOPT_TIMECONDITION, (long)CURL_TIMECOND_IFMODSINCE);
+        BID_BAIL_ON_ERROR(cc);
 
-    cc = curl_easy_setopt(curlHandle, CURLOPT_TIMEVALUE, lIfModifiedSince);
-    BID_BAIL_ON_ERROR(cc);
+        cc = curl_easy_setopt(curlHandle, CURLOPT_TIMEVALUE, (long)tIfModifiedSince);
+        BID_BAIL_ON_ERROR(cc);
+    }
+
+    szETag = json_string_value(json_object_get(cacheMetadata, "etag"));
+    if (szETag != NULL) {
+        struct curl_slist *httpHeaders;
+
+        cchIfNoneMatch = sizeof("If-None-Match: ") + strlen(szETag);
+        szIfNoneMatch = BIDMalloc(cchIfNoneMatch);
+        if (szIfNoneMatch == NULL)
+            return BID_S_NO_MEMORY;
+
+        snprintf(szIfNoneMatch, cchIfNoneMatch, "If-None-Match: %s", szETag);
+
+        httpHeaders = curl_slist_append(*pHttpHeaders, szIfNoneMatch);
+        if (httpHeaders == NULL) {
+            cc = CURLE_OUT_OF_MEMORY;
+            goto cleanup;
+        }
+        *pHttpHeaders = httpHeaders;
+
+        cc = curl_easy_setopt(curlHandle, CURLOPT_HTTPHEADER, *pHttpHeaders);
+        BID_BAIL_ON_ERROR(cc);
+    }
 
 cleanup:
+    BIDFree(szIfNoneMatch);
+
     return CURLcodeToBIDError(cc);
 }
 
@@ -283,7 +519,7 @@ _BIDRetrieveDocument(
     BIDContext context,
     const char *szHostname,
     const char *szRelativeUrl,
-    time_t tIfModifiedSince,
+    json_t *cacheMetadata,
     json_t **pJsonDoc,
     time_t *pExpiryTime)
 {
@@ -291,6 +527,7 @@ _BIDRetrieveDocument(
     CURL *curlHandle = NULL;
     struct BIDCurlHeaderDesc headers = { 0 };
     struct BIDCurlBufferDesc buffer = { NULL };
+    struct curl_slist *httpHeaders = NULL;
 
     *pJsonDoc = NULL;
     if (pExpiryTime != NULL)
@@ -312,21 +549,30 @@ _BIDRetrieveDocument(
     err = _BIDSetCurlCompositeUrl(context, curlHandle, szHostname, szRelativeUrl);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDSetCurlIfModifiedSince(context, curlHandle, tIfModifiedSince);
+    err = _BIDSetCurlConditionalRequest(context, curlHandle, cacheMetadata, &httpHeaders);
     BID_BAIL_ON_ERROR(err);
 
     err = _BIDMakeHttpRequest(context, &buffer, curlHandle, pJsonDoc);
-    BID_BAIL_ON_ERROR(err);
+    if (err != BID_S_OK && err != BID_S_DOCUMENT_NOT_MODIFIED)
+        goto cleanup;
+
+    _BIDPopulateCacheMetadata(context, &headers, curlHandle, err, cacheMetadata);
 
     if (pExpiryTime != NULL) {
-        if (headers.Expires != 0)
+        time_t now = time(NULL);
+
+        /* Expires is in server time, so apply it relative to the local clock */
+        if (headers.Expires > 0 && headers.Date > 0)
+            *pExpiryTime = now + (headers.Expires - headers.Date);
+        else if (headers.Expires > 0)
             *pExpiryTime = headers.Expires;
         else
-            *pExpiryTime = headers.Date + 60 * 60 * 24;
+            *pExpiryTime = now + 60 * 60 * 24;
     }
 
 cleanup:
-    curl_easy_cleanup(curlHandle);
+    _BIDReleasePooledCurlHandle(curlHandle);
+    curl_slist_free_all(httpHeaders);
     BIDFree(buffer.Data);
 
     return err;
@@ -371,7 +617,7 @@ _BIDPostDocument(
     BID_BAIL_ON_ERROR(err);
 
 cleanup:
-    curl_easy_cleanup(curlHandle);
+    _BIDReleasePooledCurlHandle(curlHandle);
     BIDFree(buffer.Data);
 
     return err;
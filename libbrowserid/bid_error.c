@@ -120,6 +120,9 @@ const char *_BIDErrorTable[] = {
     "Unknown Elliptic Curve",
     "Invalid Elliptic Curve for context",
     "Missing nonce",
+    "Cache key already exists",
+    "Cache is full",
+    "Too much work queued",
     "Unknown error code"
 };
 
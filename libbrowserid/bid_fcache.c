@@ -84,10 +84,18 @@
  */
 
 struct BIDFileCache {
+    BID_MUTEX Mutex;
     char *Name;
     uint32_t Flags;
 };
 
+/*
+ * fcntl locks are per-process, so the mutex serializes threads that
+ * update the cache through the same handle.
+ */
+#define BIDFileCacheLock(fc)        BID_MUTEX_LOCK(&(fc)->Mutex)
+#define BIDFileCacheUnlock(fc)      BID_MUTEX_UNLOCK(&(fc)->Mutex)
+
 static BIDError
 _BIDFileCacheAcquire(
     struct BIDCacheOps *ops BID_UNUSED,
@@ -109,6 +117,8 @@ _BIDFileCacheAcquire(
         return err;
     }
 
+    BID_MUTEX_INIT(&fc->Mutex);
+
     fc->Flags = ulFlags;
 
     *cache = fc;
@@ -128,6 +138,7 @@ _BIDFileCacheRelease(
         return BID_S_INVALID_PARAMETER;
 
     BIDFree(fc->Name);
+    BID_MUTEX_DESTROY(&fc->Mutex);
     BIDFree(fc);
 
     return BID_S_OK;
@@ -210,11 +221,13 @@ _BIDFileCacheOpen(
     BIDError err;
     int exclusive = 0, fd;
     mode_t mode;
+    struct stat sb1, sb2;
 
     *pFd = -1;
 
     mode = (fc->Flags & BID_CACHE_FLAG_READONLY) ? 0400 : 0600;
 
+again:
     fd = open(fc->Name, flags, mode);
     if (fd < 0) {
         switch (errno) {
@@ -251,6 +264,18 @@ _BIDFileCacheOpen(
         return err;
     }
 
+    /*
+     * Writers replace the cache by renaming, so if we waited for the lock
+     * it may be held on a file that is no longer the cache.
+     */
+    if (fstat(fd, &sb1) == 0 && stat(fc->Name, &sb2) == 0 &&
+        (sb1.st_dev != sb2.st_dev || sb1.st_ino != sb2.st_ino)) {
+        _BIDFileCacheUnlock(ops, context, fc, fd);
+        close(fd);
+        flags &= ~(O_EXCL);
+        goto again;
+    }
+
     *pFd = fd;
 
     return BID_S_OK;
@@ -394,7 +419,7 @@ _BIDFileCacheLoad(
         return BID_S_CACHE_READ_ERROR;
     }
 
-    data = json_loadf(fp, 0, &context->JsonError);
+    data = json_loadf(fp, 0, BID_JSON_ERROR(context));
 
     *pData = data;
 
@@ -689,22 +714,21 @@ _BIDFileCacheSetOrRemoveObject(
     void *cache,
     const char *key,
     json_t *val,
-    int remove)
+    int remove,
+    int add)
 {
     struct BIDFileCache *fc = (struct BIDFileCache *)cache;
     BIDError err;
     json_t *data = NULL, *d = NULL;
     int fd = -1;
 
-    if (fc == NULL || (val == NULL && !remove)) {
-        err = BID_S_INVALID_PARAMETER;
-        goto cleanup;
-    }
+    if (fc == NULL || (val == NULL && !remove))
+        return BID_S_INVALID_PARAMETER;
 
-    if (fc->Flags & BID_CACHE_FLAG_READONLY) {
-        err = BID_S_CACHE_PERMISSION_DENIED;
-        goto cleanup;
-    }
+    if (fc->Flags & BID_CACHE_FLAG_READONLY)
+        return BID_S_CACHE_PERMISSION_DENIED;
+
+    BIDFileCacheLock(fc);
 
     err = _BIDFileCacheOpen(ops, context, fc, O_RDWR | O_CREAT | O_CLOEXEC, &fd);
     if (err == BID_S_OK)
@@ -713,6 +737,11 @@ _BIDFileCacheSetOrRemoveObject(
         err = _BIDFileCacheNew(ops, context, fc, &data, &d);
     BID_BAIL_ON_ERROR(err);
 
+    if (add && json_object_get(d, key) != NULL) {
+        err = BID_S_CACHE_KEY_EXISTS;
+        goto cleanup;
+    }
+
     if (remove)
         err = _BIDJsonObjectDel(context, d, key, 0);
     else
@@ -726,6 +755,7 @@ _BIDFileCacheSetOrRemoveObject(
 
 cleanup:
     _BIDFileCacheClose(ops, context, fc, fd);
+    BIDFileCacheUnlock(fc);
     json_decref(data);
     json_decref(d);
 
@@ -740,7 +770,7 @@ _BIDFileCacheSetObject(
     const char *key,
     json_t *val)
 {
-    return _BIDFileCacheSetOrRemoveObject(ops, context, cache, key, val, 0);
+    return _BIDFileCacheSetOrRemoveObject(ops, context, cache, key, val, 0, 0);
 }
 
 static BIDError
@@ -750,7 +780,18 @@ _BIDFileCacheRemoveObject(
     void *cache,
     const char *key)
 {
-    return _BIDFileCacheSetOrRemoveObject(ops, context, cache, key, NULL, 1);
+    return _BIDFileCacheSetOrRemoveObject(ops, context, cache, key, NULL, 1, 0);
+}
+
+static BIDError
+_BIDFileCacheAddObject(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t *val)
+{
+    return _BIDFileCacheSetOrRemoveObject(ops, context, cache, key, val, 0, 1);
 }
 
 static BIDError
@@ -829,6 +870,62 @@ cleanup:
     return err;
 }
 
+static BIDError
+_BIDFileCachePurgeObjects(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache,
+    int (*predicate)(BIDContext, const char *, json_t *, void *),
+    void *predicateData)
+{
+    struct BIDFileCache *fc = (struct BIDFileCache *)cache;
+    BIDError err;
+    json_t *data = NULL, *d = NULL, *filtered = NULL;
+    int fd = -1;
+
+    if (fc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    if (fc->Flags & BID_CACHE_FLAG_READONLY)
+        return BID_S_CACHE_PERMISSION_DENIED;
+
+    BIDFileCacheLock(fc);
+
+    err = _BIDFileCacheOpen(ops, context, fc, O_RDWR | O_CLOEXEC, &fd);
+    if (err == BID_S_CACHE_NOT_FOUND) {
+        err = BID_S_OK;
+        goto cleanup;
+    }
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDFileCacheRead(ops, context, cache, fd, &data, &d);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDCacheFilterObjects(context, d, predicate, predicateData, &filtered);
+    BID_BAIL_ON_ERROR(err);
+
+    if (filtered == NULL)
+        goto cleanup;
+
+    if (fc->Flags & BID_CACHE_FLAG_UNVERSIONED) {
+        err = _BIDFileCacheWrite(ops, context, cache, filtered);
+    } else {
+        err = _BIDJsonObjectSet(context, data, "d", filtered, BID_JSON_FLAG_REQUIRED);
+        if (err == BID_S_OK)
+            err = _BIDFileCacheWrite(ops, context, cache, data);
+    }
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    _BIDFileCacheClose(ops, context, fc, fd);
+    BIDFileCacheUnlock(fc);
+    json_decref(data);
+    json_decref(d);
+    json_decref(filtered);
+
+    return err;
+}
+
 struct BIDCacheOps _BIDFileCache = {
     "file",
     _BIDFileCacheAcquire,
@@ -840,7 +937,9 @@ struct BIDCacheOps _BIDFileCache = {
     _BIDFileCacheGetObject,
     _BIDFileCacheSetObject,
     _BIDFileCacheRemoveObject,
+    _BIDFileCacheAddObject,
     _BIDFileCacheFirstObject,
     _BIDFileCacheNextObject,
+    _BIDFileCachePurgeObjects,
 };
 
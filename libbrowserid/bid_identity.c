@@ -39,6 +39,73 @@
 
 #include "bid_private.h"
 
+static BIDError
+_BIDVerifyBackedAssertion(
+    BIDContext context,
+    BIDReplayCache replayCache,
+    const char *szAssertion,
+    BIDBackedAssertion backedAssertion,
+    const char *szAudienceOrSpn,
+    const unsigned char *pbChannelBindings,
+    size_t cbChannelBindings,
+    time_t verificationTime,
+    uint32_t ulReqFlags,
+    BIDIdentity *pVerifiedIdentity,
+    time_t *pExpiryTime,
+    uint32_t *pulRetFlags)
+{
+    BIDError err;
+    uint32_t ulRetFlags = 0;
+    int bUseReplayCache;
+    int bCheckReplay;
+
+    if (context->ContextOptions & BID_CONTEXT_VERIFY_REMOTE) {
+        err = _BIDDecodeJWTPayload(context, backedAssertion->Assertion);
+        BID_BAIL_ON_ERROR(err);
+
+        err = _BIDVerifyRemote(context, replayCache, backedAssertion, szAudienceOrSpn, NULL,
+                               pbChannelBindings, cbChannelBindings, verificationTime, ulReqFlags,
+                               pVerifiedIdentity, &ulRetFlags);
+    } else
+        err = _BIDVerifyLocal(context, replayCache, backedAssertion, szAudienceOrSpn, NULL,
+                              pbChannelBindings, cbChannelBindings, verificationTime, ulReqFlags,
+                              NULL, NULL, pVerifiedIdentity, &ulRetFlags);
+    BID_BAIL_ON_ERROR(err);
+
+    bUseReplayCache =
+        (ulRetFlags & BID_VERIFY_FLAG_EXTRA_ROUND_TRIP) == 0 &&
+        (context->ContextOptions & BID_CONTEXT_REPLAY_CACHE);
+
+    /*
+     * If we are doing an extra round trip, we can avoid checking the replay
+     * cache. Otherwise the check is made atomically when the assertion is
+     * recorded below, so that concurrent verifiers cannot both accept it.
+     */
+    bCheckReplay = bUseReplayCache && (ulReqFlags & BID_VERIFY_FLAG_NO_REPLAY_CACHE) == 0;
+
+    if ((ulRetFlags & BID_VERIFY_FLAG_REAUTH) == 0 &&
+        (context->ContextOptions & BID_CONTEXT_ECDH_KEYEX)) {
+        err = _BIDVerifierKeyAgreement(context, *pVerifiedIdentity);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    if ((bUseReplayCache || (context->ContextOptions & BID_CONTEXT_REAUTH)) &&
+        (ulReqFlags & BID_VERIFY_FLAG_NO_REPLAY_CACHE) == 0) {
+        err = _BIDUpdateReplayCache(context, replayCache, *pVerifiedIdentity, szAssertion,
+                                    verificationTime, ulRetFlags, bCheckReplay);
+        if (err == BID_S_REPLAYED_ASSERTION)
+            _BIDCountVerifyRejection(context, BID_VERIFY_STAGE_REPLAY);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    _BIDGetJsonTimestampValue(context, (*pVerifiedIdentity)->Attributes, "exp", pExpiryTime);
+
+cleanup:
+    *pulRetFlags = ulRetFlags;
+
+    return err;
+}
+
 BIDError
 BIDVerifyAssertion(
     BIDContext context,
@@ -55,8 +122,6 @@ BIDVerifyAssertion(
 {
     BIDError err;
     BIDBackedAssertion backedAssertion = NULL;
-    uint32_t ulRetFlags = 0;
-    int bUseReplayCache;
 
     BID_CONTEXT_VALIDATE(context);
 
@@ -77,48 +142,225 @@ BIDVerifyAssertion(
      * Split backed identity assertion out into
      * <cert-1>~...<cert-n>~<identityAssertion>
      */
-    err = _BIDUnpackBackedAssertion(context, szAssertion, &backedAssertion);
+    err = _BIDUnpackBackedAssertionInternal(context, szAssertion,
+                                            BID_JWT_FLAG_LAZY_PAYLOAD, &backedAssertion);
+    if (err != BID_S_OK)
+        _BIDCountVerifyRejection(context, BID_VERIFY_STAGE_PARSE);
     BID_BAIL_ON_ERROR(err);
 
-    if (context->ContextOptions & BID_CONTEXT_VERIFY_REMOTE)
-        err = _BIDVerifyRemote(context, replayCache, backedAssertion, szAudienceOrSpn, NULL,
-                               pbChannelBindings, cbChannelBindings, verificationTime, ulReqFlags,
-                               pVerifiedIdentity, &ulRetFlags);
-    else
-        err = _BIDVerifyLocal(context, replayCache, backedAssertion, szAudienceOrSpn, NULL,
-                              pbChannelBindings, cbChannelBindings, verificationTime, ulReqFlags,
-                              NULL, NULL, pVerifiedIdentity, &ulRetFlags);
+    err = _BIDVerifyBackedAssertion(context, replayCache, szAssertion, backedAssertion,
+                                    szAudienceOrSpn, pbChannelBindings, cbChannelBindings,
+                                    verificationTime, ulReqFlags,
+                                    pVerifiedIdentity, pExpiryTime, pulRetFlags);
     BID_BAIL_ON_ERROR(err);
 
-    bUseReplayCache =
-        (ulRetFlags & BID_VERIFY_FLAG_EXTRA_ROUND_TRIP) == 0 &&
-        (context->ContextOptions & BID_CONTEXT_REPLAY_CACHE);
+cleanup:
+    _BIDReleaseBackedAssertion(context, backedAssertion);
 
-    /* If we are doing an extra round trip, we can avoid checking the replay cache */
-    if (bUseReplayCache && (ulReqFlags & BID_VERIFY_FLAG_NO_REPLAY_CACHE) == 0) {
-        err = _BIDCheckReplayCache(context, replayCache, szAssertion, verificationTime);
-        BID_BAIL_ON_ERROR(err);
+    return err;
+}
+
+struct BIDVerifyBatchDesc {
+    BIDContext Context;
+    BIDReplayCache ReplayCache;
+    const char **rgszAssertions;
+    const char **rgszAudiencesOrSpns;
+    BIDBackedAssertion *rgBackedAssertions;
+    time_t VerificationTime;
+    uint32_t ulReqFlags;
+    BIDError *rgErrors;
+    BIDIdentity *rgVerifiedIdentities;
+    time_t *rgExpiryTimes;
+    uint32_t *rgulRetFlags;
+};
+
+static void
+_BIDVerifyBatchClaims(void *arg, size_t i)
+{
+    struct BIDVerifyBatchDesc *batch = (struct BIDVerifyBatchDesc *)arg;
+
+    if (batch->rgErrors[i] != BID_S_OK)
+        return;
+
+    batch->rgErrors[i] = _BIDVerifyClaims(batch->Context,
+                                          batch->ReplayCache,
+                                          batch->rgBackedAssertions[i],
+                                          batch->rgszAudiencesOrSpns != NULL
+                                            ? batch->rgszAudiencesOrSpns[i] : NULL,
+                                          NULL, 0,
+                                          batch->VerificationTime,
+                                          batch->ulReqFlags);
+}
+
+static void
+_BIDVerifyBatchItem(void *arg, size_t i)
+{
+    struct BIDVerifyBatchDesc *batch = (struct BIDVerifyBatchDesc *)arg;
+
+    if (batch->rgErrors[i] != BID_S_OK)
+        return;
+
+    batch->rgErrors[i] = _BIDVerifyBackedAssertion(batch->Context,
+                                                   batch->ReplayCache,
+                                                   batch->rgszAssertions[i],
+                                                   batch->rgBackedAssertions[i],
+                                                   batch->rgszAudiencesOrSpns != NULL
+                                                    ? batch->rgszAudiencesOrSpns[i] : NULL,
+                                                   NULL, 0,
+                                                   batch->VerificationTime,
+                                                   batch->ulReqFlags,
+                                                   &batch->rgVerifiedIdentities[i],
+                                                   &batch->rgExpiryTimes[i],
+                                                   &batch->rgulRetFlags[i]);
+
+    /* an assertion can be rejected as a replay after it was verified */
+    if (batch->rgErrors[i] != BID_S_OK &&
+        batch->rgVerifiedIdentities[i] != BID_C_NO_IDENTITY) {
+        BIDReleaseIdentity(batch->Context, batch->rgVerifiedIdentities[i]);
+        batch->rgVerifiedIdentities[i] = BID_C_NO_IDENTITY;
     }
+}
 
-    if ((ulRetFlags & BID_VERIFY_FLAG_REAUTH) == 0 &&
-        (context->ContextOptions & BID_CONTEXT_ECDH_KEYEX)) {
-        err = _BIDVerifierKeyAgreement(context, *pVerifiedIdentity);
+/*
+ * Look up each distinct issuer in the batch once, so that the workers
+ * find them in the authority cache rather than each retrieving them.
+ */
+static void
+_BIDPrefetchBatchAuthorities(struct BIDVerifyBatchDesc *batch, size_t cAssertions)
+{
+    BIDContext context = batch->Context;
+    json_t *issuers = NULL;
+    BIDAuthority authority;
+    const char *szCertIssuer;
+    size_t i;
+
+    if (_BIDAllocJsonObject(context, &issuers) != BID_S_OK)
+        return;
+
+    for (i = 0; i < cAssertions; i++) {
+        if (batch->rgErrors[i] != BID_S_OK)
+            continue;
+
+        szCertIssuer = json_string_value(json_object_get(_BIDRootCert(context, batch->rgBackedAssertions[i]), "iss"));
+        if (szCertIssuer == NULL || json_object_get(issuers, szCertIssuer) != NULL)
+            continue;
+
+        if (_BIDAcquireAuthority(context, szCertIssuer,
+                                 batch->VerificationTime, &authority) == BID_S_OK)
+            _BIDReleaseAuthority(context, authority);
+
+        json_object_set(issuers, szCertIssuer, json_true());
+    }
+
+    json_decref(issuers);
+}
+
+BIDError
+BIDVerifyAssertions(
+    BIDContext context,
+    BIDReplayCache replayCache,
+    size_t cAssertions,
+    const char **rgszAssertions,
+    const char **rgszAudiencesOrSpns,
+    time_t verificationTime,
+    uint32_t ulReqFlags,
+    BIDError *rgErrors,
+    BIDIdentity *rgVerifiedIdentities,
+    time_t *rgExpiryTimes,
+    uint32_t *rgulRetFlags)
+{
+    BIDError err;
+    struct BIDVerifyBatchDesc batch;
+    BIDContext batchContext = BID_C_NO_CONTEXT;
+    size_t i;
+
+    BID_CONTEXT_VALIDATE(context);
+
+    memset(&batch, 0, sizeof(batch));
+
+    for (i = 0; i < cAssertions; i++) {
+        rgErrors[i] = BID_S_INVALID_PARAMETER;
+        rgVerifiedIdentities[i] = BID_C_NO_IDENTITY;
+        rgExpiryTimes[i] = 0;
+        rgulRetFlags[i] = 0;
+    }
+
+    if ((context->ContextOptions & BID_CONTEXT_RP) == 0)
+        return BID_S_INVALID_USAGE;
+
+    if (cAssertions == 0)
+        return BID_S_OK;
+
+    /*
+     * Verify with a private clone of the context, which is safe to share
+     * between the workers because nothing modifies it once created. If the
+     * context has no authority cache, give the batch one of its own so that
+     * authorities are only retrieved once.
+     */
+    err = BIDCloneContext(context, context->ContextOptions | BID_CONTEXT_THREAD_SAFE,
+                          &batchContext);
+    BID_BAIL_ON_ERROR(err);
+
+    if ((batchContext->ContextOptions & (BID_CONTEXT_VERIFY_REMOTE | BID_CONTEXT_AUTHORITY_CACHE)) == 0) {
+        err = _BIDAcquireCache(batchContext, "memory:browserid.authority", 0,
+                               &batchContext->AuthorityCache);
         BID_BAIL_ON_ERROR(err);
+
+        batchContext->ContextOptions |= BID_CONTEXT_AUTHORITY_CACHE;
     }
 
-    if ((bUseReplayCache || (context->ContextOptions & BID_CONTEXT_REAUTH)) &&
-        (ulReqFlags & BID_VERIFY_FLAG_NO_REPLAY_CACHE) == 0) {
-        err = _BIDUpdateReplayCache(context, replayCache, *pVerifiedIdentity, szAssertion,
-                                    verificationTime, ulRetFlags);
+    batch.Context = batchContext;
+    batch.ReplayCache = replayCache != BID_C_NO_REPLAY_CACHE ? replayCache : context->ReplayCache;
+    batch.rgszAssertions = rgszAssertions;
+    batch.rgszAudiencesOrSpns = rgszAudiencesOrSpns;
+    batch.VerificationTime = verificationTime;
+    batch.ulReqFlags = ulReqFlags;
+    batch.rgErrors = rgErrors;
+    batch.rgVerifiedIdentities = rgVerifiedIdentities;
+    batch.rgExpiryTimes = rgExpiryTimes;
+    batch.rgulRetFlags = rgulRetFlags;
+
+    batch.rgBackedAssertions = BIDCalloc(cAssertions, sizeof(BIDBackedAssertion));
+    if (batch.rgBackedAssertions == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    for (i = 0; i < cAssertions; i++) {
+        if (rgszAssertions[i] == NULL)
+            continue;
+
+        rgErrors[i] = _BIDUnpackBackedAssertionInternal(batchContext, rgszAssertions[i],
+                                                        BID_JWT_FLAG_LAZY_PAYLOAD,
+                                                        &batch.rgBackedAssertions[i]);
+        if (rgErrors[i] != BID_S_OK)
+            _BIDCountVerifyRejection(batchContext, BID_VERIFY_STAGE_PARSE);
+    }
+
+    /*
+     * Reject what we can without the network or public key operations,
+     * so that authorities are only retrieved for the assertions left.
+     */
+    if ((batchContext->ContextOptions & BID_CONTEXT_VERIFY_REMOTE) == 0) {
+        err = _BIDParallelFor(batchContext, cAssertions, _BIDVerifyBatchClaims, &batch);
         BID_BAIL_ON_ERROR(err);
+
+        batch.ulReqFlags |= BID_VERIFY_FLAG_CLAIMS_VERIFIED;
+
+        _BIDPrefetchBatchAuthorities(&batch, cAssertions);
     }
 
-    _BIDGetJsonTimestampValue(context, (*pVerifiedIdentity)->Attributes, "exp", pExpiryTime);
+    err = _BIDParallelFor(batchContext, cAssertions, _BIDVerifyBatchItem, &batch);
+    BID_BAIL_ON_ERROR(err);
 
 cleanup:
-    _BIDReleaseBackedAssertion(context, backedAssertion);
+    if (batch.rgBackedAssertions != NULL) {
+        for (i = 0; i < cAssertions; i++)
+            _BIDReleaseBackedAssertion(batchContext, batch.rgBackedAssertions[i]);
+        BIDFree(batch.rgBackedAssertions);
+    }
+    BIDReleaseContext(batchContext);
 
-    *pulRetFlags = ulRetFlags;
     return err;
 }
 
@@ -128,75 +128,352 @@ _BIDParseJWT(
     BIDContext context,
     const char *szJwt,
     BIDJWT *pJwt)
+{
+    return _BIDParseJWTInternal(context, szJwt, strlen(szJwt), 0, pJwt);
+}
+
+/*
+ * Parse cchJwt characters of szJwt, which need not be NUL terminated.
+ * With BID_JWT_FLAG_BORROW_DATA, the JWT refers to szJwt rather than a
+ * copy and the caller must keep it valid for the lifetime of the JWT.
+ */
+BIDError
+_BIDParseJWTInternal(
+    BIDContext context,
+    const char *szJwt,
+    size_t cchJwt,
+    uint32_t ulFlags,
+    BIDJWT *pJwt)
 {
     BIDJWT jwt = NULL;
     BIDError err;
-    char *szHeader, *szPayload, *szSignature;
+    const char *pchPayload, *pchSignature, *pchEnd;
     size_t cbSignature;
 
     *pJwt = NULL;
 
-    if (strlen(szJwt) == 0) {
+    if (cchJwt == 0) {
         err = BID_S_OK;
         goto cleanup;
     }
 
-    jwt = BIDCalloc(1, sizeof(*jwt));
-    if (jwt == NULL) {
-        err = BID_S_NO_MEMORY;
-        goto cleanup;
-    }
-
-    err = _BIDDuplicateString(context, szJwt, &jwt->EncData);
-    BID_BAIL_ON_ERROR(err);
-
-    szHeader = jwt->EncData;
+    pchEnd = szJwt + cchJwt;
 
-    szPayload = strchr(szHeader, '.');
-    if (szPayload == NULL) {
+    pchPayload = memchr(szJwt, '.', cchJwt);
+    if (pchPayload == NULL) {
         err = BID_S_INVALID_JSON_WEB_TOKEN;
         goto cleanup;
     }
-    *szPayload++ = '\0';
+    pchPayload++;
 
-    szSignature = strchr(szPayload, '.');
-    if (szSignature == NULL) {
+    pchSignature = memchr(pchPayload, '.', pchEnd - pchPayload);
+    if (pchSignature == NULL) {
         err = BID_S_INVALID_SIGNATURE;
         goto cleanup;
     }
-    *szSignature++ = '\0';
+    pchSignature++;
 
-    err = _BIDDecodeJson(context, szHeader, &jwt->Header);
+    jwt = BIDCalloc(1, sizeof(*jwt));
+    if (jwt == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    if (ulFlags & BID_JWT_FLAG_BORROW_DATA) {
+        jwt->EncData = (char *)szJwt;
+        jwt->Flags |= BID_JWT_FLAG_BORROW_DATA;
+    } else {
+        jwt->EncData = BIDMalloc(cchJwt + 1);
+        if (jwt->EncData == NULL) {
+            err = BID_S_NO_MEMORY;
+            goto cleanup;
+        }
+        memcpy(jwt->EncData, szJwt, cchJwt);
+        jwt->EncData[cchJwt] = '\0';
+    }
+
+    /* Header.Payload for signature verification */
+    jwt->EncDataLength = pchSignature - 1 - szJwt;
+
+    err = _BIDDecodeJsonLength(context, szJwt, pchPayload - 1 - szJwt, &jwt->Header);
     BID_BAIL_ON_ERROR(err);
 
     err = _BIDValidateJWTHeader(context, jwt->Header);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDDecodeJson(context, szPayload, &jwt->Payload);
-    BID_BAIL_ON_ERROR(err);
+    jwt->EncPayload = jwt->EncData + (pchPayload - szJwt);
+    jwt->EncPayloadLength = pchSignature - 1 - pchPayload;
+
+    if (ulFlags & BID_JWT_FLAG_LAZY_PAYLOAD) {
+        jwt->Flags |= BID_JWT_FLAG_LAZY_PAYLOAD;
+    } else {
+        err = _BIDDecodeJWTPayload(context, jwt);
+        BID_BAIL_ON_ERROR(err);
+    }
 
     BID_ASSERT(jwt->Signature == NULL);
 
-    err = _BIDBase64UrlDecode(szSignature, &jwt->Signature, &cbSignature);
+    err = _BIDBase64UrlDecodeLength(pchSignature, pchEnd - pchSignature,
+                                    &jwt->Signature, &cbSignature);
     BID_BAIL_ON_ERROR(err);
 
-    *(--szPayload) = '.'; /* Restore Header.Payload for signature verification */
-
     jwt->SignatureLength = (size_t)cbSignature;
-    jwt->EncDataLength = strlen(jwt->EncData);
-
-    *(--szSignature) = '.'; /* Restore Header.Signature for certificate hashing */
 
     err = BID_S_OK;
     *pJwt = jwt;
 
 cleanup:
-    if (err != BID_S_OK)
+    if (err != BID_S_OK && jwt != NULL)
         _BIDReleaseJWT(context, jwt);
 
     return err;
 }
 
+BIDError
+_BIDDecodeJWTPayload(
+    BIDContext context,
+    BIDJWT jwt)
+{
+    if (jwt->Payload != NULL)
+        return BID_S_OK;
+
+    if (jwt->EncPayload == NULL)
+        return BID_S_INVALID_JSON_WEB_TOKEN;
+
+    return _BIDDecodeJsonLength(context, jwt->EncPayload,
+                                jwt->EncPayloadLength, &jwt->Payload);
+}
+
+/*
+ * A minimal scanner over the top level of a JSON object, enough to find
+ * the claims in struct BIDJWTClaimsDesc without building a json_t. It is
+ * not a validator: the payload is always fully parsed before it is used.
+ */
+static char *
+_BIDSkipJsonWhitespace(char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+        p++;
+
+    return p;
+}
+
+static char *
+_BIDSkipJsonString(char *p, int *pbEscaped)
+{
+    BID_ASSERT(*p == '"');
+
+    for (p++; *p != '"'; p++) {
+        if (*p == '\0')
+            return NULL;
+        else if (*p == '\\') {
+            *pbEscaped = 1;
+            if (*++p == '\0')
+                return NULL;
+        }
+    }
+
+    return p + 1;
+}
+
+static char *
+_BIDSkipJsonValue(char *p)
+{
+    int depth = 0, bEscaped;
+
+    do {
+        p = _BIDSkipJsonWhitespace(p);
+
+        switch (*p) {
+        case '\0':
+            return NULL;
+        case '"':
+            p = _BIDSkipJsonString(p, &bEscaped);
+            if (p == NULL)
+                return NULL;
+            break;
+        case '{':
+        case '[':
+            depth++;
+            p++;
+            break;
+        case '}':
+        case ']':
+        case ',':
+        case ':':
+            if (depth == 0)
+                return NULL;
+            if (*p == '}' || *p == ']')
+                depth--;
+            p++;
+            break;
+        default:
+            while (*p != '\0' && strchr("{}[],:\" \t\n\r", *p) == NULL)
+                p++;
+            break;
+        }
+    } while (depth > 0);
+
+    return p;
+}
+
+/*
+ * Returns non-zero if p is a JSON integer that fits in a json_int_t.
+ */
+static int
+_BIDScanJsonTimestamp(const char *p, time_t *pts)
+{
+    json_int_t value = 0;
+    int bNegative = 0;
+    size_t cDigits = 0;
+
+    if (*p == '-') {
+        bNegative = 1;
+        p++;
+    }
+
+    for (; *p >= '0' && *p <= '9'; p++) {
+        if (++cDigits > (sizeof(json_int_t) >= 8 ? 18 : 9))
+            return 0;
+        value = value * 10 + (*p - '0');
+    }
+
+    if (cDigits == 0 || *p == '.' || *p == 'e' || *p == 'E')
+        return 0;
+
+    if (bNegative)
+        value = -value;
+
+    *pts = value;
+    *pts /= 1000;
+
+    return 1;
+}
+
+static BIDError
+_BIDScanJWTClaims(
+    char *szJson,
+    struct BIDJWTClaimsDesc *claims)
+{
+    char *p = _BIDSkipJsonWhitespace(szJson);
+
+    if (*p++ != '{')
+        return BID_S_INVALID_JSON;
+
+    p = _BIDSkipJsonWhitespace(p);
+    if (*p == '}')
+        return BID_S_OK;
+
+    for (;;) {
+        char *szKey, *pValue;
+        size_t cchKey;
+        uint32_t ulClaim = 0;
+        int bEscaped = 0;
+        time_t *pts = NULL;
+
+        p = _BIDSkipJsonWhitespace(p);
+        if (*p != '"')
+            return BID_S_INVALID_JSON;
+
+        szKey = p + 1;
+        p = _BIDSkipJsonString(p, &bEscaped);
+        if (p == NULL)
+            return BID_S_INVALID_JSON;
+        cchKey = p - 1 - szKey;
+
+        /* an escaped key might be any of the claims */
+        if (bEscaped)
+            claims->Opaque |= BID_JWT_CLAIM_ALL;
+        else if (cchKey == 3 && memcmp(szKey, "aud", 3) == 0)
+            ulClaim = BID_JWT_CLAIM_AUD;
+        else if (cchKey == 3 && memcmp(szKey, "exp", 3) == 0) {
+            ulClaim = BID_JWT_CLAIM_EXP;
+            pts = &claims->Expiry;
+        } else if (cchKey == 3 && memcmp(szKey, "iat", 3) == 0) {
+            ulClaim = BID_JWT_CLAIM_IAT;
+            pts = &claims->IssuedAt;
+        } else if (cchKey == 3 && memcmp(szKey, "nbf", 3) == 0) {
+            ulClaim = BID_JWT_CLAIM_NBF;
+            pts = &claims->NotBefore;
+        }
+
+        p = _BIDSkipJsonWhitespace(p);
+        if (*p++ != ':')
+            return BID_S_INVALID_JSON;
+
+        pValue = _BIDSkipJsonWhitespace(p);
+        p = _BIDSkipJsonValue(pValue);
+        if (p == NULL)
+            return BID_S_INVALID_JSON;
+
+        claims->Present |= ulClaim;
+
+        if (ulClaim == BID_JWT_CLAIM_AUD) {
+            claims->Audience = NULL;
+
+            /* a value that is not a string is treated as missing */
+            if (*pValue == '"') {
+                bEscaped = 0;
+                _BIDSkipJsonString(pValue, &bEscaped);
+
+                if (bEscaped) {
+                    claims->Opaque |= ulClaim;
+                } else {
+                    claims->Audience = pValue + 1;
+                    p[-1] = '\0'; /* closing quote; scanning resumes at p */
+                }
+            }
+        } else if (pts != NULL) {
+            if (!_BIDScanJsonTimestamp(pValue, pts))
+                claims->Opaque |= ulClaim;
+        }
+
+        p = _BIDSkipJsonWhitespace(p);
+        if (*p == '}')
+            break;
+        else if (*p++ != ',')
+            return BID_S_INVALID_JSON;
+    }
+
+    return BID_S_OK;
+}
+
+/*
+ * Extract the audience and validity period from a lazily parsed JWT
+ * without decoding the rest of the payload. Audience points into the
+ * thread arena, so it is only valid until the next use of the arena.
+ */
+BIDError
+_BIDGetJWTClaims(
+    BIDContext context BID_UNUSED,
+    BIDJWT jwt,
+    struct BIDJWTClaimsDesc *claims)
+{
+    BIDError err;
+    char *szJson;
+    size_t cbJson;
+
+    memset(claims, 0, sizeof(*claims));
+
+    if (jwt->EncPayload == NULL)
+        return BID_S_INVALID_JSON_WEB_TOKEN;
+
+    szJson = _BIDGetThreadArena(jwt->EncPayloadLength + 1);
+    if (szJson == NULL)
+        return BID_S_BUFFER_TOO_LONG;
+
+    cbJson = jwt->EncPayloadLength;
+
+    err = _BIDBase64UrlDecodeLength(jwt->EncPayload, jwt->EncPayloadLength,
+                                    (unsigned char **)&szJson, &cbJson);
+    if (err != BID_S_OK)
+        return err;
+
+    szJson[cbJson] = '\0';
+
+    return _BIDScanJWTClaims(szJson, claims);
+}
+
 static BIDError
 _BIDMakeSignatureData(
     BIDContext context,
@@ -209,9 +486,13 @@ _BIDMakeSignatureData(
     size_t cchEncodedHeader, cchEncodedPayload;
 
     if (jwt->EncData != NULL) {
-        BIDFree(jwt->EncData);
+        if ((jwt->Flags & BID_JWT_FLAG_BORROW_DATA) == 0)
+            BIDFree(jwt->EncData);
         jwt->EncData = NULL;
         jwt->EncDataLength = 0;
+        jwt->EncPayload = NULL;
+        jwt->EncPayloadLength = 0;
+        jwt->Flags &= ~(BID_JWT_FLAG_BORROW_DATA);
     }
 
     err = _BIDEncodeJson(context, jwt->Header, &szEncodedHeader, &cchEncodedHeader);
@@ -244,11 +525,42 @@ cleanup:
     return err;
 }
 
+static BIDError
+_BIDMakeSecretKeySignature(
+    BIDContext context,
+    BIDJWT jwt,
+    BIDSecretHandle secretHandle)
+{
+    BIDError err;
+    unsigned char hmac[32];
+    size_t cbHmac = sizeof(hmac);
+
+    err = _BIDSecretKeyHMAC(context, secretHandle,
+                            (const unsigned char *)jwt->EncData, jwt->EncDataLength,
+                            hmac, &cbHmac);
+    BID_BAIL_ON_ERROR(err);
+
+    jwt->Signature = BIDMalloc(cbHmac);
+    if (jwt->Signature == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    memcpy(jwt->Signature, hmac, cbHmac);
+    jwt->SignatureLength = cbHmac;
+
+cleanup:
+    memset(hmac, 0, sizeof(hmac));
+
+    return err;
+}
+
 BIDError
 _BIDMakeSignature(
     BIDContext context,
     BIDJWT jwt,
     BIDJWKSet keyset,
+    BIDSecretHandle secretHandle,
     json_t *certChain,
     char **pszJwt,
     size_t *pcchJwt)
@@ -257,6 +569,7 @@ _BIDMakeSignature(
     BIDJWK key = NULL;
     size_t i;
     BIDJWTAlgorithm alg = NULL;
+    const char *szAlgID = "none";
     char *szEncSignature = NULL, *p;
     size_t cchEncSignature = 0;
 
@@ -267,7 +580,10 @@ _BIDMakeSignature(
 
     err = BID_S_UNKNOWN_ALGORITHM;
 
-    if (keyset != NULL) {
+    if (secretHandle != NULL) {
+        szAlgID = "HS256";
+        err = BID_S_OK;
+    } else if (keyset != NULL) {
         for (i = 0; _BIDJWTAlgorithms[i].szAlgID != NULL; i++) {
             alg = &_BIDJWTAlgorithms[i];
 
@@ -276,6 +592,8 @@ _BIDMakeSignature(
                 break;
         }
         BID_BAIL_ON_ERROR(err);
+
+        szAlgID = alg->szAlgID;
     }
 
     if (jwt->Header == NULL) {
@@ -284,7 +602,7 @@ _BIDMakeSignature(
     }
 
     err = _BIDJsonObjectSet(context, jwt->Header, "alg",
-                            json_string(alg ? alg->szAlgID : "none"),
+                            json_string(szAlgID),
                             BID_JSON_FLAG_REQUIRED | BID_JSON_FLAG_CONSUME_REF);
     BID_BAIL_ON_ERROR(err);
 
@@ -299,10 +617,15 @@ _BIDMakeSignature(
     jwt->Signature = NULL;
     jwt->SignatureLength = 0;
 
-    if (key != NULL) {
+    if (secretHandle != NULL) {
+        err = _BIDMakeSecretKeySignature(context, jwt, secretHandle);
+        BID_BAIL_ON_ERROR(err);
+    } else if (key != NULL) {
         err = alg->MakeSignature(alg, context, jwt, key);
         BID_BAIL_ON_ERROR(err);
+    }
 
+    if (jwt->Signature != NULL) {
         err = _BIDBase64UrlEncode(jwt->Signature, jwt->SignatureLength, &szEncSignature, &cchEncSignature);
         BID_BAIL_ON_ERROR(err);
     }
@@ -398,6 +721,55 @@ cleanup:
     return err;
 }
 
+BIDError
+_BIDVerifySecretKeySignature(
+    BIDContext context,
+    BIDJWT jwt,
+    BIDSecretHandle secretHandle)
+{
+    BIDError err;
+    const char *sigAlg;
+    unsigned char hmac[32];
+    size_t cbHmac = sizeof(hmac);
+
+    BID_CONTEXT_VALIDATE(context);
+
+    if (jwt == NULL || secretHandle == NULL) {
+        err = BID_S_INVALID_PARAMETER;
+        goto cleanup;
+    }
+
+    if (jwt->SignatureLength == 0) {
+        err = BID_S_MISSING_SIGNATURE;
+        goto cleanup;
+    }
+
+    sigAlg = json_string_value(json_object_get(jwt->Header, "alg"));
+    if (sigAlg == NULL) {
+        err = BID_S_MISSING_ALGORITHM;
+        goto cleanup;
+    } else if (strcmp(sigAlg, "HS256") != 0) {
+        err = BID_S_UNKNOWN_ALGORITHM;
+        goto cleanup;
+    }
+
+    err = _BIDSecretKeyHMAC(context, secretHandle,
+                            (const unsigned char *)jwt->EncData, jwt->EncDataLength,
+                            hmac, &cbHmac);
+    BID_BAIL_ON_ERROR(err);
+
+    if (jwt->SignatureLength != cbHmac ||
+        _BIDTimingSafeCompare(jwt->Signature, hmac, cbHmac) != 0) {
+        err = BID_S_INVALID_SIGNATURE;
+        goto cleanup;
+    }
+
+cleanup:
+    memset(hmac, 0, sizeof(hmac));
+
+    return err;
+}
+
 BIDError
 _BIDReleaseJWTInternal(
     BIDContext context BID_UNUSED,
@@ -407,7 +779,8 @@ _BIDReleaseJWTInternal(
     if (jwt == NULL)
         return BID_S_INVALID_PARAMETER;
 
-    BIDFree(jwt->EncData);
+    if ((jwt->Flags & BID_JWT_FLAG_BORROW_DATA) == 0)
+        BIDFree(jwt->EncData);
     json_decref(jwt->Header);
     json_decref(jwt->Payload);
     BIDFree(jwt->Signature);
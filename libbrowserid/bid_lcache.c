@@ -0,0 +1,1127 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bid_private.h"
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#include <sys/stat.h>
+
+/*
+ * Journaled cache backend. Rather than rewriting the entire cache on
+ * every mutation as the file backend does, each change is appended to
+ * the end of the file as a single line:
+ *
+ *      {"k":"key","v":value}       set key to value
+ *      {"k":"key"}                 remove key
+ *
+ * Unless the cache is unversioned, the first line is a header record
+ * {"v":"2013.01.01-log"}. A cache written by the file backend is also
+ * accepted as a header, so existing caches can be switched over with
+ * only a change of scheme.
+ *
+ * Each cache handle keeps an index of the journal together with the
+ * offset it has been replayed to, so only records appended by other
+ * processes need to be parsed. Once the journal contains sufficiently
+ * many superseded records, it is compacted by writing the live entries
+ * to a temporary file and renaming it over the journal. Other processes
+ * notice this by the change of inode and rebuild their index.
+ */
+
+#define BID_LOG_CACHE_VERSION           "2013.01.01-log"
+#define BID_FILE_CACHE_VERSION          "2013.01.01"
+
+#define BID_LOG_CACHE_COMPACT_MIN       1024    /* minimum records before compacting */
+#define BID_LOG_CACHE_COMPACT_RATIO     2       /* records per live entry before compacting */
+
+struct BIDLogCache {
+    BID_MUTEX Mutex;
+    char *Name;
+    uint32_t Flags;
+    json_t *Index;
+    dev_t Device;
+    ino_t Inode;
+    off_t Offset;
+    size_t cRecords;
+    int bCompact;
+};
+
+/*
+ * fcntl locks are per-process, so the mutex serializes threads sharing
+ * a cache handle as well as protecting the index.
+ */
+#define BIDLogCacheLock(lc)         BID_MUTEX_LOCK(&(lc)->Mutex)
+#define BIDLogCacheUnlock(lc)       BID_MUTEX_UNLOCK(&(lc)->Mutex)
+
+static BIDError
+_BIDLogCacheAcquire(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void **cache,
+    const char *name,
+    uint32_t ulFlags)
+{
+    BIDError err;
+    struct BIDLogCache *lc;
+
+    lc = BIDCalloc(1, sizeof(*lc));
+    if (lc == NULL)
+        return BID_S_NO_MEMORY;
+
+    err = _BIDAllocJsonObject(context, &lc->Index);
+    if (err != BID_S_OK) {
+        BIDFree(lc);
+        return err;
+    }
+
+    err = _BIDDuplicateString(context, name, &lc->Name);
+    if (err != BID_S_OK) {
+        json_decref(lc->Index);
+        BIDFree(lc);
+        return err;
+    }
+
+    BID_MUTEX_INIT(&lc->Mutex);
+
+    lc->Flags = ulFlags;
+
+    *cache = lc;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDLogCacheRelease(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache)
+{
+    struct BIDLogCache *lc = (struct BIDLogCache *)cache;
+
+    if (lc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    BIDFree(lc->Name);
+    json_decref(lc->Index);
+    BID_MUTEX_DESTROY(&lc->Mutex);
+    BIDFree(lc);
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDLogCacheLockFile(int fd, int exclusive)
+{
+    int ret;
+    BIDError err;
+#ifdef HAVE_FCNTL_H
+    struct flock l;
+
+    l.l_start = 0;
+    l.l_len = 0;
+    l.l_type = exclusive ? F_WRLCK : F_RDLCK;
+    l.l_whence = SEEK_SET;
+    ret = fcntl(fd, F_SETLKW, &l);
+#else
+    ret = flock(fd, exclusive ? LOCK_EX : LOCK_SH);
+#endif
+    if (ret < 0)
+        ret = errno;
+    if (ret == EACCES) /* fcntl can return EACCES instead of EAGAIN */
+        ret = EAGAIN;
+
+    switch (ret) {
+    case 0:
+        err = BID_S_OK;
+        break;
+    case EAGAIN:
+        err = BID_S_CACHE_LOCK_TIMEOUT;
+        break;
+    default:
+        err = BID_S_CACHE_LOCK_ERROR;
+        break;
+    }
+
+    return err;
+}
+
+static BIDError
+_BIDLogCacheUnlockFile(int fd)
+{
+    int ret;
+
+#ifdef HAVE_FCNTL_H
+    struct flock l;
+    l.l_start = 0;
+    l.l_len = 0;
+    l.l_type = F_UNLCK;
+    l.l_whence = SEEK_SET;
+    ret = fcntl(fd, F_SETLKW, &l);
+#else
+    ret = flock(fd, LOCK_UN);
+#endif
+    if (ret < 0)
+        ret = errno;
+
+    return (ret == 0) ? BID_S_OK : BID_S_CACHE_UNLOCK_ERROR;
+}
+
+/*
+ * Open and lock the journal. Because compaction replaces the journal,
+ * the lock may have been acquired on a file that is no longer linked at
+ * the cache name, in which case we retry with the new file.
+ */
+static BIDError
+_BIDLogCacheOpen(
+    struct BIDLogCache *lc,
+    int flags,
+    int *pFd)
+{
+    BIDError err;
+    int exclusive, fd;
+    mode_t mode;
+    struct stat sb1, sb2;
+
+    *pFd = -1;
+
+    mode = (lc->Flags & BID_CACHE_FLAG_READONLY) ? 0400 : 0600;
+    exclusive = ((flags & O_WRONLY) || (flags & O_RDWR));
+
+    for (;;) {
+        fd = open(lc->Name, flags, mode);
+        if (fd < 0) {
+            switch (errno) {
+            case ENOENT:
+                err = BID_S_CACHE_NOT_FOUND;
+                break;
+            case EPERM:
+                err = BID_S_CACHE_PERMISSION_DENIED;
+                break;
+            case EEXIST:
+                err = BID_S_CACHE_ALREADY_EXISTS;
+                break;
+            default:
+                err = BID_S_CACHE_OPEN_ERROR;
+                break;
+            }
+            return err;
+        }
+
+#ifdef HAVE_FCNTL_H
+        if (flags & O_CLOEXEC) {
+            int f = fcntl(fd, F_GETFD);
+            if (f != -1)
+                fcntl(fd, F_SETFD, f | FD_CLOEXEC);
+        }
+#endif
+
+        err = _BIDLogCacheLockFile(fd, exclusive);
+        if (err != BID_S_OK) {
+            close(fd);
+            return err;
+        }
+
+        if (fstat(fd, &sb1) < 0) {
+            _BIDLogCacheUnlockFile(fd);
+            close(fd);
+            return BID_S_CACHE_OPEN_ERROR;
+        }
+
+        if (stat(lc->Name, &sb2) == 0 &&
+            sb1.st_dev == sb2.st_dev && sb1.st_ino == sb2.st_ino)
+            break;
+
+        _BIDLogCacheUnlockFile(fd);
+        close(fd);
+
+        flags &= ~(O_EXCL);
+    }
+
+    *pFd = fd;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDLogCacheClose(int fd)
+{
+    BIDError err = BID_S_OK;
+
+    if (fd != -1) {
+        err = _BIDLogCacheUnlockFile(fd);
+        if (close(fd) < 0)
+            err = BID_S_CACHE_CLOSE_ERROR;
+    }
+
+    return err;
+}
+
+static BIDError
+_BIDLogCacheReset(
+    BIDContext context,
+    struct BIDLogCache *lc,
+    struct stat *sb)
+{
+    BIDError err;
+    json_t *index;
+
+    err = _BIDAllocJsonObject(context, &index);
+    if (err != BID_S_OK)
+        return err;
+
+    json_decref(lc->Index);
+    lc->Index = index;
+
+    lc->Device = (sb != NULL) ? sb->st_dev : 0;
+    lc->Inode = (sb != NULL) ? sb->st_ino : 0;
+    lc->Offset = 0;
+    lc->cRecords = 0;
+    lc->bCompact = 0;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDLogCacheApplyRecord(
+    BIDContext context,
+    struct BIDLogCache *lc,
+    json_t *record,
+    int bFirstRecord)
+{
+    BIDError err;
+    const char *key;
+    json_t *value;
+
+    if (!json_is_object(record))
+        return BID_S_CACHE_READ_ERROR;
+
+    key = json_string_value(json_object_get(record, "k"));
+    if (key == NULL) {
+        const char *version;
+
+        if (!bFirstRecord || (lc->Flags & BID_CACHE_FLAG_UNVERSIONED))
+            return BID_S_CACHE_READ_ERROR;
+
+        version = json_string_value(json_object_get(record, "v"));
+        if (version == NULL)
+            return BID_S_CACHE_INVALID_VERSION;
+
+        if (strcmp(version, BID_LOG_CACHE_VERSION) == 0)
+            return BID_S_OK;
+
+        /* A cache written by the file backend becomes the base of the journal */
+        if (strcmp(version, BID_FILE_CACHE_VERSION) == 0) {
+            json_t *d = json_object_get(record, "d");
+
+            if (!json_is_object(d))
+                return BID_S_CACHE_READ_ERROR;
+            if (json_object_update(lc->Index, d) < 0)
+                return BID_S_NO_MEMORY;
+
+            return BID_S_OK;
+        }
+
+        return BID_S_CACHE_INVALID_VERSION;
+    } else if (bFirstRecord && (lc->Flags & BID_CACHE_FLAG_UNVERSIONED) == 0) {
+        return BID_S_CACHE_INVALID_VERSION;
+    }
+
+    value = json_object_get(record, "v");
+    if (value == NULL)
+        err = _BIDJsonObjectDel(context, lc->Index, key, 0);
+    else
+        err = _BIDJsonObjectSet(context, lc->Index, key, value, 0);
+
+    return err;
+}
+
+/*
+ * Bring the index up to date with any records appended since it was
+ * last synchronized. The caller must hold the journal lock.
+ */
+static BIDError
+_BIDLogCacheSync(
+    BIDContext context,
+    struct BIDLogCache *lc,
+    int fd)
+{
+    BIDError err;
+    struct stat sb;
+    char *buf = NULL, *p, *q;
+    size_t cbTail, cbRead = 0;
+    json_t *record = NULL;
+
+    if (fstat(fd, &sb) < 0)
+        return BID_S_CACHE_READ_ERROR;
+
+    if (sb.st_dev != lc->Device || sb.st_ino != lc->Inode ||
+        sb.st_size < lc->Offset) {
+        err = _BIDLogCacheReset(context, lc, &sb);
+        if (err != BID_S_OK)
+            return err;
+    }
+
+    if (sb.st_size == lc->Offset)
+        return BID_S_OK;
+
+    cbTail = sb.st_size - lc->Offset;
+
+    buf = BIDMalloc(cbTail + 1);
+    if (buf == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    if (lseek(fd, lc->Offset, SEEK_SET) < 0) {
+        err = BID_S_CACHE_READ_ERROR;
+        goto cleanup;
+    }
+
+    while (cbRead < cbTail) {
+        ssize_t cbChunk = read(fd, &buf[cbRead], cbTail - cbRead);
+
+        if (cbChunk < 0 && errno == EINTR)
+            continue;
+        else if (cbChunk <= 0)
+            break;
+
+        cbRead += cbChunk;
+    }
+    buf[cbRead] = '\0';
+
+    /* An incomplete trailing record is left for the next writer to truncate */
+    for (p = buf; (q = memchr(p, '\n', &buf[cbRead] - p)) != NULL; p = q + 1) {
+        *q = '\0';
+
+        if (q == p)
+            continue;
+
+        record = json_loads(p, 0, BID_JSON_ERROR(context));
+        if (record != NULL)
+            err = _BIDLogCacheApplyRecord(context, lc, record,
+                                          (lc->Offset == 0 && lc->cRecords == 0));
+        else
+            err = BID_S_CACHE_READ_ERROR;
+
+        /*
+         * Skip a complete but malformed record rather than failing every
+         * later sync; the next writer compacts it out of the journal.
+         */
+        if (err == BID_S_CACHE_READ_ERROR) {
+            lc->bCompact = 1;
+            err = BID_S_OK;
+        }
+        BID_BAIL_ON_ERROR(err);
+
+        json_decref(record);
+        record = NULL;
+
+        lc->cRecords++;
+    }
+
+    lc->Offset += (p - buf);
+    err = BID_S_OK;
+
+cleanup:
+    if (err != BID_S_OK) {
+        /* force the index to be rebuilt from scratch next time */
+        lc->Device = 0;
+        lc->Inode = 0;
+    }
+    json_decref(record);
+    BIDFree(buf);
+
+    return err;
+}
+
+static BIDError
+_BIDLogCacheStoreRecord(
+    int fd,
+    json_t *record,
+    size_t *pcbWritten)
+{
+    char *szJson;
+    size_t cchJson;
+    ssize_t cbWritten;
+
+    szJson = json_dumps(record, JSON_COMPACT);
+    if (szJson == NULL)
+        return BID_S_CANNOT_ENCODE_JSON;
+
+    cchJson = strlen(szJson);
+
+    cbWritten = write(fd, szJson, cchJson);
+    if (cbWritten == cchJson)
+        cbWritten += write(fd, "\n", 1);
+
+    BIDFree(szJson);
+
+    if (cbWritten != cchJson + 1)
+        return BID_S_CACHE_WRITE_ERROR;
+
+    *pcbWritten += cbWritten;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDLogCacheMakeRecord(
+    BIDContext context,
+    const char *key,
+    json_t *value,
+    json_t **pRecord)
+{
+    BIDError err;
+    json_t *record = NULL;
+
+    *pRecord = NULL;
+
+    err = _BIDAllocJsonObject(context, &record);
+    BID_BAIL_ON_ERROR(err);
+
+    if (key != NULL) {
+        err = _BIDJsonObjectSet(context, record, "k", json_string(key),
+                                BID_JSON_FLAG_REQUIRED | BID_JSON_FLAG_CONSUME_REF);
+        BID_BAIL_ON_ERROR(err);
+
+        if (value != NULL) {
+            err = _BIDJsonObjectSet(context, record, "v", value, 0);
+            BID_BAIL_ON_ERROR(err);
+        }
+    } else {
+        err = _BIDJsonObjectSet(context, record, "v", json_string(BID_LOG_CACHE_VERSION),
+                                BID_JSON_FLAG_REQUIRED | BID_JSON_FLAG_CONSUME_REF);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    err = BID_S_OK;
+    *pRecord = record;
+
+cleanup:
+    if (err != BID_S_OK)
+        json_decref(record);
+
+    return err;
+}
+
+static BIDError
+_BIDLogCacheStoreHeader(
+    BIDContext context,
+    int fd,
+    size_t *pcbWritten)
+{
+    BIDError err;
+    json_t *header;
+
+    err = _BIDLogCacheMakeRecord(context, NULL, NULL, &header);
+    if (err != BID_S_OK)
+        return err;
+
+    err = _BIDLogCacheStoreRecord(fd, header, pcbWritten);
+
+    json_decref(header);
+
+    return err;
+}
+
+/*
+ * Append a record to the journal, discarding any incomplete record left
+ * by an interrupted writer. The caller must hold the journal lock
+ * exclusively and have synchronized the index.
+ */
+static BIDError
+_BIDLogCacheAppend(
+    BIDContext context,
+    struct BIDLogCache *lc,
+    int fd,
+    json_t *record)
+{
+    BIDError err;
+    size_t cbWritten = 0;
+    struct stat sb;
+
+    if (fstat(fd, &sb) < 0)
+        return BID_S_CACHE_WRITE_ERROR;
+
+    if (sb.st_size != lc->Offset && ftruncate(fd, lc->Offset) < 0)
+        return BID_S_CACHE_WRITE_ERROR;
+
+    if (lseek(fd, lc->Offset, SEEK_SET) < 0)
+        return BID_S_CACHE_WRITE_ERROR;
+
+    if (lc->Offset == 0 && (lc->Flags & BID_CACHE_FLAG_UNVERSIONED) == 0) {
+        err = _BIDLogCacheStoreHeader(context, fd, &cbWritten);
+        if (err == BID_S_OK)
+            lc->cRecords++;
+    } else {
+        err = BID_S_OK;
+    }
+
+    if (err == BID_S_OK)
+        err = _BIDLogCacheStoreRecord(fd, record, &cbWritten);
+
+    if (err != BID_S_OK) {
+        if (ftruncate(fd, lc->Offset) < 0)
+            err = BID_S_CACHE_WRITE_ERROR;
+        return err;
+    }
+
+    lc->Offset += cbWritten;
+    lc->cRecords++;
+
+    return BID_S_OK;
+}
+
+/*
+ * Rewrite the journal with only the live entries. The caller must hold
+ * the journal lock exclusively, which is released on the old file after
+ * the rename; waiters then notice the inode change in _BIDLogCacheOpen().
+ */
+static BIDError
+_BIDLogCacheRewrite(
+    BIDContext context,
+    struct BIDLogCache *lc)
+{
+    BIDError err;
+    int fd = -1;
+    char *szTmpName = NULL;
+    size_t cchFileName, cbWritten = 0, cRecords = 0;
+    void *iter;
+    json_t *record = NULL;
+    struct stat sb;
+
+    cchFileName = strlen(lc->Name);
+    szTmpName = BIDMalloc(cchFileName + sizeof(".XXXXXX"));
+    if (szTmpName == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    memcpy(szTmpName, lc->Name, cchFileName);
+    memcpy(&szTmpName[cchFileName], ".XXXXXX", sizeof(".XXXXXX"));
+
+    fd = mkstemp(szTmpName);
+    if (fd < 0) {
+        err = BID_S_CACHE_WRITE_ERROR;
+        goto cleanup;
+    }
+
+    if ((lc->Flags & BID_CACHE_FLAG_UNVERSIONED) == 0) {
+        err = _BIDLogCacheStoreHeader(context, fd, &cbWritten);
+        BID_BAIL_ON_ERROR(err);
+
+        cRecords++;
+    }
+
+    for (iter = json_object_iter(lc->Index);
+         iter != NULL;
+         iter = json_object_iter_next(lc->Index, iter)) {
+        err = _BIDLogCacheMakeRecord(context, json_object_iter_key(iter),
+                                     json_object_iter_value(iter), &record);
+        BID_BAIL_ON_ERROR(err);
+
+        err = _BIDLogCacheStoreRecord(fd, record, &cbWritten);
+        BID_BAIL_ON_ERROR(err);
+
+        json_decref(record);
+        record = NULL;
+
+        cRecords++;
+    }
+
+    if (fstat(fd, &sb) < 0) {
+        err = BID_S_CACHE_WRITE_ERROR;
+        goto cleanup;
+    }
+
+    if (rename(szTmpName, lc->Name) < 0) {
+        err = BID_S_CACHE_WRITE_ERROR;
+        goto cleanup;
+    }
+
+    lc->Device = sb.st_dev;
+    lc->Inode = sb.st_ino;
+    lc->Offset = cbWritten;
+    lc->cRecords = cRecords;
+    lc->bCompact = 0;
+
+    err = BID_S_OK;
+
+cleanup:
+    if (fd != -1) {
+        if (close(fd) < 0 && err == BID_S_OK)
+            err = BID_S_CACHE_CLOSE_ERROR;
+        if (err != BID_S_OK)
+            unlink(szTmpName);
+    }
+    json_decref(record);
+    BIDFree(szTmpName);
+
+    return err;
+}
+
+/*
+ * Rewrite the journal once superseded or malformed records dominate it,
+ * or as soon as any malformed record has been skipped.
+ */
+static BIDError
+_BIDLogCacheCompact(
+    BIDContext context,
+    struct BIDLogCache *lc)
+{
+    if (!lc->bCompact &&
+        (lc->cRecords < BID_LOG_CACHE_COMPACT_MIN ||
+         lc->cRecords < BID_LOG_CACHE_COMPACT_RATIO * json_object_size(lc->Index)))
+        return BID_S_OK;
+
+    return _BIDLogCacheRewrite(context, lc);
+}
+
+static BIDError
+_BIDLogCacheInitialize(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache)
+{
+    BIDError err, err2;
+    struct BIDLogCache *lc = (struct BIDLogCache *)cache;
+    int fd = -1;
+    size_t cbWritten = 0;
+    struct stat sb;
+
+    if (lc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    BIDLogCacheLock(lc);
+
+    err = _BIDLogCacheOpen(lc, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, &fd);
+    BID_BAIL_ON_ERROR(err);
+
+    if (fstat(fd, &sb) < 0) {
+        err = BID_S_CACHE_OPEN_ERROR;
+        goto cleanup;
+    }
+
+    err = _BIDLogCacheReset(context, lc, &sb);
+    BID_BAIL_ON_ERROR(err);
+
+    if ((lc->Flags & BID_CACHE_FLAG_UNVERSIONED) == 0) {
+        err = _BIDLogCacheStoreHeader(context, fd, &cbWritten);
+        BID_BAIL_ON_ERROR(err);
+
+        lc->Offset = cbWritten;
+        lc->cRecords++;
+    }
+
+cleanup:
+    err2 = _BIDLogCacheClose(fd);
+
+    BIDLogCacheUnlock(lc);
+
+    return (err == BID_S_OK) ? err2 : err;
+}
+
+static BIDError
+_BIDLogCacheDestroy(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache)
+{
+    BIDError err, err2;
+    struct BIDLogCache *lc = (struct BIDLogCache *)cache;
+    int fd = -1;
+
+    if (lc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    BIDLogCacheLock(lc);
+
+    err = _BIDLogCacheOpen(lc, O_RDWR | O_CLOEXEC, &fd);
+    BID_BAIL_ON_ERROR(err);
+
+    if (unlink(lc->Name) < 0) {
+        err = BID_S_CACHE_DESTROY_ERROR;
+        goto cleanup;
+    }
+
+    err = _BIDLogCacheReset(context, lc, NULL);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    err2 = _BIDLogCacheClose(fd);
+
+    BIDLogCacheUnlock(lc);
+
+    return (err == BID_S_OK) ? err2 : err;
+}
+
+static BIDError
+_BIDLogCacheGetName(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache,
+    const char **name)
+{
+    struct BIDLogCache *lc = (struct BIDLogCache *)cache;
+
+    if (lc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    *name = lc->Name;
+    BID_ASSERT(*name != NULL);
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDLogCacheGetLastChangedTime(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache,
+    time_t *pTime)
+{
+    struct BIDLogCache *lc = (struct BIDLogCache *)cache;
+    struct stat sb;
+
+    *pTime = 0;
+
+    if (lc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    if (stat(lc->Name, &sb) < 0)
+        return (errno == ENOENT) ? BID_S_CACHE_NOT_FOUND : BID_S_CACHE_OPEN_ERROR;
+
+    *pTime = sb.st_mtime;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDLogCacheGetObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t **val)
+{
+    struct BIDLogCache *lc = (struct BIDLogCache *)cache;
+    BIDError err;
+    int fd = -1;
+
+    *val = NULL;
+
+    if (lc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    BIDLogCacheLock(lc);
+
+    err = _BIDLogCacheOpen(lc, O_RDONLY | O_CLOEXEC, &fd);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDLogCacheSync(context, lc, fd);
+    BID_BAIL_ON_ERROR(err);
+
+    *val = json_incref(json_object_get(lc->Index, key));
+
+    if (*val == NULL)
+        err = BID_S_CACHE_KEY_NOT_FOUND;
+    else
+        err = BID_S_OK;
+
+cleanup:
+    _BIDLogCacheClose(fd);
+
+    BIDLogCacheUnlock(lc);
+
+    return err;
+}
+
+static BIDError
+_BIDLogCacheSetOrRemoveObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t *val,
+    int remove,
+    int add)
+{
+    struct BIDLogCache *lc = (struct BIDLogCache *)cache;
+    BIDError err;
+    json_t *record = NULL;
+    int fd = -1;
+
+    if (lc == NULL || (val == NULL && !remove))
+        return BID_S_INVALID_PARAMETER;
+
+    if (lc->Flags & BID_CACHE_FLAG_READONLY)
+        return BID_S_CACHE_PERMISSION_DENIED;
+
+    BIDLogCacheLock(lc);
+
+    err = _BIDLogCacheOpen(lc, O_RDWR | O_CREAT | O_CLOEXEC, &fd);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDLogCacheSync(context, lc, fd);
+    BID_BAIL_ON_ERROR(err);
+
+    if (add && json_object_get(lc->Index, key) != NULL) {
+        err = BID_S_CACHE_KEY_EXISTS;
+        goto cleanup;
+    }
+
+    /* don't grow the journal for keys that aren't there */
+    if (remove && json_object_get(lc->Index, key) == NULL) {
+        err = BID_S_OK;
+        goto cleanup;
+    }
+
+    err = _BIDLogCacheMakeRecord(context, key, remove ? NULL : val, &record);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDLogCacheAppend(context, lc, fd, record);
+    BID_BAIL_ON_ERROR(err);
+
+    if (remove)
+        err = _BIDJsonObjectDel(context, lc->Index, key, 0);
+    else
+        err = _BIDJsonObjectSet(context, lc->Index, key, val, 0);
+    BID_BAIL_ON_ERROR(err);
+
+    /* compaction failure is not fatal, the journal remains valid */
+    _BIDLogCacheCompact(context, lc);
+
+    err = BID_S_OK;
+
+cleanup:
+    _BIDLogCacheClose(fd);
+
+    BIDLogCacheUnlock(lc);
+
+    json_decref(record);
+
+    return err;
+}
+
+static BIDError
+_BIDLogCacheSetObject(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t *val)
+{
+    return _BIDLogCacheSetOrRemoveObject(ops, context, cache, key, val, 0, 0);
+}
+
+static BIDError
+_BIDLogCacheRemoveObject(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache,
+    const char *key)
+{
+    return _BIDLogCacheSetOrRemoveObject(ops, context, cache, key, NULL, 1, 0);
+}
+
+static BIDError
+_BIDLogCacheAddObject(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t *val)
+{
+    return _BIDLogCacheSetOrRemoveObject(ops, context, cache, key, val, 0, 1);
+}
+
+static BIDError
+_BIDLogCacheFirstObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    void **cookie,
+    const char **key,
+    json_t **val)
+{
+    struct BIDLogCache *lc = (struct BIDLogCache *)cache;
+    BIDError err;
+    json_t *indexCopy = NULL;
+    int fd = -1;
+
+    *key = NULL;
+    *val = NULL;
+
+    BID_ASSERT(cookie != NULL);
+
+    if (lc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    BIDLogCacheLock(lc);
+
+    err = _BIDLogCacheOpen(lc, O_RDONLY | O_CLOEXEC, &fd);
+    if (err == BID_S_OK)
+        err = _BIDLogCacheSync(context, lc, fd);
+    if (err == BID_S_OK) {
+        indexCopy = json_copy(lc->Index);
+        if (indexCopy == NULL)
+            err = BID_S_NO_MEMORY;
+    }
+
+    _BIDLogCacheClose(fd);
+
+    BIDLogCacheUnlock(lc);
+
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDCacheIteratorAlloc(indexCopy, cookie);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDCacheIteratorNext(cookie, key, val);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    json_decref(indexCopy);
+
+    return err;
+}
+
+static BIDError
+_BIDLogCacheNextObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache BID_UNUSED,
+    void **cookie,
+    const char **key,
+    json_t **val)
+{
+    BIDError err;
+
+    *key = NULL;
+    *val = NULL;
+
+    BID_ASSERT(cookie != NULL && *cookie != NULL);
+
+    err = _BIDCacheIteratorNext(cookie, key, val);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    return err;
+}
+
+/*
+ * Rather than appending a removal record for each purged entry, filter
+ * the index and rewrite the journal once.
+ */
+static BIDError
+_BIDLogCachePurgeObjects(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    int (*predicate)(BIDContext, const char *, json_t *, void *),
+    void *data)
+{
+    struct BIDLogCache *lc = (struct BIDLogCache *)cache;
+    BIDError err;
+    json_t *filtered = NULL;
+    int fd = -1;
+
+    if (lc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    if (lc->Flags & BID_CACHE_FLAG_READONLY)
+        return BID_S_CACHE_PERMISSION_DENIED;
+
+    BIDLogCacheLock(lc);
+
+    err = _BIDLogCacheOpen(lc, O_RDWR | O_CLOEXEC, &fd);
+    if (err == BID_S_CACHE_NOT_FOUND) {
+        err = BID_S_OK;
+        goto cleanup;
+    }
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDLogCacheSync(context, lc, fd);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDCacheFilterObjects(context, lc->Index, predicate, data, &filtered);
+    BID_BAIL_ON_ERROR(err);
+
+    if (filtered == NULL)
+        goto cleanup;
+
+    json_decref(lc->Index);
+    lc->Index = filtered;
+    filtered = NULL;
+
+    err = _BIDLogCacheRewrite(context, lc);
+    if (err != BID_S_OK) {
+        /* the index no longer reflects the journal, so rebuild it next time */
+        lc->Device = 0;
+        lc->Inode = 0;
+    }
+
+cleanup:
+    _BIDLogCacheClose(fd);
+
+    BIDLogCacheUnlock(lc);
+
+    json_decref(filtered);
+
+    return err;
+}
+
+struct BIDCacheOps _BIDLogCache = {
+    "log",
+    _BIDLogCacheAcquire,
+    _BIDLogCacheRelease,
+    _BIDLogCacheInitialize,
+    _BIDLogCacheDestroy,
+    _BIDLogCacheGetName,
+    _BIDLogCacheGetLastChangedTime,
+    _BIDLogCacheGetObject,
+    _BIDLogCacheSetObject,
+    _BIDLogCacheRemoveObject,
+    _BIDLogCacheAddObject,
+    _BIDLogCacheFirstObject,
+    _BIDLogCacheNextObject,
+    _BIDLogCachePurgeObjects,
+};
@@ -222,7 +222,8 @@ _BIDMemoryCacheSetOrRemoveObject(
     void *cache,
     const char *key,
     json_t *val,
-    int remove)
+    int remove,
+    int add)
 {
     struct BIDMemoryCache *mc = (struct BIDMemoryCache *)cache;
     BIDError err;
@@ -238,7 +239,9 @@ _BIDMemoryCacheSetOrRemoveObject(
     }
 
     BIDMemoryCacheLock(mc);
-    if (remove)
+    if (add && json_object_get(mc->Data, key) != NULL)
+        err = BID_S_CACHE_KEY_EXISTS;
+    else if (remove)
         err = _BIDJsonObjectDel(context, mc->Data, key, 0);
     else
         err = _BIDJsonObjectSet(context, mc->Data, key, val, 0);
@@ -262,7 +265,7 @@ _BIDMemoryCacheSetObject(
     const char *key,
     json_t *val)
 {
-    return _BIDMemoryCacheSetOrRemoveObject(ops, context, cache, key, val, 0);
+    return _BIDMemoryCacheSetOrRemoveObject(ops, context, cache, key, val, 0, 0);
 }
 
 static BIDError
@@ -272,7 +275,18 @@ _BIDMemoryCacheRemoveObject(
     void *cache,
     const char *key)
 {
-    return _BIDMemoryCacheSetOrRemoveObject(ops, context, cache, key, NULL, 1);
+    return _BIDMemoryCacheSetOrRemoveObject(ops, context, cache, key, NULL, 1, 0);
+}
+
+static BIDError
+_BIDMemoryCacheAddObject(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t *val)
+{
+    return _BIDMemoryCacheSetOrRemoveObject(ops, context, cache, key, val, 0, 1);
 }
 
 static BIDError
@@ -334,6 +348,37 @@ cleanup:
     return err;
 }
 
+static BIDError
+_BIDMemoryCachePurgeObjects(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    int (*predicate)(BIDContext, const char *, json_t *, void *),
+    void *data)
+{
+    struct BIDMemoryCache *mc = (struct BIDMemoryCache *)cache;
+    BIDError err;
+    json_t *filtered = NULL;
+
+    if (mc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    if (mc->Flags & BID_CACHE_FLAG_READONLY)
+        return BID_S_CACHE_PERMISSION_DENIED;
+
+    /* values are immutable, so iterators holding the old dictionary are unaffected */
+    BIDMemoryCacheLock(mc);
+    err = _BIDCacheFilterObjects(context, mc->Data, predicate, data, &filtered);
+    if (err == BID_S_OK && filtered != NULL) {
+        json_decref(mc->Data);
+        mc->Data = filtered;
+        time(&mc->LastChangedTime);
+    }
+    BIDMemoryCacheUnlock(mc);
+
+    return err;
+}
+
 struct BIDCacheOps _BIDMemoryCache = {
     "memory",
     _BIDMemoryCacheAcquire,
@@ -345,7 +390,9 @@ struct BIDCacheOps _BIDMemoryCache = {
     _BIDMemoryCacheGetObject,
     _BIDMemoryCacheSetObject,
     _BIDMemoryCacheRemoveObject,
+    _BIDMemoryCacheAddObject,
     _BIDMemoryCacheFirstObject,
     _BIDMemoryCacheNextObject,
+    _BIDMemoryCachePurgeObjects,
 };
 
@@ -0,0 +1,1755 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bid_private.h"
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Memory-mapped hash table cache backend, intended for replay caches
+ * that are shared between many acceptor processes.
+ *
+ * The file is a header followed by a power of two fixed-size slots,
+ * addressed by open addressing with linear probing on a hash of the key
+ * (typically the assertion digest). Each entry starts with a head slot
+ * holding the key, the latest expiry time found in the value and the
+ * value itself as compact JSON. Values too large for the head slot, such
+ * as re-authentication tickets, continue in the slots that immediately
+ * follow it; each continuation slot records its distance from the head
+ * and a copy of the expiry time. Probe sequences are bounded, so lookups
+ * and updates touch a constant number of slots regardless of how many
+ * entries the cache holds.
+ *
+ * Locking uses single byte fcntl locks within each slot, so it works
+ * across processes and is released if a process dies: the first byte
+ * serializes updates to keys hashing to that slot, and the second guards
+ * the contents of the slot itself. Updates hold at most one bucket lock,
+ * and slot locks are only ever taken in ascending order, so they cannot
+ * deadlock. Slots whose entries have expired or been removed are reused
+ * by later inserts; continuation slots of an expired entry may be reused
+ * before its head, so readers check that each still points back to it.
+ *
+ * Removed entries leave tombstones so that probe sequences remain intact.
+ * When an insert finds its probe sequence lengthened by dead slots, or no
+ * room within it, the live entries are copied into a new table, grown if
+ * necessary, which is renamed over the cache file. Updates hold a shared
+ * lock on the header that rebuilding holds exclusively; the old table is
+ * then marked stale, and other handles remap the new one when they next
+ * use it.
+ */
+
+#define BID_MAPPED_CACHE_MAGIC          "BIDMC003"
+#define BID_MAPPED_CACHE_SLOT_SIZE      1024
+#define BID_MAPPED_CACHE_KEY_SIZE       64
+#define BID_MAPPED_CACHE_DEFAULT_SLOTS  (1 << 16)
+#define BID_MAPPED_CACHE_MAX_SLOTS      (1 << 26)
+#define BID_MAPPED_CACHE_MAX_PROBE      64
+#define BID_MAPPED_CACHE_REBUILD_PROBE  16      /* dead slots probed before rebuilding */
+#define BID_MAPPED_CACHE_MAX_RUN        16      /* slots per entry */
+
+#define BID_MAPPED_CACHE_FLAG_STALE     0x00000001  /* superseded by a rebuilt table */
+
+#define BID_MAPPED_SLOT_EMPTY           0
+#define BID_MAPPED_SLOT_USED            1
+#define BID_MAPPED_SLOT_DELETED         2
+#define BID_MAPPED_SLOT_CONTINUATION    3
+
+struct BIDMappedCacheHeader {
+    char Magic[8];
+    uint32_t SlotSize;
+    uint32_t Flags;
+    uint64_t cSlots;
+    int64_t LastChangedTime;
+};
+
+struct BIDMappedCacheSlot {
+    uint32_t State;
+    uint32_t cbValue;
+    int64_t Expiry;
+    char Key[BID_MAPPED_CACHE_KEY_SIZE];
+    char Value[BID_MAPPED_CACHE_SLOT_SIZE - BID_MAPPED_CACHE_KEY_SIZE - 16];
+};
+
+struct BIDMappedCacheContinuationSlot {
+    uint32_t State;
+    uint32_t cHead;             /* distance back to the head slot */
+    int64_t Expiry;
+    char Value[BID_MAPPED_CACHE_SLOT_SIZE - 16];
+};
+
+#define BID_MAPPED_HEAD_VALUE_SIZE  sizeof(((struct BIDMappedCacheSlot *)0)->Value)
+#define BID_MAPPED_CONT_VALUE_SIZE  sizeof(((struct BIDMappedCacheContinuationSlot *)0)->Value)
+#define BID_MAPPED_CACHE_MAX_VALUE  (BID_MAPPED_HEAD_VALUE_SIZE + \
+                                     (BID_MAPPED_CACHE_MAX_RUN - 1) * BID_MAPPED_CONT_VALUE_SIZE)
+
+struct BIDMappedCache {
+    BID_MUTEX Mutex;
+    char *Name;
+    uint32_t Flags;
+    int Fd;
+    unsigned char *Map;
+    size_t cbMap;
+    uint64_t cSlots;
+};
+
+/*
+ * fcntl locks are per-process, or where available per open file, so the
+ * mutex serializes threads sharing a cache handle as well as protecting
+ * the mapping. Open file locks also keep handles within a process from
+ * sharing, or on close releasing, each other's locks.
+ */
+#ifdef F_OFD_SETLKW
+#define BID_MAPPED_SETLKW           F_OFD_SETLKW
+#else
+#define BID_MAPPED_SETLKW           F_SETLKW
+#endif
+
+#define BIDMappedCacheLock(mc)      BID_MUTEX_LOCK(&(mc)->Mutex)
+#define BIDMappedCacheUnlock(mc)    BID_MUTEX_UNLOCK(&(mc)->Mutex)
+
+#define BID_MAPPED_SLOT_OFFSET(i)   (((off_t)(i) + 1) * BID_MAPPED_CACHE_SLOT_SIZE)
+#define BID_MAPPED_SLOT(mc, i)      ((struct BIDMappedCacheSlot *)&(mc)->Map[BID_MAPPED_SLOT_OFFSET(i)])
+#define BID_MAPPED_CONT(mc, i)      ((struct BIDMappedCacheContinuationSlot *)&(mc)->Map[BID_MAPPED_SLOT_OFFSET(i)])
+#define BID_MAPPED_HEADER(mc)       ((struct BIDMappedCacheHeader *)(mc)->Map)
+
+#define BID_MAPPED_FORMAT_LOCK      0
+#define BID_MAPPED_TABLE_LOCK       1
+#define BID_MAPPED_BUCKET_LOCK(i)   (BID_MAPPED_SLOT_OFFSET(i))
+#define BID_MAPPED_SLOT_LOCK(i)     (BID_MAPPED_SLOT_OFFSET(i) + 1)
+
+static BIDError
+_BIDMappedCacheAcquire(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void **cache,
+    const char *name,
+    uint32_t ulFlags)
+{
+    BIDError err;
+    struct BIDMappedCache *mc;
+
+    mc = BIDCalloc(1, sizeof(*mc));
+    if (mc == NULL)
+        return BID_S_NO_MEMORY;
+
+    err = _BIDDuplicateString(context, name, &mc->Name);
+    if (err != BID_S_OK) {
+        BIDFree(mc);
+        return err;
+    }
+
+    BID_MUTEX_INIT(&mc->Mutex);
+
+    mc->Flags = ulFlags;
+    mc->Fd = -1;
+
+    *cache = mc;
+
+    return BID_S_OK;
+}
+
+static void
+_BIDMappedCacheUnmap(struct BIDMappedCache *mc)
+{
+    if (mc->Map != NULL) {
+        munmap(mc->Map, mc->cbMap);
+        mc->Map = NULL;
+        mc->cbMap = 0;
+        mc->cSlots = 0;
+    }
+    if (mc->Fd != -1) {
+        close(mc->Fd);
+        mc->Fd = -1;
+    }
+}
+
+static BIDError
+_BIDMappedCacheRelease(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache)
+{
+    struct BIDMappedCache *mc = (struct BIDMappedCache *)cache;
+
+    if (mc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    _BIDMappedCacheUnmap(mc);
+    BIDFree(mc->Name);
+    BID_MUTEX_DESTROY(&mc->Mutex);
+    BIDFree(mc);
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDMappedCacheLockByte(
+    int fd,
+    off_t offset,
+    short type)
+{
+    int ret;
+    BIDError err;
+    struct flock l;
+
+    memset(&l, 0, sizeof(l));
+    l.l_start = offset;
+    l.l_len = 1;
+    l.l_type = type;
+    l.l_whence = SEEK_SET;
+
+    do {
+        ret = fcntl(fd, BID_MAPPED_SETLKW, &l);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        ret = errno;
+    if (ret == EACCES) /* fcntl can return EACCES instead of EAGAIN */
+        ret = EAGAIN;
+
+    switch (ret) {
+    case 0:
+        err = BID_S_OK;
+        break;
+    case EAGAIN:
+        err = BID_S_CACHE_LOCK_TIMEOUT;
+        break;
+    default:
+        err = (type == F_UNLCK) ? BID_S_CACHE_UNLOCK_ERROR : BID_S_CACHE_LOCK_ERROR;
+        break;
+    }
+
+    return err;
+}
+
+static uint64_t
+_BIDMappedCacheHash(const char *key)
+{
+    uint64_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+
+    for (; *key != '\0'; key++) {
+        h ^= (unsigned char)*key;
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static BIDError
+_BIDMappedCacheFormatSlots(
+    int fd,
+    uint64_t cSlots)
+{
+    struct BIDMappedCacheHeader header;
+
+    if (ftruncate(fd, BID_MAPPED_SLOT_OFFSET(cSlots)) < 0)
+        return BID_S_CACHE_WRITE_ERROR;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.Magic, BID_MAPPED_CACHE_MAGIC, sizeof(header.Magic));
+    header.SlotSize = BID_MAPPED_CACHE_SLOT_SIZE;
+    header.cSlots = cSlots;
+    header.LastChangedTime = time(NULL);
+
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        return BID_S_CACHE_WRITE_ERROR;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDMappedCacheFormat(
+    BIDContext context,
+    struct BIDMappedCache *mc BID_UNUSED,
+    int fd)
+{
+    uint64_t cSlots = BID_MAPPED_CACHE_DEFAULT_SLOTS;
+    json_t *value;
+
+    if (_BIDGetCacheObject(context, context->Config, "mmapcacheslots", &value) == BID_S_OK) {
+        uint32_t ulSlots = _BIDJsonUInt32Value(value);
+
+        json_decref(value);
+
+        /* fewer slots than the probe window is a misconfiguration */
+        if (ulSlots < BID_MAPPED_CACHE_MAX_PROBE)
+            return BID_S_INVALID_PARAMETER;
+
+        for (cSlots = BID_MAPPED_CACHE_MAX_PROBE;
+             cSlots < ulSlots && cSlots < BID_MAPPED_CACHE_MAX_SLOTS;
+             cSlots <<= 1)
+            ;
+    }
+
+    return _BIDMappedCacheFormatSlots(fd, cSlots);
+}
+
+/*
+ * Open, if necessary format, and map the cache file.
+ */
+static BIDError
+_BIDMappedCacheMap(
+    BIDContext context,
+    struct BIDMappedCache *mc,
+    int flags)
+{
+    BIDError err, err2;
+    int fd = -1;
+    int bReadOnly = !!(mc->Flags & BID_CACHE_FLAG_READONLY);
+    struct stat sb;
+    struct BIDMappedCacheHeader header;
+    void *map = MAP_FAILED;
+    size_t cbMap;
+
+    if (mc->Map != NULL)
+        return BID_S_OK;
+
+    if (bReadOnly)
+        flags &= ~(O_CREAT | O_EXCL);
+
+    fd = open(mc->Name, (bReadOnly ? O_RDONLY : O_RDWR) | flags, 0600);
+    if (fd < 0) {
+        switch (errno) {
+        case ENOENT:
+            err = BID_S_CACHE_NOT_FOUND;
+            break;
+        case EPERM:
+        case EACCES:
+            err = BID_S_CACHE_PERMISSION_DENIED;
+            break;
+        case EEXIST:
+            err = BID_S_CACHE_ALREADY_EXISTS;
+            break;
+        default:
+            err = BID_S_CACHE_OPEN_ERROR;
+            break;
+        }
+        return err;
+    }
+
+#ifdef HAVE_FCNTL_H
+    {
+        int f = fcntl(fd, F_GETFD);
+        if (f != -1)
+            fcntl(fd, F_SETFD, f | FD_CLOEXEC);
+    }
+#endif
+
+    /* the header lock serializes formatting a new cache */
+    err = _BIDMappedCacheLockByte(fd, BID_MAPPED_FORMAT_LOCK, bReadOnly ? F_RDLCK : F_WRLCK);
+    if (err != BID_S_OK) {
+        close(fd);
+        return err;
+    }
+
+    if (fstat(fd, &sb) < 0) {
+        err = BID_S_CACHE_OPEN_ERROR;
+        goto cleanup;
+    }
+
+    if (sb.st_size == 0) {
+        if (bReadOnly) {
+            err = BID_S_CACHE_NOT_FOUND;
+            goto cleanup;
+        }
+
+        err = _BIDMappedCacheFormat(context, mc, fd);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        err = BID_S_CACHE_READ_ERROR;
+        goto cleanup;
+    }
+
+    if (memcmp(header.Magic, BID_MAPPED_CACHE_MAGIC, sizeof(header.Magic)) != 0 ||
+        header.SlotSize != BID_MAPPED_CACHE_SLOT_SIZE ||
+        header.cSlots == 0 || (header.cSlots & (header.cSlots - 1)) != 0) {
+        err = BID_S_CACHE_INVALID_VERSION;
+        goto cleanup;
+    }
+
+    cbMap = BID_MAPPED_SLOT_OFFSET(header.cSlots);
+
+    if (fstat(fd, &sb) < 0 || sb.st_size < cbMap) {
+        err = BID_S_CACHE_READ_ERROR;
+        goto cleanup;
+    }
+
+    map = mmap(NULL, cbMap, bReadOnly ? PROT_READ : (PROT_READ | PROT_WRITE),
+               MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        err = BID_S_CACHE_OPEN_ERROR;
+        goto cleanup;
+    }
+
+    mc->Fd = fd;
+    mc->Map = map;
+    mc->cbMap = cbMap;
+    mc->cSlots = header.cSlots;
+
+    err = BID_S_OK;
+
+cleanup:
+    err2 = _BIDMappedCacheLockByte(fd, BID_MAPPED_FORMAT_LOCK, F_UNLCK);
+    if (err == BID_S_OK)
+        err = err2;
+    if (err != BID_S_OK) {
+        if (mc->Map != NULL)
+            _BIDMappedCacheUnmap(mc);
+        else
+            close(fd);
+    }
+
+    return err;
+}
+
+/*
+ * Map the cache, remapping it if the table has been superseded by a
+ * rebuilt one. Readers need no further locking, as a superseded table
+ * is never modified again.
+ */
+static BIDError
+_BIDMappedCacheMapCurrent(
+    BIDContext context,
+    struct BIDMappedCache *mc,
+    int flags)
+{
+    BIDError err;
+
+    err = _BIDMappedCacheMap(context, mc, flags);
+    if (err == BID_S_OK &&
+        (BID_MAPPED_HEADER(mc)->Flags & BID_MAPPED_CACHE_FLAG_STALE)) {
+        _BIDMappedCacheUnmap(mc);
+        err = _BIDMappedCacheMap(context, mc, flags);
+    }
+
+    return err;
+}
+
+/*
+ * Map the cache and take the table lock, shared for updates or exclusive
+ * for rebuilding. If the table had been superseded, the rebuilt one is
+ * mapped instead and *pbRemapped is set.
+ */
+static BIDError
+_BIDMappedCacheLockTable(
+    BIDContext context,
+    struct BIDMappedCache *mc,
+    short type,
+    int flags,
+    int *pbRemapped)
+{
+    BIDError err;
+
+    if (pbRemapped != NULL)
+        *pbRemapped = 0;
+
+    for (;;) {
+        err = _BIDMappedCacheMap(context, mc, flags);
+        if (err != BID_S_OK)
+            break;
+
+        err = _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_TABLE_LOCK, type);
+        if (err != BID_S_OK)
+            break;
+
+        if ((BID_MAPPED_HEADER(mc)->Flags & BID_MAPPED_CACHE_FLAG_STALE) == 0)
+            break;
+
+        _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_TABLE_LOCK, F_UNLCK);
+        _BIDMappedCacheUnmap(mc);
+
+        if (pbRemapped != NULL)
+            *pbRemapped = 1;
+    }
+
+    return err;
+}
+
+static int
+_BIDMappedCacheSlotReusableP(
+    BIDContext context,
+    struct BIDMappedCacheSlot *slot,
+    time_t now)
+{
+    if (slot->State == BID_MAPPED_SLOT_DELETED)
+        return 1;
+
+    /* continuation slots carry the expiry time of their head */
+    return ((slot->State == BID_MAPPED_SLOT_USED ||
+             slot->State == BID_MAPPED_SLOT_CONTINUATION) &&
+            slot->Expiry != 0 && now >= slot->Expiry + context->Skew);
+}
+
+/*
+ * The inline expiry is the latest of the well known expiry claims, so
+ * an entry is never reused whilst it might still be consulted.
+ */
+static time_t
+_BIDMappedCacheExpiry(
+    BIDContext context,
+    json_t *val)
+{
+    static const char *szExpiryClaims[] = { "exp", "a-exp", "renew-exp" };
+    time_t expiry = 0, t;
+    size_t i;
+
+    for (i = 0; i < sizeof(szExpiryClaims) / sizeof(szExpiryClaims[0]); i++) {
+        _BIDGetJsonTimestampValue(context, val, szExpiryClaims[i], &t);
+        if (t > expiry)
+            expiry = t;
+    }
+
+    return expiry;
+}
+
+/*
+ * Number of slots, including the head, occupied by a value of cbValue bytes.
+ */
+static uint64_t
+_BIDMappedCacheRunLength(size_t cbValue)
+{
+    if (cbValue <= BID_MAPPED_HEAD_VALUE_SIZE)
+        return 1;
+
+    return 1 + (cbValue - BID_MAPPED_HEAD_VALUE_SIZE + BID_MAPPED_CONT_VALUE_SIZE - 1) /
+               BID_MAPPED_CONT_VALUE_SIZE;
+}
+
+/*
+ * Copy out the value of the entry whose head is slot s; the caller holds
+ * the lock on the head slot. Continuation slots of an expired entry may
+ * have been reused, in which case the entry is treated as absent.
+ */
+static BIDError
+_BIDMappedCacheCopyValue(
+    struct BIDMappedCache *mc,
+    uint64_t s,
+    char **pszValue)
+{
+    BIDError err = BID_S_OK;
+    struct BIDMappedCacheSlot *slot = BID_MAPPED_SLOT(mc, s);
+    size_t cbValue = slot->cbValue, cbCopied;
+    uint64_t i, cRun;
+    char *szValue;
+
+    *pszValue = NULL;
+
+    cRun = _BIDMappedCacheRunLength(cbValue);
+    if (cbValue > BID_MAPPED_CACHE_MAX_VALUE || s + cRun > mc->cSlots)
+        return BID_S_CACHE_READ_ERROR;
+
+    szValue = BIDMalloc(cbValue + 1);
+    if (szValue == NULL)
+        return BID_S_NO_MEMORY;
+
+    cbCopied = (cRun == 1) ? cbValue : BID_MAPPED_HEAD_VALUE_SIZE;
+    memcpy(szValue, slot->Value, cbCopied);
+
+    for (i = 1; i < cRun; i++) {
+        struct BIDMappedCacheContinuationSlot *cont = BID_MAPPED_CONT(mc, s + i);
+        size_t cbChunk = cbValue - cbCopied;
+
+        if (cbChunk > BID_MAPPED_CONT_VALUE_SIZE)
+            cbChunk = BID_MAPPED_CONT_VALUE_SIZE;
+
+        err = _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s + i), F_RDLCK);
+        if (err != BID_S_OK)
+            break;
+
+        if (cont->State == BID_MAPPED_SLOT_CONTINUATION &&
+            cont->cHead == i && cont->Expiry == slot->Expiry) {
+            memcpy(&szValue[cbCopied], cont->Value, cbChunk);
+            cbCopied += cbChunk;
+        } else {
+            err = BID_S_CACHE_KEY_NOT_FOUND;
+        }
+
+        _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s + i), F_UNLCK);
+
+        if (err != BID_S_OK)
+            break;
+    }
+
+    if (err != BID_S_OK) {
+        BIDFree(szValue);
+        return err;
+    }
+
+    szValue[cbValue] = '\0';
+    *pszValue = szValue;
+
+    return BID_S_OK;
+}
+
+/*
+ * Delete the entry whose head is slot s, along with its continuation
+ * slots; the caller holds the write lock on the head slot.
+ */
+static void
+_BIDMappedCacheFreeRun(
+    struct BIDMappedCache *mc,
+    uint64_t s)
+{
+    struct BIDMappedCacheSlot *slot = BID_MAPPED_SLOT(mc, s);
+    uint64_t i, cRun = _BIDMappedCacheRunLength(slot->cbValue);
+
+    slot->State = BID_MAPPED_SLOT_DELETED;
+
+    for (i = 1; i < cRun && s + i < mc->cSlots; i++) {
+        struct BIDMappedCacheContinuationSlot *cont = BID_MAPPED_CONT(mc, s + i);
+
+        if (_BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s + i), F_WRLCK) != BID_S_OK)
+            break;
+
+        if (cont->State == BID_MAPPED_SLOT_CONTINUATION && cont->cHead == i)
+            cont->State = BID_MAPPED_SLOT_DELETED;
+
+        _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s + i), F_UNLCK);
+    }
+}
+
+/*
+ * Return the number of slots occupied by the entry whose head is slot s,
+ * or zero if it is not a live entry. Only used whilst holding the table
+ * lock exclusively, when no slot locks are needed.
+ */
+static uint64_t
+_BIDMappedCacheLiveRunLength(
+    BIDContext context,
+    struct BIDMappedCache *mc,
+    uint64_t s,
+    time_t now)
+{
+    struct BIDMappedCacheSlot *slot = BID_MAPPED_SLOT(mc, s);
+    uint64_t i, cRun;
+
+    if (slot->State != BID_MAPPED_SLOT_USED ||
+        _BIDMappedCacheSlotReusableP(context, slot, now) ||
+        memchr(slot->Key, '\0', sizeof(slot->Key)) == NULL ||
+        slot->cbValue > BID_MAPPED_CACHE_MAX_VALUE)
+        return 0;
+
+    cRun = _BIDMappedCacheRunLength(slot->cbValue);
+    if (s + cRun > mc->cSlots)
+        return 0;
+
+    for (i = 1; i < cRun; i++) {
+        struct BIDMappedCacheContinuationSlot *cont = BID_MAPPED_CONT(mc, s + i);
+
+        if (cont->State != BID_MAPPED_SLOT_CONTINUATION ||
+            cont->cHead != i || cont->Expiry != slot->Expiry)
+            return 0;
+    }
+
+    return cRun;
+}
+
+/*
+ * Copy the cRun slots of the entry whose head is slot s into a new table
+ * that is private to the caller. Returns zero if there is no room for it
+ * within the probe window.
+ */
+static int
+_BIDMappedCacheCopyRun(
+    struct BIDMappedCache *mc,
+    uint64_t s,
+    uint64_t cRun,
+    struct BIDMappedCache *table)
+{
+    struct BIDMappedCacheSlot *slot = BID_MAPPED_SLOT(mc, s);
+    uint64_t h = _BIDMappedCacheHash(slot->Key);
+    uint64_t i, j;
+
+    for (i = 0; i < BID_MAPPED_CACHE_MAX_PROBE && i < table->cSlots; i++) {
+        uint64_t d = (h + i) & (table->cSlots - 1);
+        struct BIDMappedCacheSlot *dst = BID_MAPPED_SLOT(table, d);
+        int bFree = (d + cRun <= table->cSlots);
+
+        for (j = 0; bFree && j < cRun; j++) {
+            uint32_t state = BID_MAPPED_SLOT(table, d + j)->State;
+
+            bFree = (state == BID_MAPPED_SLOT_EMPTY || state == BID_MAPPED_SLOT_DELETED);
+        }
+
+        if (bFree) {
+            memcpy(dst, slot, cRun * BID_MAPPED_CACHE_SLOT_SIZE);
+            return 1;
+        }
+
+        /* lookups must be able to probe past an empty slot the entry skips */
+        if (dst->State == BID_MAPPED_SLOT_EMPTY)
+            dst->State = BID_MAPPED_SLOT_DELETED;
+    }
+
+    return 0;
+}
+
+static BIDError
+_BIDMappedCacheCreateTable(
+    struct BIDMappedCache *mc,
+    uint64_t cSlots,
+    struct BIDMappedCache *table,
+    char **pszTmpName)
+{
+    BIDError err;
+    char *szTmpName = NULL;
+    size_t cchFileName;
+    int fd = -1;
+    void *map;
+
+    *pszTmpName = NULL;
+
+    cchFileName = strlen(mc->Name);
+    szTmpName = BIDMalloc(cchFileName + sizeof(".XXXXXX"));
+    if (szTmpName == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    memcpy(szTmpName, mc->Name, cchFileName);
+    memcpy(&szTmpName[cchFileName], ".XXXXXX", sizeof(".XXXXXX"));
+
+    fd = mkstemp(szTmpName);
+    if (fd < 0) {
+        err = BID_S_CACHE_WRITE_ERROR;
+        goto cleanup;
+    }
+
+#ifdef HAVE_FCNTL_H
+    {
+        int f = fcntl(fd, F_GETFD);
+        if (f != -1)
+            fcntl(fd, F_SETFD, f | FD_CLOEXEC);
+    }
+#endif
+
+    err = _BIDMappedCacheFormatSlots(fd, cSlots);
+    BID_BAIL_ON_ERROR(err);
+
+    map = mmap(NULL, BID_MAPPED_SLOT_OFFSET(cSlots), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        err = BID_S_CACHE_WRITE_ERROR;
+        goto cleanup;
+    }
+
+    table->Fd = fd;
+    table->Map = map;
+    table->cbMap = BID_MAPPED_SLOT_OFFSET(cSlots);
+    table->cSlots = cSlots;
+
+    *pszTmpName = szTmpName;
+    szTmpName = NULL;
+    fd = -1;
+
+cleanup:
+    if (fd != -1)
+        close(fd);
+    if (szTmpName != NULL) {
+        unlink(szTmpName);
+        BIDFree(szTmpName);
+    }
+
+    return err;
+}
+
+/*
+ * Copy the live entries into a new table, large enough that they occupy
+ * at most half of it, and rename it over the cache file. This reclaims
+ * the slots of removed and expired entries, which would otherwise keep
+ * lengthening probe sequences, and grows the table (if bGrow is set or
+ * it is too full) when entries no longer fit in their probe windows.
+ */
+static BIDError
+_BIDMappedCacheRebuild(
+    BIDContext context,
+    struct BIDMappedCache *mc,
+    int bGrow)
+{
+    BIDError err;
+    struct BIDMappedCache table;
+    char *szTmpName = NULL;
+    uint64_t s, cSlots, cLive = 0;
+    time_t now = time(NULL);
+    int bRemapped = 0, bTableLocked = 0;
+
+    memset(&table, 0, sizeof(table));
+    table.Fd = -1;
+
+    err = _BIDMappedCacheLockTable(context, mc, F_WRLCK, 0, &bRemapped);
+    BID_BAIL_ON_ERROR(err);
+
+    bTableLocked = 1;
+
+    /* another handle rebuilt the table whilst we were waiting */
+    if (bRemapped)
+        goto cleanup;
+
+    for (s = 0; s < mc->cSlots; s++)
+        cLive += _BIDMappedCacheLiveRunLength(context, mc, s, now);
+
+    cSlots = mc->cSlots;
+    while ((bGrow || cSlots < 2 * cLive) && cSlots < BID_MAPPED_CACHE_MAX_SLOTS) {
+        cSlots <<= 1;
+        bGrow = 0;
+    }
+
+    for (;;) {
+        err = _BIDMappedCacheCreateTable(mc, cSlots, &table, &szTmpName);
+        BID_BAIL_ON_ERROR(err);
+
+        for (s = 0; s < mc->cSlots; s++) {
+            uint64_t cRun = _BIDMappedCacheLiveRunLength(context, mc, s, now);
+
+            if (cRun != 0 && !_BIDMappedCacheCopyRun(mc, s, cRun, &table))
+                break;
+        }
+
+        if (s == mc->cSlots)
+            break;
+
+        /* too many entries share a probe window, so try a larger table */
+        _BIDMappedCacheUnmap(&table);
+        unlink(szTmpName);
+        BIDFree(szTmpName);
+        szTmpName = NULL;
+
+        if (cSlots >= BID_MAPPED_CACHE_MAX_SLOTS) {
+            err = BID_S_CACHE_WRITE_ERROR;
+            goto cleanup;
+        }
+
+        cSlots <<= 1;
+    }
+
+    if (rename(szTmpName, mc->Name) < 0) {
+        err = BID_S_CACHE_WRITE_ERROR;
+        goto cleanup;
+    }
+
+    BIDFree(szTmpName);
+    szTmpName = NULL;
+
+    /* only once the rebuilt table can be found by name */
+    BID_MAPPED_HEADER(mc)->Flags |= BID_MAPPED_CACHE_FLAG_STALE;
+
+cleanup:
+    if (szTmpName != NULL) {
+        unlink(szTmpName);
+        BIDFree(szTmpName);
+    }
+    _BIDMappedCacheUnmap(&table);
+    if (bTableLocked) {
+        _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_TABLE_LOCK, F_UNLCK);
+        if (err == BID_S_OK && !bRemapped)
+            _BIDMappedCacheUnmap(mc);
+    }
+
+    return err;
+}
+
+static BIDError
+_BIDMappedCacheInitialize(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache)
+{
+    struct BIDMappedCache *mc = (struct BIDMappedCache *)cache;
+    BIDError err;
+
+    if (mc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    BIDMappedCacheLock(mc);
+    _BIDMappedCacheUnmap(mc);
+    err = _BIDMappedCacheMap(context, mc, O_CREAT | O_EXCL);
+    BIDMappedCacheUnlock(mc);
+
+    return err;
+}
+
+static BIDError
+_BIDMappedCacheDestroy(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache)
+{
+    struct BIDMappedCache *mc = (struct BIDMappedCache *)cache;
+    BIDError err = BID_S_OK;
+
+    if (mc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    BIDMappedCacheLock(mc);
+    _BIDMappedCacheUnmap(mc);
+    if (unlink(mc->Name) < 0)
+        err = (errno == ENOENT) ? BID_S_CACHE_NOT_FOUND : BID_S_CACHE_DESTROY_ERROR;
+    BIDMappedCacheUnlock(mc);
+
+    return err;
+}
+
+static BIDError
+_BIDMappedCacheGetName(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache,
+    const char **name)
+{
+    struct BIDMappedCache *mc = (struct BIDMappedCache *)cache;
+
+    if (mc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    *name = mc->Name;
+    BID_ASSERT(*name != NULL);
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDMappedCacheGetLastChangedTime(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    time_t *pTime)
+{
+    struct BIDMappedCache *mc = (struct BIDMappedCache *)cache;
+    BIDError err;
+
+    *pTime = 0;
+
+    if (mc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    BIDMappedCacheLock(mc);
+    err = _BIDMappedCacheMapCurrent(context, mc, 0);
+    if (err == BID_S_OK)
+        *pTime = BID_MAPPED_HEADER(mc)->LastChangedTime;
+    BIDMappedCacheUnlock(mc);
+
+    return err;
+}
+
+static BIDError
+_BIDMappedCacheGetObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t **val)
+{
+    struct BIDMappedCache *mc = (struct BIDMappedCache *)cache;
+    BIDError err, err2;
+    uint64_t i, h;
+    char *szValue = NULL;
+
+    *val = NULL;
+
+    if (mc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    if (strlen(key) >= BID_MAPPED_CACHE_KEY_SIZE)
+        return BID_S_CACHE_KEY_NOT_FOUND;
+
+    BIDMappedCacheLock(mc);
+
+    err = _BIDMappedCacheMapCurrent(context, mc, 0);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BID_S_CACHE_KEY_NOT_FOUND;
+    h = _BIDMappedCacheHash(key);
+
+    for (i = 0; i < BID_MAPPED_CACHE_MAX_PROBE && i < mc->cSlots; i++) {
+        uint64_t s = (h + i) & (mc->cSlots - 1);
+        struct BIDMappedCacheSlot *slot = BID_MAPPED_SLOT(mc, s);
+        int bEmpty, bFound;
+
+        err2 = _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s), F_RDLCK);
+        if (err2 != BID_S_OK) {
+            err = err2;
+            break;
+        }
+
+        bEmpty = (slot->State == BID_MAPPED_SLOT_EMPTY);
+        bFound = (slot->State == BID_MAPPED_SLOT_USED &&
+                  strncmp(slot->Key, key, BID_MAPPED_CACHE_KEY_SIZE) == 0);
+        if (bFound)
+            err = _BIDMappedCacheCopyValue(mc, s, &szValue);
+
+        _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s), F_UNLCK);
+
+        if (bFound || bEmpty)
+            break;
+    }
+
+cleanup:
+    BIDMappedCacheUnlock(mc);
+
+    if (err == BID_S_OK) {
+        *val = json_loads(szValue, 0, BID_JSON_ERROR(context));
+        if (*val == NULL)
+            err = BID_S_CACHE_READ_ERROR;
+    }
+
+    BIDFree(szValue);
+
+    return err;
+}
+
+/*
+ * Check whether slot i of a run starting at slot s may be used as a
+ * continuation slot; the caller holds its lock. The first cOwned slots
+ * of the run belong to the entry being replaced.
+ */
+static int
+_BIDMappedCacheContinuationFreeP(
+    BIDContext context,
+    struct BIDMappedCache *mc,
+    uint64_t s,
+    uint64_t i,
+    uint64_t cOwned,
+    time_t now)
+{
+    struct BIDMappedCacheSlot *slot = BID_MAPPED_SLOT(mc, s + i);
+
+    if (slot->State == BID_MAPPED_SLOT_EMPTY ||
+        _BIDMappedCacheSlotReusableP(context, slot, now))
+        return 1;
+
+    return (i < cOwned &&
+            slot->State == BID_MAPPED_SLOT_CONTINUATION &&
+            BID_MAPPED_CONT(mc, s + i)->cHead == i);
+}
+
+static BIDError
+_BIDMappedCacheRunFreeP(
+    BIDContext context,
+    struct BIDMappedCache *mc,
+    uint64_t s,
+    uint64_t cRun,
+    time_t now,
+    int *pbFree)
+{
+    BIDError err;
+    uint64_t i;
+
+    *pbFree = (s + cRun <= mc->cSlots);
+
+    for (i = 1; *pbFree && i < cRun; i++) {
+        err = _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s + i), F_RDLCK);
+        if (err != BID_S_OK)
+            return err;
+
+        *pbFree = _BIDMappedCacheContinuationFreeP(context, mc, s, i, 0, now);
+
+        _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s + i), F_UNLCK);
+    }
+
+    return BID_S_OK;
+}
+
+/*
+ * Find the slot holding key, and the first slot at which a run of cRun
+ * slots could be stored. The caller holds the bucket lock for the key,
+ * so the key cannot be inserted elsewhere in the meantime.
+ *
+ * An entry may not start beyond the empty slot that ends the probe
+ * sequence, as lookups would stop before reaching it. If there is no
+ * room before that slot, it is returned in *pEmpty so that the caller
+ * can turn it into a tombstone and look again. *pcDead is set to the
+ * number of removed or expired entries probed.
+ */
+static BIDError
+_BIDMappedCacheFindSlot(
+    BIDContext context,
+    struct BIDMappedCache *mc,
+    const char *key,
+    uint64_t h,
+    uint64_t cRun,
+    time_t now,
+    int64_t *pFound,
+    int64_t *pReuse,
+    int64_t *pEmpty,
+    uint64_t *pcDead)
+{
+    BIDError err;
+    uint64_t i;
+
+    *pFound = -1;
+    *pReuse = -1;
+    *pEmpty = -1;
+    *pcDead = 0;
+
+    for (i = 0; i < BID_MAPPED_CACHE_MAX_PROBE && i < mc->cSlots; i++) {
+        uint64_t s = (h + i) & (mc->cSlots - 1);
+        struct BIDMappedCacheSlot *slot = BID_MAPPED_SLOT(mc, s);
+        int bEmpty, bFound, bFree;
+
+        err = _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s), F_RDLCK);
+        if (err != BID_S_OK)
+            return err;
+
+        bEmpty = (slot->State == BID_MAPPED_SLOT_EMPTY);
+        bFound = (slot->State == BID_MAPPED_SLOT_USED &&
+                  strncmp(slot->Key, key, BID_MAPPED_CACHE_KEY_SIZE) == 0);
+        bFree = !bFound && (bEmpty || _BIDMappedCacheSlotReusableP(context, slot, now));
+        if (bFree && !bEmpty)
+            (*pcDead)++;
+
+        _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s), F_UNLCK);
+
+        if (bFound && *pFound == -1)
+            *pFound = s;
+
+        if (bFree && *pReuse == -1) {
+            err = _BIDMappedCacheRunFreeP(context, mc, s, cRun, now, &bFree);
+            if (err != BID_S_OK)
+                return err;
+
+            if (bFree)
+                *pReuse = s;
+        }
+
+        if (bEmpty) {
+            if (*pReuse == -1)
+                *pEmpty = s;
+            break;
+        } else if (*pFound != -1 && *pReuse != -1) {
+            break;
+        }
+    }
+
+    return BID_S_OK;
+}
+
+/*
+ * Store an entry in the run of slots starting at slot s, if they are
+ * still free. The caller holds the write lock on the head slot and has
+ * checked it; the first cOwned slots belong to the entry being replaced,
+ * and any of those beyond the new run are deleted. Continuation slots
+ * are written before the head, so readers never see a partial entry.
+ */
+static BIDError
+_BIDMappedCacheStoreRun(
+    BIDContext context,
+    struct BIDMappedCache *mc,
+    uint64_t s,
+    uint64_t cOwned,
+    const char *key,
+    const char *szJson,
+    size_t cchJson,
+    time_t expiry,
+    time_t now,
+    int *pbStored)
+{
+    BIDError err = BID_S_OK;
+    struct BIDMappedCacheSlot *slot = BID_MAPPED_SLOT(mc, s);
+    uint64_t i, cRun, cSpan, cLocked;
+    size_t cbCopied;
+    int bFree = 1;
+
+    *pbStored = 0;
+
+    cRun = _BIDMappedCacheRunLength(cchJson);
+    if (s + cRun > mc->cSlots)
+        return BID_S_OK;
+
+    cSpan = cRun > cOwned ? cRun : cOwned;
+    if (s + cSpan > mc->cSlots)
+        cSpan = mc->cSlots - s;
+
+    for (cLocked = 1; cLocked < cSpan; cLocked++) {
+        err = _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s + cLocked), F_WRLCK);
+        if (err != BID_S_OK)
+            break;
+
+        if (cLocked < cRun &&
+            !_BIDMappedCacheContinuationFreeP(context, mc, s, cLocked, cOwned, now)) {
+            bFree = 0;
+            cLocked++;
+            break;
+        }
+    }
+    BID_BAIL_ON_ERROR(err);
+
+    if (!bFree)
+        goto cleanup;
+
+    cbCopied = (cRun == 1) ? cchJson : BID_MAPPED_HEAD_VALUE_SIZE;
+
+    for (i = 1; i < cRun; i++) {
+        struct BIDMappedCacheContinuationSlot *cont = BID_MAPPED_CONT(mc, s + i);
+        size_t cbChunk = cchJson - cbCopied;
+
+        if (cbChunk > BID_MAPPED_CONT_VALUE_SIZE)
+            cbChunk = BID_MAPPED_CONT_VALUE_SIZE;
+
+        cont->State = BID_MAPPED_SLOT_CONTINUATION;
+        cont->cHead = i;
+        cont->Expiry = expiry;
+        memcpy(cont->Value, &szJson[cbCopied], cbChunk);
+        cbCopied += cbChunk;
+    }
+
+    for (i = cRun; i < cSpan; i++) {
+        struct BIDMappedCacheContinuationSlot *cont = BID_MAPPED_CONT(mc, s + i);
+
+        if (cont->State == BID_MAPPED_SLOT_CONTINUATION && cont->cHead == i)
+            cont->State = BID_MAPPED_SLOT_DELETED;
+    }
+
+    slot->State = BID_MAPPED_SLOT_USED;
+    slot->Expiry = expiry;
+    memcpy(slot->Key, key, strlen(key) + 1);
+    memcpy(slot->Value, szJson, cRun == 1 ? cchJson : BID_MAPPED_HEAD_VALUE_SIZE);
+    slot->cbValue = cchJson;
+
+    *pbStored = 1;
+
+cleanup:
+    for (i = 1; i < cLocked; i++)
+        _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s + i), F_UNLCK);
+
+    return err;
+}
+
+/*
+ * Store, add or remove an entry; the caller holds the handle mutex. On
+ * return, *pbRebuild is set if the table should be rebuilt, either to
+ * make room for the entry (if it could not be stored) or because probe
+ * sequences have been lengthened by dead entries.
+ */
+static BIDError
+_BIDMappedCacheUpdate(
+    BIDContext context,
+    struct BIDMappedCache *mc,
+    const char *key,
+    const char *szJson,
+    size_t cchJson,
+    time_t expiry,
+    time_t now,
+    int remove,
+    int add,
+    int *pbRebuild)
+{
+    BIDError err;
+    uint64_t h = 0, cRun;
+    int bTableLocked = 0, bBucketLocked = 0, bStored = 0, retry;
+
+    *pbRebuild = 0;
+
+    cRun = remove ? 0 : _BIDMappedCacheRunLength(cchJson);
+
+    err = _BIDMappedCacheLockTable(context, mc, F_RDLCK, O_CREAT, NULL);
+    BID_BAIL_ON_ERROR(err);
+
+    bTableLocked = 1;
+
+    h = _BIDMappedCacheHash(key) & (mc->cSlots - 1);
+
+    err = _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_BUCKET_LOCK(h), F_WRLCK);
+    BID_BAIL_ON_ERROR(err);
+
+    bBucketLocked = 1;
+
+    /* a reusable slot may be claimed by another key before we lock it */
+    for (retry = 0; !bStored && retry < BID_MAPPED_CACHE_MAX_PROBE; retry++) {
+        struct BIDMappedCacheSlot *slot;
+        int64_t found, reuse, empty;
+        uint64_t cDead;
+        int bMatch;
+
+        err = _BIDMappedCacheFindSlot(context, mc, key, h, cRun, now,
+                                      &found, &reuse, &empty, &cDead);
+        BID_BAIL_ON_ERROR(err);
+
+        if (cDead >= BID_MAPPED_CACHE_REBUILD_PROBE)
+            *pbRebuild = 1;
+
+        if (found != -1) {
+            err = _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(found), F_WRLCK);
+            BID_BAIL_ON_ERROR(err);
+
+            slot = BID_MAPPED_SLOT(mc, found);
+
+            /* the entry may have been purged meanwhile */
+            bMatch = (slot->State == BID_MAPPED_SLOT_USED &&
+                      strncmp(slot->Key, key, BID_MAPPED_CACHE_KEY_SIZE) == 0);
+
+            /* expired entries count as absent, as they may be reused at any time */
+            if (add && bMatch && !_BIDMappedCacheSlotReusableP(context, slot, now)) {
+                _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(found), F_UNLCK);
+                err = BID_S_CACHE_KEY_EXISTS;
+                goto cleanup;
+            }
+
+            if (bMatch && remove) {
+                _BIDMappedCacheFreeRun(mc, found);
+                BID_MAPPED_HEADER(mc)->LastChangedTime = now;
+                bStored = 1;
+            } else if (bMatch) {
+                /* replace the entry in place if the slots after it are free */
+                err = _BIDMappedCacheStoreRun(context, mc, found,
+                                              _BIDMappedCacheRunLength(slot->cbValue),
+                                              key, szJson, cchJson, expiry, now, &bStored);
+                if (bStored)
+                    BID_MAPPED_HEADER(mc)->LastChangedTime = now;
+            }
+
+            _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(found), F_UNLCK);
+            BID_BAIL_ON_ERROR(err);
+
+            if (!bMatch)
+                continue;
+        }
+
+        if (remove) {
+            bStored = 1;
+            break;
+        } else if (bStored) {
+            break;
+        }
+
+        if (reuse == -1) {
+            if (empty == -1) {
+                err = BID_S_CACHE_WRITE_ERROR; /* no room within the probe window */
+                *pbRebuild = 1;
+                goto cleanup;
+            }
+
+            /* a tombstone lets the probe sequence continue past the empty slot */
+            err = _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(empty), F_WRLCK);
+            BID_BAIL_ON_ERROR(err);
+
+            slot = BID_MAPPED_SLOT(mc, empty);
+            if (slot->State == BID_MAPPED_SLOT_EMPTY)
+                slot->State = BID_MAPPED_SLOT_DELETED;
+
+            _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(empty), F_UNLCK);
+            continue;
+        }
+
+        err = _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(reuse), F_WRLCK);
+        BID_BAIL_ON_ERROR(err);
+
+        slot = BID_MAPPED_SLOT(mc, reuse);
+
+        /* an expired slot may have been reused for another key meanwhile */
+        if (slot->State == BID_MAPPED_SLOT_EMPTY ||
+            _BIDMappedCacheSlotReusableP(context, slot, now)) {
+            err = _BIDMappedCacheStoreRun(context, mc, reuse, 0,
+                                          key, szJson, cchJson, expiry, now, &bStored);
+            if (bStored)
+                BID_MAPPED_HEADER(mc)->LastChangedTime = now;
+        }
+
+        _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(reuse), F_UNLCK);
+        BID_BAIL_ON_ERROR(err);
+
+        /* the entry did not fit in place, so remove it now it has moved */
+        if (bStored && found != -1) {
+            err = _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(found), F_WRLCK);
+            BID_BAIL_ON_ERROR(err);
+
+            slot = BID_MAPPED_SLOT(mc, found);
+            if (slot->State == BID_MAPPED_SLOT_USED &&
+                strncmp(slot->Key, key, BID_MAPPED_CACHE_KEY_SIZE) == 0)
+                _BIDMappedCacheFreeRun(mc, found);
+
+            _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(found), F_UNLCK);
+        }
+    }
+
+    err = bStored ? BID_S_OK : BID_S_CACHE_LOCK_TIMEOUT;
+
+cleanup:
+    if (bBucketLocked)
+        _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_BUCKET_LOCK(h), F_UNLCK);
+    if (bTableLocked)
+        _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_TABLE_LOCK, F_UNLCK);
+
+    return err;
+}
+
+static BIDError
+_BIDMappedCacheSetOrRemoveObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t *val,
+    int remove,
+    int add)
+{
+    struct BIDMappedCache *mc = (struct BIDMappedCache *)cache;
+    BIDError err;
+    char *szJson = NULL;
+    size_t cchJson = 0;
+    time_t now, expiry = 0;
+    int bRebuild, cRebuilds;
+
+    if (mc == NULL || (val == NULL && !remove))
+        return BID_S_INVALID_PARAMETER;
+
+    if (mc->Flags & BID_CACHE_FLAG_READONLY)
+        return BID_S_CACHE_PERMISSION_DENIED;
+
+    if (strlen(key) >= BID_MAPPED_CACHE_KEY_SIZE)
+        return BID_S_BUFFER_TOO_LONG;
+
+    if (!remove) {
+        szJson = json_dumps(val, JSON_COMPACT);
+        if (szJson == NULL)
+            return BID_S_CANNOT_ENCODE_JSON;
+
+        cchJson = strlen(szJson);
+        if (cchJson > BID_MAPPED_CACHE_MAX_VALUE) {
+            BIDFree(szJson);
+            return BID_S_BUFFER_TOO_LONG;
+        }
+
+        expiry = _BIDMappedCacheExpiry(context, val);
+    }
+
+    time(&now);
+
+    BIDMappedCacheLock(mc);
+
+    for (cRebuilds = 0; ; cRebuilds++) {
+        err = _BIDMappedCacheUpdate(context, mc, key, szJson, cchJson, expiry, now,
+                                    remove, add, &bRebuild);
+        if (!bRebuild)
+            break;
+
+        if (err == BID_S_OK) {
+            /* best effort, as the update has been made */
+            _BIDMappedCacheRebuild(context, mc, 0);
+            break;
+        } else if (err != BID_S_CACHE_WRITE_ERROR || cRebuilds == 2) {
+            break;
+        }
+
+        /* reclaim dead slots first, and then grow the table */
+        err = _BIDMappedCacheRebuild(context, mc, cRebuilds > 0);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+cleanup:
+    BIDMappedCacheUnlock(mc);
+
+    BIDFree(szJson);
+
+    return err;
+}
+
+static BIDError
+_BIDMappedCacheSetObject(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t *val)
+{
+    return _BIDMappedCacheSetOrRemoveObject(ops, context, cache, key, val, 0, 0);
+}
+
+static BIDError
+_BIDMappedCacheRemoveObject(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache,
+    const char *key)
+{
+    return _BIDMappedCacheSetOrRemoveObject(ops, context, cache, key, NULL, 1, 0);
+}
+
+static BIDError
+_BIDMappedCacheAddObject(
+    struct BIDCacheOps *ops,
+    BIDContext context,
+    void *cache,
+    const char *key,
+    json_t *val)
+{
+    return _BIDMappedCacheSetOrRemoveObject(ops, context, cache, key, val, 0, 1);
+}
+
+/*
+ * Iteration takes a snapshot of the live entries, which is proportional
+ * to the size of the table; it is intended for tools and purging only.
+ */
+static BIDError
+_BIDMappedCacheSnapshot(
+    BIDContext context,
+    struct BIDMappedCache *mc,
+    json_t **pSnapshot)
+{
+    BIDError err;
+    json_t *snapshot = NULL;
+    uint64_t s;
+    char szKey[BID_MAPPED_CACHE_KEY_SIZE];
+
+    *pSnapshot = NULL;
+
+    err = _BIDAllocJsonObject(context, &snapshot);
+    BID_BAIL_ON_ERROR(err);
+
+    for (s = 0; s < mc->cSlots; s++) {
+        struct BIDMappedCacheSlot *slot = BID_MAPPED_SLOT(mc, s);
+        json_t *value;
+        char *szValue = NULL;
+        int bUsed;
+
+        if (slot->State != BID_MAPPED_SLOT_USED)
+            continue;
+
+        err = _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s), F_RDLCK);
+        BID_BAIL_ON_ERROR(err);
+
+        bUsed = (slot->State == BID_MAPPED_SLOT_USED &&
+                 memchr(slot->Key, '\0', sizeof(slot->Key)) != NULL);
+        if (bUsed) {
+            memcpy(szKey, slot->Key, sizeof(szKey));
+            err = _BIDMappedCacheCopyValue(mc, s, &szValue);
+        }
+
+        _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s), F_UNLCK);
+
+        if (err == BID_S_NO_MEMORY)
+            goto cleanup;
+        else if (!bUsed || err != BID_S_OK)
+            continue;
+
+        value = json_loads(szValue, 0, BID_JSON_ERROR(context));
+        BIDFree(szValue);
+        if (value == NULL)
+            continue;
+
+        err = _BIDJsonObjectSet(context, snapshot, szKey, value,
+                                BID_JSON_FLAG_REQUIRED | BID_JSON_FLAG_CONSUME_REF);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    err = BID_S_OK;
+    *pSnapshot = snapshot;
+
+cleanup:
+    if (err != BID_S_OK)
+        json_decref(snapshot);
+
+    return err;
+}
+
+static BIDError
+_BIDMappedCacheFirstObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    void **cookie,
+    const char **key,
+    json_t **val)
+{
+    struct BIDMappedCache *mc = (struct BIDMappedCache *)cache;
+    BIDError err;
+    json_t *snapshot = NULL;
+
+    *key = NULL;
+    *val = NULL;
+
+    BID_ASSERT(cookie != NULL);
+
+    if (mc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    BIDMappedCacheLock(mc);
+    err = _BIDMappedCacheMapCurrent(context, mc, 0);
+    if (err == BID_S_OK)
+        err = _BIDMappedCacheSnapshot(context, mc, &snapshot);
+    BIDMappedCacheUnlock(mc);
+
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDCacheIteratorAlloc(snapshot, cookie);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDCacheIteratorNext(cookie, key, val);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    json_decref(snapshot);
+
+    return err;
+}
+
+static BIDError
+_BIDMappedCacheNextObject(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context BID_UNUSED,
+    void *cache BID_UNUSED,
+    void **cookie,
+    const char **key,
+    json_t **val)
+{
+    BIDError err;
+
+    *key = NULL;
+    *val = NULL;
+
+    BID_ASSERT(cookie != NULL && *cookie != NULL);
+
+    err = _BIDCacheIteratorNext(cookie, key, val);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    return err;
+}
+
+/*
+ * Purging visits each slot once, deciding and deleting under the slot
+ * lock so that an entry rewritten meanwhile is judged on its new value.
+ * The table is then rebuilt to reclaim the purged slots.
+ */
+static BIDError
+_BIDMappedCachePurgeObjects(
+    struct BIDCacheOps *ops BID_UNUSED,
+    BIDContext context,
+    void *cache,
+    int (*predicate)(BIDContext, const char *, json_t *, void *),
+    void *data)
+{
+    struct BIDMappedCache *mc = (struct BIDMappedCache *)cache;
+    BIDError err;
+    uint64_t s;
+    int bTableLocked = 0, bPurged = 0;
+
+    if (mc == NULL)
+        return BID_S_INVALID_PARAMETER;
+
+    if (mc->Flags & BID_CACHE_FLAG_READONLY)
+        return BID_S_CACHE_PERMISSION_DENIED;
+
+    BIDMappedCacheLock(mc);
+
+    err = _BIDMappedCacheLockTable(context, mc, F_RDLCK, 0, NULL);
+    if (err == BID_S_CACHE_NOT_FOUND) {
+        err = BID_S_OK;
+        goto cleanup;
+    }
+    BID_BAIL_ON_ERROR(err);
+
+    bTableLocked = 1;
+
+    for (s = 0; s < mc->cSlots; s++) {
+        struct BIDMappedCacheSlot *slot = BID_MAPPED_SLOT(mc, s);
+        json_t *value = NULL;
+        char *szValue = NULL;
+        int bPurge = 0;
+
+        if (slot->State != BID_MAPPED_SLOT_USED)
+            continue;
+
+        err = _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s), F_WRLCK);
+        BID_BAIL_ON_ERROR(err);
+
+        if (slot->State == BID_MAPPED_SLOT_USED &&
+            memchr(slot->Key, '\0', sizeof(slot->Key)) != NULL) {
+            err = _BIDMappedCacheCopyValue(mc, s, &szValue);
+            if (err == BID_S_OK) {
+                value = json_loads(szValue, 0, BID_JSON_ERROR(context));
+                bPurge = (value != NULL && predicate(context, slot->Key, value, data));
+            } else if (err == BID_S_CACHE_KEY_NOT_FOUND) {
+                /* an expired entry whose continuation slots were reused */
+                bPurge = 1;
+                err = BID_S_OK;
+            }
+        }
+
+        if (bPurge) {
+            _BIDMappedCacheFreeRun(mc, s);
+            bPurged = 1;
+        }
+
+        _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_SLOT_LOCK(s), F_UNLCK);
+
+        json_decref(value);
+        BIDFree(szValue);
+
+        if (err == BID_S_NO_MEMORY)
+            goto cleanup;
+    }
+
+    if (bPurged)
+        BID_MAPPED_HEADER(mc)->LastChangedTime = time(NULL);
+
+    err = BID_S_OK;
+
+cleanup:
+    if (bTableLocked)
+        _BIDMappedCacheLockByte(mc->Fd, BID_MAPPED_TABLE_LOCK, F_UNLCK);
+    if (err == BID_S_OK && bPurged)
+        err = _BIDMappedCacheRebuild(context, mc, 0);
+    BIDMappedCacheUnlock(mc);
+
+    return err;
+}
+
+struct BIDCacheOps _BIDMappedCache = {
+    "mmap",
+    _BIDMappedCacheAcquire,
+    _BIDMappedCacheRelease,
+    _BIDMappedCacheInitialize,
+    _BIDMappedCacheDestroy,
+    _BIDMappedCacheGetName,
+    _BIDMappedCacheGetLastChangedTime,
+    _BIDMappedCacheGetObject,
+    _BIDMappedCacheSetObject,
+    _BIDMappedCacheRemoveObject,
+    _BIDMappedCacheAddObject,
+    _BIDMappedCacheFirstObject,
+    _BIDMappedCacheNextObject,
+    _BIDMappedCachePurgeObjects,
+};
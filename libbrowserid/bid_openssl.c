@@ -53,6 +53,7 @@
 #include <openssl/err.h>
 
 #include <ctype.h>
+#include <sys/stat.h>
 
 #ifdef GSSBID_DEBUG
 #define BID_CRYPTO_PRINT_ERRORS() do { ERR_print_errors_fp(stderr); } while (0)
@@ -81,14 +82,228 @@ _BIDAllocSecret(
     int freeit,
     BIDSecretHandle *pSecretHandle);
 
+/*
+ * Process-wide cache of public keys parsed from JWKs, so that verifying
+ * signatures from the same issuer does not repeatedly decode the key
+ * parameters and set up Montgomery contexts. Entries are keyed by a
+ * SHA-256 fingerprint of the key parameters and are evicted in least
+ * recently used order.
+ */
+#define BID_KEY_CACHE_SIZE          32
+
+struct BIDKeyCacheEntry {
+    unsigned char Fingerprint[SHA256_DIGEST_LENGTH];
+    int Type;
+    void *Key;
+    uint64_t LastUsed;
+};
+
+static struct {
+    BID_MUTEX Mutex;
+    uint64_t Clock;
+    uint64_t Hits;
+    uint64_t Misses;
+    struct BIDKeyCacheEntry Entries[BID_KEY_CACHE_SIZE];
+} _BIDKeyCache;
+
+/*
+ * Process-wide cache of X.509 trust stores, keyed by the configured CA
+ * file and directory. A store is reloaded when the modification time of
+ * any of its sources changes; each load is assigned a new generation.
+ */
+#define BID_X509_STORE_CACHE_SIZE   4
+
+struct BIDX509StoreCacheEntry {
+    json_t *CAFile;
+    json_t *CADir;
+    time_t Mtimes[4];
+    uint64_t Generation;
+    uint64_t LastUsed;
+    X509_STORE *Store;
+};
+
+/*
+ * Process-wide cache of verified certificate chains, keyed by a SHA-256
+ * thumbprint of the leaf certificate. An entry is valid only for the
+ * store generation that verified it and until the earliest notAfter in
+ * the chain.
+ */
+#define BID_X509_CHAIN_CACHE_SIZE   32
+
+struct BIDX509ChainCacheEntry {
+    unsigned char Thumbprint[SHA256_DIGEST_LENGTH];
+    uint64_t Generation;
+    uint64_t LastUsed;
+    STACK_OF(X509) *Chain;
+};
+
+static struct {
+    BID_MUTEX Mutex;
+    uint64_t Clock;
+    uint64_t Generation;
+    struct BIDX509StoreCacheEntry Stores[BID_X509_STORE_CACHE_SIZE];
+    struct BIDX509ChainCacheEntry Chains[BID_X509_CHAIN_CACHE_SIZE];
+} _BIDX509Cache;
+
+/*
+ * Process-wide pool of pre-generated ephemeral ECDH keys for each curve,
+ * refilled on a background thread so that handshakes need not wait for
+ * key generation; starting it installs the OpenSSL locking callbacks,
+ * whether or not the context is thread-safe. A pool is only filled once its curve has been used.
+ * Keys are removed from the pool when handed out, so each is used once;
+ * a forked child sets aside the keys inherited from its parent, to be
+ * freed on its first acquire. The curve groups are created once, with
+ * precomputed multiples of the generator.
+ */
+#define BID_ECDH_KEY_POOL_SIZE      8
+
+struct BIDECDHKeyPool {
+    int Nid;
+    EC_GROUP *Group;
+    int bRefilling;
+    size_t cKeys;
+    EC_KEY *Keys[BID_ECDH_KEY_POOL_SIZE];
+    size_t cStaleKeys;
+    EC_KEY *StaleKeys[BID_ECDH_KEY_POOL_SIZE];
+};
+
+static struct {
+    BID_MUTEX Mutex;
+    struct BIDECDHKeyPool Curves[3];
+} _BIDECDHKeyPool;
+
+static BID_MUTEX _BIDOpenSSLLocksMutex;
+static BID_MUTEX *_BIDOpenSSLLocks;
+static int _BIDOpenSSLLocksCount;
+
+static void
+_BIDOpenSSLLockingCallback(
+    int mode,
+    int n,
+    const char *file BID_UNUSED,
+    int line BID_UNUSED)
+{
+    if (mode & CRYPTO_LOCK)
+        BID_MUTEX_LOCK(&_BIDOpenSSLLocks[n]);
+    else
+        BID_MUTEX_UNLOCK(&_BIDOpenSSLLocks[n]);
+}
+
+/*
+ * Install locking callbacks when the first context that may be used
+ * concurrently is acquired, unless the application has already done so.
+ * The default thread ID callback (the address of errno) is sufficient.
+ */
+void
+_BIDCryptoThreadInit(void)
+{
+    int i, nLocks;
+
+    BID_MUTEX_LOCK(&_BIDOpenSSLLocksMutex);
+
+    if (_BIDOpenSSLLocks != NULL || CRYPTO_get_locking_callback() != NULL)
+        goto cleanup;
+
+    nLocks = CRYPTO_num_locks();
+
+    _BIDOpenSSLLocks = BIDCalloc(nLocks, sizeof(BID_MUTEX));
+    if (_BIDOpenSSLLocks == NULL)
+        goto cleanup;
+
+    for (i = 0; i < nLocks; i++)
+        BID_MUTEX_INIT(&_BIDOpenSSLLocks[i]);
+    _BIDOpenSSLLocksCount = nLocks;
+
+    CRYPTO_set_locking_callback(_BIDOpenSSLLockingCallback);
+
+cleanup:
+    BID_MUTEX_UNLOCK(&_BIDOpenSSLLocksMutex);
+}
+
+static void
+_BIDECDHKeyPoolAtForkPrepare(void)
+{
+    BID_MUTEX_LOCK(&_BIDECDHKeyPool.Mutex);
+}
+
+static void
+_BIDECDHKeyPoolAtForkParent(void)
+{
+    BID_MUTEX_UNLOCK(&_BIDECDHKeyPool.Mutex);
+}
+
+/*
+ * The refill thread does not survive fork(), and inherited keys must not
+ * be used by both processes. They are only moved aside here, because
+ * freeing them may take OpenSSL locks held by threads of the parent.
+ * A pool only refills after an acquire has freed its stale keys, so
+ * there is always room for them.
+ */
+static void
+_BIDECDHKeyPoolAtForkChild(void)
+{
+    struct BIDECDHKeyPool *pool;
+    size_t i, j;
+
+    for (i = 0; i < sizeof(_BIDECDHKeyPool.Curves) / sizeof(_BIDECDHKeyPool.Curves[0]); i++) {
+        pool = &_BIDECDHKeyPool.Curves[i];
+
+        for (j = 0; j < pool->cKeys && pool->cStaleKeys < BID_ECDH_KEY_POOL_SIZE; j++) {
+            pool->StaleKeys[pool->cStaleKeys++] = pool->Keys[j];
+            pool->Keys[j] = NULL;
+        }
+        pool->cKeys = 0;
+        pool->bRefilling = 0;
+    }
+
+    BID_MUTEX_UNLOCK(&_BIDECDHKeyPool.Mutex);
+}
+
 static void
 _BIDOpenSSLInit(void) __attribute__((__constructor__));
 
 static void
 _BIDOpenSSLInit(void)
 {
+    BID_MUTEX_INIT(&_BIDOpenSSLLocksMutex);
     OpenSSL_add_all_algorithms();
     ERR_load_crypto_strings();
+    BID_MUTEX_INIT(&_BIDKeyCache.Mutex);
+    BID_MUTEX_INIT(&_BIDX509Cache.Mutex);
+    BID_MUTEX_INIT(&_BIDECDHKeyPool.Mutex);
+    _BIDECDHKeyPool.Curves[0].Nid = NID_X9_62_prime256v1;
+    _BIDECDHKeyPool.Curves[1].Nid = NID_secp384r1;
+    _BIDECDHKeyPool.Curves[2].Nid = NID_secp521r1;
+
+    pthread_atfork(_BIDECDHKeyPoolAtForkPrepare, _BIDECDHKeyPoolAtForkParent,
+                   _BIDECDHKeyPoolAtForkChild);
+}
+
+/*
+ * Remove our locking callbacks when the library is unloaded, so that
+ * OpenSSL is not left calling into unmapped code.
+ */
+static void
+_BIDOpenSSLFini(void) __attribute__((__destructor__));
+
+static void
+_BIDOpenSSLFini(void)
+{
+    int i;
+
+    /* workers may still be using OpenSSL */
+    _BIDShutdownWorkers();
+
+    if (_BIDOpenSSLLocks == NULL)
+        return;
+
+    if (CRYPTO_get_locking_callback() == _BIDOpenSSLLockingCallback)
+        CRYPTO_set_locking_callback(NULL);
+
+    for (i = 0; i < _BIDOpenSSLLocksCount; i++)
+        BID_MUTEX_DESTROY(&_BIDOpenSSLLocks[i]);
+    BIDFree(_BIDOpenSSLLocks);
+    _BIDOpenSSLLocks = NULL;
 }
 
 static BIDError
@@ -449,6 +664,230 @@ _BIDMakeRsaKey(
     return err;
 }
 
+static const char *_BIDRsaKeyParams[] = { "n", "e", NULL };
+static const char *_BIDDsaKeyParams[] = { "p", "q", "g", "y", NULL };
+
+static BIDError
+_BIDMakeKeyFingerprint(
+    BIDContext context,
+    BIDJWK jwk,
+    int type,
+    unsigned char fingerprint[SHA256_DIGEST_LENGTH])
+{
+    SHA256_CTX sha;
+    json_t *x5c;
+    const char **szParams;
+    const char *szValue;
+    unsigned char legacy;
+
+    SHA256_Init(&sha);
+    SHA256_Update(&sha, &type, sizeof(type));
+
+    x5c = json_object_get(jwk, "x5c");
+    if (x5c != NULL) {
+        szValue = json_string_value(json_array_get(x5c, 0));
+        if (szValue == NULL)
+            return BID_S_MISSING_CERT;
+
+        SHA256_Update(&sha, "x5c", sizeof("x5c"));
+        SHA256_Update(&sha, szValue, strlen(szValue) + 1);
+    } else {
+        /* the legacy encoding changes how the parameters are interpreted */
+        legacy = _BIDIsLegacyJWK(context, jwk);
+        SHA256_Update(&sha, &legacy, sizeof(legacy));
+
+        szParams = (type == EVP_PKEY_RSA) ? _BIDRsaKeyParams : _BIDDsaKeyParams;
+
+        for (; *szParams != NULL; szParams++) {
+            szValue = json_string_value(json_object_get(jwk, *szParams));
+            if (szValue == NULL)
+                return BID_S_NO_KEY;
+
+            SHA256_Update(&sha, *szParams, strlen(*szParams) + 1);
+            SHA256_Update(&sha, szValue, strlen(szValue) + 1);
+        }
+    }
+
+    SHA256_Final(fingerprint, &sha);
+
+    return BID_S_OK;
+}
+
+static void
+_BIDKeyCacheRefKey(int type, void *key)
+{
+    if (type == EVP_PKEY_RSA)
+        RSA_up_ref((RSA *)key);
+    else
+        DSA_up_ref((DSA *)key);
+}
+
+static void
+_BIDKeyCacheFreeKey(int type, void *key)
+{
+    if (key == NULL)
+        return;
+    else if (type == EVP_PKEY_RSA)
+        RSA_free((RSA *)key);
+    else
+        DSA_free((DSA *)key);
+}
+
+/*
+ * Set up the Montgomery context for the public operation now, so that
+ * it is not lazily created by concurrent users of the cached key.
+ */
+static void
+_BIDKeyCacheWarmKey(int type, void *key)
+{
+    BN_CTX *bnCtx;
+
+    bnCtx = BN_CTX_new();
+    if (bnCtx == NULL)
+        return;
+
+    if (type == EVP_PKEY_RSA) {
+        RSA *rsa = (RSA *)key;
+
+        if (rsa->flags & RSA_FLAG_CACHE_PUBLIC)
+            BN_MONT_CTX_set_locked(&rsa->_method_mod_n, CRYPTO_LOCK_RSA, rsa->n, bnCtx);
+    } else {
+        DSA *dsa = (DSA *)key;
+
+        if (dsa->flags & DSA_FLAG_CACHE_MONT_P)
+            BN_MONT_CTX_set_locked(&dsa->method_mont_p, CRYPTO_LOCK_DSA, dsa->p, bnCtx);
+    }
+
+    BN_CTX_free(bnCtx);
+}
+
+static BIDError
+_BIDMakeDsaKey(
+    BIDContext context,
+    BIDJWK jwk,
+    int public,
+    DSA **pDsa);
+
+/*
+ * Return a public key from the cache, parsing and caching it if absent.
+ * The caller owns a reference to the returned key, which it releases
+ * with _BIDReleaseCachedPublicKey().
+ */
+static BIDError
+_BIDAcquireCachedPublicKey(
+    BIDContext context,
+    BIDJWK jwk,
+    int type,
+    void **pKey)
+{
+    BIDError err;
+    unsigned char fingerprint[SHA256_DIGEST_LENGTH];
+    struct BIDKeyCacheEntry *entry, *victim = NULL;
+    void *key = NULL;
+    size_t i;
+
+    *pKey = NULL;
+
+    err = _BIDMakeKeyFingerprint(context, jwk, type, fingerprint);
+    if (err != BID_S_OK)
+        return err;
+
+    BID_MUTEX_LOCK(&_BIDKeyCache.Mutex);
+
+    for (i = 0; i < BID_KEY_CACHE_SIZE; i++) {
+        entry = &_BIDKeyCache.Entries[i];
+
+        if (entry->Key != NULL && entry->Type == type &&
+            memcmp(entry->Fingerprint, fingerprint, sizeof(fingerprint)) == 0) {
+            entry->LastUsed = ++_BIDKeyCache.Clock;
+            _BIDKeyCache.Hits++;
+            _BIDKeyCacheRefKey(type, entry->Key);
+            *pKey = entry->Key;
+            break;
+        }
+    }
+
+    if (*pKey == NULL)
+        _BIDKeyCache.Misses++;
+
+    BID_MUTEX_UNLOCK(&_BIDKeyCache.Mutex);
+
+    if (*pKey != NULL)
+        return BID_S_OK;
+
+    if (type == EVP_PKEY_RSA)
+        err = _BIDMakeRsaKey(context, jwk, 1, (RSA **)&key);
+    else
+        err = _BIDMakeDsaKey(context, jwk, 1, (DSA **)&key);
+    if (err != BID_S_OK)
+        return err;
+
+    _BIDKeyCacheWarmKey(type, key);
+
+    BID_MUTEX_LOCK(&_BIDKeyCache.Mutex);
+
+    for (i = 0; i < BID_KEY_CACHE_SIZE; i++) {
+        entry = &_BIDKeyCache.Entries[i];
+
+        /* another thread may have cached it whilst we were parsing */
+        if (entry->Key != NULL && entry->Type == type &&
+            memcmp(entry->Fingerprint, fingerprint, sizeof(fingerprint)) == 0) {
+            victim = NULL;
+            break;
+        }
+
+        if (victim == NULL || entry->Key == NULL ||
+            (victim->Key != NULL && entry->LastUsed < victim->LastUsed))
+            victim = entry;
+    }
+
+    if (victim != NULL) {
+        _BIDKeyCacheFreeKey(victim->Type, victim->Key);
+
+        memcpy(victim->Fingerprint, fingerprint, sizeof(fingerprint));
+        victim->Type = type;
+        _BIDKeyCacheRefKey(type, key);
+        victim->Key = key;
+        victim->LastUsed = ++_BIDKeyCache.Clock;
+    }
+
+    BID_MUTEX_UNLOCK(&_BIDKeyCache.Mutex);
+
+    *pKey = key;
+
+    return BID_S_OK;
+}
+
+/*
+ * Cached keys are shared by threads whose contexts may not have installed
+ * the OpenSSL locking callbacks, which protect key reference counts, so
+ * references are only ever taken and released under the cache mutex.
+ */
+static void
+_BIDReleaseCachedPublicKey(int type, void *key)
+{
+    if (key == NULL)
+        return;
+
+    BID_MUTEX_LOCK(&_BIDKeyCache.Mutex);
+    _BIDKeyCacheFreeKey(type, key);
+    BID_MUTEX_UNLOCK(&_BIDKeyCache.Mutex);
+}
+
+BIDError
+_BIDGetKeyCacheStatistics(
+    BIDContext context BID_UNUSED,
+    uint64_t *pHits,
+    uint64_t *pMisses)
+{
+    BID_MUTEX_LOCK(&_BIDKeyCache.Mutex);
+    *pHits = _BIDKeyCache.Hits;
+    *pMisses = _BIDKeyCache.Misses;
+    BID_MUTEX_UNLOCK(&_BIDKeyCache.Mutex);
+
+    return BID_S_OK;
+}
+
 static BIDError
 _RSAKeySize(
     struct BIDJWTAlgorithmDesc *algorithm BID_UNUSED,
@@ -539,7 +978,7 @@ _RSAVerifySignature(
 
     *valid = 0;
 
-    err = _BIDMakeRsaKey(context, jwk, 1, &rsa);
+    err = _BIDAcquireCachedPublicKey(context, jwk, EVP_PKEY_RSA, (void **)&rsa);
     BID_BAIL_ON_ERROR(err);
 
     BID_ASSERT(jwt->EncData != NULL);
@@ -568,7 +1007,7 @@ _RSAVerifySignature(
               _BIDTimingSafeCompare(signature, digest, signatureLength) == 0);
 
 cleanup:
-    RSA_free(rsa);
+    _BIDReleaseCachedPublicKey(EVP_PKEY_RSA, rsa);
     BIDFree(signature);
 
     return err;
@@ -767,7 +1206,7 @@ _DSAVerifySignature(
 
     BID_ASSERT(jwt->EncData != NULL);
 
-    err = _BIDMakeDsaKey(context, jwk, 1, &dsa);
+    err = _BIDAcquireCachedPublicKey(context, jwk, EVP_PKEY_DSA, (void **)&dsa);
     BID_BAIL_ON_ERROR(err);
 
     err = _BIDMakeShaDigest(algorithm, context, jwt, digest, &digestLength);
@@ -797,7 +1236,7 @@ _DSAVerifySignature(
     err = BID_S_OK;
 
 cleanup:
-    DSA_free(dsa);
+    _BIDReleaseCachedPublicKey(EVP_PKEY_DSA, dsa);
     DSA_SIG_free(dsaSig);
 
     return err;
@@ -1585,6 +2024,255 @@ cleanup:
     return err;
 }
 
+static int
+_BIDStringsEqual(const char *s1, const char *s2)
+{
+    if (s1 == NULL || s2 == NULL)
+        return s1 == s2;
+
+    return strcmp(s1, s2) == 0;
+}
+
+static void
+_BIDGetX509StoreMtimes(
+    const char *szCAFile,
+    const char *szCADir,
+    time_t mtimes[4])
+{
+    const char *szPaths[4];
+    struct stat sb;
+    size_t i;
+
+    szPaths[0] = szCAFile;
+    szPaths[1] = szCADir;
+    szPaths[2] = X509_get_default_cert_file();
+    szPaths[3] = X509_get_default_cert_dir();
+
+    for (i = 0; i < 4; i++) {
+        if (szPaths[i] != NULL && stat(szPaths[i], &sb) == 0)
+            mtimes[i] = sb.st_mtime;
+        else
+            mtimes[i] = 0;
+    }
+}
+
+static BIDError
+_BIDLoadX509Store(
+    const char *szCAFile,
+    const char *szCADir,
+    X509_STORE **pStore)
+{
+    X509_STORE *store;
+
+    *pStore = NULL;
+
+    store = X509_STORE_new();
+    if (store == NULL) {
+        BID_CRYPTO_PRINT_ERRORS();
+        return BID_S_CRYPTO_ERROR;
+    }
+
+    if (X509_STORE_load_locations(store, szCAFile, szCADir) != 1 ||
+        X509_STORE_set_default_paths(store) != 1) {
+        BID_CRYPTO_PRINT_ERRORS();
+        X509_STORE_free(store);
+        return BID_S_CRYPTO_ERROR;
+    }
+
+#if 0
+    X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
+#endif
+
+    *pStore = store;
+
+    return BID_S_OK;
+}
+
+/*
+ * Return the trust store for the CA locations in certParams, loading it
+ * if it is absent or any of its sources have changed. The caller owns a
+ * reference to the returned store.
+ */
+static BIDError
+_BIDAcquireX509Store(
+    BIDContext context BID_UNUSED,
+    json_t *certParams,
+    X509_STORE **pStore,
+    uint64_t *pGeneration)
+{
+    BIDError err;
+    json_t *caCertificateFile = json_object_get(certParams, "ca-certificate");
+    json_t *caCertificateDir = json_object_get(certParams, "ca-directory");
+    const char *szCAFile = json_string_value(caCertificateFile);
+    const char *szCADir = json_string_value(caCertificateDir);
+    time_t mtimes[4];
+    struct BIDX509StoreCacheEntry *entry = NULL, *victim = NULL;
+    X509_STORE *store = NULL;
+    size_t i;
+
+    *pStore = NULL;
+    *pGeneration = 0;
+
+    _BIDGetX509StoreMtimes(szCAFile, szCADir, mtimes);
+
+    BID_MUTEX_LOCK(&_BIDX509Cache.Mutex);
+
+    for (i = 0; i < BID_X509_STORE_CACHE_SIZE; i++) {
+        entry = &_BIDX509Cache.Stores[i];
+
+        if (entry->Store != NULL &&
+            _BIDStringsEqual(json_string_value(entry->CAFile), szCAFile) &&
+            _BIDStringsEqual(json_string_value(entry->CADir), szCADir))
+            break;
+
+        if (victim == NULL || entry->Store == NULL ||
+            (victim->Store != NULL && entry->LastUsed < victim->LastUsed))
+            victim = entry;
+    }
+
+    if (i < BID_X509_STORE_CACHE_SIZE &&
+        memcmp(entry->Mtimes, mtimes, sizeof(mtimes)) == 0) {
+        entry->LastUsed = ++_BIDX509Cache.Clock;
+        CRYPTO_add(&entry->Store->references, 1, CRYPTO_LOCK_X509_STORE);
+        *pStore = entry->Store;
+        *pGeneration = entry->Generation;
+    }
+
+    BID_MUTEX_UNLOCK(&_BIDX509Cache.Mutex);
+
+    if (*pStore != NULL)
+        return BID_S_OK;
+
+    err = _BIDLoadX509Store(szCAFile, szCADir, &store);
+    if (err != BID_S_OK)
+        return err;
+
+    BID_MUTEX_LOCK(&_BIDX509Cache.Mutex);
+
+    /* reuse the stale entry for these locations, if there was one */
+    if (i < BID_X509_STORE_CACHE_SIZE)
+        victim = entry;
+
+    if (victim->Store != NULL)
+        X509_STORE_free(victim->Store);
+    json_decref(victim->CAFile);
+    json_decref(victim->CADir);
+
+    victim->CAFile = json_incref(caCertificateFile);
+    victim->CADir = json_incref(caCertificateDir);
+    memcpy(victim->Mtimes, mtimes, sizeof(mtimes));
+    victim->Generation = ++_BIDX509Cache.Generation;
+    victim->LastUsed = ++_BIDX509Cache.Clock;
+    victim->Store = store;
+
+    CRYPTO_add(&store->references, 1, CRYPTO_LOCK_X509_STORE);
+    *pStore = store;
+    *pGeneration = victim->Generation;
+
+    BID_MUTEX_UNLOCK(&_BIDX509Cache.Mutex);
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDMakeX509Thumbprint(
+    json_t *certChain,
+    unsigned char thumbprint[SHA256_DIGEST_LENGTH])
+{
+    const char *szCert;
+
+    szCert = json_string_value(json_array_get(certChain, 0));
+    if (szCert == NULL)
+        return BID_S_MISSING_CERT;
+
+    SHA256((const unsigned char *)szCert, strlen(szCert), thumbprint);
+
+    return BID_S_OK;
+}
+
+static int
+_BIDIsX509ChainCurrent(STACK_OF(X509) *chain)
+{
+    int i;
+
+    for (i = 0; i < sk_X509_num(chain); i++) {
+        if (X509_cmp_time(X509_get_notAfter(sk_X509_value(chain, i)), NULL) <= 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int
+_BIDFindVerifiedX509Chain(
+    const unsigned char thumbprint[SHA256_DIGEST_LENGTH],
+    uint64_t generation)
+{
+    struct BIDX509ChainCacheEntry *entry;
+    int bFound = 0;
+    size_t i;
+
+    BID_MUTEX_LOCK(&_BIDX509Cache.Mutex);
+
+    for (i = 0; i < BID_X509_CHAIN_CACHE_SIZE; i++) {
+        entry = &_BIDX509Cache.Chains[i];
+
+        if (entry->Chain == NULL ||
+            memcmp(entry->Thumbprint, thumbprint, SHA256_DIGEST_LENGTH) != 0)
+            continue;
+
+        if (entry->Generation == generation &&
+            _BIDIsX509ChainCurrent(entry->Chain)) {
+            entry->LastUsed = ++_BIDX509Cache.Clock;
+            bFound = 1;
+        } else {
+            sk_X509_pop_free(entry->Chain, X509_free);
+            entry->Chain = NULL;
+        }
+        break;
+    }
+
+    BID_MUTEX_UNLOCK(&_BIDX509Cache.Mutex);
+
+    return bFound;
+}
+
+static void
+_BIDCacheVerifiedX509Chain(
+    const unsigned char thumbprint[SHA256_DIGEST_LENGTH],
+    uint64_t generation,
+    STACK_OF(X509) *chain)
+{
+    struct BIDX509ChainCacheEntry *entry, *victim = NULL;
+    size_t i;
+
+    BID_MUTEX_LOCK(&_BIDX509Cache.Mutex);
+
+    for (i = 0; i < BID_X509_CHAIN_CACHE_SIZE; i++) {
+        entry = &_BIDX509Cache.Chains[i];
+
+        if (entry->Chain != NULL &&
+            memcmp(entry->Thumbprint, thumbprint, SHA256_DIGEST_LENGTH) == 0) {
+            victim = entry;
+            break;
+        }
+
+        if (victim == NULL || entry->Chain == NULL ||
+            (victim->Chain != NULL && entry->LastUsed < victim->LastUsed))
+            victim = entry;
+    }
+
+    if (victim->Chain != NULL)
+        sk_X509_pop_free(victim->Chain, X509_free);
+
+    memcpy(victim->Thumbprint, thumbprint, SHA256_DIGEST_LENGTH);
+    victim->Generation = generation;
+    victim->LastUsed = ++_BIDX509Cache.Clock;
+    victim->Chain = chain;
+
+    BID_MUTEX_UNLOCK(&_BIDX509Cache.Mutex);
+}
+
 BIDError
 _BIDValidateX509CertChain(
     BIDContext context,
@@ -1597,15 +2285,25 @@ _BIDValidateX509CertChain(
     X509_STORE_CTX *storeCtx = NULL;
     X509 *leafCert = NULL;
     STACK_OF(X509) *chain = NULL;
+    STACK_OF(X509) *verifiedChain = NULL;
+    unsigned char thumbprint[SHA256_DIGEST_LENGTH];
+    uint64_t generation;
     int i;
-    json_t *caCertificateFile = NULL;
-    json_t *caCertificateDir = NULL;
 
     if (json_array_size(certChain) == 0) {
         err = BID_S_MISSING_CERT;
         goto cleanup;
     }
 
+    err = _BIDMakeX509Thumbprint(certChain, thumbprint);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDAcquireX509Store(context, certParams, &store, &generation);
+    BID_BAIL_ON_ERROR(err);
+
+    if (_BIDFindVerifiedX509Chain(thumbprint, generation))
+        goto cleanup;
+
     err = _BIDCertDataToX509(context, certChain, 0, &leafCert);
     BID_BAIL_ON_ERROR(err);
 
@@ -1624,40 +2322,29 @@ _BIDValidateX509CertChain(
         sk_X509_push(chain, cert);
     }
 
-    store = X509_STORE_new();
     storeCtx = X509_STORE_CTX_new();
-    if (store == NULL || storeCtx == NULL) {
-        BID_CRYPTO_PRINT_ERRORS();
-        err = BID_S_CRYPTO_ERROR;
-        goto cleanup;
-    }
-
-    caCertificateFile = json_object_get(certParams, "ca-certificate");
-    caCertificateDir = json_object_get(certParams, "ca-directory");
-
-    if (X509_STORE_load_locations(store,
-                                  json_string_value(caCertificateFile),
-                                  json_string_value(caCertificateDir)) != 1 ||
-        X509_STORE_set_default_paths(store) != 1 ||
+    if (storeCtx == NULL ||
         X509_STORE_CTX_init(storeCtx, store, leafCert, chain) != 1) {
         BID_CRYPTO_PRINT_ERRORS();
         err = BID_S_CRYPTO_ERROR;
         goto cleanup;
     }
 
-#if 0
-    X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
-#endif
-
     if (!X509_verify_cert(storeCtx)) {
         BID_CRYPTO_PRINT_ERRORS();
         err = BID_S_UNTRUSTED_X509_CERT;
         goto cleanup;
     }
 
+    verifiedChain = X509_STORE_CTX_get1_chain(storeCtx);
+    if (verifiedChain != NULL)
+        _BIDCacheVerifiedX509Chain(thumbprint, generation, verifiedChain);
+
 cleanup:
     if (chain != NULL)
-        sk_X509_free(chain);
+        sk_X509_pop_free(chain, X509_free);
+    if (leafCert != NULL)
+        X509_free(leafCert);
     if (storeCtx != NULL)
         X509_STORE_CTX_free(storeCtx);
     if (store != NULL)
@@ -1730,47 +2417,291 @@ _BIDImportSecretKeyData(
     return _BIDAllocSecret(context, pbSecret, cbSecret, 0, pSecretHandle);
 }
 
-static BIDError
-_BIDMakeECKeyByCurve(
+BIDError
+_BIDExportSecretKeyData(
     BIDContext context BID_UNUSED,
+    BIDSecretHandle secretHandle,
+    unsigned char **ppbSecret,
+    size_t *pcbSecret)
+{
+    *ppbSecret = NULL;
+    *pcbSecret = 0;
+
+    if (secretHandle == NULL || secretHandle->pbSecret == NULL)
+        return BID_S_INVALID_SECRET;
+
+    *ppbSecret = BIDMalloc(secretHandle->cbSecret);
+    if (*ppbSecret == NULL)
+        return BID_S_NO_MEMORY;
+
+    memcpy(*ppbSecret, secretHandle->pbSecret, secretHandle->cbSecret);
+    *pcbSecret = secretHandle->cbSecret;
+
+    return BID_S_OK;
+}
+
+/*
+ * HMAC-SHA256 keyed directly from a secret handle, so that session keys
+ * need not round-trip through a JWK to sign or verify a JWT.
+ */
+BIDError
+_BIDSecretKeyHMAC(
+    BIDContext context BID_UNUSED,
+    BIDSecretHandle secretHandle,
+    const unsigned char *pbData,
+    size_t cbData,
+    unsigned char *pbHmac,
+    size_t *pcbHmac)
+{
+    unsigned int mdLength = (unsigned int)*pcbHmac;
+
+    if (secretHandle == NULL || secretHandle->pbSecret == NULL)
+        return BID_S_INVALID_SECRET;
+
+    if (*pcbHmac < SHA256_DIGEST_LENGTH)
+        return BID_S_BUFFER_TOO_SMALL;
+
+    if (HMAC(EVP_sha256(), secretHandle->pbSecret, (int)secretHandle->cbSecret,
+             pbData, cbData, pbHmac, &mdLength) == NULL)
+        return BID_S_CRYPTO_ERROR;
+
+    *pcbHmac = mdLength;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDGetECDHKeyPool(
+    BIDContext context,
     json_t *ecDhParams,
-    EC_KEY **pEcKey)
+    struct BIDECDHKeyPool **pPool)
 {
     BIDError err;
-    EC_KEY *ecKey = NULL;
     ssize_t curve = 0;
-    int nid = 0;
+
+    *pPool = NULL;
 
     err = _BIDGetECDHCurve(context, ecDhParams, &curve);
-    BID_BAIL_ON_ERROR(err);
+    if (err != BID_S_OK)
+        return err;
 
     switch (curve) {
     case BID_CONTEXT_ECDH_CURVE_P256:
-        nid = NID_X9_62_prime256v1;
+        *pPool = &_BIDECDHKeyPool.Curves[0];
         break;
     case BID_CONTEXT_ECDH_CURVE_P384:
-        nid = NID_secp384r1;
+        *pPool = &_BIDECDHKeyPool.Curves[1];
         break;
     case BID_CONTEXT_ECDH_CURVE_P521:
-        nid = NID_secp521r1;
+        *pPool = &_BIDECDHKeyPool.Curves[2];
         break;
     default:
-        err = BID_S_UNKNOWN_EC_CURVE;
-        goto cleanup;
-        break;
+        return BID_S_UNKNOWN_EC_CURVE;
+    }
+
+    return BID_S_OK;
+}
+
+/*
+ * Make an EC key on the pool's cached group, creating the group on
+ * first use. The group is never freed, so it may be used unlocked.
+ */
+static BIDError
+_BIDMakeECKeyFromPool(
+    struct BIDECDHKeyPool *pool,
+    EC_KEY **pEcKey)
+{
+    EC_GROUP *group;
+    EC_KEY *ecKey;
+
+    *pEcKey = NULL;
+
+    BID_MUTEX_LOCK(&_BIDECDHKeyPool.Mutex);
+
+    if (pool->Group == NULL) {
+        group = EC_GROUP_new_by_curve_name(pool->Nid);
+        if (group != NULL && !EC_GROUP_precompute_mult(group, NULL)) {
+            EC_GROUP_free(group);
+            group = NULL;
+        }
+        pool->Group = group;
+    }
+
+    group = pool->Group;
+
+    BID_MUTEX_UNLOCK(&_BIDECDHKeyPool.Mutex);
+
+    if (group == NULL)
+        return BID_S_CRYPTO_ERROR;
+
+    ecKey = EC_KEY_new();
+    if (ecKey == NULL)
+        return BID_S_NO_MEMORY;
+
+    if (!EC_KEY_set_group(ecKey, group)) {
+        EC_KEY_free(ecKey);
+        return BID_S_CRYPTO_ERROR;
+    }
+
+    *pEcKey = ecKey;
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDMakeECKeyByCurve(
+    BIDContext context,
+    json_t *ecDhParams,
+    EC_KEY **pEcKey)
+{
+    BIDError err;
+    struct BIDECDHKeyPool *pool;
+
+    *pEcKey = NULL;
+
+    err = _BIDGetECDHKeyPool(context, ecDhParams, &pool);
+    if (err != BID_S_OK)
+        return err;
+
+    return _BIDMakeECKeyFromPool(pool, pEcKey);
+}
+
+static BIDError
+_BIDGenerateECKeyFromPool(
+    struct BIDECDHKeyPool *pool,
+    EC_KEY **pEcKey)
+{
+    BIDError err;
+    EC_KEY *ecKey;
+
+    *pEcKey = NULL;
+
+    err = _BIDMakeECKeyFromPool(pool, &ecKey);
+    if (err != BID_S_OK)
+        return err;
+
+    if (!EC_KEY_generate_key(ecKey)) {
+        EC_KEY_free(ecKey);
+        return BID_S_DH_KEY_GENERATION_FAILURE;
     }
 
-    ecKey = EC_KEY_new_by_curve_name(nid);
+    *pEcKey = ecKey;
+
+    return BID_S_OK;
+}
+
+static void
+_BIDRefillECDHKeyPool(void *arg)
+{
+    struct BIDECDHKeyPool *pool = arg;
+    BIDError err;
+    EC_KEY *ecKey;
+    int bDone;
+
+    do {
+        err = _BIDGenerateECKeyFromPool(pool, &ecKey);
+
+        BID_MUTEX_LOCK(&_BIDECDHKeyPool.Mutex);
+
+        if (ecKey != NULL && pool->cKeys < BID_ECDH_KEY_POOL_SIZE) {
+            pool->Keys[pool->cKeys++] = ecKey;
+            ecKey = NULL;
+        }
+
+        /* on failure, the next handshake will try again */
+        bDone = (err != BID_S_OK || pool->cKeys == BID_ECDH_KEY_POOL_SIZE);
+        if (bDone)
+            pool->bRefilling = 0;
+
+        BID_MUTEX_UNLOCK(&_BIDECDHKeyPool.Mutex);
+    } while (!bDone);
+
+    EC_KEY_free(ecKey);
+}
+
+/*
+ * Take a pre-generated key from the pool, falling back to generating
+ * one if it is empty, and start refilling the pool if it is not full.
+ */
+static BIDError
+_BIDAcquireECDHKey(
+    BIDContext context,
+    json_t *ecDhParams,
+    EC_KEY **pEcKey)
+{
+    BIDError err;
+    struct BIDECDHKeyPool *pool;
+    EC_KEY *ecKey = NULL;
+    EC_KEY *staleKeys[BID_ECDH_KEY_POOL_SIZE];
+    size_t cStaleKeys, i;
+
+    *pEcKey = NULL;
+
+    err = _BIDGetECDHKeyPool(context, ecDhParams, &pool);
+    if (err != BID_S_OK)
+        return err;
+
+    BID_MUTEX_LOCK(&_BIDECDHKeyPool.Mutex);
+
+    /* keys inherited across fork(), see _BIDECDHKeyPoolAtForkChild() */
+    cStaleKeys = pool->cStaleKeys;
+    for (i = 0; i < cStaleKeys; i++) {
+        staleKeys[i] = pool->StaleKeys[i];
+        pool->StaleKeys[i] = NULL;
+    }
+    pool->cStaleKeys = 0;
+
+    if (pool->cKeys != 0) {
+        ecKey = pool->Keys[--pool->cKeys];
+        pool->Keys[pool->cKeys] = NULL;
+    }
+
+    if (!pool->bRefilling && pool->cKeys < BID_ECDH_KEY_POOL_SIZE) {
+        /* the refill uses OpenSSL concurrently, even if the context does not */
+        _BIDCryptoThreadInit();
+
+        if (_BIDRunAsync(context, _BIDRefillECDHKeyPool, pool) == BID_S_OK)
+            pool->bRefilling = 1;
+    }
+
+    BID_MUTEX_UNLOCK(&_BIDECDHKeyPool.Mutex);
+
+    for (i = 0; i < cStaleKeys; i++)
+        EC_KEY_free(staleKeys[i]);
+
     if (ecKey == NULL) {
-        err = BID_S_CRYPTO_ERROR;
-        goto cleanup;
+        err = _BIDGenerateECKeyFromPool(pool, &ecKey);
+        if (err != BID_S_OK)
+            return err;
     }
 
-    err = BID_S_OK;
     *pEcKey = ecKey;
 
-cleanup:
-    return err;
+    return BID_S_OK;
+}
+
+BIDError
+_BIDGetECDHKeyPoolStatistics(
+    BIDContext context,
+    json_t *ecDhParams,
+    size_t *pcKeys,
+    size_t *pcMaxKeys)
+{
+    BIDError err;
+    struct BIDECDHKeyPool *pool;
+
+    *pcKeys = 0;
+    *pcMaxKeys = BID_ECDH_KEY_POOL_SIZE;
+
+    err = _BIDGetECDHKeyPool(context, ecDhParams, &pool);
+    if (err != BID_S_OK)
+        return err;
+
+    BID_MUTEX_LOCK(&_BIDECDHKeyPool.Mutex);
+    *pcKeys = pool->cKeys;
+    BID_MUTEX_UNLOCK(&_BIDECDHKeyPool.Mutex);
+
+    return BID_S_OK;
 }
 
 BIDError
@@ -1790,14 +2721,9 @@ _BIDGenerateECDHKey(
     err = _BIDAllocJsonObject(context, &ecDhKey);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDMakeECKeyByCurve(context, ecDhParams, &ec);
+    err = _BIDAcquireECDHKey(context, ecDhParams, &ec);
     BID_BAIL_ON_ERROR(err);
 
-    if (!EC_KEY_generate_key(ec)) {
-        err = BID_S_DH_KEY_GENERATION_FAILURE;
-        goto cleanup;
-    }
-
     err = _BIDJsonObjectSet(context, ecDhKey, "params", ecDhParams, BID_JSON_FLAG_REQUIRED);
     BID_BAIL_ON_ERROR(err);
 
@@ -39,15 +39,105 @@
 
 #include "bid_private.h"
 
+#include <stddef.h>
 #include <sys/time.h>
+#include <unistd.h>
+
+static pthread_key_t _BIDJsonErrorKey;
+static int _BIDJsonErrorKeyValid;
+static pthread_key_t _BIDThreadArenaKey;
+static int _BIDThreadArenaKeyValid;
 
 static void
 _BIDLibraryInit(void) __attribute__((__constructor__));
 
+static void
+_BIDWorkerPoolInit(void);
+
 static void
 _BIDLibraryInit(void)
 {
     json_set_alloc_funcs(BIDMalloc, BIDFree);
+    _BIDWorkerPoolInit();
+    _BIDAuthorityInit();
+    _BIDReauthInit();
+    _BIDJsonErrorKeyValid = (pthread_key_create(&_BIDJsonErrorKey, BIDFree) == 0);
+    _BIDThreadArenaKeyValid = (pthread_key_create(&_BIDThreadArenaKey, BIDFree) == 0);
+}
+
+static void
+_BIDLibraryFini(void) __attribute__((__destructor__));
+
+static void
+_BIDLibraryFini(void)
+{
+    _BIDShutdownWorkers();
+}
+
+/*
+ * Per-thread JSON error information for contexts that are shared
+ * between threads (BID_CONTEXT_THREAD_SAFE). May return NULL, which
+ * the JSON library treats as not wanting error information.
+ */
+json_error_t *
+_BIDGetThreadJsonError(void)
+{
+    json_error_t *error;
+
+    if (!_BIDJsonErrorKeyValid)
+        return NULL;
+
+    error = pthread_getspecific(_BIDJsonErrorKey);
+    if (error == NULL) {
+        error = BIDCalloc(1, sizeof(*error));
+        if (error == NULL)
+            return NULL;
+
+        if (pthread_setspecific(_BIDJsonErrorKey, error) != 0) {
+            BIDFree(error);
+            return NULL;
+        }
+    }
+
+    return error;
+}
+
+struct BIDThreadArenaDesc {
+    size_t Size;
+    unsigned char Data[1];
+};
+
+void *
+_BIDGetThreadArena(size_t cb)
+{
+    struct BIDThreadArenaDesc *arena;
+
+    if (!_BIDThreadArenaKeyValid || cb > BID_THREAD_ARENA_MAX)
+        return NULL;
+
+    arena = pthread_getspecific(_BIDThreadArenaKey);
+    if (arena == NULL || arena->Size < cb) {
+        size_t size = 1024;
+
+        while (size < cb)
+            size *= 2;
+
+        BIDFree(arena);
+        pthread_setspecific(_BIDThreadArenaKey, NULL);
+
+        arena = BIDMalloc(offsetof(struct BIDThreadArenaDesc, Data) + size);
+        if (arena == NULL)
+            return NULL;
+
+        arena->Size = size;
+
+        if (pthread_setspecific(_BIDThreadArenaKey, arena) != 0) {
+            BIDFree(arena);
+            return NULL;
+        }
+    }
+
+    return arena->Data;
 }
 
 BIDError
@@ -68,6 +158,333 @@ _BIDGetCurrentJsonTimestamp(
     return (*pTs == NULL) ? BID_S_NO_MEMORY : BID_S_OK;
 }
 
+/*
+ * Process-wide pool of worker threads for _BIDParallelFor() and
+ * _BIDRunAsync(). Workers are started on demand, up to
+ * BID_MAX_WORKER_THREADS, and are joined when the library is unloaded;
+ * work that has not started by then is discarded.
+ */
+struct BIDWorkGroupDesc {
+    size_t cPending;                    /* items queued or running */
+};
+
+struct BIDWorkItemDesc {
+    struct BIDWorkItemDesc *Next;
+    void (*Fn)(void *);
+    void *Arg;
+    struct BIDWorkGroupDesc *Group;     /* if NULL, freed once run */
+};
+
+static struct {
+    BID_MUTEX Mutex;
+    BID_COND WorkAvailable;
+    BID_COND WorkDone;
+    struct BIDWorkItemDesc *Head;
+    struct BIDWorkItemDesc **pTail;
+    size_t cQueued;
+    size_t cIdle;
+    size_t cThreads;
+    size_t cCpus;
+    int bShutdown;
+    pthread_t Threads[BID_MAX_WORKER_THREADS];
+} _BIDWorkerPool;
+
+/*
+ * The following functions must be called with _BIDWorkerPool.Mutex held.
+ */
+static struct BIDWorkItemDesc *
+_BIDDequeueWorkItem(void)
+{
+    struct BIDWorkItemDesc *item = _BIDWorkerPool.Head;
+
+    _BIDWorkerPool.Head = item->Next;
+    if (_BIDWorkerPool.Head == NULL)
+        _BIDWorkerPool.pTail = &_BIDWorkerPool.Head;
+    _BIDWorkerPool.cQueued--;
+
+    return item;
+}
+
+static void
+_BIDDiscardWorkItems(void)
+{
+    struct BIDWorkItemDesc *item;
+
+    while (_BIDWorkerPool.Head != NULL) {
+        item = _BIDDequeueWorkItem();
+        if (item->Group == NULL)
+            BIDFree(item);
+        else
+            item->Group->cPending--;
+    }
+
+    BID_COND_BROADCAST(&_BIDWorkerPool.WorkDone);
+}
+
+static void *
+_BIDWorkerThread(void *arg BID_UNUSED)
+{
+    struct BIDWorkItemDesc *item;
+
+    BID_MUTEX_LOCK(&_BIDWorkerPool.Mutex);
+
+    for (;;) {
+        while (_BIDWorkerPool.Head == NULL && !_BIDWorkerPool.bShutdown) {
+            _BIDWorkerPool.cIdle++;
+            BID_COND_WAIT(&_BIDWorkerPool.WorkAvailable, &_BIDWorkerPool.Mutex);
+            _BIDWorkerPool.cIdle--;
+        }
+
+        if (_BIDWorkerPool.bShutdown)
+            break;
+
+        item = _BIDDequeueWorkItem();
+
+        BID_MUTEX_UNLOCK(&_BIDWorkerPool.Mutex);
+
+        item->Fn(item->Arg);
+
+        BID_MUTEX_LOCK(&_BIDWorkerPool.Mutex);
+
+        if (item->Group == NULL)
+            BIDFree(item);
+        else if (--item->Group->cPending == 0)
+            BID_COND_BROADCAST(&_BIDWorkerPool.WorkDone);
+    }
+
+    BID_MUTEX_UNLOCK(&_BIDWorkerPool.Mutex);
+
+    return NULL;
+}
+
+static BIDError
+_BIDQueueWorkItem(struct BIDWorkItemDesc *item)
+{
+    pthread_t *thread;
+
+    if (_BIDWorkerPool.bShutdown)
+        return BID_S_NO_MEMORY;
+
+    /* start a worker unless an idle one will pick this item up */
+    if (_BIDWorkerPool.cQueued >= _BIDWorkerPool.cIdle &&
+        _BIDWorkerPool.cThreads < BID_MAX_WORKER_THREADS) {
+        thread = &_BIDWorkerPool.Threads[_BIDWorkerPool.cThreads];
+        if (pthread_create(thread, NULL, _BIDWorkerThread, NULL) == 0)
+            _BIDWorkerPool.cThreads++;
+    }
+
+    if (_BIDWorkerPool.cThreads == 0)
+        return BID_S_NO_MEMORY;
+
+    item->Next = NULL;
+    *_BIDWorkerPool.pTail = item;
+    _BIDWorkerPool.pTail = &item->Next;
+    _BIDWorkerPool.cQueued++;
+
+    BID_COND_BROADCAST(&_BIDWorkerPool.WorkAvailable);
+
+    return BID_S_OK;
+}
+
+/*
+ * Remove the items of group that no worker has started, and wait for
+ * the rest to complete.
+ */
+static void
+_BIDWaitWorkGroup(struct BIDWorkGroupDesc *group)
+{
+    struct BIDWorkItemDesc **pItem = &_BIDWorkerPool.Head;
+
+    while (*pItem != NULL) {
+        if ((*pItem)->Group == group) {
+            *pItem = (*pItem)->Next;
+            _BIDWorkerPool.cQueued--;
+            group->cPending--;
+        } else {
+            pItem = &(*pItem)->Next;
+        }
+    }
+    _BIDWorkerPool.pTail = pItem;
+
+    while (group->cPending != 0)
+        BID_COND_WAIT(&_BIDWorkerPool.WorkDone, &_BIDWorkerPool.Mutex);
+}
+
+static void
+_BIDWorkerPoolAtForkPrepare(void)
+{
+    BID_MUTEX_LOCK(&_BIDWorkerPool.Mutex);
+}
+
+static void
+_BIDWorkerPoolAtForkParent(void)
+{
+    BID_MUTEX_UNLOCK(&_BIDWorkerPool.Mutex);
+}
+
+/*
+ * Workers do not survive fork(), and queued work belongs to the parent.
+ */
+static void
+_BIDWorkerPoolAtForkChild(void)
+{
+    _BIDDiscardWorkItems();
+    _BIDWorkerPool.cIdle = 0;
+    _BIDWorkerPool.cThreads = 0;
+
+    BID_MUTEX_UNLOCK(&_BIDWorkerPool.Mutex);
+}
+
+static void
+_BIDWorkerPoolInit(void)
+{
+    long nCpus;
+
+    BID_MUTEX_INIT(&_BIDWorkerPool.Mutex);
+    BID_COND_INIT(&_BIDWorkerPool.WorkAvailable);
+    BID_COND_INIT(&_BIDWorkerPool.WorkDone);
+    _BIDWorkerPool.pTail = &_BIDWorkerPool.Head;
+
+    nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    _BIDWorkerPool.cCpus = nCpus > 1 ? (size_t)nCpus : 1;
+    if (_BIDWorkerPool.cCpus > BID_MAX_WORKER_THREADS)
+        _BIDWorkerPool.cCpus = BID_MAX_WORKER_THREADS;
+
+    pthread_atfork(_BIDWorkerPoolAtForkPrepare, _BIDWorkerPoolAtForkParent,
+                   _BIDWorkerPoolAtForkChild);
+}
+
+void
+_BIDShutdownWorkers(void)
+{
+    pthread_t threads[BID_MAX_WORKER_THREADS];
+    size_t cThreads, i;
+
+    BID_MUTEX_LOCK(&_BIDWorkerPool.Mutex);
+
+    _BIDWorkerPool.bShutdown = 1;
+    BID_COND_BROADCAST(&_BIDWorkerPool.WorkAvailable);
+
+    cThreads = _BIDWorkerPool.cThreads;
+    memcpy(threads, _BIDWorkerPool.Threads, cThreads * sizeof(pthread_t));
+    _BIDWorkerPool.cThreads = 0;
+
+    BID_MUTEX_UNLOCK(&_BIDWorkerPool.Mutex);
+
+    for (i = 0; i < cThreads; i++) {
+        if (!pthread_equal(threads[i], pthread_self()))
+            pthread_join(threads[i], NULL);
+    }
+
+    BID_MUTEX_LOCK(&_BIDWorkerPool.Mutex);
+    _BIDDiscardWorkItems();
+    BID_MUTEX_UNLOCK(&_BIDWorkerPool.Mutex);
+}
+
+struct BIDParallelForArgs {
+    size_t cItems;
+    volatile long Next;
+    void (*Fn)(void *, size_t);
+    void *Arg;
+};
+
+static void
+_BIDParallelForWork(void *arg)
+{
+    struct BIDParallelForArgs *args = (struct BIDParallelForArgs *)arg;
+    size_t i;
+
+    for (;;) {
+        i = (size_t)(BID_ATOMIC_INCREMENT(&args->Next) - 1);
+        if (i >= args->cItems)
+            break;
+
+        args->Fn(args->Arg, i);
+    }
+}
+
+/*
+ * The calling thread is also a worker, and never waits for a helper
+ * that has not started, so a full or busy pool (or a call made from
+ * a worker) only reduces the parallelism.
+ */
+BIDError
+_BIDParallelFor(
+    BIDContext context BID_UNUSED,
+    size_t cItems,
+    void (*fn)(void *, size_t),
+    void *arg)
+{
+    struct BIDParallelForArgs args;
+    struct BIDWorkGroupDesc group;
+    struct BIDWorkItemDesc helpers[BID_MAX_WORKER_THREADS - 1];
+    size_t cHelpers, i;
+
+    args.cItems = cItems;
+    args.Next = 0;
+    args.Fn = fn;
+    args.Arg = arg;
+
+    group.cPending = 0;
+
+    cHelpers = _BIDWorkerPool.cCpus - 1;
+    if (cHelpers >= cItems)
+        cHelpers = cItems != 0 ? cItems - 1 : 0;
+
+    BID_MUTEX_LOCK(&_BIDWorkerPool.Mutex);
+
+    for (i = 0; i < cHelpers; i++) {
+        helpers[i].Fn = _BIDParallelForWork;
+        helpers[i].Arg = &args;
+        helpers[i].Group = &group;
+
+        if (_BIDQueueWorkItem(&helpers[i]) != BID_S_OK)
+            break;
+        group.cPending++;
+    }
+
+    BID_MUTEX_UNLOCK(&_BIDWorkerPool.Mutex);
+
+    _BIDParallelForWork(&args);
+
+    BID_MUTEX_LOCK(&_BIDWorkerPool.Mutex);
+    _BIDWaitWorkGroup(&group);
+    BID_MUTEX_UNLOCK(&_BIDWorkerPool.Mutex);
+
+    return BID_S_OK;
+}
+
+BIDError
+_BIDRunAsync(
+    BIDContext context BID_UNUSED,
+    void (*fn)(void *),
+    void *arg)
+{
+    BIDError err;
+    struct BIDWorkItemDesc *item;
+
+    item = BIDCalloc(1, sizeof(*item));
+    if (item == NULL)
+        return BID_S_NO_MEMORY;
+
+    item->Fn = fn;
+    item->Arg = arg;
+
+    BID_MUTEX_LOCK(&_BIDWorkerPool.Mutex);
+
+    if (_BIDWorkerPool.cQueued >= BID_MAX_QUEUED_WORK)
+        err = BID_S_WORK_QUEUE_FULL;
+    else
+        err = _BIDQueueWorkItem(item);
+
+    BID_MUTEX_UNLOCK(&_BIDWorkerPool.Mutex);
+
+    if (err != BID_S_OK)
+        BIDFree(item);
+
+    return err;
+}
+
 #ifdef GSSBID_DEBUG
 void
 _BIDOutputDebugJson(json_t *j)
@@ -132,6 +132,16 @@ typedef struct BIDSecretHandleDesc *BIDSecretHandle;
 struct BIDModalSessionDesc;
 typedef struct BIDModalSessionDesc *BIDModalSession;
 
+/*
+ * An expired authority document may still be used for up to
+ * BID_AUTHORITY_STALE_WINDOW seconds (unless configured otherwise)
+ * while it is refreshed in the background. Failed retrievals are remembered in the authority cache
+ * for an interval, in seconds, that doubles with each consecutive failure.
+ */
+#define BID_AUTHORITY_STALE_WINDOW      (60 * 60)
+#define BID_AUTHORITY_RETRY_MIN         30
+#define BID_AUTHORITY_RETRY_MAX         (60 * 30)
+
 BIDError
 _BIDAcquireDefaultAuthorityCache(
     BIDContext context);
@@ -161,6 +171,9 @@ _BIDIssuerIsAuthoritative(
     const char *szIssuer,
     time_t verificationTime);
 
+void
+_BIDAuthorityInit(void);
+
 /*
  * bid_base64.c
  */
@@ -177,6 +190,9 @@ _BIDBase64Encode(const unsigned char *data, size_t size, uint32_t encoding, char
 BIDError
 _BIDBase64UrlDecode(const char *str, unsigned char **pData, size_t *cbData);
 
+BIDError
+_BIDBase64UrlDecodeLength(const char *str, size_t cchStr, unsigned char **pData, size_t *cbData);
+
 /*
  * bid_cache.c
  */
@@ -198,9 +214,15 @@ struct BIDCacheOps {
     BIDError (*GetObject)(struct BIDCacheOps *, BIDContext, void *, const char *key, json_t **val);
     BIDError (*SetObject)(struct BIDCacheOps *, BIDContext, void *, const char *key, json_t *val);
     BIDError (*RemoveObject)(struct BIDCacheOps *, BIDContext, void *, const char *key);
+    /* atomically set key only if it is not present, otherwise BID_S_CACHE_KEY_EXISTS */
+    BIDError (*AddObject)(struct BIDCacheOps *, BIDContext, void *, const char *key, json_t *val);
 
     BIDError (*FirstObject)(struct BIDCacheOps *, BIDContext, void *, void **, const char **, json_t **val);
     BIDError (*NextObject)(struct BIDCacheOps *, BIDContext, void *, void **, const char **, json_t **val);
+
+    /* optional, remove all entries matching predicate under one lock */
+    BIDError (*PurgeObjects)(struct BIDCacheOps *, BIDContext, void *,
+                             int (*predicate)(BIDContext, const char *, json_t *, void *), void *);
 };
 
 void
@@ -213,6 +235,11 @@ _BIDAcquireCache(
     uint32_t ulFlags,
     BIDCache *pCache);
 
+BIDError
+_BIDRetainCache(
+    BIDContext context,
+    BIDCache cache);
+
 BIDError
 _BIDReleaseCache(
     BIDContext context,
@@ -264,6 +291,13 @@ _BIDRemoveCacheObject(
     BIDCache cache,
     const char *key);
 
+BIDError
+_BIDAddCacheObject(
+    BIDContext context,
+    BIDCache cache,
+    const char *key,
+    json_t *value);
+
 BIDError
 _BIDGetCacheLastChangedTime(
     BIDContext context,
@@ -297,6 +331,14 @@ _BIDCacheIteratorNext(
     const char **pKey,
     json_t **pValue);
 
+BIDError
+_BIDCacheFilterObjects(
+    BIDContext context,
+    json_t *data,
+    int (*predicate)(BIDContext, const char *, json_t *, void *),
+    void *predicateData,
+    json_t **pFiltered);
+
 BIDError
 _BIDPurgeCache(
     BIDContext context,
@@ -311,6 +353,16 @@ _BIDPerformCacheObjects(
     BIDError (*selector)(BIDContext, BIDCache, const char *, json_t *, void *data),
     void *data);
 
+#define BID_CACHE_EVICT_BATCH                   4
+
+BIDError
+_BIDCheckCacheCapacity(
+    BIDContext context,
+    BIDCache cache,
+    time_t (*getExpiryTime)(BIDContext, json_t *),
+    size_t cMaxEntries,
+    time_t currentTime);
+
 #if __BLOCKS__
 BIDError
 _BIDPerformCacheObjectsWithBlock(
@@ -362,14 +414,31 @@ struct BIDContextDesc {
     uint32_t ECDHCurve;
     uint32_t TicketLifetime;
     uint32_t RenewLifetime;
+    uint32_t ReplayCacheMaxEntries;
+    uint32_t AuthorityStaleWindow;
     BIDCache Config;
     void *ParentWindow;
+    struct BIDVerifyStatsDesc *VerifyStats;
+};
+
+/*
+ * Rejection counts, shared by a context and the contexts cloned from it.
+ */
+struct BIDVerifyStatsDesc {
+    volatile long References;
+    volatile long Rejections[BID_VERIFY_STAGE_MAX];
 };
 
 void
 _BIDFinalizeContext(
     BIDContext context);
 
+/*
+ * Error information for the current JSON decode on this context.
+ */
+#define BID_JSON_ERROR(context)     (((context)->ContextOptions & BID_CONTEXT_THREAD_SAFE) ? \
+                                     _BIDGetThreadJsonError() : &(context)->JsonError)
+
 /*
  * bid_crypto.c
  */
@@ -401,7 +470,7 @@ _BIDDeriveSessionSubkey(
     BIDContext context,
     BIDIdentity identity,
     const char *szSalt,
-    BIDJWK *pDerivedKey);
+    BIDSecretHandle *pSubkey);
 
 BIDError
 _BIDImportSecretKey(
@@ -409,6 +478,12 @@ _BIDImportSecretKey(
     BIDJWK jwk,
     BIDSecretHandle *pSecretHandle);
 
+BIDError
+_BIDExportSecretKey(
+    BIDContext context,
+    BIDSecretHandle secretHandle,
+    BIDJWK *pJwk);
+
 int
 _BIDIsLegacyJWK(BIDContext context, BIDJWK jwt);
 
@@ -532,6 +607,9 @@ _BIDValidateSubject(
 /*
  * bid_jwt.c
  */
+#define BID_JWT_FLAG_BORROW_DATA    0x00000001  /* EncData is owned by the caller */
+#define BID_JWT_FLAG_LAZY_PAYLOAD   0x00000002  /* Payload is decoded on demand */
+
 struct BIDJWTDesc {
     char *EncData;
     size_t EncDataLength;
@@ -539,6 +617,29 @@ struct BIDJWTDesc {
     json_t *Payload;
     unsigned char *Signature;
     size_t SignatureLength;
+    const char *EncPayload;                     /* undecoded payload, if lazy */
+    size_t EncPayloadLength;
+    uint32_t Flags;
+};
+
+#define BID_JWT_CLAIM_AUD           0x00000001
+#define BID_JWT_CLAIM_EXP           0x00000002
+#define BID_JWT_CLAIM_IAT           0x00000004
+#define BID_JWT_CLAIM_NBF           0x00000008
+#define BID_JWT_CLAIM_TIMES         (BID_JWT_CLAIM_EXP | BID_JWT_CLAIM_IAT | BID_JWT_CLAIM_NBF)
+#define BID_JWT_CLAIM_ALL           (BID_JWT_CLAIM_AUD | BID_JWT_CLAIM_TIMES)
+
+/*
+ * The claims needed to reject an assertion before its payload is parsed.
+ * Claims in Opaque are present but can only be interpreted by a full parse.
+ */
+struct BIDJWTClaimsDesc {
+    uint32_t Present;
+    uint32_t Opaque;
+    const char *Audience;                       /* in thread arena */
+    time_t IssuedAt;
+    time_t NotBefore;
+    time_t Expiry;
 };
 
 BIDError
@@ -546,6 +647,7 @@ _BIDMakeSignature(
     BIDContext context,
     BIDJWT jwt,
     BIDJWKSet keyset,
+    BIDSecretHandle secretHandle,
     json_t *x509CertChain,
     char **pszJwt,
     size_t *pcchJwt);
@@ -556,6 +658,12 @@ _BIDVerifySignature(
     BIDJWT jwt,
     BIDJWKSet keyset);
 
+BIDError
+_BIDVerifySecretKeySignature(
+    BIDContext context,
+    BIDJWT jwt,
+    BIDSecretHandle secretHandle);
+
 BIDError
 _BIDReleaseJWTInternal(
     BIDContext context BID_UNUSED,
@@ -573,12 +681,43 @@ _BIDParseJWT(
     const char *szJwt,
     BIDJWT *pJwt);
 
+BIDError
+_BIDParseJWTInternal(
+    BIDContext context,
+    const char *szJwt,
+    size_t cchJwt,
+    uint32_t ulFlags,
+    BIDJWT *pJwt);
+
+BIDError
+_BIDDecodeJWTPayload(
+    BIDContext context,
+    BIDJWT jwt);
+
+BIDError
+_BIDGetJWTClaims(
+    BIDContext context,
+    BIDJWT jwt,
+    struct BIDJWTClaimsDesc *claims);
+
 /*
- * bid_fcache.c
+ * bid_lcache.c
+ */
+
+extern struct BIDCacheOps _BIDLogCache;
+
+/*
+ * bid_mcache.c
  */
 
 extern struct BIDCacheOps _BIDMemoryCache;
 
+/*
+ * bid_mmcache.c
+ */
+
+extern struct BIDCacheOps _BIDMappedCache;
+
 /*
  * bid_openssl.c
  */
@@ -594,12 +733,47 @@ _BIDImportSecretKeyData(
     size_t cbSecret,
     BIDSecretHandle *pSecretHandle);
 
+BIDError
+_BIDExportSecretKeyData(
+    BIDContext context,
+    BIDSecretHandle secretHandle,
+    unsigned char **ppbSecret,
+    size_t *pcbSecret);
+
+BIDError
+_BIDSecretKeyHMAC(
+    BIDContext context,
+    BIDSecretHandle secretHandle,
+    const unsigned char *pbData,
+    size_t cbData,
+    unsigned char *pbHmac,
+    size_t *pcbHmac);
+
+BIDError
+_BIDGetKeyCacheStatistics(
+    BIDContext context,
+    uint64_t *pHits,
+    uint64_t *pMisses);
+
+BIDError
+_BIDGetECDHKeyPoolStatistics(
+    BIDContext context,
+    json_t *ecDhParams,
+    size_t *pcKeys,
+    size_t *pcMaxKeys);
+
 /*
  * To implement a new crypto provider, you need to replace the following
  * dispatch table and functions.
  */
 extern struct BIDJWTAlgorithmDesc _BIDJWTAlgorithms[];
 
+/*
+ * Prepare the provider for a context that may be shared between threads.
+ */
+void
+_BIDCryptoThreadInit(void);
+
 BIDError
 _BIDMakeDigestInternal(
     BIDContext context,
@@ -697,6 +871,14 @@ _BIDGenerateECDHKey(
 #define BID_MUTEX_DESTROY(m)         pthread_mutex_destroy((m))
 #define BID_MUTEX_LOCK(m)            pthread_mutex_lock((m))
 #define BID_MUTEX_UNLOCK(m)          pthread_mutex_unlock((m))
+
+#define BID_ATOMIC_INCREMENT(p)      __sync_add_and_fetch((p), 1)
+#define BID_ATOMIC_DECREMENT(p)      __sync_sub_and_fetch((p), 1)
+
+#define BID_COND                     pthread_cond_t
+#define BID_COND_INIT(c)             pthread_cond_init((c), NULL)
+#define BID_COND_WAIT(c, m)          pthread_cond_wait((c), (m))
+#define BID_COND_BROADCAST(c)        pthread_cond_broadcast((c))
 #endif /* !WIN32 */
 
 BIDError
@@ -704,6 +886,51 @@ _BIDGetCurrentJsonTimestamp(
     BIDContext context,
     json_t **pTs);
 
+json_error_t *
+_BIDGetThreadJsonError(void);
+
+/*
+ * Per-thread scratch buffer of at least cb bytes, valid until the next
+ * call on the same thread. Returns NULL if cb is too large, in which case
+ * the caller should allocate.
+ */
+#define BID_THREAD_ARENA_MAX        (64 * 1024)
+
+void *
+_BIDGetThreadArena(size_t cb);
+
+/*
+ * Call fn(arg, i) for each i in [0, cItems) on the calling thread and
+ * the process-wide worker pool, returning when all calls have completed.
+ */
+#define BID_MAX_WORKER_THREADS      16
+
+BIDError
+_BIDParallelFor(
+    BIDContext context,
+    size_t cItems,
+    void (*fn)(void *, size_t),
+    void *arg);
+
+/*
+ * Queue fn(arg) to run on a worker thread. At most BID_MAX_QUEUED_WORK
+ * calls may be waiting for a worker; beyond that BID_S_WORK_QUEUE_FULL
+ * is returned and fn is not called.
+ */
+#define BID_MAX_QUEUED_WORK         64
+
+BIDError
+_BIDRunAsync(
+    BIDContext context,
+    void (*fn)(void *),
+    void *arg);
+
+/*
+ * Stop and join the worker pool; called when the library is unloaded.
+ */
+void
+_BIDShutdownWorkers(void);
+
 #ifdef GSSBID_DEBUG
 void
 _BIDOutputDebugJson(json_t *j);
@@ -717,6 +944,22 @@ _BIDOutputDebugJson(json_t *j);
 #define BID_TICKET_FLAG_RENEWED                 0x1
 #define BID_TICKET_FLAG_MUTUAL_AUTH             0x2
 
+BIDError
+_BIDMakeTicketCacheKey(
+    BIDContext context,
+    const char *szCurve,
+    const char *szAudienceOrSpn,
+    const char *szSubject, /* optional */
+    char **pszCacheKey);
+
+BIDError
+_BIDFindTicketInCache(
+    BIDContext context,
+    BIDTicketCache ticketCache,
+    const char *szAudienceOrSpn,
+    const char *szIdentityName, /* optional */
+    json_t **pCred);
+
 BIDError
 _BIDStoreTicketInCache(
     BIDContext context,
@@ -746,9 +989,36 @@ _BIDVerifyReauthAssertion(
     BIDBackedAssertion assertion,
     time_t verificationTime,
     BIDIdentity *pVerifiedIdentity,
-    BIDJWK *pVerifierCred,
     uint32_t *pulRetFlags);
 
+BIDError
+_BIDCacheReauthTicket(
+    BIDContext context,
+    BIDReplayCache replayCache,
+    const char *szTicket,
+    json_t *cred);
+
+void
+_BIDReauthInit(void);
+
+void
+_BIDInvalidateReauthTicket(
+    BIDContext context,
+    BIDCache cache,
+    const char *szTicket);
+
+void
+_BIDNoteReauthTicketCacheChange(
+    BIDContext context,
+    BIDCache cache,
+    time_t previousChangedTime);
+
+BIDError
+_BIDGetReauthTicketStatistics(
+    BIDContext context,
+    uint64_t *pHits,
+    uint64_t *pMisses);
+
 BIDError
 _BIDAcquireDefaultTicketCache(
     BIDContext context);
@@ -899,11 +1169,19 @@ _BIDDecodeJson(
     const char *encodedJson,
     json_t **pjData);
 
+BIDError
+_BIDDecodeJsonLength(
+    BIDContext context,
+    const char *encodedJson,
+    size_t cchEncodedJson,
+    json_t **pjData);
+
 BIDError
 _BIDPackBackedAssertion(
     BIDContext context,
     BIDBackedAssertion assertion,
     BIDJWKSet keyset,
+    BIDSecretHandle secretHandle,
     json_t *certChain,
     char **pEncodedJson);
 
@@ -913,17 +1191,30 @@ _BIDUnpackBackedAssertion(
     const char *encodedJson,
     BIDBackedAssertion *pAssertion);
 
+BIDError
+_BIDUnpackBackedAssertionInternal(
+    BIDContext context,
+    const char *encodedJson,
+    uint32_t ulFlags,
+    BIDBackedAssertion *pAssertion);
+
 BIDError
 _BIDReleaseBackedAssertion(
     BIDContext context,
     BIDBackedAssertion assertion);
 
+/*
+ * If cacheMetadata is non-NULL, any "last-modified" and "etag" values it
+ * contains make the request conditional, and are updated from the response.
+ * If the document has not been modified, BID_S_DOCUMENT_NOT_MODIFIED is
+ * returned along with the new expiry time.
+ */
 BIDError
 _BIDRetrieveDocument(
     BIDContext context,
     const char *szHostname,
     const char *szRelativeUrl,
-    time_t tIfModifiedSince,
+    json_t *cacheMetadata,
     json_t **pJsonDoc,
     time_t *pExpiryTime);
 
@@ -994,8 +1285,7 @@ BIDError
 _BIDCheckReplayCache(
     BIDContext context,
     BIDReplayCache replayCache,
-    const char *szAssertion,
-    time_t verificationTime);
+    const char *szAssertion);
 
 BIDError
 _BIDUpdateReplayCache(
@@ -1004,7 +1294,8 @@ _BIDUpdateReplayCache(
     BIDIdentity identity,
     const char *pAssertion,
     time_t verificationTime,
-    uint32_t ulFlags);
+    uint32_t ulFlags,
+    int bCheckReplay);
 
 BIDError
 _BIDPurgeReplayCache(
@@ -1094,9 +1385,26 @@ struct BIDIdentityDesc {
 /* Private input flags (ulReqFlags) */
 #define BID_VERIFY_FLAG_RP                      0x00010000
 #define BID_VERIFY_FLAG_NO_REPLAY_CACHE         0x00020000 /* temporarily disable replay cache */
+#define BID_VERIFY_FLAG_CLAIMS_VERIFIED         0x00040000 /* _BIDVerifyClaims already called */
 
 /* Private output flags (ulRetFlags) */
 
+BIDError
+_BIDVerifyClaims(
+    BIDContext context,
+    BIDReplayCache replayCache,
+    BIDBackedAssertion backedAssertion,
+    const char *szAudience,
+    const unsigned char *pbChannelBindings,
+    size_t cbChannelBindings,
+    time_t verificationTime,
+    uint32_t ulReqFlags);
+
+void
+_BIDCountVerifyRejection(
+    BIDContext context,
+    BIDVerifyStage stage);
+
 BIDError
 _BIDVerifyLocal(
     BIDContext context,
@@ -1108,7 +1416,7 @@ _BIDVerifyLocal(
     size_t cbChannelBindings,
     time_t verificationTime,
     uint32_t ulReqFlags,
-    BIDJWK optionalVerifyCred,
+    BIDSecretHandle optionalVerifySecret,
     json_t *optionalCertAnchors,
     BIDIdentity *pVerifiedIdentity,
     uint32_t *pulRetFlags);
@@ -1119,6 +1427,13 @@ _BIDValidateExpiry(
     time_t verificationTime,
     json_t *assertion);
 
+BIDError
+_BIDPrefetchCertAuthorities(
+    BIDContext context,
+    BIDBackedAssertion backedAssertion,
+    time_t verificationTime,
+    uint32_t ulReqFlags);
+
 /*
  * bid_webkit.c
  */
@@ -1149,6 +1464,14 @@ _BIDRunModalSession(
 #define BID_MUTEX_LOCK(m)            EnterCriticalSection((m))
 #define BID_MUTEX_UNLOCK(m)          LeaveCriticalSection((m))
 
+#define BID_ATOMIC_INCREMENT(p)      InterlockedIncrement((p))
+#define BID_ATOMIC_DECREMENT(p)      InterlockedDecrement((p))
+
+#define BID_COND                     CONDITION_VARIABLE
+#define BID_COND_INIT(c)             (InitializeConditionVariable((c)), 0)
+#define BID_COND_WAIT(c, m)          SleepConditionVariableCS((c), (m), INFINITE)
+#define BID_COND_BROADCAST(c)        WakeAllConditionVariable((c))
+
 BIDError
 _BIDTimeToSecondsSince1970(
     BIDContext context BID_UNUSED,
@@ -45,41 +45,62 @@ _BIDAcquireDefaultReplayCache(BIDContext context)
     return _BIDAcquireCacheForUser(context, "browserid.replay", &context->ReplayCache);
 }
 
+/*
+ * If the cache entry is being used for re-authentication (it has a key)
+ * then it expires with the ticket. Otherwise, it expires with the assertion.
+ */
+static time_t
+_BIDGetReplayCacheEntryExpiryTime(
+    BIDContext context,
+    json_t *j)
+{
+    time_t expiryTime = 0;
+
+    if (json_object_get(j, "ark") != NULL)
+        _BIDGetJsonTimestampValue(context, j, "exp", &expiryTime);
+    else
+        _BIDGetJsonTimestampValue(context, j, "a-exp", &expiryTime);
+
+    return expiryTime;
+}
+
+/*
+ * Look for an assertion in the replay cache before any effort is spent
+ * verifying it. This is only an optimisation: the authoritative check is
+ * made by _BIDUpdateReplayCache(), so cache errors are ignored here.
+ */
 BIDError
 _BIDCheckReplayCache(
     BIDContext context,
     BIDReplayCache replayCache,
-    const char *szAssertion,
-    time_t verificationTime)
+    const char *szAssertion)
 {
     BIDError err;
-    json_t *rdata = NULL;
     json_t *digest = NULL;
-    time_t tsHash, expHash;
-
-    err = _BIDDigestAssertion(context, szAssertion, &digest);
-    BID_BAIL_ON_ERROR(err);
+    json_t *rdata = NULL;
 
     if (replayCache == BID_C_NO_REPLAY_CACHE)
         replayCache = context->ReplayCache;
 
-    err = _BIDGetCacheObject(context, replayCache, json_string_value(digest), &rdata);
-    if (err == BID_S_OK) {
-        _BIDGetJsonTimestampValue(context, rdata, "iat", &tsHash);
-        _BIDGetJsonTimestampValue(context, rdata, "exp", &expHash);
+    err = _BIDDigestAssertion(context, szAssertion, &digest);
+    BID_BAIL_ON_ERROR(err);
 
-        if (verificationTime < expHash)
-            err = BID_S_REPLAYED_ASSERTION;
-    } else
-        err = BID_S_OK;
+    if (_BIDGetCacheObject(context, replayCache, json_string_value(digest), &rdata) == BID_S_OK)
+        err = BID_S_REPLAYED_ASSERTION;
 
 cleanup:
-    json_decref(rdata);
     json_decref(digest);
+    json_decref(rdata);
 
     return err;
 }
 
+/*
+ * Record a verified assertion in the replay cache. If bCheckReplay is set,
+ * the entry is added atomically and BID_S_REPLAYED_ASSERTION is returned
+ * if the assertion was already present, so that detecting and recording
+ * a replay is a single cache operation.
+ */
 BIDError
 _BIDUpdateReplayCache(
     BIDContext context,
@@ -87,16 +108,19 @@ _BIDUpdateReplayCache(
     BIDIdentity identity,
     const char *szAssertion,
     time_t verificationTime,
-    uint32_t ulFlags)
+    uint32_t ulFlags,
+    int bCheckReplay)
 {
     BIDError err;
     json_t *rdata = NULL;
+    BIDSecretHandle arkHandle = NULL;
     json_t *ark = NULL;
     json_t *tkt = NULL;
     json_t *digest = NULL;
     int bStoreReauthCreds = 0;
     uint32_t ticketLifetime = 0, renewLifetime = 0;
     time_t ticketExpiry = 0, renewExpiry = 0;
+    time_t lastChanged = 0;
 
     err = _BIDDigestAssertion(context, szAssertion, &digest);
     BID_BAIL_ON_ERROR(err);
@@ -137,7 +161,10 @@ _BIDUpdateReplayCache(
     if (bStoreReauthCreds) {
         uint32_t ulTicketFlags;
 
-        err = _BIDDeriveSessionSubkey(context, identity, "ARK", &ark);
+        err = _BIDDeriveSessionSubkey(context, identity, "ARK", &arkHandle);
+        BID_BAIL_ON_ERROR(err);
+
+        err = _BIDExportSecretKey(context, arkHandle, &ark);
         BID_BAIL_ON_ERROR(err);
 
         err = _BIDJsonObjectSet(context, rdata, "ark", ark, 0);
@@ -180,12 +207,43 @@ _BIDUpdateReplayCache(
     if (replayCache == BID_C_NO_REPLAY_CACHE)
         replayCache = context->ReplayCache;
 
-    err = _BIDSetCacheObject(context, replayCache, json_string_value(digest), rdata);
+    /* from before any eviction, see _BIDNoteReauthTicketCacheChange() */
+    if (context->ContextOptions & BID_CONTEXT_REAUTH)
+        _BIDGetCacheLastChangedTime(context, replayCache, &lastChanged);
+
+    /* a full cache must still report a replay as such */
+    if (bCheckReplay && context->ReplayCacheMaxEntries != 0 &&
+        _BIDGetCacheObject(context, replayCache, json_string_value(digest), NULL) == BID_S_OK) {
+        err = BID_S_REPLAYED_ASSERTION;
+        goto cleanup;
+    }
+
+    /* refuse rather than evict live entries, which would allow replays */
+    err = _BIDCheckCacheCapacity(context, replayCache, _BIDGetReplayCacheEntryExpiryTime,
+                                 context->ReplayCacheMaxEntries, verificationTime);
+    BID_BAIL_ON_ERROR(err);
+
+    if (bCheckReplay) {
+        err = _BIDAddCacheObject(context, replayCache, json_string_value(digest), rdata);
+        if (err == BID_S_CACHE_KEY_EXISTS)
+            err = BID_S_REPLAYED_ASSERTION;
+    } else {
+        err = _BIDSetCacheObject(context, replayCache, json_string_value(digest), rdata);
+    }
+
+    if (context->ContextOptions & BID_CONTEXT_REAUTH) {
+        if (!bCheckReplay)
+            _BIDInvalidateReauthTicket(context, replayCache, json_string_value(digest));
+        _BIDNoteReauthTicketCacheChange(context, replayCache, lastChanged);
+    }
     BID_BAIL_ON_ERROR(err);
 
     if (bStoreReauthCreds) {
         BID_ASSERT(identity->PrivateAttributes != NULL);
 
+        /* best effort, the replay cache entry is authoritative */
+        _BIDCacheReauthTicket(context, replayCache, json_string_value(digest), rdata);
+
         err = _BIDAllocJsonObject(context, &tkt);
         BID_BAIL_ON_ERROR(err);
 
@@ -202,6 +260,8 @@ _BIDUpdateReplayCache(
 cleanup:
     json_decref(digest);
     json_decref(ark);
+    if (arkHandle != NULL)
+        _BIDDestroySecret(context, arkHandle);
     json_decref(rdata);
     json_decref(tkt);
 
@@ -225,28 +285,34 @@ BIDReleaseReplayCache(
     return _BIDReleaseCache(context, cache);
 }
 
+struct BIDPurgeReplayCacheArgsDesc {
+    time_t CurrentTime;
+    json_t *Tickets;
+};
+
+/*
+ * Called with the cache locked by some backends, so the keys of purged
+ * tickets are collected to be invalidated afterwards.
+ */
 static int
 _BIDShouldPurgeReplayCacheEntryP(
     BIDContext context,
     BIDCache cache BID_UNUSED,
-    const char *szKey BID_UNUSED,
+    const char *szKey,
     json_t *j,
     void *data)
 {
-    time_t now = *((time_t *)data);
-    time_t expiryTime;
+    struct BIDPurgeReplayCacheArgsDesc *args = data;
+    time_t expiryTime = _BIDGetReplayCacheEntryExpiryTime(context, j);
+
+    /* the assertion may be accepted until the clock skew has passed */
+    if (expiryTime != 0 && args->CurrentTime - expiryTime <= context->Skew)
+        return 0;
 
-    /*
-     * If the cache entry is being used for re-authentication (it has a key)
-     * then purge only when the ticket expires. Otherwise, purge when the
-     * assertion expires.
-     */
     if (json_object_get(j, "ark") != NULL)
-        _BIDGetJsonTimestampValue(context, j, "exp", &expiryTime);
-    else
-        _BIDGetJsonTimestampValue(context, j, "a-exp", &expiryTime);
+        json_array_append_new(args->Tickets, json_string(szKey));
 
-    return (expiryTime == 0 || now >= expiryTime);
+    return 1;
 }
 
 BIDError
@@ -255,5 +321,26 @@ _BIDPurgeReplayCache(
     BIDCache cache,
     time_t currentTime)
 {
-    return _BIDPurgeCache(context, cache, _BIDShouldPurgeReplayCacheEntryP, &currentTime);
+    BIDError err;
+    struct BIDPurgeReplayCacheArgsDesc args;
+    time_t lastChanged = 0;
+    size_t i;
+
+    args.CurrentTime = currentTime;
+    args.Tickets = json_array();
+    if (args.Tickets == NULL)
+        return BID_S_NO_MEMORY;
+
+    _BIDGetCacheLastChangedTime(context, cache, &lastChanged);
+
+    err = _BIDPurgeCache(context, cache, _BIDShouldPurgeReplayCacheEntryP, &args);
+
+    for (i = 0; i < json_array_size(args.Tickets); i++)
+        _BIDInvalidateReauthTicket(context, cache,
+                                   json_string_value(json_array_get(args.Tickets, i)));
+    _BIDNoteReauthTicketCacheChange(context, cache, lastChanged);
+
+    json_decref(args.Tickets);
+
+    return err;
 }
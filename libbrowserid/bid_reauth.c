@@ -43,65 +43,119 @@
  * Fast reauthentication support
  */
 
-static BIDError
+/*
+ * Copy a ticket cache key component, escaping the '$' separator and the
+ * escape character itself, and return the length of the escaped string.
+ * If szEscaped is NULL, only the length is returned.
+ */
+static size_t
+_BIDEscapeTicketCacheKeyComponent(
+    const char *szComponent,
+    char *szEscaped)
+{
+    const char *p;
+    size_t cchEscaped = 0;
+
+    for (p = szComponent; *p != '\0'; p++) {
+        if (*p == '$' || *p == '%') {
+            if (szEscaped != NULL)
+                snprintf(&szEscaped[cchEscaped], 4, "%%%02X", (unsigned char)*p);
+            cchEscaped += 3;
+        } else {
+            if (szEscaped != NULL)
+                szEscaped[cchEscaped] = *p;
+            cchEscaped++;
+        }
+    }
+
+    return cchEscaped;
+}
+
+/*
+ * Tickets are keyed by curve, audience and subject, so that each identity
+ * is found with a single lookup. The most recently stored ticket for an
+ * audience is also kept under the key without a subject, for callers that
+ * do not name an identity. Components are escaped so that no two
+ * audience and subject pairs share a key.
+ */
+BIDError
 _BIDMakeTicketCacheKey(
-    BIDContext context,
+    BIDContext context BID_UNUSED,
+    const char *szCurve,
     const char *szAudienceOrSpn,
+    const char *szSubject,
     char **pszCacheKey)
 {
-    BIDError err;
-    char szCachePrefix[64];
     char *szCacheKey = NULL;
-    size_t cchCachePrefix, cchAudienceOrSpn;
+    size_t cchCurve, cchAudienceOrSpn, cchSubject = 0;
     size_t cchCacheKey;
 
     *pszCacheKey = NULL;
 
-    if (szAudienceOrSpn == NULL)
+    if (szCurve == NULL || szAudienceOrSpn == NULL)
         return BID_S_INVALID_PARAMETER;
 
-    /*
-     * Encode the number of bits in the DH key, or the ECDH curve, so we can
-     * quickly find a ticket that suits the context encryption type.
-     */
-    if (context->ContextOptions & BID_CONTEXT_ECDH_KEYEX) {
-        const char *szCurve;
-
-        err = BIDGetContextParam(context, BID_PARAM_ECDH_CURVE, (void **)&szCurve);
-        if (err != BID_S_OK)
-            return err;
-
-        snprintf(szCachePrefix, sizeof(szCachePrefix), "%s$", szCurve);
-    } else {
-        return BID_S_CACHE_KEY_NOT_FOUND;
+    cchCurve = _BIDEscapeTicketCacheKeyComponent(szCurve, NULL);
+    cchAudienceOrSpn = _BIDEscapeTicketCacheKeyComponent(szAudienceOrSpn, NULL);
+    cchCacheKey = cchCurve + 1 + cchAudienceOrSpn;
+    if (szSubject != NULL) {
+        cchSubject = _BIDEscapeTicketCacheKeyComponent(szSubject, NULL);
+        cchCacheKey += 1 + cchSubject;
     }
 
-    cchCachePrefix = strlen(szCachePrefix);
-    cchAudienceOrSpn = strlen(szAudienceOrSpn);
-    cchCacheKey = cchCachePrefix + cchAudienceOrSpn;
-
     szCacheKey = BIDMalloc(cchCacheKey + 1);
     if (szCacheKey == NULL)
         return BID_S_NO_MEMORY;
 
-    memcpy(szCacheKey, szCachePrefix, cchCachePrefix);
-    memcpy(&szCacheKey[cchCachePrefix], szAudienceOrSpn, cchAudienceOrSpn);
-    szCacheKey[cchCachePrefix + cchAudienceOrSpn] = '\0';
+    _BIDEscapeTicketCacheKeyComponent(szCurve, szCacheKey);
+    szCacheKey[cchCurve] = '$';
+    _BIDEscapeTicketCacheKeyComponent(szAudienceOrSpn, &szCacheKey[cchCurve + 1]);
+    if (szSubject != NULL) {
+        szCacheKey[cchCurve + 1 + cchAudienceOrSpn] = '$';
+        _BIDEscapeTicketCacheKeyComponent(szSubject, &szCacheKey[cchCurve + 1 + cchAudienceOrSpn + 1]);
+    }
+    szCacheKey[cchCacheKey] = '\0';
 
     *pszCacheKey = szCacheKey;
 
     return BID_S_OK;
 }
 
+/*
+ * Make the ticket cache key for the context's key agreement parameters.
+ * The ECDH curve is encoded so we can quickly find a ticket that suits
+ * the context encryption type.
+ */
+static BIDError
+_BIDMakeContextTicketCacheKey(
+    BIDContext context,
+    const char *szAudienceOrSpn,
+    const char *szSubject,
+    char **pszCacheKey)
+{
+    BIDError err;
+    const char *szCurve;
+
+    *pszCacheKey = NULL;
+
+    if ((context->ContextOptions & BID_CONTEXT_ECDH_KEYEX) == 0)
+        return BID_S_CACHE_KEY_NOT_FOUND;
+
+    err = BIDGetContextParam(context, BID_PARAM_ECDH_CURVE, (void **)&szCurve);
+    if (err != BID_S_OK)
+        return err;
+
+    return _BIDMakeTicketCacheKey(context, szCurve, szAudienceOrSpn, szSubject, pszCacheKey);
+}
+
 static BIDError
 _BIDDeriveAuthenticatorSessionKey(
     BIDContext context,
-    BIDJWK ark,
+    BIDSecretHandle ark,
     BIDJWT ap,
     BIDSecretHandle *pSecretHandle)
 {
     BIDError err;
-    BIDSecretHandle secretHandle = NULL;
     unsigned char *pbNonce = NULL;
     size_t cbNonce = 0;
     unsigned char *pbASK = NULL;
@@ -109,13 +163,10 @@ _BIDDeriveAuthenticatorSessionKey(
 
     *pSecretHandle = NULL;
 
-    err = _BIDImportSecretKey(context, ark, &secretHandle);
-    BID_BAIL_ON_ERROR(err);
-
     err = _BIDGetJsonBinaryValue(context, ap->Payload, "nonce", &pbNonce, &cbNonce);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDDeriveKey(context, secretHandle, pbNonce, cbNonce, &pbASK, &cbASK);
+    err = _BIDDeriveKey(context, ark, pbNonce, cbNonce, &pbASK, &cbASK);
     BID_BAIL_ON_ERROR(err);
 
     err = _BIDImportSecretKeyData(context, pbASK, cbASK, pSecretHandle);
@@ -124,7 +175,6 @@ _BIDDeriveAuthenticatorSessionKey(
     err = BID_S_OK;
 
 cleanup:
-    _BIDDestroySecret(context, secretHandle);
     BIDFree(pbNonce);
     if (pbASK != NULL) {
         memset(pbASK, 0, cbASK);
@@ -151,10 +201,12 @@ _BIDStoreTicketInCache(
     BIDError err;
     json_t *cred = NULL;
     json_t *aud;
+    BIDSecretHandle arkHandle = NULL;
     BIDJWK ark = NULL;
     const char *szAudienceOrSpn = NULL;
     const char *szSubject = NULL;
     char *szCacheKey = NULL;
+    char *szDefaultCacheKey = NULL;
 
     BID_CONTEXT_VALIDATE(context);
 
@@ -176,7 +228,11 @@ _BIDStoreTicketInCache(
         goto cleanup;
     }
 
-    err = _BIDDeriveSessionSubkey(context, identity, "ARK", &ark);
+    err = _BIDDeriveSessionSubkey(context, identity, "ARK", &arkHandle);
+    BID_BAIL_ON_ERROR(err);
+
+    /* the ticket is persisted, so the ARK must be serialized with it */
+    err = _BIDExportSecretKey(context, arkHandle, &ark);
     BID_BAIL_ON_ERROR(err);
 
     cred = json_copy(identity->Attributes);
@@ -205,16 +261,25 @@ _BIDStoreTicketInCache(
     err = BIDGetIdentitySubject(context, identity, &szSubject);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDMakeTicketCacheKey(context, szAudienceOrSpn, &szCacheKey);
+    err = _BIDMakeContextTicketCacheKey(context, szAudienceOrSpn, szSubject, &szCacheKey);
     BID_BAIL_ON_ERROR(err);
 
     err = _BIDSetCacheObject(context, context->TicketCache, szCacheKey, cred);
     BID_BAIL_ON_ERROR(err);
 
+    err = _BIDMakeContextTicketCacheKey(context, szAudienceOrSpn, NULL, &szDefaultCacheKey);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDSetCacheObject(context, context->TicketCache, szDefaultCacheKey, cred);
+    BID_BAIL_ON_ERROR(err);
+
 cleanup:
     json_decref(cred);
     json_decref(ark);
+    if (arkHandle != NULL)
+        _BIDDestroySecret(context, arkHandle);
     BIDFree(szCacheKey);
+    BIDFree(szDefaultCacheKey);
 
     return err;
 }
@@ -229,7 +294,7 @@ BIDStoreTicketInCache(
     json_t *ticket;
     BIDError err;
 
-    ticket = json_loads(szTicket, 0, &context->JsonError);
+    ticket = json_loads(szTicket, 0, BID_JSON_ERROR(context));
     if (ticket == NULL)
         return BID_S_INVALID_JSON;
 
@@ -349,144 +414,186 @@ cleanup:
     return err;
 }
 
+/*
+ * Split a stored ticket into identity attributes, with the secret stuff
+ * removed, and private attributes. The renew-exp and crv attributes are
+ * propagated so that any additional tickets also have these same values.
+ */
 static BIDError
-_BIDMakeReauthIdentity(
+_BIDMakeTicketAttributes(
     BIDContext context,
     json_t *cred,
-    BIDJWT ap,
-    BIDIdentity *pIdentity)
+    json_t **pAttributes,
+    json_t **pPrivateAttributes)
 {
     BIDError err;
-    BIDIdentity identity = BID_C_NO_IDENTITY;
-    json_t *credCopy = NULL;
+    json_t *attrs = NULL;
+    json_t *privateAttrs = NULL;
 
-    *pIdentity = NULL;
+    *pAttributes = NULL;
+    *pPrivateAttributes = NULL;
 
-    credCopy = json_copy(cred);
-    if (credCopy == NULL) {
+    attrs = json_copy(cred);
+    if (attrs == NULL) {
         err = BID_S_NO_MEMORY;
         goto cleanup;
     }
 
-    err = _BIDAllocIdentity(context, credCopy, &identity);
+    err = _BIDJsonObjectDel(context, attrs, "ark", 0);
     BID_BAIL_ON_ERROR(err);
 
-    /* remove the secret stuff from the attribute cache */
-    err = _BIDJsonObjectDel(context, identity->Attributes, "ark", 0);
+    err = _BIDJsonObjectDel(context, attrs, "a-exp", 0);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDJsonObjectDel(context, identity->Attributes, "a-exp", 0);
+    err = _BIDJsonObjectDel(context, attrs, "flags", 0);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDJsonObjectDel(context, identity->Attributes, "flags", 0);
+    err = _BIDJsonObjectDel(context, attrs, "aud", 0);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDJsonObjectDel(context, identity->Attributes, "aud", 0);
+    err = _BIDAllocJsonObject(context, &privateAttrs);
     BID_BAIL_ON_ERROR(err);
 
-    /* copy over the assertion expiry time */
-    err = _BIDJsonObjectSet(context, identity->PrivateAttributes, "a-exp",
+    err = _BIDJsonObjectSet(context, privateAttrs, "a-exp",
                             json_object_get(cred, "a-exp"), 0);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDJsonObjectSet(context, identity->PrivateAttributes, "aud",
+    err = _BIDJsonObjectSet(context, privateAttrs, "aud",
                             json_object_get(cred, "aud"), 0);
     BID_BAIL_ON_ERROR(err);
 
-    /* Save protocol options, internal use only */
-    err = _BIDJsonObjectSet(context, identity->PrivateAttributes, "opts",
-                            json_object_get(ap->Payload, "opts"), 0);
+    err = _BIDJsonObjectSet(context, privateAttrs, "renew-exp",
+                            json_object_get(cred, "renew-exp"), 0);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDDeriveAuthenticatorSessionKey(context, json_object_get(cred, "ark"), ap,
-                                            &identity->SecretHandle);
+    err = _BIDJsonObjectSet(context, privateAttrs, "crv",
+                            json_object_get(cred, "crv"), 0);
     BID_BAIL_ON_ERROR(err);
 
-    *pIdentity = identity;
+    *pAttributes = attrs;
+    attrs = NULL;
+    *pPrivateAttributes = privateAttrs;
+    privateAttrs = NULL;
 
 cleanup:
-    if (err != BID_S_OK)
-        BIDReleaseIdentity(context, identity);
-    json_decref(credCopy);
+    json_decref(attrs);
+    json_decref(privateAttrs);
 
     return err;
 }
 
-struct BIDMatchTicketArgsDesc {
-    char *szCacheKey;
-    const char *szIdentityName;
-    json_t *cred;
-};
-
 static BIDError
-_BIDMatchTicketInCacheCB(
-    BIDContext context BID_UNUSED,
-    BIDCache cache BID_UNUSED,
-    const char *szKey,
-    json_t *cacheVal,
-    void *data)
+_BIDMakeReauthIdentity(
+    BIDContext context,
+    json_t *cred,
+    BIDSecretHandle ark,
+    BIDJWT ap,
+    BIDIdentity *pIdentity)
 {
-    struct BIDMatchTicketArgsDesc *args = (struct BIDMatchTicketArgsDesc *)data;
-    const char *szCacheIdentity;
+    BIDError err;
+    BIDIdentity identity = BID_C_NO_IDENTITY;
+    json_t *attrs = NULL;
+    json_t *privateAttrs = NULL;
+
+    *pIdentity = NULL;
 
-    BID_ASSERT(szKey != NULL);
-    BID_ASSERT(args->szIdentityName != NULL);
-    BID_ASSERT(args->cred == NULL);
+    err = _BIDMakeTicketAttributes(context, cred, &attrs, &privateAttrs);
+    BID_BAIL_ON_ERROR(err);
 
-    szCacheIdentity = json_string_value(json_object_get(cacheVal, "sub"));
+    err = _BIDAllocIdentity(context, attrs, &identity);
+    BID_BAIL_ON_ERROR(err);
 
-    if (strcmp(szKey, args->szCacheKey) == 0 &&
-        szCacheIdentity != NULL &&
-        strcmp(szCacheIdentity, args->szIdentityName) == 0) {
-        args->cred = json_incref(cacheVal);
-        return BID_S_NO_MORE_ITEMS;
-    }
+    json_decref(identity->PrivateAttributes);
+    identity->PrivateAttributes = json_incref(privateAttrs);
 
-    return BID_S_OK;
+    /* Save protocol options, internal use only */
+    err = _BIDJsonObjectSet(context, identity->PrivateAttributes, "opts",
+                            json_object_get(ap->Payload, "opts"), 0);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDDeriveAuthenticatorSessionKey(context, ark, ap, &identity->SecretHandle);
+    BID_BAIL_ON_ERROR(err);
+
+    *pIdentity = identity;
+
+cleanup:
+    if (err != BID_S_OK)
+        BIDReleaseIdentity(context, identity);
+    json_decref(attrs);
+    json_decref(privateAttrs);
+
+    return err;
 }
 
 static BIDError
-_BIDFindTicketInCache(
+_BIDGetTicketFromCache(
     BIDContext context,
     BIDTicketCache ticketCache,
     const char *szAudienceOrSpn,
+    const char *szSubject,
     const char *szIdentityName,
     json_t **pCred)
 {
     BIDError err;
-    struct BIDMatchTicketArgsDesc args = { 0 };
+    char *szCacheKey = NULL;
+    const char *szCacheAudience;
+    const char *szCacheIdentity;
 
-    args.szCacheKey = NULL;
-    args.szIdentityName = szIdentityName;
-    args.cred = NULL;
+    *pCred = NULL;
 
-    err = _BIDMakeTicketCacheKey(context, szAudienceOrSpn, &args.szCacheKey);
+    err = _BIDMakeContextTicketCacheKey(context, szAudienceOrSpn, szSubject, &szCacheKey);
     BID_BAIL_ON_ERROR(err);
 
+    err = _BIDGetCacheObject(context, ticketCache, szCacheKey, pCred);
+    BID_BAIL_ON_ERROR(err);
+
+    /* never use a ticket issued for another audience */
+    szCacheAudience = json_string_value(json_object_get(*pCred, "aud"));
+    if (szCacheAudience == NULL || strcmp(szCacheAudience, szAudienceOrSpn) != 0) {
+        err = BID_S_CACHE_KEY_NOT_FOUND;
+        goto cleanup;
+    }
+
     if (szIdentityName != NULL) {
-        err = _BIDPerformCacheObjects(context, ticketCache, _BIDMatchTicketInCacheCB, &args);
-        if (err == BID_S_NO_MORE_ITEMS && args.cred != NULL)
-            err = BID_S_OK;
-        BID_BAIL_ON_ERROR(err);
+        szCacheIdentity = json_string_value(json_object_get(*pCred, "sub"));
 
-        if (args.cred == NULL) {
+        if (szCacheIdentity == NULL || strcmp(szCacheIdentity, szIdentityName) != 0) {
             err = BID_S_CACHE_KEY_NOT_FOUND;
             goto cleanup;
         }
-    } else {
-        err = _BIDGetCacheObject(context, ticketCache, args.szCacheKey, &args.cred);
-        BID_BAIL_ON_ERROR(err);
     }
 
-    BID_ASSERT(err == BID_S_OK || args.cred == NULL);
+cleanup:
+    if (err != BID_S_OK) {
+        json_decref(*pCred);
+        *pCred = NULL;
+    }
+    BIDFree(szCacheKey);
 
-    err = BID_S_OK;
-    *pCred = args.cred;
+    return err;
+}
 
-cleanup:
-    if (err != BID_S_OK)
-        json_decref(args.cred);
-    BIDFree(args.szCacheKey);
+BIDError
+_BIDFindTicketInCache(
+    BIDContext context,
+    BIDTicketCache ticketCache,
+    const char *szAudienceOrSpn,
+    const char *szIdentityName,
+    json_t **pCred)
+{
+    BIDError err;
+
+    if (szIdentityName != NULL) {
+        err = _BIDGetTicketFromCache(context, ticketCache, szAudienceOrSpn,
+                                     szIdentityName, szIdentityName, pCred);
+        /* caches written before tickets were keyed by subject */
+        if (err == BID_S_CACHE_KEY_NOT_FOUND)
+            err = _BIDGetTicketFromCache(context, ticketCache, szAudienceOrSpn,
+                                         NULL, szIdentityName, pCred);
+    } else {
+        err = _BIDGetTicketFromCache(context, ticketCache, szAudienceOrSpn,
+                                     NULL, NULL, pCred);
+    }
 
     return err;
 }
@@ -533,6 +640,7 @@ _BIDGetReauthAssertion(
     BIDError err;
     json_t *cred = NULL;
     json_t *tkt = NULL;
+    BIDSecretHandle ark = NULL;
     BIDJWT ap = NULL;
     struct BIDBackedAssertionDesc backedAssertion = { 0 };
     time_t now = 0;
@@ -589,16 +697,19 @@ _BIDGetReauthAssertion(
     err = _BIDValidateReauthCredStrength(context, cred);
     BID_BAIL_ON_ERROR(err);
 
+    err = _BIDImportSecretKey(context, json_object_get(cred, "ark"), &ark);
+    BID_BAIL_ON_ERROR(err);
+
     backedAssertion.Assertion = ap;
     backedAssertion.cCertificates = 0;
 
     if (pAssertion != NULL) {
-        err = _BIDPackBackedAssertion(context, &backedAssertion, json_object_get(cred, "ark"), NULL, pAssertion);
+        err = _BIDPackBackedAssertion(context, &backedAssertion, NULL, ark, NULL, pAssertion);
         BID_BAIL_ON_ERROR(err);
     }
 
     if (pAssertedIdentity != NULL) {
-        err = _BIDMakeReauthIdentity(context, cred, ap, pAssertedIdentity);
+        err = _BIDMakeReauthIdentity(context, cred, ark, ap, pAssertedIdentity);
         BID_BAIL_ON_ERROR(err);
     }
 
@@ -610,11 +721,630 @@ _BIDGetReauthAssertion(
 
 cleanup:
     json_decref(cred);
+    if (ark != NULL)
+        _BIDDestroySecret(context, ark);
     _BIDReleaseJWT(context, ap);
 
     return err;
 }
 
+/*
+ * Tickets issued or verified by this process are kept in memory, keyed by
+ * replay cache instance and ticket ID, with the ARK already imported and
+ * the identity attributes already built. The replay cache remains the
+ * durable copy. The replay cache code drops an entry when it replaces or
+ * purges its ticket, and records the cache's change time after each of
+ * its writes; an entry is otherwise trusted only if the cache has not
+ * been changed elsewhere since the entry was last validated against it.
+ * Change times have a resolution of a second, so a change made elsewhere
+ * in the same second as the last one known here is not noticed. Entries are
+ * reference counted so that a ticket can be used outside the lock while
+ * another thread evicts it.
+ */
+#define BID_REAUTH_TICKET_BUCKETS       1024    /* power of two */
+#define BID_REAUTH_TICKET_MAX_ENTRIES   8192
+
+/*
+ * Kept for each replay cache with tickets in the table. ChangedTime is
+ * the cache's change time after the last change known here. Generation
+ * is renewed whenever the cache is found to have been changed elsewhere,
+ * and an entry is current only if it was validated in this generation.
+ */
+struct BIDReauthCacheDesc {
+    struct BIDReauthCacheDesc *Next;
+    BIDCache Cache;
+    size_t cTickets;
+    time_t ChangedTime;
+    uint64_t Generation;
+};
+
+struct BIDReauthTicketDesc {
+    struct BIDReauthTicketDesc *NextInBucket;
+    struct BIDReauthTicketDesc *Prev;
+    struct BIDReauthTicketDesc *Next;
+    unsigned long cRefs;
+    uint32_t Hash;
+    BIDCache Cache;             /* retained */
+    struct BIDReauthCacheDesc *CacheState;
+    char *Tid;
+    json_t *Cred;
+    uint64_t Generation;
+    time_t ExpiryTime;
+    uint32_t ulTicketFlags;
+    BIDSecretHandle Ark;
+    json_t *Times;
+    json_t *Attributes;
+    json_t *PrivateAttributes;
+};
+
+static struct {
+    BID_MUTEX Mutex;
+    size_t cEntries;
+    uint64_t Hits;
+    uint64_t Misses;
+    uint64_t Generation;
+    struct BIDReauthTicketDesc *Head; /* most recently used */
+    struct BIDReauthTicketDesc *Tail;
+    struct BIDReauthTicketDesc *Buckets[BID_REAUTH_TICKET_BUCKETS];
+    struct BIDReauthCacheDesc *Caches;
+} _BIDReauthTickets;
+
+void
+_BIDReauthInit(void)
+{
+    BID_MUTEX_INIT(&_BIDReauthTickets.Mutex);
+}
+
+static uint32_t
+_BIDReauthTicketHash(
+    BIDCache cache,
+    const char *szTid)
+{
+    uint32_t hash = 2166136261U;
+    uintptr_t p = (uintptr_t)cache;
+    const char *q;
+    size_t i;
+
+    for (q = szTid; *q != '\0'; q++)
+        hash = (hash ^ (unsigned char)*q) * 16777619U;
+    for (i = 0; i < sizeof(p); i++, p >>= 8)
+        hash = (hash ^ (unsigned char)(p & 0xFF)) * 16777619U;
+
+    return hash;
+}
+
+static void
+_BIDFreeReauthTicket(
+    BIDContext context,
+    struct BIDReauthTicketDesc *ticket)
+{
+    if (ticket == NULL)
+        return;
+
+    if (ticket->Cache != NULL)
+        _BIDReleaseCache(context, ticket->Cache);
+    BIDFree(ticket->Tid);
+    json_decref(ticket->Cred);
+    if (ticket->Ark != NULL)
+        _BIDDestroySecret(context, ticket->Ark);
+    json_decref(ticket->Times);
+    json_decref(ticket->Attributes);
+    json_decref(ticket->PrivateAttributes);
+    BIDFree(ticket);
+}
+
+static void
+_BIDFreeReauthTicketList(
+    BIDContext context,
+    struct BIDReauthTicketDesc *freeList)
+{
+    struct BIDReauthTicketDesc *ticket;
+
+    while (freeList != NULL) {
+        ticket = freeList;
+        freeList = ticket->NextInBucket;
+        _BIDFreeReauthTicket(context, ticket);
+    }
+}
+
+/*
+ * The following functions must be called with _BIDReauthTickets.Mutex held.
+ */
+static struct BIDReauthTicketDesc *
+_BIDFindReauthTicket(
+    uint32_t hash,
+    BIDCache cache,
+    const char *szTid)
+{
+    struct BIDReauthTicketDesc *ticket;
+
+    ticket = _BIDReauthTickets.Buckets[hash & (BID_REAUTH_TICKET_BUCKETS - 1)];
+
+    for (; ticket != NULL; ticket = ticket->NextInBucket) {
+        if (ticket->Hash == hash &&
+            ticket->Cache == cache &&
+            strcmp(ticket->Tid, szTid) == 0)
+            break;
+    }
+
+    return ticket;
+}
+
+static struct BIDReauthCacheDesc *
+_BIDFindReauthCache(BIDCache cache)
+{
+    struct BIDReauthCacheDesc *rc;
+
+    for (rc = _BIDReauthTickets.Caches; rc != NULL; rc = rc->Next) {
+        if (rc->Cache == cache)
+            break;
+    }
+
+    return rc;
+}
+
+static void
+_BIDUnlinkReauthTicketLRU(struct BIDReauthTicketDesc *ticket)
+{
+    if (ticket->Prev != NULL)
+        ticket->Prev->Next = ticket->Next;
+    else
+        _BIDReauthTickets.Head = ticket->Next;
+
+    if (ticket->Next != NULL)
+        ticket->Next->Prev = ticket->Prev;
+    else
+        _BIDReauthTickets.Tail = ticket->Prev;
+
+    ticket->Prev = ticket->Next = NULL;
+}
+
+static void
+_BIDLinkReauthTicketLRU(struct BIDReauthTicketDesc *ticket)
+{
+    ticket->Prev = NULL;
+    ticket->Next = _BIDReauthTickets.Head;
+
+    if (_BIDReauthTickets.Head != NULL)
+        _BIDReauthTickets.Head->Prev = ticket;
+    else
+        _BIDReauthTickets.Tail = ticket;
+
+    _BIDReauthTickets.Head = ticket;
+}
+
+/*
+ * Remove a ticket from the table and drop the table's reference, adding
+ * the ticket to *pFreeList if it is now unreferenced, to be freed by the
+ * caller once the lock is released.
+ */
+static void
+_BIDUnlinkReauthTicket(
+    struct BIDReauthTicketDesc *ticket,
+    struct BIDReauthTicketDesc **pFreeList)
+{
+    struct BIDReauthTicketDesc **pp;
+
+    pp = &_BIDReauthTickets.Buckets[ticket->Hash & (BID_REAUTH_TICKET_BUCKETS - 1)];
+
+    while (*pp != ticket)
+        pp = &(*pp)->NextInBucket;
+    *pp = ticket->NextInBucket;
+    ticket->NextInBucket = NULL;
+
+    _BIDUnlinkReauthTicketLRU(ticket);
+
+    _BIDReauthTickets.cEntries--;
+
+    if (--ticket->CacheState->cTickets == 0) {
+        struct BIDReauthCacheDesc **prc = &_BIDReauthTickets.Caches;
+
+        while (*prc != ticket->CacheState)
+            prc = &(*prc)->Next;
+        *prc = ticket->CacheState->Next;
+        BIDFree(ticket->CacheState);
+    }
+    ticket->CacheState = NULL;
+
+    if (--ticket->cRefs == 0) {
+        ticket->NextInBucket = *pFreeList;
+        *pFreeList = ticket;
+    }
+}
+
+static BIDError
+_BIDAllocReauthTicket(
+    BIDContext context,
+    BIDCache cache,
+    const char *szTid,
+    json_t *cred,
+    struct BIDReauthTicketDesc **pTicket)
+{
+    BIDError err;
+    struct BIDReauthTicketDesc *ticket;
+
+    *pTicket = NULL;
+
+    ticket = BIDCalloc(1, sizeof(*ticket));
+    if (ticket == NULL)
+        return BID_S_NO_MEMORY;
+
+    ticket->cRefs = 1;
+    ticket->Hash = _BIDReauthTicketHash(cache, szTid);
+    ticket->Cred = json_incref(cred);
+
+    err = _BIDRetainCache(context, cache);
+    BID_BAIL_ON_ERROR(err);
+
+    ticket->Cache = cache;
+
+    err = _BIDDuplicateString(context, szTid, &ticket->Tid);
+    BID_BAIL_ON_ERROR(err);
+
+    _BIDGetJsonTimestampValue(context, cred, "exp", &ticket->ExpiryTime);
+    ticket->ulTicketFlags = _BIDJsonUInt32Value(json_object_get(cred, "flags"));
+
+    err = _BIDImportSecretKey(context, json_object_get(cred, "ark"), &ticket->Ark);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDAllocJsonObject(context, &ticket->Times);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDJsonObjectSet(context, ticket->Times, "iat", json_object_get(cred, "iat"), 0);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDJsonObjectSet(context, ticket->Times, "nbf", json_object_get(cred, "nbf"), 0);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDJsonObjectSet(context, ticket->Times, "exp", json_object_get(cred, "exp"), 0);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDMakeTicketAttributes(context, cred, &ticket->Attributes, &ticket->PrivateAttributes);
+    BID_BAIL_ON_ERROR(err);
+
+    *pTicket = ticket;
+
+cleanup:
+    if (err != BID_S_OK)
+        _BIDFreeReauthTicket(context, ticket);
+
+    return err;
+}
+
+static int
+_BIDReauthTicketExpiredP(
+    BIDContext context,
+    struct BIDReauthTicketDesc *ticket,
+    time_t currentTime)
+{
+    return ticket->ExpiryTime != 0 &&
+           currentTime > ticket->ExpiryTime + (time_t)context->Skew;
+}
+
+/*
+ * Add a ticket to the table, replacing any existing entry for the same
+ * ticket ID and evicting the least recently used entries to make room.
+ * The ticket must reflect every change made to the cache up to
+ * changedTime, which starts the record of changes to a cache that has
+ * no other tickets in the table. generation is that of the cache when
+ * the ticket was read from it, or zero if the ticket was just stored or
+ * the cache had no record then.
+ */
+static void
+_BIDInsertReauthTicket(
+    BIDContext context,
+    struct BIDReauthTicketDesc *ticket,
+    time_t changedTime,
+    uint64_t generation)
+{
+    struct BIDReauthTicketDesc *existing;
+    struct BIDReauthTicketDesc *freeList = NULL;
+    struct BIDReauthCacheDesc *rc;
+    size_t iBucket = ticket->Hash & (BID_REAUTH_TICKET_BUCKETS - 1);
+
+    BID_MUTEX_LOCK(&_BIDReauthTickets.Mutex);
+
+    existing = _BIDFindReauthTicket(ticket->Hash, ticket->Cache, ticket->Tid);
+    if (existing != NULL)
+        _BIDUnlinkReauthTicket(existing, &freeList);
+
+    while (_BIDReauthTickets.cEntries >= BID_REAUTH_TICKET_MAX_ENTRIES)
+        _BIDUnlinkReauthTicket(_BIDReauthTickets.Tail, &freeList);
+
+    rc = _BIDFindReauthCache(ticket->Cache);
+    if (rc == NULL) {
+        rc = BIDCalloc(1, sizeof(*rc));
+        if (rc == NULL)
+            goto cleanup;
+
+        rc->Cache = ticket->Cache;
+        rc->ChangedTime = changedTime;
+        rc->Generation = ++_BIDReauthTickets.Generation;
+        rc->Next = _BIDReauthTickets.Caches;
+        _BIDReauthTickets.Caches = rc;
+        generation = 0;
+    }
+
+    rc->cTickets++;
+    ticket->CacheState = rc;
+    ticket->Generation = generation != 0 ? generation : rc->Generation;
+
+    ticket->NextInBucket = _BIDReauthTickets.Buckets[iBucket];
+    _BIDReauthTickets.Buckets[iBucket] = ticket;
+    _BIDLinkReauthTicketLRU(ticket);
+    ticket->cRefs++;
+    _BIDReauthTickets.cEntries++;
+
+cleanup:
+    BID_MUTEX_UNLOCK(&_BIDReauthTickets.Mutex);
+
+    _BIDFreeReauthTicketList(context, freeList);
+}
+
+static void
+_BIDReleaseReauthTicket(
+    BIDContext context,
+    struct BIDReauthTicketDesc *ticket)
+{
+    int bFree;
+
+    BID_MUTEX_LOCK(&_BIDReauthTickets.Mutex);
+    bFree = (--ticket->cRefs == 0);
+    BID_MUTEX_UNLOCK(&_BIDReauthTickets.Mutex);
+
+    if (bFree)
+        _BIDFreeReauthTicket(context, ticket);
+}
+
+/*
+ * Drop the entry for szTicket in cache. This is called when the replay
+ * cache entry for a ticket is replaced or removed through this process.
+ */
+void
+_BIDInvalidateReauthTicket(
+    BIDContext context,
+    BIDCache cache,
+    const char *szTicket)
+{
+    struct BIDReauthTicketDesc *ticket;
+    struct BIDReauthTicketDesc *freeList = NULL;
+
+    BID_MUTEX_LOCK(&_BIDReauthTickets.Mutex);
+
+    ticket = _BIDFindReauthTicket(_BIDReauthTicketHash(cache, szTicket), cache, szTicket);
+    if (ticket != NULL)
+        _BIDUnlinkReauthTicket(ticket, &freeList);
+
+    BID_MUTEX_UNLOCK(&_BIDReauthTickets.Mutex);
+
+    _BIDFreeReauthTicketList(context, freeList);
+}
+
+/*
+ * Record a change made to cache through this process, after the affected
+ * tickets have been invalidated. previousChangedTime is the change time
+ * of the cache from before the change: if it differs from the last change
+ * known here, the cache was also changed elsewhere in the meantime.
+ */
+void
+_BIDNoteReauthTicketCacheChange(
+    BIDContext context,
+    BIDCache cache,
+    time_t previousChangedTime)
+{
+    struct BIDReauthCacheDesc *rc;
+    time_t changedTime;
+
+    if (_BIDGetCacheLastChangedTime(context, cache, &changedTime) != BID_S_OK)
+        return;
+
+    BID_MUTEX_LOCK(&_BIDReauthTickets.Mutex);
+
+    rc = _BIDFindReauthCache(cache);
+    if (rc != NULL) {
+        if (previousChangedTime != rc->ChangedTime)
+            rc->Generation = ++_BIDReauthTickets.Generation;
+        rc->ChangedTime = changedTime;
+    }
+
+    BID_MUTEX_UNLOCK(&_BIDReauthTickets.Mutex);
+}
+
+/*
+ * Record a ticket that has just been stored in the replay cache, so that
+ * the first reauthentication with it does not need to read the cache.
+ */
+BIDError
+_BIDCacheReauthTicket(
+    BIDContext context,
+    BIDReplayCache replayCache,
+    const char *szTicket,
+    json_t *cred)
+{
+    BIDError err;
+    struct BIDReauthTicketDesc *ticket = NULL;
+    time_t changedTime;
+
+    err = _BIDGetCacheLastChangedTime(context, replayCache, &changedTime);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDAllocReauthTicket(context, replayCache, szTicket, cred, &ticket);
+    BID_BAIL_ON_ERROR(err);
+
+    _BIDInsertReauthTicket(context, ticket, changedTime, 0);
+
+cleanup:
+    if (ticket != NULL)
+        _BIDReleaseReauthTicket(context, ticket);
+
+    return err;
+}
+
+/*
+ * Find a ticket in the table, or load it from the replay cache if it is
+ * not there or the cache has changed since it was validated. The caller
+ * must release the returned ticket.
+ */
+static BIDError
+_BIDAcquireReauthTicket(
+    BIDContext context,
+    BIDReplayCache replayCache,
+    const char *szTicket,
+    time_t verificationTime,
+    struct BIDReauthTicketDesc **pTicket)
+{
+    BIDError err;
+    struct BIDReauthTicketDesc *ticket = NULL;
+    struct BIDReauthTicketDesc *freeList = NULL;
+    struct BIDReauthCacheDesc *rc;
+    json_t *cred = NULL;
+    time_t lastChanged = 0;
+    uint64_t generation = 0;
+    int bLastChanged, bCurrent = 0;
+
+    *pTicket = NULL;
+
+    bLastChanged =
+        (_BIDGetCacheLastChangedTime(context, replayCache, &lastChanged) == BID_S_OK);
+
+    BID_MUTEX_LOCK(&_BIDReauthTickets.Mutex);
+
+    rc = _BIDFindReauthCache(replayCache);
+    if (rc != NULL) {
+        /* any change not made here was made elsewhere */
+        if (bLastChanged && lastChanged != rc->ChangedTime) {
+            rc->ChangedTime = lastChanged;
+            rc->Generation = ++_BIDReauthTickets.Generation;
+        }
+        generation = rc->Generation;
+    }
+
+    ticket = _BIDFindReauthTicket(_BIDReauthTicketHash(replayCache, szTicket),
+                                  replayCache, szTicket);
+    if (ticket != NULL && _BIDReauthTicketExpiredP(context, ticket, verificationTime)) {
+        _BIDUnlinkReauthTicket(ticket, &freeList);
+        ticket = NULL;
+    } else if (ticket != NULL) {
+        _BIDUnlinkReauthTicketLRU(ticket);
+        _BIDLinkReauthTicketLRU(ticket);
+        ticket->cRefs++;
+
+        bCurrent = bLastChanged && ticket->Generation == generation;
+    }
+
+    if (bCurrent)
+        _BIDReauthTickets.Hits++;
+    else
+        _BIDReauthTickets.Misses++;
+
+    BID_MUTEX_UNLOCK(&_BIDReauthTickets.Mutex);
+
+    _BIDFreeReauthTicketList(context, freeList);
+
+    if (bCurrent) {
+        *pTicket = ticket;
+        return BID_S_OK;
+    }
+
+    /* the generation was taken first, so that a concurrent change is not missed */
+    err = _BIDGetCacheObject(context, replayCache, szTicket, &cred);
+    if (err == BID_S_CACHE_NOT_FOUND || err == BID_S_CACHE_KEY_NOT_FOUND) {
+        /* removed through another cache handle or process */
+        if (ticket != NULL)
+            _BIDInvalidateReauthTicket(context, replayCache, szTicket);
+        err = BID_S_INVALID_ASSERTION;
+    }
+    BID_BAIL_ON_ERROR(err);
+
+    if (ticket != NULL && json_equal(cred, ticket->Cred)) {
+        BID_MUTEX_LOCK(&_BIDReauthTickets.Mutex);
+        ticket->Generation = generation;
+        BID_MUTEX_UNLOCK(&_BIDReauthTickets.Mutex);
+
+        *pTicket = ticket;
+        ticket = NULL;
+        goto cleanup;
+    }
+
+    if (ticket != NULL) {
+        _BIDReleaseReauthTicket(context, ticket);
+        ticket = NULL;
+    }
+
+    err = _BIDAllocReauthTicket(context, replayCache, szTicket, cred, &ticket);
+    BID_BAIL_ON_ERROR(err);
+
+    if (bLastChanged && !_BIDReauthTicketExpiredP(context, ticket, verificationTime))
+        _BIDInsertReauthTicket(context, ticket, lastChanged, generation);
+
+    *pTicket = ticket;
+    ticket = NULL;
+
+cleanup:
+    if (ticket != NULL)
+        _BIDReleaseReauthTicket(context, ticket);
+    json_decref(cred);
+
+    return err;
+}
+
+/*
+ * Hits are tickets used without reading the replay cache.
+ */
+BIDError
+_BIDGetReauthTicketStatistics(
+    BIDContext context BID_UNUSED,
+    uint64_t *pHits,
+    uint64_t *pMisses)
+{
+    BID_MUTEX_LOCK(&_BIDReauthTickets.Mutex);
+    *pHits = _BIDReauthTickets.Hits;
+    *pMisses = _BIDReauthTickets.Misses;
+    BID_MUTEX_UNLOCK(&_BIDReauthTickets.Mutex);
+
+    return BID_S_OK;
+}
+
+static BIDError
+_BIDMakeTicketIdentity(
+    BIDContext context,
+    struct BIDReauthTicketDesc *ticket,
+    BIDJWT ap,
+    BIDIdentity *pIdentity)
+{
+    BIDError err;
+    BIDIdentity identity = BID_C_NO_IDENTITY;
+
+    *pIdentity = NULL;
+
+    /* ticket attributes are immutable, so they can be shared */
+    err = _BIDAllocIdentity(context, ticket->Attributes, &identity);
+    BID_BAIL_ON_ERROR(err);
+
+    json_decref(identity->PrivateAttributes);
+    identity->PrivateAttributes = json_copy(ticket->PrivateAttributes);
+    if (identity->PrivateAttributes == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    /* Save protocol options, internal use only */
+    err = _BIDJsonObjectSet(context, identity->PrivateAttributes, "opts",
+                            json_object_get(ap->Payload, "opts"), 0);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDDeriveAuthenticatorSessionKey(context, ticket->Ark, ap, &identity->SecretHandle);
+    BID_BAIL_ON_ERROR(err);
+
+    *pIdentity = identity;
+
+cleanup:
+    if (err != BID_S_OK)
+        BIDReleaseIdentity(context, identity);
+
+    return err;
+}
+
 BIDError
 _BIDVerifyReauthAssertion(
     BIDContext context,
@@ -622,18 +1352,15 @@ _BIDVerifyReauthAssertion(
     BIDBackedAssertion assertion,
     time_t verificationTime,
     BIDIdentity *pVerifiedIdentity,
-    BIDJWK *pVerifierCred,
     uint32_t *pulRetFlags)
 {
     BIDError err;
     BIDJWT ap = assertion->Assertion;
     const char *szTicket;
-    json_t *cred = NULL;
-    uint32_t ulTicketFlags = 0;
+    struct BIDReauthTicketDesc *ticket = NULL;
     json_t *tkt = NULL;
 
     *pVerifiedIdentity = BID_C_NO_IDENTITY;
-    *pVerifierCred = NULL;
 
     BID_CONTEXT_VALIDATE(context);
 
@@ -654,56 +1381,32 @@ _BIDVerifyReauthAssertion(
 
     *pulRetFlags |= BID_VERIFY_FLAG_REAUTH;
 
-    err = _BIDGetCacheObject(context, replayCache, szTicket, &cred);
-    if (err == BID_S_CACHE_NOT_FOUND || err == BID_S_CACHE_KEY_NOT_FOUND)
-        err = BID_S_INVALID_ASSERTION;
+    err = _BIDAcquireReauthTicket(context, replayCache, szTicket, verificationTime, &ticket);
     BID_BAIL_ON_ERROR(err);
 
-    ulTicketFlags = _BIDJsonUInt32Value(json_object_get(cred, "flags"));
-
-    err = _BIDValidateReauthCredStrength(context, cred);
+    err = _BIDValidateReauthCredStrength(context, ticket->PrivateAttributes);
     BID_BAIL_ON_ERROR(err);
 
     /*
      * _BIDVerifyLocal will verify the authenticator expiry as it is in the
      * claims and is the moral equivalent of the assertion expiry. However,
-     * we also need to verify the ticket is still valid. We need to create
-     * new object as _BIDValidateExpiry expects the expiry time to be in
-     * the exp attribute.
+     * we also need to verify the ticket is still valid.
      */
-    err = _BIDValidateExpiry(context, verificationTime, cred);
+    err = _BIDValidateExpiry(context, verificationTime, ticket->Times);
     BID_BAIL_ON_ERROR(err);
 
-    if (ulTicketFlags & BID_TICKET_FLAG_MUTUAL_AUTH)
+    if (ticket->ulTicketFlags & BID_TICKET_FLAG_MUTUAL_AUTH)
         *pulRetFlags |= BID_VERIFY_FLAG_REAUTH_MUTUAL;
 
-    *pVerifierCred = json_incref(json_object_get(cred, "ark"));
-
-    err = _BIDVerifySignature(context, ap, *pVerifierCred);
-    BID_BAIL_ON_ERROR(err);
-
-    err = _BIDMakeReauthIdentity(context, cred, ap, pVerifiedIdentity);
-    BID_BAIL_ON_ERROR(err);
-
-    /*
-     * Propagate the renew-exp and crv attributes from the original ticket into
-     * the identity so that any additional tickets also have this same value.
-     */
-    err = _BIDJsonObjectSet(context, (*pVerifiedIdentity)->PrivateAttributes,
-                            "renew-exp", json_object_get(cred, "renew-exp"), 0);
+    err = _BIDVerifySecretKeySignature(context, ap, ticket->Ark);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDJsonObjectSet(context, (*pVerifiedIdentity)->PrivateAttributes,
-                            "crv", json_object_get(cred, "crv"), 0);
+    err = _BIDMakeTicketIdentity(context, ticket, ap, pVerifiedIdentity);
     BID_BAIL_ON_ERROR(err);
 
 cleanup:
-    if (err != BID_S_OK) {
-        json_decref(*pVerifierCred);
-        *pVerifierCred = NULL;
-    }
-
-    json_decref(cred);
+    if (ticket != NULL)
+        _BIDReleaseReauthTicket(context, ticket);
 
     return err;
 }
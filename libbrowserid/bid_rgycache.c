@@ -641,6 +641,8 @@ struct BIDCacheOps _BIDRegistryCache = {
     _BIDRegistryCacheGetObject,
     _BIDRegistryCacheSetObject,
     _BIDRegistryCacheRemoveObject,
+    NULL, /* AddObject */
     _BIDRegistryCacheFirstObject,
     _BIDRegistryCacheNextObject,
+    NULL, /* PurgeObjects */
 };
@@ -53,6 +53,7 @@ BIDMakeRPResponseToken(
     struct BIDJWTDesc jwt = { 0 };
     struct BIDBackedAssertionDesc backedAssertion = { 0 };
     BIDJWK key = NULL;
+    BIDSecretHandle rrk = NULL;
     json_t *payload = NULL;
     json_t *certChain = NULL;
     json_t *dh = NULL;
@@ -104,7 +105,7 @@ BIDMakeRPResponseToken(
     }
     if (err != BID_S_OK &&
         (ulReqFlags & BID_RP_FLAG_HAVE_SESSION_KEY)) {
-        err = _BIDDeriveSessionSubkey(context, identity, "RRK", &key);
+        err = _BIDDeriveSessionSubkey(context, identity, "RRK", &rrk);
         BID_BAIL_ON_ERROR(err);
     }
 
@@ -148,7 +149,7 @@ BIDMakeRPResponseToken(
     backedAssertion.Assertion = &jwt;
     backedAssertion.cCertificates = 0;
 
-    err = _BIDPackBackedAssertion(context, &backedAssertion, key, certChain, pszResponseToken);
+    err = _BIDPackBackedAssertion(context, &backedAssertion, key, rrk, certChain, pszResponseToken);
     BID_BAIL_ON_ERROR(err);
 
     *pchResponseToken = strlen(*pszResponseToken);
@@ -156,6 +157,8 @@ BIDMakeRPResponseToken(
 cleanup:
     json_decref(payload);
     json_decref(key);
+    if (rrk != NULL)
+        _BIDDestroySecret(context, rrk);
     json_decref(certChain);
     json_decref(dh);
     json_decref(jti);
@@ -175,7 +178,7 @@ BIDVerifyRPResponseToken(
     uint32_t *pulRetFlags)
 {
     BIDError err;
-    BIDJWK verifyCred = NULL;
+    BIDSecretHandle rrk = NULL;
     BIDBackedAssertion backedAssertion = NULL;
     json_t *dh;
     json_t *certParams;
@@ -186,6 +189,8 @@ BIDVerifyRPResponseToken(
     *pulRetFlags = 0;
 
     err = _BIDUnpackBackedAssertion(context, szAssertion, &backedAssertion);
+    if (err != BID_S_OK)
+        _BIDCountVerifyRejection(context, BID_VERIFY_STAGE_PARSE);
     BID_BAIL_ON_ERROR(err);
 
     err = _BIDGetKeyAgreementObject(context, backedAssertion->Assertion->Payload, &dh);
@@ -195,7 +200,7 @@ BIDVerifyRPResponseToken(
     }
 
     if (ulReqFlags & BID_RP_FLAG_HAVE_SESSION_KEY) {
-        err = _BIDDeriveSessionSubkey(context, identity, "RRK", &verifyCred);
+        err = _BIDDeriveSessionSubkey(context, identity, "RRK", &rrk);
         BID_BAIL_ON_ERROR(err);
     }
 
@@ -204,7 +209,7 @@ BIDVerifyRPResponseToken(
     ulVerifyReqFlags = BID_VERIFY_FLAG_RP;
 
     err = _BIDVerifyLocal(context, NULL, backedAssertion, NULL, szAudienceName,
-                          NULL, 0, time(NULL), ulVerifyReqFlags, verifyCred,
+                          NULL, 0, time(NULL), ulVerifyReqFlags, rrk,
                           certParams, NULL, &ulVerifyRetFlags);
     BID_BAIL_ON_ERROR(err);
 
@@ -263,7 +268,8 @@ cleanup:
         *pPayload = json_incref(backedAssertion->Assertion->Payload);
 
     _BIDReleaseBackedAssertion(context, backedAssertion);
-    json_decref(verifyCred);
+    if (rrk != NULL)
+        _BIDDestroySecret(context, rrk);
 
     return err;
 }
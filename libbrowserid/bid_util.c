@@ -133,33 +133,57 @@ _BIDDecodeJson(
     BIDContext context,
     const char *encodedJson,
     json_t **pjData)
+{
+    return _BIDDecodeJsonLength(context, encodedJson, strlen(encodedJson), pjData);
+}
+
+/*
+ * The decoded JSON only needs to live until json_loads() returns, so use
+ * the per-thread arena where possible.
+ */
+BIDError
+_BIDDecodeJsonLength(
+    BIDContext context,
+    const char *encodedJson,
+    size_t cchEncodedJson,
+    json_t **pjData)
 {
     BIDError err;
-    char *szJson = NULL;
+    char *szJson, *szBuffer = NULL;
     size_t cbJson;
     json_t *jData;
 
     *pjData = NULL;
 
-    err = _BIDBase64UrlDecode(encodedJson, (unsigned char **)&szJson, &cbJson);
-    if (err != BID_S_OK) {
-        BIDFree(szJson);
-        return err;
+    szJson = _BIDGetThreadArena(cchEncodedJson + 1);
+    if (szJson == NULL) {
+        szJson = szBuffer = BIDMalloc(cchEncodedJson + 1);
+        if (szJson == NULL)
+            return BID_S_NO_MEMORY;
     }
 
+    cbJson = cchEncodedJson; /* leave room for terminator */
+
+    err = _BIDBase64UrlDecodeLength(encodedJson, cchEncodedJson,
+                                    (unsigned char **)&szJson, &cbJson);
+    BID_BAIL_ON_ERROR(err);
+
     /* XXX check valid string first? */
     szJson[cbJson] = '\0';
 
-    jData = json_loads(szJson, 0, &context->JsonError);
+    jData = json_loads(szJson, 0, BID_JSON_ERROR(context));
     if (jData == NULL) {
-        BIDFree(szJson);
-        return BID_S_INVALID_JSON;
+        err = BID_S_INVALID_JSON;
+        goto cleanup;
     }
 
-    BIDFree(szJson);
     *pjData = jData;
+    err = BID_S_OK;
 
-    return BID_S_OK;
+cleanup:
+    BIDFree(szBuffer);
+
+    return err;
 }
 
 BIDError
@@ -167,9 +191,24 @@ _BIDUnpackBackedAssertion(
     BIDContext context,
     const char *encodedJson,
     BIDBackedAssertion *pAssertion)
+{
+    return _BIDUnpackBackedAssertionInternal(context, encodedJson, 0, pAssertion);
+}
+
+/*
+ * The JWTs borrow their encoded data from the backed assertion, so
+ * it is only copied once. If BID_JWT_FLAG_LAZY_PAYLOAD is set, the
+ * identity assertion payload is left to _BIDDecodeJWTPayload().
+ */
+BIDError
+_BIDUnpackBackedAssertionInternal(
+    BIDContext context,
+    const char *encodedJson,
+    uint32_t ulFlags,
+    BIDBackedAssertion *pAssertion)
 {
     BIDError err;
-    char *p;
+    char *p, *pEnd;
     BIDBackedAssertion assertion = NULL;
 
     if (encodedJson == NULL) {
@@ -187,10 +226,12 @@ _BIDUnpackBackedAssertion(
     BID_BAIL_ON_ERROR(err);
 
     assertion->EncDataLength = strlen(assertion->EncData);
+    pEnd = assertion->EncData + assertion->EncDataLength;
 
     for (p = assertion->EncData; p != NULL; ) {
-        char *q = strchr(p, '~');
+        char *q = memchr(p, '~', pEnd - p);
         BIDJWT *pDst;
+        uint32_t ulJwtFlags = BID_JWT_FLAG_BORROW_DATA;
 
         if (q != NULL) {
             if (assertion->cCertificates >= BID_MAX_CERTS) {
@@ -198,24 +239,20 @@ _BIDUnpackBackedAssertion(
                 goto cleanup;
             }
 
-            *q = '\0';
             pDst = &assertion->rCertificates[assertion->cCertificates];
         } else {
             pDst = &assertion->Assertion;
+            ulJwtFlags |= (ulFlags & BID_JWT_FLAG_LAZY_PAYLOAD);
         }
 
-        err = _BIDParseJWT(context, p, pDst);
+        err = _BIDParseJWTInternal(context, p, (q != NULL ? q : pEnd) - p,
+                                   ulJwtFlags, pDst);
         BID_BAIL_ON_ERROR(err);
 
         if (*pDst != assertion->Assertion)
             assertion->cCertificates++;
 
-        if (q == NULL) {
-            p = NULL;
-        } else {
-            *q = '~';
-            p = q + 1;
-        }
+        p = (q != NULL) ? q + 1 : NULL;
     }
 
     if (assertion->Assertion == NULL) {
@@ -223,9 +260,11 @@ _BIDUnpackBackedAssertion(
         goto cleanup;
     }
 
-    BID_ASSERT(assertion->Assertion->Payload != NULL);
+    BID_ASSERT(assertion->Assertion->Payload != NULL ||
+               (ulFlags & BID_JWT_FLAG_LAZY_PAYLOAD));
 
-    _BIDOutputDebugJson(assertion->Assertion->Payload);
+    if (assertion->Assertion->Payload != NULL)
+        _BIDOutputDebugJson(assertion->Assertion->Payload);
 
     *pAssertion = assertion;
 
@@ -241,6 +280,7 @@ _BIDPackBackedAssertion(
     BIDContext context,
     BIDBackedAssertion assertion,
     BIDJWKSet keyset,
+    BIDSecretHandle secretHandle,
     json_t *certChain,
     char **pEncodedJson)
 {
@@ -260,13 +300,14 @@ _BIDPackBackedAssertion(
 
     _BIDOutputDebugJson(assertion->Assertion->Payload);
 
-    err = _BIDMakeSignature(context, assertion->Assertion, keyset, certChain,
-                            &szEncodedAssertion, &cchEncodedAssertion);
+    err = _BIDMakeSignature(context, assertion->Assertion, keyset, secretHandle,
+                            certChain, &szEncodedAssertion, &cchEncodedAssertion);
     BID_BAIL_ON_ERROR(err);
 
     for (i = 0; i < assertion->cCertificates; i++) {
         err = _BIDMakeSignature(context, assertion->rCertificates[i], keyset,
-                                NULL, &szEncodedCerts[i], &cchEncodedCerts[i]);
+                                secretHandle, NULL,
+                                &szEncodedCerts[i], &cchEncodedCerts[i]);
         BID_BAIL_ON_ERROR(err);
     }
 
@@ -47,42 +47,53 @@
  * Party MAY choose the length of that interval, though it is recommended
  * it be less than 5 minutes.
  */
-BIDError
-_BIDValidateExpiry(
+static BIDError
+_BIDValidateTimes(
     BIDContext context,
     time_t verificationTime,
-    json_t *jwt)
+    uint32_t ulClaims,
+    time_t issueTime,
+    time_t notBefore,
+    time_t expiryTime)
 {
-    BIDError err = BID_S_OK;
-    time_t issueTime = 0, notBefore = 0, expiryTime = 0;
+    if ((ulClaims & BID_JWT_CLAIM_IAT) && issueTime - verificationTime > context->Skew)
+        return BID_S_INVALID_ASSERTION;
 
-    err = _BIDGetJsonTimestampValue(context, jwt, "iat", &issueTime);
-    if (err == BID_S_OK && issueTime - verificationTime > context->Skew) {
-        err = BID_S_INVALID_ASSERTION;
-        goto cleanup;
-    }
+    if ((ulClaims & BID_JWT_CLAIM_NBF) && notBefore - verificationTime > context->Skew)
+        return BID_S_ASSERTION_NOT_YET_VALID;
 
-    err = _BIDGetJsonTimestampValue(context, jwt, "nbf", &notBefore);
-    if (err == BID_S_OK && notBefore - verificationTime > context->Skew) {
-        err = BID_S_ASSERTION_NOT_YET_VALID;
-        goto cleanup;
-    }
+    if ((ulClaims & BID_JWT_CLAIM_EXP) == 0) {
+        if (issueTime == 0)
+            return BID_S_UNKNOWN_JSON_KEY;
 
-    err = _BIDGetJsonTimestampValue(context, jwt, "exp", &expiryTime);
-    if (err == BID_S_UNKNOWN_JSON_KEY && issueTime != 0) {
         /* XXX use Skew as default lifetime as well as clock skew */
         expiryTime = issueTime + context->Skew;
-        err = BID_S_OK;
     }
-    BID_BAIL_ON_ERROR(err);
 
-    if (verificationTime - expiryTime > context->Skew) {
-        err = BID_S_EXPIRED_ASSERTION;
-        goto cleanup;
-    }
+    if (verificationTime - expiryTime > context->Skew)
+        return BID_S_EXPIRED_ASSERTION;
 
-cleanup:
-    return err;
+    return BID_S_OK;
+}
+
+BIDError
+_BIDValidateExpiry(
+    BIDContext context,
+    time_t verificationTime,
+    json_t *jwt)
+{
+    time_t issueTime = 0, notBefore = 0, expiryTime = 0;
+    uint32_t ulClaims = 0;
+
+    if (_BIDGetJsonTimestampValue(context, jwt, "iat", &issueTime) == BID_S_OK)
+        ulClaims |= BID_JWT_CLAIM_IAT;
+    if (_BIDGetJsonTimestampValue(context, jwt, "nbf", &notBefore) == BID_S_OK)
+        ulClaims |= BID_JWT_CLAIM_NBF;
+    if (_BIDGetJsonTimestampValue(context, jwt, "exp", &expiryTime) == BID_S_OK)
+        ulClaims |= BID_JWT_CLAIM_EXP;
+
+    return _BIDValidateTimes(context, verificationTime, ulClaims,
+                             issueTime, notBefore, expiryTime);
 }
 
 static BIDError
@@ -177,6 +188,48 @@ cleanup:
     return err;
 }
 
+/*
+ * Reject an assertion on its audience or validity period before the
+ * payload is parsed. Anything that cannot be decided from the claims
+ * alone is left to _BIDValidateAudience() and _BIDValidateExpiry().
+ */
+static BIDError
+_BIDValidateClaims(
+    BIDContext context,
+    BIDJWT jwt,
+    const char *szAudienceOrSpn,
+    time_t verificationTime)
+{
+    BIDError err;
+    struct BIDJWTClaimsDesc claims;
+
+    if (_BIDGetJWTClaims(context, jwt, &claims) != BID_S_OK)
+        return BID_S_OK;
+
+    if (szAudienceOrSpn != NULL && (claims.Opaque & BID_JWT_CLAIM_AUD) == 0) {
+        if (claims.Audience == NULL)
+            err = BID_S_MISSING_AUDIENCE;
+        else if (strcmp(szAudienceOrSpn, claims.Audience) == 0)
+            err = BID_S_OK;
+        else if (context->ContextOptions & BID_CONTEXT_HOST_SPN_ALIAS)
+            err = _BIDValidateAudienceHostAlias(context, szAudienceOrSpn, claims.Audience);
+        else
+            err = BID_S_BAD_AUDIENCE;
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    if ((claims.Opaque & BID_JWT_CLAIM_TIMES) == 0) {
+        err = _BIDValidateTimes(context, verificationTime, claims.Present,
+                                claims.IssuedAt, claims.NotBefore, claims.Expiry);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    err = BID_S_OK;
+
+cleanup:
+    return err;
+}
+
 /*
  * From https://github.com/mozilla/id-specs/blob/prod/browserid/index.md:
  *
@@ -250,6 +303,38 @@ _BIDValidateCertIssuer(
                                      verificationTime);
 }
 
+/*
+ * Retrieve the authorities that _BIDVerifyLocal would consult for this
+ * assertion, so that they are in the authority cache when it is verified.
+ */
+BIDError
+_BIDPrefetchCertAuthorities(
+    BIDContext context,
+    BIDBackedAssertion backedAssertion,
+    time_t verificationTime,
+    uint32_t ulReqFlags)
+{
+    BIDError err;
+    BIDAuthority authority = NULL;
+    const char *szCertIssuer;
+
+    if (backedAssertion->cCertificates == 0)
+        return BID_S_OK;
+
+    szCertIssuer = json_string_value(json_object_get(_BIDRootCert(context, backedAssertion), "iss"));
+    if (szCertIssuer == NULL)
+        return BID_S_MISSING_ISSUER;
+
+    err = _BIDAcquireAuthority(context, szCertIssuer, verificationTime, &authority);
+    if (err != BID_S_OK)
+        return err;
+
+    _BIDReleaseAuthority(context, authority);
+
+    /* follows any delegation from the email domain to the issuer */
+    return _BIDValidateCertIssuer(context, backedAssertion, verificationTime, ulReqFlags);
+}
+
 /*
  * From https://github.com/mozilla/id-specs/blob/prod/browserid/index.md:
  *
@@ -317,6 +402,106 @@ cleanup:
     return err;
 }
 
+/*
+ * Checks that depend only on the assertion itself and the replay cache,
+ * run before any authority is consulted or signature verified so that
+ * junk is rejected as cheaply as possible.
+ */
+BIDError
+_BIDVerifyClaims(
+    BIDContext context,
+    BIDReplayCache replayCache,
+    BIDBackedAssertion backedAssertion,
+    const char *szAudience,
+    const unsigned char *pbChannelBindings,
+    size_t cbChannelBindings,
+    time_t verificationTime,
+    uint32_t ulReqFlags)
+{
+    BIDError err;
+    BIDJWT assertion = backedAssertion->Assertion;
+    BIDVerifyStage stage = BID_VERIFY_STAGE_CLAIMS;
+    uint32_t ulOpts = 0;
+
+    if (assertion->Payload == NULL) {
+        err = _BIDValidateClaims(context, assertion, szAudience, verificationTime);
+        BID_BAIL_ON_ERROR(err);
+
+        stage = BID_VERIFY_STAGE_PARSE;
+
+        err = _BIDDecodeJWTPayload(context, assertion);
+        BID_BAIL_ON_ERROR(err);
+
+        stage = BID_VERIFY_STAGE_CLAIMS;
+    }
+
+    /* Only allow one certificate for now */
+    if (backedAssertion->cCertificates > 1) {
+        err = BID_S_TOO_MANY_CERTS;
+        goto cleanup;
+    }
+
+    /*
+     * Assertions requesting an extra round trip are exempt from replay
+     * detection, see _BIDVerifyBackedAssertion().
+     */
+    if ((ulReqFlags & (BID_VERIFY_FLAG_RP | BID_VERIFY_FLAG_NO_REPLAY_CACHE)) == 0 &&
+        (context->ContextOptions & BID_CONTEXT_REPLAY_CACHE) &&
+        backedAssertion->EncData != NULL) {
+        err = _BIDParseProtocolOpts(context, json_object_get(assertion->Payload, "opts"), &ulOpts);
+        BID_BAIL_ON_ERROR(err);
+
+        if ((ulOpts & BID_VERIFY_FLAG_EXTRA_ROUND_TRIP) == 0) {
+            stage = BID_VERIFY_STAGE_REPLAY;
+
+            err = _BIDCheckReplayCache(context, replayCache, backedAssertion->EncData);
+            BID_BAIL_ON_ERROR(err);
+
+            stage = BID_VERIFY_STAGE_CLAIMS;
+        }
+    }
+
+    err = _BIDValidateAudience(context, backedAssertion, szAudience, pbChannelBindings, cbChannelBindings);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDValidateExpiry(context, verificationTime, assertion->Payload);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    if (err != BID_S_OK)
+        _BIDCountVerifyRejection(context, stage);
+
+    return err;
+}
+
+void
+_BIDCountVerifyRejection(
+    BIDContext context,
+    BIDVerifyStage stage)
+{
+    BID_ASSERT(stage < BID_VERIFY_STAGE_MAX);
+
+    BID_ATOMIC_INCREMENT(&context->VerifyStats->Rejections[stage]);
+}
+
+BIDError
+BIDGetVerifyRejections(
+    BIDContext context,
+    BIDVerifyStage stage,
+    unsigned long *pcRejections)
+{
+    *pcRejections = 0;
+
+    BID_CONTEXT_VALIDATE(context);
+
+    if ((unsigned int)stage >= BID_VERIFY_STAGE_MAX)
+        return BID_S_INVALID_PARAMETER;
+
+    *pcRejections = (unsigned long)context->VerifyStats->Rejections[stage];
+
+    return BID_S_OK;
+}
+
 /*
  * Local verifier. This code path is used in the following cases:
  *
@@ -347,14 +532,17 @@ _BIDVerifyLocal(
     size_t cbChannelBindings,
     time_t verificationTime,
     uint32_t ulReqFlags,
-    BIDJWK verifyCred,
+    BIDSecretHandle verifySecret,
     json_t *certAnchors,
     BIDIdentity *pVerifiedIdentity,
     uint32_t *pulRetFlags)
 {
     BIDError err;
     BIDIdentity verifiedIdentity = BID_C_NO_IDENTITY;
+    BIDJWK verifyCred = NULL;
+    int bReauth = 0;
     json_t *x509Certificate = NULL;
+    BIDVerifyStage stage = BID_VERIFY_STAGE_SIGNATURE;
 
     if (pVerifiedIdentity != NULL)
         *pVerifiedIdentity = BID_C_NO_IDENTITY;
@@ -363,7 +551,6 @@ _BIDVerifyLocal(
     BID_CONTEXT_VALIDATE(context);
 
     BID_ASSERT(backedAssertion->Assertion != NULL);
-    BID_ASSERT(backedAssertion->Assertion->Payload != NULL);
     BID_ASSERT((ulReqFlags & BID_VERIFY_FLAG_RP) || szSubjectName == NULL);
 
     if ((ulReqFlags & BID_VERIFY_FLAG_REAUTH) &&
@@ -372,7 +559,15 @@ _BIDVerifyLocal(
     if (ulReqFlags & BID_VERIFY_FLAG_RP)
         *pulRetFlags |= BID_VERIFY_FLAG_RP;
 
-    json_incref(verifyCred);
+    if ((ulReqFlags & BID_VERIFY_FLAG_CLAIMS_VERIFIED) == 0) {
+        err = _BIDVerifyClaims(context, replayCache, backedAssertion, szAudience,
+                               pbChannelBindings, cbChannelBindings,
+                               verificationTime, ulReqFlags);
+        if (err != BID_S_OK)
+            return err;
+    }
+
+    BID_ASSERT(backedAssertion->Assertion->Payload != NULL);
 
     if (backedAssertion->cCertificates == 0) {
         x509Certificate = json_object_get(backedAssertion->Assertion->Header, "x5c");
@@ -383,38 +578,33 @@ _BIDVerifyLocal(
                                    certAnchors, verificationTime);
             BID_BAIL_ON_ERROR(err);
 
-            verifyCred = json_incref(backedAssertion->Assertion->Header);
+            verifyCred = backedAssertion->Assertion->Header;
             *pulRetFlags |= BID_VERIFY_FLAG_X509 | BID_VERIFY_FLAG_VALIDATED_CERTS;
         } else if (ulReqFlags & BID_VERIFY_FLAG_REAUTH) {
-            BID_ASSERT(verifyCred == NULL);
+            BID_ASSERT(verifySecret == NULL);
             BID_ASSERT((ulReqFlags & BID_VERIFY_FLAG_RP) == 0);
 
+            /* this also verifies the signature with the ticket key */
             err = _BIDVerifyReauthAssertion(context, replayCache,
                                             backedAssertion, verificationTime,
-                                            &verifiedIdentity, &verifyCred, pulRetFlags);
+                                            &verifiedIdentity, pulRetFlags);
             BID_BAIL_ON_ERROR(err);
+
+            bReauth = 1;
         } else if ((ulReqFlags & BID_VERIFY_FLAG_RP) == 0) {
             err = BID_S_INVALID_ASSERTION;
             goto cleanup;
         }
     }
 
-    err = _BIDValidateAudience(context, backedAssertion, szAudience, pbChannelBindings, cbChannelBindings);
-    BID_BAIL_ON_ERROR(err);
-
-    err = _BIDValidateExpiry(context, verificationTime, backedAssertion->Assertion->Payload);
-    BID_BAIL_ON_ERROR(err);
-
-    /* Only allow one certificate for now */
-    if (backedAssertion->cCertificates > 1) {
-        err = BID_S_TOO_MANY_CERTS;
-        goto cleanup;
-    }
-
     if (backedAssertion->cCertificates > 0) {
+        stage = BID_VERIFY_STAGE_AUTHORITY;
+
         err = _BIDValidateCertIssuer(context, backedAssertion, verificationTime, ulReqFlags);
         BID_BAIL_ON_ERROR(err);
 
+        stage = BID_VERIFY_STAGE_SIGNATURE;
+
         err = _BIDValidateCertChain(context, backedAssertion, verificationTime);
         BID_BAIL_ON_ERROR(err);
 
@@ -422,10 +612,17 @@ _BIDVerifyLocal(
         *pulRetFlags |= BID_VERIFY_FLAG_VALIDATED_CERTS;
     }
 
-    BID_ASSERT(verifyCred != NULL);
-
-    err = _BIDVerifyAssertionSignature(context, backedAssertion, verifyCred);
-    BID_BAIL_ON_ERROR(err);
+    /* a certificate or X.509 key takes precedence over any session key */
+    if (verifyCred != NULL) {
+        err = _BIDVerifyAssertionSignature(context, backedAssertion, verifyCred);
+        BID_BAIL_ON_ERROR(err);
+    } else if (verifySecret != NULL) {
+        err = _BIDVerifySecretKeySignature(context, backedAssertion->Assertion, verifySecret);
+        BID_BAIL_ON_ERROR(err);
+    } else if (!bReauth) {
+        err = BID_S_NO_KEY;
+        goto cleanup;
+    }
 
     if (verifiedIdentity == BID_C_NO_IDENTITY) {
         err = _BIDPopulateIdentity(context, backedAssertion, *pulRetFlags, &verifiedIdentity);
@@ -449,9 +646,10 @@ _BIDVerifyLocal(
         *pVerifiedIdentity = verifiedIdentity;
 
 cleanup:
+    if (err != BID_S_OK)
+        _BIDCountVerifyRejection(context, stage);
     if (err != BID_S_OK || pVerifiedIdentity == NULL)
         BIDReleaseIdentity(context, verifiedIdentity);
-    json_decref(verifyCred);
 
     return err;
 }
@@ -389,8 +389,10 @@ static BIDError
 _BIDMakeShaDigestInternal(
     LPCWSTR wszAlgID,
     BIDContext context BID_UNUSED,
-    BIDJWT jwt,
-    BIDJWK jwk,
+    const unsigned char *pbKey,
+    size_t cbKey,
+    const unsigned char *pbData,
+    size_t cbData,
     unsigned char *digest,
     size_t *digestLength)
 {
@@ -399,27 +401,19 @@ _BIDMakeShaDigestInternal(
     BCRYPT_HASH_HANDLE hHash = NULL;
     NTSTATUS nts;
     PUCHAR pbHashObject = NULL;
-    DWORD cbHashObject, cbHash, cbData;
-    PBYTE pbKey = NULL;
-    size_t cbKey = 0;
-
-    if (jwk != NULL) {
-        err = _BIDGetJsonBinaryValue(context, jwk, "secret-key",
-                                     &pbKey, &cbKey);
-        BID_BAIL_ON_ERROR(err);
-    }
+    DWORD cbHashObject, cbHash, cbProperty;
 
     nts = BCryptOpenAlgorithmProvider(&hAlg,
                                       wszAlgID,
                                       NULL,
-                                      jwk ? BCRYPT_ALG_HANDLE_HMAC_FLAG : 0);
+                                      pbKey ? BCRYPT_ALG_HANDLE_HMAC_FLAG : 0);
     BID_BAIL_ON_ERROR((err = _BIDNtStatusToBIDError(nts)));
 
     nts = BCryptGetProperty(hAlg,
                             BCRYPT_OBJECT_LENGTH,
                             (PUCHAR)&cbHashObject,
                             sizeof(DWORD),
-                            &cbData,
+                            &cbProperty,
                             0);
     BID_BAIL_ON_ERROR((err = _BIDNtStatusToBIDError(nts)));
 
@@ -433,7 +427,7 @@ _BIDMakeShaDigestInternal(
                             BCRYPT_HASH_LENGTH,
                             (PUCHAR)&cbHash,
                             sizeof(DWORD),
-                            &cbData,
+                            &cbProperty,
                             0);
     BID_BAIL_ON_ERROR((err = _BIDNtStatusToBIDError(nts)));
 
@@ -446,14 +440,14 @@ _BIDMakeShaDigestInternal(
                            &hHash,
                            pbHashObject,
                            cbHashObject,
-                           pbKey,
-                           cbKey,
+                           (PUCHAR)pbKey,
+                           (ULONG)cbKey,
                            0);
     BID_BAIL_ON_ERROR((err = _BIDNtStatusToBIDError(nts)));
 
     nts = BCryptHashData(hHash,
-                         (PUCHAR)jwt->EncData,
-                         jwt->EncDataLength,
+                         (PUCHAR)pbData,
+                         (ULONG)cbData,
                          0);
     BID_BAIL_ON_ERROR((err = _BIDNtStatusToBIDError(nts)));
 
@@ -471,10 +465,6 @@ cleanup:
         BCryptCloseAlgorithmProvider(hAlg, 0);
     if (hHash != NULL)
         BCryptDestroyHash(hHash);
-    if (pbKey != NULL) {
-        SecureZeroMemory(pbKey, cbKey);
-        BIDFree(pbKey);
-    }
     BIDFree(pbHashObject);
 
     return err;
@@ -491,14 +481,29 @@ _BIDMakeShaDigest(
 {
     BIDError err;
     LPCWSTR wszAlgID;
+    PBYTE pbKey = NULL;
+    size_t cbKey = 0;
 
     err = _BIDMapHashAlgorithmID(algorithm, &wszAlgID);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDMakeShaDigestInternal(wszAlgID, context, jwt, jwk, digest, digestLength);
+    if (jwk != NULL) {
+        err = _BIDGetJsonBinaryValue(context, jwk, "secret-key",
+                                     &pbKey, &cbKey);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    err = _BIDMakeShaDigestInternal(wszAlgID, context, pbKey, cbKey,
+                                    (PUCHAR)jwt->EncData, jwt->EncDataLength,
+                                    digest, digestLength);
     BID_BAIL_ON_ERROR(err);
 
 cleanup:
+    if (pbKey != NULL) {
+        SecureZeroMemory(pbKey, cbKey);
+        BIDFree(pbKey);
+    }
+
     return err;
 }
 
@@ -1294,6 +1299,14 @@ _BIDJWTAlgorithms[] = {
     },
 };
 
+/*
+ * CNG is thread-safe, so there is nothing to do here.
+ */
+void
+_BIDCryptoThreadInit(void)
+{
+}
+
 BIDError
 _BIDMakeDigestInternal(
     BIDContext context,
@@ -1303,7 +1316,7 @@ _BIDMakeDigestInternal(
     BIDError err;
     LPCSTR szAlgID;
     LPCWSTR wszAlgID;
-    struct BIDJWTDesc jwt = { 0 };
+    const char *szValue;
     UCHAR pbDigest[64]; /* longest known hash is SHA-512 */
     size_t cbDigest;
     json_t *dig = NULL;
@@ -1317,12 +1330,12 @@ _BIDMakeDigestInternal(
     err = _BIDMapHashAlgorithmIDByName(szAlgID, &wszAlgID);
     BID_BAIL_ON_ERROR(err);
 
-    jwt.EncData = (LPSTR)json_string_value(value);
-    jwt.EncDataLength = strlen(jwt.EncData);
+    szValue = json_string_value(value);
 
     cbDigest = sizeof(pbDigest);
 
-    err = _BIDMakeShaDigestInternal(wszAlgID, context, &jwt, NULL,
+    err = _BIDMakeShaDigestInternal(wszAlgID, context, NULL, 0,
+                                    (PUCHAR)szValue, strlen(szValue),
                                     pbDigest, &cbDigest);
     BID_BAIL_ON_ERROR(err);
 
@@ -2883,6 +2896,58 @@ _BIDImportSecretKeyData(
     return _BIDAllocSecret(context, &keyInput, pSecretHandle);
 }
 
+BIDError
+_BIDExportSecretKeyData(
+    BIDContext context BID_UNUSED,
+    BIDSecretHandle secretHandle,
+    unsigned char **ppbSecret,
+    size_t *pcbSecret)
+{
+    *ppbSecret = NULL;
+    *pcbSecret = 0;
+
+    /* key agreement secrets are not exportable from CNG */
+    if (secretHandle == NULL ||
+        secretHandle->SecretType != SECRET_TYPE_IMPORTED ||
+        secretHandle->SecretData.Imported.pbSecret == NULL)
+        return BID_S_INVALID_SECRET;
+
+    *ppbSecret = BIDMalloc(secretHandle->SecretData.Imported.cbSecret);
+    if (*ppbSecret == NULL)
+        return BID_S_NO_MEMORY;
+
+    CopyMemory(*ppbSecret,
+               secretHandle->SecretData.Imported.pbSecret,
+               secretHandle->SecretData.Imported.cbSecret);
+    *pcbSecret = secretHandle->SecretData.Imported.cbSecret;
+
+    return BID_S_OK;
+}
+
+/*
+ * HMAC-SHA256 keyed directly from a secret handle, so that session keys
+ * need not round-trip through a JWK to sign or verify a JWT.
+ */
+BIDError
+_BIDSecretKeyHMAC(
+    BIDContext context,
+    BIDSecretHandle secretHandle,
+    const unsigned char *pbData,
+    size_t cbData,
+    unsigned char *pbHmac,
+    size_t *pcbHmac)
+{
+    if (secretHandle == NULL ||
+        secretHandle->SecretType != SECRET_TYPE_IMPORTED ||
+        secretHandle->SecretData.Imported.pbSecret == NULL)
+        return BID_S_INVALID_SECRET;
+
+    return _BIDMakeShaDigestInternal(BCRYPT_SHA256_ALGORITHM, context,
+                                     secretHandle->SecretData.Imported.pbSecret,
+                                     secretHandle->SecretData.Imported.cbSecret,
+                                     pbData, cbData, pbHmac, pcbHmac);
+}
+
 BIDError
 _BIDGenerateECDHKey(
     BIDContext context,
@@ -2979,3 +3044,28 @@ cleanup:
 
     return err;
 }
+
+BIDError
+_BIDGetKeyCacheStatistics(
+    BIDContext context BID_UNUSED,
+    uint64_t *pHits,
+    uint64_t *pMisses)
+{
+    *pHits = 0;
+    *pMisses = 0;
+
+    return BID_S_NOT_IMPLEMENTED;
+}
+
+BIDError
+_BIDGetECDHKeyPoolStatistics(
+    BIDContext context BID_UNUSED,
+    json_t *ecDhParams BID_UNUSED,
+    size_t *pcKeys,
+    size_t *pcMaxKeys)
+{
+    *pcKeys = 0;
+    *pcMaxKeys = 0;
+
+    return BID_S_NOT_IMPLEMENTED;
+}
@@ -44,6 +44,9 @@
 #define BID_IMS_HTTP_HEADER         L"If-Modified-Since: "
 #define BID_IMS_HTTP_HEADER_SIZE    (sizeof(BID_IMS_HTTP_HEADER) - sizeof(WCHAR))
 
+#define BID_INM_HTTP_HEADER         L"If-None-Match: "
+#define BID_INM_HTTP_HEADER_SIZE    (sizeof(BID_INM_HTTP_HEADER) - sizeof(WCHAR))
+
 /* XXX */
 static BIDError
 WinHttpStatusToBIDError(void)
@@ -232,6 +235,8 @@ _BIDMakeHttpRequest(
     switch (dwStatusCode) {
     case 304:
         err = BID_S_DOCUMENT_NOT_MODIFIED;
+        if (pExpiryTime != NULL)
+            _BIDGetHttpExpiry(context, hRequest, pExpiryTime);
         goto cleanup;
     case 200:
         err = BID_S_OK;
@@ -248,7 +253,7 @@ _BIDMakeHttpRequest(
 
     buffer.Data[buffer.Offset] = '\0';
 
-    *pJsonDoc = json_loads(buffer.Data, 0, &context->JsonError);
+    *pJsonDoc = json_loads(buffer.Data, 0, BID_JSON_ERROR(context));
     if (*pJsonDoc == NULL) {
         err = BID_S_INVALID_JSON;
         goto cleanup;
@@ -263,16 +268,108 @@ cleanup:
     return err;
 }
 
+static BIDError
+_BIDSetHttpIfNoneMatch(
+    BIDContext context,
+    HINTERNET hRequest,
+    const char *szETag)
+{
+    BIDError err;
+    PWSTR wszETag = NULL;
+    PWSTR wszHeader = NULL;
+    size_t cchHeader;
+
+    err = _BIDUtf8ToUcs2(context, szETag, &wszETag);
+    BID_BAIL_ON_ERROR(err);
+
+    cchHeader = BID_INM_HTTP_HEADER_SIZE / sizeof(WCHAR) + wcslen(wszETag) + 1;
+
+    wszHeader = BIDMalloc(cchHeader * sizeof(WCHAR));
+    if (wszHeader == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    _snwprintf(wszHeader, cchHeader, L"%s%s", BID_INM_HTTP_HEADER, wszETag);
+
+    if (!WinHttpAddRequestHeaders(hRequest, wszHeader, (ULONG)-1,
+                                  WINHTTP_ADDREQ_FLAG_ADD)) {
+        err = WinHttpStatusToBIDError();
+        goto cleanup;
+    }
+
+cleanup:
+    BIDFree(wszETag);
+    BIDFree(wszHeader);
+
+    return err;
+}
+
+/*
+ * Record the response validators, so that the document can later be
+ * revalidated with a conditional request. A full response replaces any
+ * existing validators; a 304 response only updates those it contains.
+ */
+static void
+_BIDPopulateCacheMetadata(
+    BIDContext context,
+    HINTERNET hRequest,
+    BIDError httpErr,
+    json_t *cacheMetadata)
+{
+    DWORD dwSize;
+    SYSTEMTIME st;
+    FILETIME ft;
+    time_t lastModified;
+    WCHAR wszETag[256];
+    char *szETag = NULL;
+
+    if (cacheMetadata == NULL)
+        return;
+
+    if (httpErr == BID_S_OK) {
+        json_object_del(cacheMetadata, "last-modified");
+        json_object_del(cacheMetadata, "etag");
+    }
+
+    dwSize = sizeof(st);
+    if (WinHttpQueryHeaders(hRequest,
+                            WINHTTP_QUERY_LAST_MODIFIED |
+                               WINHTTP_QUERY_FLAG_SYSTEMTIME,
+                            NULL,
+                            &st,
+                            &dwSize,
+                            WINHTTP_NO_HEADER_INDEX) &&
+        SystemTimeToFileTime(&st, &ft) &&
+        _BIDTimeToSecondsSince1970(context, &ft, &lastModified) == BID_S_OK)
+        _BIDSetJsonTimestampValue(context, cacheMetadata, "last-modified", lastModified);
+
+    /* an ETag that is too long to keep is simply not used */
+    dwSize = sizeof(wszETag);
+    if (WinHttpQueryHeaders(hRequest,
+                            WINHTTP_QUERY_ETAG,
+                            WINHTTP_HEADER_NAME_BY_INDEX,
+                            wszETag,
+                            &dwSize,
+                            WINHTTP_NO_HEADER_INDEX) &&
+        _BIDUcs2ToUtf8(context, wszETag, &szETag) == BID_S_OK) {
+        json_object_set_new(cacheMetadata, "etag", json_string(szETag));
+        BIDFree(szETag);
+    }
+}
+
 BIDError
 _BIDRetrieveDocument(
     BIDContext context,
     const char *szHostname,
     const char *szRelativeUrl,
-    time_t tIfModifiedSince,
+    json_t *cacheMetadata,
     json_t **pJsonDoc,
     time_t *pExpiryTime)
 {
     BIDError err;
+    time_t tIfModifiedSince = 0;
+    const char *szETag = NULL;
     HINTERNET hSession = NULL;
     HINTERNET hConnect = NULL;
     HINTERNET hRequest = NULL;
@@ -312,6 +409,11 @@ _BIDRetrieveDocument(
         goto cleanup;
     }
 
+    if (cacheMetadata != NULL) {
+        _BIDGetJsonTimestampValue(context, cacheMetadata, "last-modified", &tIfModifiedSince);
+        szETag = json_string_value(json_object_get(cacheMetadata, "etag"));
+    }
+
     if (tIfModifiedSince) {
         WCHAR wszTimeStr[(BID_IMS_HTTP_HEADER_SIZE + WINHTTP_TIME_FORMAT_BUFSIZE) / sizeof(WCHAR)] = BID_IMS_HTTP_HEADER;
         FILETIME ft;
@@ -333,9 +435,17 @@ _BIDRetrieveDocument(
         }
     }
 
+    if (szETag != NULL) {
+        err = _BIDSetHttpIfNoneMatch(context, hRequest, szETag);
+        BID_BAIL_ON_ERROR(err);
+    }
+
     err = _BIDMakeHttpRequest(context, hRequest, WINHTTP_NO_REQUEST_DATA,
                               pJsonDoc, pExpiryTime);
-    BID_BAIL_ON_ERROR(err);
+    if (err != BID_S_OK && err != BID_S_DOCUMENT_NOT_MODIFIED)
+        goto cleanup;
+
+    _BIDPopulateCacheMetadata(context, hRequest, err, cacheMetadata);
 
 cleanup:
     WinHttpCloseHandle(hRequest);
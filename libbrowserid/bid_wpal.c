@@ -51,6 +51,8 @@ static void __cdecl
 _BIDLibraryInit(void)
 {
     json_set_alloc_funcs(BIDMalloc, BIDFree);
+    _BIDAuthorityInit();
+    _BIDReauthInit();
 }
 
 BIDError
@@ -109,6 +111,23 @@ _BIDGetCurrentJsonTimestamp(
     return (*pTs == NULL) ? BID_S_NO_MEMORY : BID_S_OK;
 }
 
+static __declspec(thread) json_error_t _BIDThreadJsonError;
+
+json_error_t *
+_BIDGetThreadJsonError(void)
+{
+    return &_BIDThreadJsonError;
+}
+
+/* Implicit TLS is allocated for every thread, so keep this small */
+static __declspec(thread) unsigned char _BIDThreadArena[8192];
+
+void *
+_BIDGetThreadArena(size_t cb)
+{
+    return (cb <= sizeof(_BIDThreadArena)) ? _BIDThreadArena : NULL;
+}
+
 BIDError
 _BIDUtf8ToUcs2(
     BIDContext context BID_UNUSED,
@@ -229,6 +248,151 @@ _BIDSetJsonFileTimeValue(
     return err;
 }
 
+/*
+ * Work is run on the system thread pool, so there are no threads of
+ * our own to stop when the library is unloaded.
+ */
+void
+_BIDShutdownWorkers(void)
+{
+}
+
+struct BIDParallelForArgs {
+    size_t cItems;
+    volatile long Next;
+    volatile long cRefs;                /* the caller and running helpers */
+    HANDLE hDone;
+    void (*Fn)(void *, size_t);
+    void *Arg;
+};
+
+static void
+_BIDParallelForWork(struct BIDParallelForArgs *args)
+{
+    size_t i;
+
+    for (;;) {
+        i = (size_t)(BID_ATOMIC_INCREMENT(&args->Next) - 1);
+        if (i >= args->cItems)
+            break;
+
+        args->Fn(args->Arg, i);
+    }
+}
+
+static VOID CALLBACK
+_BIDParallelForCallback(PTP_CALLBACK_INSTANCE instance, PVOID arg)
+{
+    struct BIDParallelForArgs *args = (struct BIDParallelForArgs *)arg;
+
+    _BIDParallelForWork(args);
+
+    if (BID_ATOMIC_DECREMENT(&args->cRefs) == 0)
+        SetEventWhenCallbackReturns(instance, args->hDone);
+}
+
+/*
+ * The calling thread is also a worker, so helpers that the system
+ * thread pool starts late find no items left and return at once.
+ */
+BIDError
+_BIDParallelFor(
+    BIDContext context BID_UNUSED,
+    size_t cItems,
+    void (*fn)(void *, size_t),
+    void *arg)
+{
+    struct BIDParallelForArgs args;
+    SYSTEM_INFO si;
+    size_t cHelpers, i;
+
+    args.cItems = cItems;
+    args.Next = 0;
+    args.cRefs = 1;
+    args.Fn = fn;
+    args.Arg = arg;
+
+    GetSystemInfo(&si);
+
+    cHelpers = si.dwNumberOfProcessors > 1 ? si.dwNumberOfProcessors - 1 : 0;
+    if (cHelpers > BID_MAX_WORKER_THREADS - 1)
+        cHelpers = BID_MAX_WORKER_THREADS - 1;
+    if (cHelpers >= cItems)
+        cHelpers = cItems != 0 ? cItems - 1 : 0;
+
+    args.hDone = cHelpers != 0 ? CreateEvent(NULL, TRUE, FALSE, NULL) : NULL;
+    if (args.hDone == NULL)
+        cHelpers = 0;
+
+    for (i = 0; i < cHelpers; i++) {
+        BID_ATOMIC_INCREMENT(&args.cRefs);
+        if (!TrySubmitThreadpoolCallback(_BIDParallelForCallback, &args, NULL)) {
+            BID_ATOMIC_DECREMENT(&args.cRefs);
+            break;
+        }
+    }
+
+    _BIDParallelForWork(&args);
+
+    if (BID_ATOMIC_DECREMENT(&args.cRefs) != 0)
+        WaitForSingleObject(args.hDone, INFINITE);
+
+    if (args.hDone != NULL)
+        CloseHandle(args.hDone);
+
+    return BID_S_OK;
+}
+
+struct BIDRunAsyncArgs {
+    void (*Fn)(void *);
+    void *Arg;
+};
+
+/* the system thread pool has no queue limit, so count outstanding work */
+static volatile long _BIDAsyncWork;
+
+static VOID CALLBACK
+_BIDRunAsyncCallback(PTP_CALLBACK_INSTANCE instance BID_UNUSED, PVOID arg)
+{
+    struct BIDRunAsyncArgs args = *((struct BIDRunAsyncArgs *)arg);
+
+    BIDFree(arg);
+    args.Fn(args.Arg);
+
+    BID_ATOMIC_DECREMENT(&_BIDAsyncWork);
+}
+
+BIDError
+_BIDRunAsync(
+    BIDContext context BID_UNUSED,
+    void (*fn)(void *),
+    void *arg)
+{
+    struct BIDRunAsyncArgs *args;
+
+    if (BID_ATOMIC_INCREMENT(&_BIDAsyncWork) > BID_MAX_QUEUED_WORK) {
+        BID_ATOMIC_DECREMENT(&_BIDAsyncWork);
+        return BID_S_WORK_QUEUE_FULL;
+    }
+
+    args = BIDMalloc(sizeof(*args));
+    if (args == NULL) {
+        BID_ATOMIC_DECREMENT(&_BIDAsyncWork);
+        return BID_S_NO_MEMORY;
+    }
+
+    args->Fn = fn;
+    args->Arg = arg;
+
+    if (!TrySubmitThreadpoolCallback(_BIDRunAsyncCallback, args, NULL)) {
+        BID_ATOMIC_DECREMENT(&_BIDAsyncWork);
+        BIDFree(args);
+        return BID_S_NO_MEMORY;
+    }
+
+    return BID_S_OK;
+}
+
 #ifdef GSSBID_DEBUG
 void
 _BIDOutputDebugJson(json_t *j)
@@ -39,11 +39,14 @@
 
 #include "bid_private.h"
 
+/*
+ * Replace the identity's session key with one derived from the jti; the
+ * new key is also used to sign and verify the XRT token itself.
+ */
 static BIDError
 _BIDDeriveXRTKey(
     BIDContext context,
-    BIDIdentity identity,
-    json_t **pSignKey)
+    BIDIdentity identity)
 {
     BIDError err;
     unsigned char *pbSalt = NULL;
@@ -51,8 +54,6 @@ _BIDDeriveXRTKey(
     unsigned char *pbXRTK = NULL;
     size_t cbXRTK = 0;
     BIDSecretHandle newCMK = NULL;
-    json_t *signKey = NULL;
-    json_t *sk = NULL;
 
     err = _BIDGetJsonBinaryValue(context, identity->PrivateAttributes, "jti", &pbSalt, &cbSalt);
     BID_BAIL_ON_ERROR(err);
@@ -66,20 +67,10 @@ _BIDDeriveXRTKey(
     err = _BIDImportSecretKeyData(context, pbXRTK, cbXRTK, &newCMK);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDAllocJsonObject(context, &signKey);
-    BID_BAIL_ON_ERROR(err);
-
-    err = _BIDJsonBinaryValue(context, pbXRTK, cbXRTK, &sk);
-    BID_BAIL_ON_ERROR(err);
-
-    err = _BIDJsonObjectSet(context, signKey, "secret-key", sk, 0);
-    BID_BAIL_ON_ERROR(err);
-
     _BIDDestroySecret(context, identity->SecretHandle);
     identity->SecretHandle = newCMK;
 
     err = BID_S_OK;
-    *pSignKey = signKey;
 
 cleanup:
     BIDFree(pbSalt);
@@ -87,11 +78,8 @@ cleanup:
         memset(pbXRTK, 0, cbXRTK);
         BIDFree(pbXRTK);
     }
-    json_decref(sk);
-    if (err != BID_S_OK) {
+    if (err != BID_S_OK && newCMK != NULL)
         _BIDDestroySecret(context, newCMK);
-        json_decref(signKey);
-    }
 
     return err;
 }
@@ -113,7 +101,6 @@ BIDMakeXRTToken(
     BIDError err;
     struct BIDJWTDesc jwt = { 0 };
     struct BIDBackedAssertionDesc backedAssertion = { 0 };
-    BIDJWK key = NULL;
     json_t *payload = NULL;
 
     BID_ASSERT(context->ContextOptions & BID_CONTEXT_USER_AGENT);
@@ -128,7 +115,7 @@ BIDMakeXRTToken(
         goto cleanup;
     }
 
-    err = _BIDDeriveXRTKey(context, identity, &key);
+    err = _BIDDeriveXRTKey(context, identity);
     BID_BAIL_ON_ERROR(err);
 
     jwt.EncData = NULL;
@@ -141,14 +128,14 @@ BIDMakeXRTToken(
     backedAssertion.Assertion = &jwt;
     backedAssertion.cCertificates = 0;
 
-    err = _BIDPackBackedAssertion(context, &backedAssertion, key, NULL, pszResponseToken);
+    err = _BIDPackBackedAssertion(context, &backedAssertion, NULL, identity->SecretHandle,
+                                  NULL, pszResponseToken);
     BID_BAIL_ON_ERROR(err);
 
     *pchResponseToken = strlen(*pszResponseToken);
 
 cleanup:
     json_decref(payload);
-    json_decref(key);
     _BIDReleaseJWTInternal(context, &jwt, 0);
 
     return err;
@@ -164,7 +151,6 @@ BIDVerifyXRTToken(
     uint32_t *pulRetFlags)
 {
     BIDError err;
-    BIDJWK verifyCred = NULL;
     BIDBackedAssertion backedAssertion = NULL;
 
     *pulRetFlags = 0;
@@ -177,10 +163,11 @@ BIDVerifyXRTToken(
         goto cleanup;
     }
 
-    err = _BIDDeriveXRTKey(context, identity, &verifyCred);
+    err = _BIDDeriveXRTKey(context, identity);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDVerifySignature(context, backedAssertion->Assertion, verifyCred);
+    err = _BIDVerifySecretKeySignature(context, backedAssertion->Assertion,
+                                       identity->SecretHandle);
     BID_BAIL_ON_ERROR(err);
 
 cleanup:
@@ -188,7 +175,6 @@ cleanup:
         *pPayload = json_incref(backedAssertion->Assertion->Payload);
 
     _BIDReleaseBackedAssertion(context, backedAssertion);
-    json_decref(verifyCred);
 
     return err;
 }
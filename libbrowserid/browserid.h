@@ -132,6 +132,9 @@ typedef enum {
     BID_S_UNKNOWN_EC_CURVE,
     BID_S_INVALID_EC_CURVE,
     BID_S_MISSING_NONCE,
+    BID_S_CACHE_KEY_EXISTS,
+    BID_S_CACHE_FULL,
+    BID_S_WORK_QUEUE_FULL,
     BID_S_UNKNOWN_ERROR_CODE,
 } BIDError;
 
@@ -218,6 +221,13 @@ typedef struct BIDContextDesc *BIDContext;
  */
 #define BID_CONTEXT_HOST_SPN_ALIAS          0x00001000
 
+/*
+ * Context may be shared between threads once it has been configured.
+ * JSON error information (BID_PARAM_JSON_ERROR_INFO) is then kept per
+ * thread. BIDSetContextParam must not be called on a shared context.
+ */
+#define BID_CONTEXT_THREAD_SAFE             0x00002000
+
 /*
  * Context management.
  */
@@ -234,6 +244,23 @@ BIDAcquireContext(
 BIDError
 BIDReleaseContext(BIDContext context);
 
+/*
+ * Create a context that shares the configuration and caches of an
+ * existing, fully configured template context. The template must not
+ * be modified once it has been cloned. Options that require state the
+ * template was not acquired with (BID_CONTEXT_RP and the authority and
+ * replay cache options) must be a subset of the template's options.
+ * BID_CONTEXT_TICKET_CACHE shares the template's ticket cache if it has
+ * one; otherwise the clone acquires the default ticket cache of the
+ * calling user, so a template shared by several users should be
+ * acquired without it.
+ */
+BIDError
+BIDCloneContext(
+    BIDContext templateContext,
+    uint32_t ulContextOptions,
+    BIDContext *pContext);
+
 #define BID_ECDH_CURVE_P256                 "P-256"
 #define BID_ECDH_CURVE_P384                 "P-384"
 #define BID_ECDH_CURVE_P521                 "P-521"
@@ -375,6 +402,80 @@ BIDVerifyAssertion(
     time_t *pExpiryTime,
     uint32_t *pulVerifyFlags);
 
+/*
+ * Asynchronously retrieve the authority documents needed to verify an
+ * assertion into the context's authority cache, so that a subsequent
+ * BIDVerifyAssertion() does not block on the network. Concurrent lookups
+ * of the same authority share a single fetch. If BID_S_OK is returned,
+ * the callback is invoked exactly once on a library worker thread, and is
+ * passed a thread-safe clone of the context that is valid only for the
+ * duration of the call; the caller's context may be released as soon as
+ * this function returns. When verifying remotely there is nothing to fetch
+ * and the callback is invoked with the caller's context before returning.
+ * If too much work is already queued, BID_S_WORK_QUEUE_FULL is returned
+ * and the callback is not invoked. Requires BID_CONTEXT_AUTHORITY_CACHE
+ * unless verifying remotely.
+ */
+typedef void (*BIDPrefetchCallback)(BIDContext context, BIDError err, void *callbackArg);
+
+BIDError
+BIDPrefetchAuthorities(
+    BIDContext context,
+    const char *szAssertion,
+    time_t tVerificationTime,
+    uint32_t ulReqFlags,
+    BIDPrefetchCallback callback,
+    void *callbackArg);
+
+/*
+ * Verify a batch of assertions, spreading the work over the calling
+ * thread and the library's worker threads. Each distinct issuer is
+ * looked up once for the whole batch. Per-assertion results are returned
+ * in the output arrays, which must each have cAssertions elements, and
+ * an identity is returned only for assertions that verified;
+ * rgszAudiencesOrSpns may be NULL. An assertion that appears more than
+ * once is accepted at most once. The return value indicates whether the
+ * batch as a whole could be processed.
+ */
+BIDError
+BIDVerifyAssertions(
+    BIDContext context,
+    BIDReplayCache replayReauthCache, /* optional, uses context replay cache if absent */
+    size_t cAssertions,
+    const char **rgszAssertions,
+    const char **rgszAudiencesOrSpns,
+    time_t tVerificationTime,
+    uint32_t ulReqFlags,
+    BIDError *rgErrors,
+    BIDIdentity *rgVerifiedIdentities,
+    time_t *rgExpiryTimes,
+    uint32_t *rgulVerifyFlags);
+
+/*
+ * Stages of assertion verification, in the order in which they are run.
+ * Work that needs the network or public key operations is only done for
+ * assertions that pass the cheaper stages.
+ */
+typedef enum {
+    BID_VERIFY_STAGE_PARSE = 0,         /* malformed assertion */
+    BID_VERIFY_STAGE_CLAIMS,            /* audience, channel bindings or validity */
+    BID_VERIFY_STAGE_REPLAY,            /* found in replay cache */
+    BID_VERIFY_STAGE_AUTHORITY,         /* issuer discovery or delegation */
+    BID_VERIFY_STAGE_SIGNATURE,         /* certificates, signature or subject */
+    BID_VERIFY_STAGE_MAX
+} BIDVerifyStage;
+
+/*
+ * Return the number of assertions that this context, the context it was
+ * cloned from and any other clones of that context have rejected at the
+ * given stage of verification.
+ */
+BIDError
+BIDGetVerifyRejections(
+    BIDContext context,
+    BIDVerifyStage stage,
+    unsigned long *pcRejections);
+
 BIDError
 BIDGetIdentityAudience(
     BIDContext context,
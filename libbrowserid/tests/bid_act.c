@@ -0,0 +1,847 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <arpa/inet.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * Authority cache test, against a local HTTPS server: failed retrievals
+ * are cached with exponential backoff, an expired document is served for
+ * the configured stale window while it is refreshed in the background,
+ * and a cached document is revalidated with a conditional request.
+ * Verification times are passed explicitly, so that the test need not
+ * wait for the backoff to elapse.
+ */
+
+#define TEST_STALE_WINDOW       120
+#define TEST_WAIT_SECONDS       10
+
+static char
+DsaPublicKey[] =
+"{\"algorithm\":\"DS\",\"version\":\"2012.08.15\",\"y\":\"EgxmUUA4YD/wNDJH3mX+QTIiIwDtn2cAaCkXr0HGKFN3eTuoOqt6iCvTXEkFZCSIog9ml6wKIasJO8mcT+ZVD+40oD+CXKeRJ7LXPnpSuB5rSvgUxEtVY4/8wWra5RnhoHn8BOgb6tq/zOn9EEV6nE6h/t4rVb/dLW1QTono1Q8=\",\"p\":\"/2AEg9tqv8W0Xqt4WUs1M9VQ2fG/Kpkqeo2qbcNPgEWtTm4MQp0zTu6q79fiPUgQvgDkzBSSy6MluoH/LVpbMFqNF+s79KBqNJ05LgDTKXRKUXk4A0ToKhjEeTNDj4keIq7vgS1pyPdeMmy3DqAAw/d239vWBGOMLvcX/CbQLhc=\",\"q\":\"4h4E+RHR7XmRAI7Kqzv3dZhDCcM=\",\"g\":\"xSpKD/O35h/fGGfOhBODaaYVT0r6kpZuPIJ+Jc+mz1CLkOXeQZ4TN+B6Lp4qPNXepwTRdfjr9q85fWnhELlq+xfHoDJZMp5IKbDQO7x4lrFbSt5T4TCFjMNNliaaqJBB9AkTbHJCo4iVydW8ytTzia8dekvROYvQct/6iWIzOXo=\"}";
+
+static int cFailures;
+
+static void
+CheckError(const char *szTest, BIDError err, BIDError expected)
+{
+    const char *s1, *s2;
+
+    if (err == expected)
+        return;
+
+    BIDErrorToString(err, &s1);
+    BIDErrorToString(expected, &s2);
+    fprintf(stderr, "%s: got %s[%d], expected %s[%d]\n", szTest, s1, err, s2, expected);
+    cFailures++;
+}
+
+static void
+CheckValue(const char *szTest, long value, long expected)
+{
+    if (value == expected)
+        return;
+
+    fprintf(stderr, "%s: got %ld, expected %ld\n", szTest, value, expected);
+    cFailures++;
+}
+
+/*
+ * The local server either drops each connection, so that retrieval
+ * fails, or answers with the authority document. The document carries
+ * an ETag and Last-Modified time, and a request whose If-None-Match
+ * names the current ETag is answered with 304 Not Modified.
+ */
+enum ServerMode {
+    SERVER_FAIL,
+    SERVER_DOCUMENT
+};
+
+static struct {
+    int Socket;
+    SSL_CTX *SslCtx;
+    char szHostname[32];
+    pthread_t Thread;
+    pthread_mutex_t Mutex;
+    enum ServerMode Mode;
+    char szETag[32];
+    long cRequests;
+    long cConditionalRequests;
+    long cNotModified;
+} Server = { -1, NULL, "", 0, PTHREAD_MUTEX_INITIALIZER, SERVER_FAIL, "\"1\"", 0, 0, 0 };
+
+#define SERVER_LAST_MODIFIED        "Sat, 01 Jun 2013 00:00:00 GMT"
+#define SERVER_LAST_MODIFIED_TIME   1370044800
+
+static void
+SetServerMode(enum ServerMode mode)
+{
+    pthread_mutex_lock(&Server.Mutex);
+    Server.Mode = mode;
+    pthread_mutex_unlock(&Server.Mutex);
+}
+
+static long
+ServerCount(long *pCount)
+{
+    long count;
+
+    pthread_mutex_lock(&Server.Mutex);
+    count = *pCount;
+    pthread_mutex_unlock(&Server.Mutex);
+
+    return count;
+}
+
+static long
+ServerRequests(void)
+{
+    return ServerCount(&Server.cRequests);
+}
+
+static void
+SetServerETag(const char *szETag)
+{
+    pthread_mutex_lock(&Server.Mutex);
+    snprintf(Server.szETag, sizeof(Server.szETag), "%s", szETag);
+    pthread_mutex_unlock(&Server.Mutex);
+}
+
+static void
+ServeDocument(int s)
+{
+    SSL *ssl;
+    char szRequest[4096];
+    char szResponse[4096];
+    char szIfNoneMatch[64];
+    size_t cbRequest = 0;
+    int cbRead, bNotModified;
+
+    ssl = SSL_new(Server.SslCtx);
+    if (ssl == NULL)
+        return;
+
+    SSL_set_fd(ssl, s);
+
+    if (SSL_accept(ssl) != 1)
+        goto cleanup;
+
+    /* the request has no body, so read up to the end of the headers */
+    while (cbRequest < sizeof(szRequest) - 1) {
+        cbRead = SSL_read(ssl, &szRequest[cbRequest], sizeof(szRequest) - 1 - cbRequest);
+        if (cbRead <= 0)
+            goto cleanup;
+        cbRequest += cbRead;
+        szRequest[cbRequest] = '\0';
+        if (strstr(szRequest, "\r\n\r\n") != NULL)
+            break;
+    }
+
+    pthread_mutex_lock(&Server.Mutex);
+
+    snprintf(szIfNoneMatch, sizeof(szIfNoneMatch), "\r\nIf-None-Match: %s\r\n", Server.szETag);
+    bNotModified = (strstr(szRequest, szIfNoneMatch) != NULL);
+
+    if (strstr(szRequest, "\r\nIf-None-Match: ") != NULL &&
+        strstr(szRequest, "\r\nIf-Modified-Since: ") != NULL)
+        Server.cConditionalRequests++;
+    if (bNotModified)
+        Server.cNotModified++;
+
+    if (bNotModified) {
+        snprintf(szResponse, sizeof(szResponse),
+                 "HTTP/1.1 304 Not Modified\r\n"
+                 "ETag: %s\r\n"
+                 "Connection: close\r\n"
+                 "\r\n",
+                 Server.szETag);
+    } else {
+        snprintf(szResponse, sizeof(szResponse),
+                 "HTTP/1.1 200 OK\r\n"
+                 "Content-Type: application/json\r\n"
+                 "Content-Length: %zu\r\n"
+                 "ETag: %s\r\n"
+                 "Last-Modified: " SERVER_LAST_MODIFIED "\r\n"
+                 "Connection: close\r\n"
+                 "\r\n"
+                 "{\"public-key\":%s}",
+                 strlen(DsaPublicKey) + sizeof("{\"public-key\":}") - 1,
+                 Server.szETag, DsaPublicKey);
+    }
+
+    pthread_mutex_unlock(&Server.Mutex);
+
+    SSL_write(ssl, szResponse, strlen(szResponse));
+    SSL_shutdown(ssl);
+
+cleanup:
+    SSL_free(ssl);
+}
+
+static void *
+ServerThread(void *arg BID_UNUSED)
+{
+    enum ServerMode mode;
+    int s;
+
+    while ((s = accept(Server.Socket, NULL, NULL)) >= 0) {
+        pthread_mutex_lock(&Server.Mutex);
+        Server.cRequests++;
+        mode = Server.Mode;
+        pthread_mutex_unlock(&Server.Mutex);
+
+        if (mode == SERVER_DOCUMENT)
+            ServeDocument(s);
+
+        close(s);
+    }
+
+    return NULL;
+}
+
+static EVP_PKEY *
+MakeKey(void)
+{
+    EVP_PKEY *pkey;
+    RSA *rsa;
+    BIGNUM *e;
+
+    pkey = EVP_PKEY_new();
+    rsa = RSA_new();
+    e = BN_new();
+
+    if (pkey == NULL || rsa == NULL || e == NULL ||
+        BN_set_word(e, RSA_F4) != 1 ||
+        RSA_generate_key_ex(rsa, 2048, e, NULL) != 1 ||
+        EVP_PKEY_assign_RSA(pkey, rsa) != 1) {
+        EVP_PKEY_free(pkey);
+        RSA_free(rsa);
+        pkey = NULL;
+    }
+
+    BN_free(e);
+
+    return pkey;
+}
+
+/*
+ * Make a self-signed certificate for the server's address, which the
+ * test configures as the HTTPS CA.
+ */
+static X509 *
+MakeCert(EVP_PKEY *key)
+{
+    X509 *x509;
+    X509_NAME *name;
+    X509_EXTENSION *ext;
+
+    x509 = X509_new();
+    if (x509 == NULL)
+        return NULL;
+
+    X509_set_version(x509, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_get_notBefore(x509), -3600);
+    X509_gmtime_adj(X509_get_notAfter(x509), 86400);
+    X509_set_pubkey(x509, key);
+
+    name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (const unsigned char *)"127.0.0.1", -1, -1, 0);
+    X509_set_issuer_name(x509, name);
+
+    ext = X509V3_EXT_conf_nid(NULL, NULL, NID_basic_constraints, "critical,CA:TRUE");
+    if (ext != NULL) {
+        X509_add_ext(x509, ext, -1);
+        X509_EXTENSION_free(ext);
+    }
+
+    ext = X509V3_EXT_conf_nid(NULL, NULL, NID_subject_alt_name, "IP:127.0.0.1");
+    if (ext != NULL) {
+        X509_add_ext(x509, ext, -1);
+        X509_EXTENSION_free(ext);
+    }
+
+    if (X509_sign(x509, key, EVP_sha256()) == 0) {
+        X509_free(x509);
+        return NULL;
+    }
+
+    return x509;
+}
+
+static BIDError
+StartServer(const char *szCAFile)
+{
+    BIDError err = BID_S_CRYPTO_ERROR;
+    struct sockaddr_in sin;
+    socklen_t cbSin = sizeof(sin);
+    EVP_PKEY *key = NULL;
+    X509 *cert = NULL;
+    FILE *fp = NULL;
+
+    SSL_library_init();
+
+    key = MakeKey();
+    if (key == NULL)
+        goto cleanup;
+
+    cert = MakeCert(key);
+    if (cert == NULL)
+        goto cleanup;
+
+    Server.SslCtx = SSL_CTX_new(SSLv23_server_method());
+    if (Server.SslCtx == NULL ||
+        SSL_CTX_use_certificate(Server.SslCtx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey(Server.SslCtx, key) != 1)
+        goto cleanup;
+
+    fp = fopen(szCAFile, "w");
+    if (fp == NULL || !PEM_write_X509(fp, cert)) {
+        err = BID_S_CACHE_WRITE_ERROR;
+        goto cleanup;
+    }
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    Server.Socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (Server.Socket < 0 ||
+        bind(Server.Socket, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+        listen(Server.Socket, 16) != 0 ||
+        getsockname(Server.Socket, (struct sockaddr *)&sin, &cbSin) != 0) {
+        err = BID_S_HTTP_ERROR;
+        goto cleanup;
+    }
+
+    snprintf(Server.szHostname, sizeof(Server.szHostname),
+             "127.0.0.1:%d", ntohs(sin.sin_port));
+
+    if (pthread_create(&Server.Thread, NULL, ServerThread, NULL) != 0) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    err = BID_S_OK;
+
+cleanup:
+    if (fp != NULL)
+        fclose(fp);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+
+    return err;
+}
+
+static void
+StopServer(void)
+{
+    if (Server.Socket < 0)
+        return;
+
+    shutdown(Server.Socket, SHUT_RDWR);
+    close(Server.Socket);
+    pthread_join(Server.Thread, NULL);
+    SSL_CTX_free(Server.SslCtx);
+}
+
+/*
+ * Write a configuration with no clock skew, so that expiry times are
+ * exact, and that trusts the local server.
+ */
+static BIDError
+WriteConfig(const char *szConfigFile, const char *szCAFile)
+{
+    FILE *fp;
+    int bWritten;
+
+    fp = fopen(szConfigFile, "w");
+    if (fp == NULL)
+        return BID_S_CACHE_OPEN_ERROR;
+
+    bWritten = fprintf(fp, "{\"maxclockskew\": 0, \"authoritystalewindow\": %d, "
+                       "\"https-ca-certificate\": \"%s\"}",
+                       TEST_STALE_WINDOW, szCAFile) > 0;
+
+    if (fclose(fp) != 0 || !bWritten)
+        return BID_S_CACHE_WRITE_ERROR;
+
+    return BID_S_OK;
+}
+
+static json_t *
+GetCacheEntry(BIDContext context)
+{
+    BIDCache authorityCache = NULL;
+    json_t *entry = NULL;
+
+    BIDGetContextParam(context, BID_PARAM_AUTHORITY_CACHE, (void **)&authorityCache);
+    _BIDGetCacheObject(context, authorityCache, Server.szHostname, &entry);
+
+    return entry;
+}
+
+static long
+GetCacheEntryValue(BIDContext context, const char *szKey)
+{
+    json_t *entry = GetCacheEntry(context);
+    time_t t = 0;
+    long value;
+
+    if (strcmp(szKey, "failures") == 0) {
+        value = (long)json_integer_value(json_object_get(entry, szKey));
+    } else {
+        _BIDGetJsonTimestampValue(context, entry, szKey, &t);
+        value = (long)t;
+    }
+
+    json_decref(entry);
+
+    return value;
+}
+
+static BIDError
+SetCacheEntry(BIDContext context, json_t *entry)
+{
+    BIDCache authorityCache = NULL;
+    BIDError err;
+
+    err = BIDGetContextParam(context, BID_PARAM_AUTHORITY_CACHE, (void **)&authorityCache);
+    if (err != BID_S_OK)
+        return err;
+
+    return _BIDSetCacheObject(context, authorityCache, Server.szHostname, entry);
+}
+
+/*
+ * Put an authority document that expired at expiryTime in the cache.
+ */
+static BIDError
+CacheStaleAuthority(BIDContext context, time_t expiryTime)
+{
+    BIDError err;
+    json_t *authority;
+
+    authority = json_pack("{s:o, s:I}",
+                          "public-key", json_loads(DsaPublicKey, 0, NULL),
+                          "exp", (json_int_t)expiryTime * 1000);
+    if (authority == NULL)
+        return BID_S_NO_MEMORY;
+
+    err = SetCacheEntry(context, authority);
+
+    json_decref(authority);
+
+    return err;
+}
+
+static BIDError
+AcquireAuthority(BIDContext context, time_t verificationTime)
+{
+    BIDError err;
+    BIDAuthority authority = NULL;
+
+    err = _BIDAcquireAuthority(context, Server.szHostname, verificationTime, &authority);
+    if (authority != NULL) {
+        if (json_object_get(authority, "public-key") == NULL)
+            err = BID_S_NO_KEY;
+        _BIDReleaseAuthority(context, authority);
+    }
+
+    return err;
+}
+
+/*
+ * Wait for a background refresh to record the given number of failures,
+ * or with cFailures zero, to store a fresh document.
+ */
+static void
+WaitForRefresh(const char *szTest, BIDContext context, long cExpectedFailures, long cRequests)
+{
+    int i;
+
+    for (i = 0; i < TEST_WAIT_SECONDS * 100; i++) {
+        if (ServerRequests() >= cRequests &&
+            GetCacheEntryValue(context, "failures") == cExpectedFailures &&
+            (cExpectedFailures != 0 || GetCacheEntryValue(context, "retry") == 0))
+            return;
+        usleep(10000);
+    }
+
+    fprintf(stderr, "%s: refresh did not complete\n", szTest);
+    cFailures++;
+}
+
+/*
+ * A failure is cached until its retry time, which doubles with each
+ * consecutive failure up to BID_AUTHORITY_RETRY_MAX; a success clears it.
+ */
+static void
+TestBackoff(BIDContext context, time_t now)
+{
+    BIDError err, fetchErr;
+    json_t *entry;
+    long cRequests = ServerRequests();
+    time_t t = now;
+
+    SetServerMode(SERVER_FAIL);
+
+    fetchErr = AcquireAuthority(context, t);
+    if (fetchErr == BID_S_OK) {
+        CheckError("backoff: fetch", fetchErr, BID_S_HTTP_ERROR);
+        return;
+    }
+    CheckValue("backoff: fetch requests", ServerRequests(), ++cRequests);
+    CheckValue("backoff: failures", GetCacheEntryValue(context, "failures"), 1);
+    CheckValue("backoff: retry time", GetCacheEntryValue(context, "exp"),
+               t + BID_AUTHORITY_RETRY_MIN);
+
+    err = AcquireAuthority(context, t + BID_AUTHORITY_RETRY_MIN - 1);
+    CheckError("backoff: cached failure", err, fetchErr);
+    CheckValue("backoff: cached failure requests", ServerRequests(), cRequests);
+
+    t += BID_AUTHORITY_RETRY_MIN;
+    err = AcquireAuthority(context, t);
+    CheckError("backoff: second fetch", err, fetchErr);
+    CheckValue("backoff: second fetch requests", ServerRequests(), ++cRequests);
+    CheckValue("backoff: second failures", GetCacheEntryValue(context, "failures"), 2);
+    CheckValue("backoff: second retry time", GetCacheEntryValue(context, "exp"),
+               t + 2 * BID_AUTHORITY_RETRY_MIN);
+
+    err = AcquireAuthority(context, t + 2 * BID_AUTHORITY_RETRY_MIN - 1);
+    CheckError("backoff: doubled", err, fetchErr);
+    CheckValue("backoff: doubled requests", ServerRequests(), cRequests);
+
+    t += 2 * BID_AUTHORITY_RETRY_MIN;
+    err = AcquireAuthority(context, t);
+    CheckError("backoff: third fetch", err, fetchErr);
+    CheckValue("backoff: third fetch requests", ServerRequests(), ++cRequests);
+    CheckValue("backoff: third retry time", GetCacheEntryValue(context, "exp"),
+               t + 4 * BID_AUTHORITY_RETRY_MIN);
+
+    /* the interval is capped */
+    entry = GetCacheEntry(context);
+    if (entry != NULL) {
+        entry = json_copy(entry);
+        json_object_set_new(entry, "failures", json_integer(20));
+        SetCacheEntry(context, entry);
+        json_decref(entry);
+    }
+
+    t += 4 * BID_AUTHORITY_RETRY_MIN;
+    err = AcquireAuthority(context, t);
+    CheckError("backoff: capped", err, fetchErr);
+    CheckValue("backoff: capped retry time", GetCacheEntryValue(context, "exp"),
+               t + BID_AUTHORITY_RETRY_MAX);
+
+    SetServerMode(SERVER_DOCUMENT);
+
+    t += BID_AUTHORITY_RETRY_MAX;
+    err = AcquireAuthority(context, t);
+    CheckError("backoff: recovered", err, BID_S_OK);
+    CheckValue("backoff: recovered failures", GetCacheEntryValue(context, "failures"), 0);
+}
+
+/*
+ * An expired document is used for the configured stale window. Each use
+ * starts a background refresh, unless a failed refresh has set a retry
+ * time that has not yet been reached; past the window, the document must
+ * be retrieved again.
+ */
+static void
+TestStaleWindow(BIDContext context, time_t now)
+{
+    BIDError err;
+    long cRequests = ServerRequests();
+    time_t expiryTime = now - TEST_STALE_WINDOW / 2;
+
+    SetServerMode(SERVER_FAIL);
+
+    err = CacheStaleAuthority(context, expiryTime);
+    CheckError("stale: cache", err, BID_S_OK);
+
+    err = AcquireAuthority(context, now);
+    CheckError("stale: use", err, BID_S_OK);
+    WaitForRefresh("stale: refresh", context, 1, ++cRequests);
+    CheckValue("stale: retry time", GetCacheEntryValue(context, "retry"),
+               now + BID_AUTHORITY_RETRY_MIN);
+
+    err = AcquireAuthority(context, now + BID_AUTHORITY_RETRY_MIN - 1);
+    CheckError("stale: use before retry", err, BID_S_OK);
+    usleep(200000);
+    CheckValue("stale: no refresh before retry", ServerRequests(), cRequests);
+
+    err = AcquireAuthority(context, now + BID_AUTHORITY_RETRY_MIN);
+    CheckError("stale: use at retry", err, BID_S_OK);
+    WaitForRefresh("stale: second refresh", context, 2, ++cRequests);
+    CheckValue("stale: doubled retry time", GetCacheEntryValue(context, "retry"),
+               now + 3 * BID_AUTHORITY_RETRY_MIN);
+
+    /* the document was kept throughout */
+    CheckValue("stale: expiry time", GetCacheEntryValue(context, "exp"), expiryTime);
+
+    err = AcquireAuthority(context, expiryTime + TEST_STALE_WINDOW + 1);
+    if (err == BID_S_OK)
+        CheckError("stale: past window", err, BID_S_HTTP_ERROR);
+    CheckValue("stale: past window requests", ServerRequests(), ++cRequests);
+
+    /* a successful refresh replaces the document */
+    SetServerMode(SERVER_DOCUMENT);
+
+    err = CacheStaleAuthority(context, expiryTime);
+    CheckError("stale: cache again", err, BID_S_OK);
+
+    err = AcquireAuthority(context, now);
+    CheckError("stale: use again", err, BID_S_OK);
+    WaitForRefresh("stale: successful refresh", context, 0, ++cRequests);
+    if (GetCacheEntryValue(context, "exp") <= now) {
+        fprintf(stderr, "stale: refreshed document has expired\n");
+        cFailures++;
+    }
+}
+
+static const char *
+GetCacheEntryETag(BIDContext context, char *szETag, size_t cchETag)
+{
+    json_t *entry = GetCacheEntry(context);
+    const char *s = json_string_value(json_object_get(entry, "etag"));
+
+    snprintf(szETag, cchETag, "%s", s != NULL ? s : "");
+    json_decref(entry);
+
+    return szETag;
+}
+
+/*
+ * Make the cached document expire at expiryTime, keeping its validators.
+ */
+static BIDError
+ExpireCacheEntry(BIDContext context, time_t expiryTime)
+{
+    BIDError err;
+    json_t *entry = GetCacheEntry(context);
+    json_t *copy;
+
+    copy = json_copy(entry);
+    json_decref(entry);
+    if (copy == NULL)
+        return BID_S_NO_MEMORY;
+
+    err = _BIDSetJsonTimestampValue(context, copy, "exp", expiryTime);
+    if (err == BID_S_OK)
+        err = SetCacheEntry(context, copy);
+
+    json_decref(copy);
+
+    return err;
+}
+
+static void
+WaitForExpiry(const char *szTest, BIDContext context, time_t notAfter)
+{
+    int i;
+
+    for (i = 0; i < TEST_WAIT_SECONDS * 100; i++) {
+        if (GetCacheEntryValue(context, "exp") > notAfter)
+            return;
+        usleep(10000);
+    }
+
+    fprintf(stderr, "%s: refresh did not complete\n", szTest);
+    cFailures++;
+}
+
+/*
+ * A document is stored with its ETag and Last-Modified time, and once it
+ * expires, both the background refresh and a synchronous retrieval send
+ * them in a conditional request. A 304 response only extends the cached
+ * document's lifetime; a changed document replaces it.
+ */
+static void
+TestRevalidation(BIDContext context, time_t now)
+{
+    BIDError err;
+    BIDCache authorityCache = NULL;
+    long cRequests, cConditionalRequests, cNotModified;
+    char szETag[32];
+
+    SetServerMode(SERVER_DOCUMENT);
+    SetServerETag("\"1\"");
+
+    BIDGetContextParam(context, BID_PARAM_AUTHORITY_CACHE, (void **)&authorityCache);
+    _BIDRemoveCacheObject(context, authorityCache, Server.szHostname);
+
+    cRequests = ServerRequests();
+    cConditionalRequests = ServerCount(&Server.cConditionalRequests);
+    cNotModified = ServerCount(&Server.cNotModified);
+
+    err = AcquireAuthority(context, now);
+    CheckError("revalidation: fetch", err, BID_S_OK);
+    CheckValue("revalidation: fetch requests", ServerRequests(), ++cRequests);
+    CheckValue("revalidation: unconditional fetch",
+               ServerCount(&Server.cConditionalRequests), cConditionalRequests);
+    if (strcmp(GetCacheEntryETag(context, szETag, sizeof(szETag)), "\"1\"") != 0) {
+        fprintf(stderr, "revalidation: cached ETag %s\n", szETag);
+        cFailures++;
+    }
+    if (GetCacheEntryValue(context, "last-modified") != SERVER_LAST_MODIFIED_TIME) {
+        fprintf(stderr, "revalidation: Last-Modified time not cached\n");
+        cFailures++;
+    }
+
+    /* in the stale window, revalidated in the background */
+    err = ExpireCacheEntry(context, now - TEST_STALE_WINDOW / 2);
+    CheckError("revalidation: expire", err, BID_S_OK);
+
+    err = AcquireAuthority(context, now);
+    CheckError("revalidation: stale", err, BID_S_OK);
+    WaitForExpiry("revalidation: refresh", context, now);
+    CheckValue("revalidation: refresh requests", ServerRequests(), ++cRequests);
+    CheckValue("revalidation: conditional refresh",
+               ServerCount(&Server.cConditionalRequests), ++cConditionalRequests);
+    CheckValue("revalidation: refresh not modified",
+               ServerCount(&Server.cNotModified), ++cNotModified);
+    CheckValue("revalidation: refresh failures", GetCacheEntryValue(context, "failures"), 0);
+
+    /* past the stale window, revalidated synchronously */
+    err = ExpireCacheEntry(context, now - 2 * TEST_STALE_WINDOW);
+    CheckError("revalidation: expire again", err, BID_S_OK);
+
+    err = AcquireAuthority(context, now);
+    CheckError("revalidation: expired", err, BID_S_OK);
+    CheckValue("revalidation: conditional fetch",
+               ServerCount(&Server.cConditionalRequests), ++cConditionalRequests);
+    CheckValue("revalidation: fetch not modified",
+               ServerCount(&Server.cNotModified), ++cNotModified);
+    if (GetCacheEntryValue(context, "exp") <= now) {
+        fprintf(stderr, "revalidation: not modified document has expired\n");
+        cFailures++;
+    }
+
+    /* a changed document is replaced, with its new ETag */
+    SetServerETag("\"2\"");
+
+    err = ExpireCacheEntry(context, now - 2 * TEST_STALE_WINDOW);
+    CheckError("revalidation: expire changed", err, BID_S_OK);
+
+    err = AcquireAuthority(context, now);
+    CheckError("revalidation: changed", err, BID_S_OK);
+    CheckValue("revalidation: changed conditional",
+               ServerCount(&Server.cConditionalRequests), ++cConditionalRequests);
+    CheckValue("revalidation: changed not modified",
+               ServerCount(&Server.cNotModified), cNotModified);
+    if (strcmp(GetCacheEntryETag(context, szETag, sizeof(szETag)), "\"2\"") != 0) {
+        fprintf(stderr, "revalidation: cached ETag %s after change\n", szETag);
+        cFailures++;
+    }
+}
+
+int main(int argc BID_UNUSED, char *argv[] BID_UNUSED)
+{
+    BIDError err;
+    BIDContext context = NULL;
+    char szDir[] = "/tmp/bid_act.XXXXXX";
+    char szCAFile[PATH_MAX] = "", szConfigFile[PATH_MAX] = "";
+    char szConfigName[PATH_MAX + 5];
+    time_t now = time(NULL);
+    const char *s;
+
+    if (mkdtemp(szDir) == NULL) {
+        err = BID_S_CACHE_OPEN_ERROR;
+        goto cleanup;
+    }
+
+    snprintf(szCAFile, sizeof(szCAFile), "%s/ca.pem", szDir);
+    snprintf(szConfigFile, sizeof(szConfigFile), "%s/config.json", szDir);
+    snprintf(szConfigName, sizeof(szConfigName), "file:%s", szConfigFile);
+
+    err = StartServer(szCAFile);
+    BID_BAIL_ON_ERROR(err);
+
+    err = WriteConfig(szConfigFile, szCAFile);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDAcquireContext(szConfigName, BID_CONTEXT_RP | BID_CONTEXT_AUTHORITY_CACHE |
+                            BID_CONTEXT_THREAD_SAFE, NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(context, BID_PARAM_AUTHORITY_CACHE_NAME, "memory:");
+    BID_BAIL_ON_ERROR(err);
+
+    TestBackoff(context, now);
+    TestStaleWindow(context, now);
+    TestRevalidation(context, now);
+
+    if (cFailures != 0)
+        err = BID_S_INVALID_ASSERTION;
+    else
+        printf("Authority cache tests passed\n");
+
+cleanup:
+    BIDReleaseContext(context);
+    StopServer();
+
+    if (szConfigFile[0] != '\0')
+        unlink(szConfigFile);
+    if (szCAFile[0] != '\0')
+        unlink(szCAFile);
+    rmdir(szDir);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
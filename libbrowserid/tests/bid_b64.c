@@ -40,6 +40,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "browserid.h"
 #include "bid_private.h"
@@ -57,6 +58,195 @@ static void dump(unsigned char *data, size_t len)
     printf("\n");
 }
 
+/*
+ * The original character-at-a-time decoder, used as a reference for the
+ * table driven and vectorized implementation.
+ */
+static const char refChars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static ssize_t
+refPos(char c)
+{
+    const char *p;
+
+    if (c == '+')
+        c = '-';
+    else if (c == '/')
+        c = '_';
+    for (p = refChars; *p != '\0'; p++) {
+        if (*p == c)
+            return p - refChars;
+    }
+
+    return -1;
+}
+
+static ssize_t
+refTokenDecode(const char *token)
+{
+    size_t i, toklen;
+    size_t val = 0;
+    size_t marker = 0;
+
+    toklen = strlen(token);
+    if (toklen < 2)
+        return -1;
+    else if (toklen > 4)
+        toklen = 4;
+
+    for (i = 0; i < 4; i++) {
+        val *= 64;
+        if (i < toklen) {
+            ssize_t tmp = 0;
+
+            if (token[i] == '=') {
+                marker++;
+            } else if (marker != 0) {
+                return -1;
+            } else {
+                tmp = refPos(token[i]);
+                if (tmp < 0)
+                    return -1;
+            }
+            val += tmp;
+        }
+    }
+
+    if (marker == 0)
+        marker = 4 - toklen;
+    if (marker > 2)
+        return -1;
+
+    return (marker << 24) | val;
+}
+
+static BIDError
+refDecode(const char *str, unsigned char *data, size_t *pcbData)
+{
+    const char *p = str;
+    unsigned char *q = data;
+
+    while (*p != '\0' && *p != '=') {
+        ssize_t val = refTokenDecode(p);
+        uint8_t marker;
+
+        if (val == -1)
+            return BID_S_INVALID_BASE64;
+
+        marker = (val >> 24) & 0xff;
+        *q++ = (val >> 16) & 0xff;
+        if (marker < 2)
+            *q++ = (val >> 8) & 0xff;
+        if (marker < 1)
+            *q++ = val & 0xff;
+        p += 4 - marker;
+    }
+
+    *pcbData = q - data;
+    return BID_S_OK;
+}
+
+/*
+ * Check that valid, truncated and corrupted strings of every length decode
+ * identically with both implementations, and that encoding round trips.
+ */
+static int
+fuzzEquivalence(unsigned int iterations)
+{
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_+/=.";
+    unsigned char in[512], refOut[1024], *out;
+    char *enc, s[1024];
+    size_t i, len, cchEnc, refLen, outLen;
+    BIDError err, refErr;
+    unsigned int n;
+    int failures = 0;
+
+    for (n = 0; n < iterations; n++) {
+        len = rand() % sizeof(in);
+        for (i = 0; i < len; i++)
+            in[i] = rand() & 0xff;
+
+        err = _BIDBase64Encode(in, len,
+                               (n & 1) ? BID_ENCODING_BASE64 : BID_ENCODING_BASE64_URL,
+                               &enc, &cchEnc);
+        if (err != BID_S_OK || cchEnc != strlen(enc)) {
+            fprintf(stderr, "encode failed: %d\n", err);
+            return 1;
+        }
+
+        /* corrupt some of the encodings */
+        memcpy(s, enc, cchEnc + 1);
+        if (n % 4 == 2 && cchEnc != 0)
+            s[rand() % cchEnc] = alphabet[rand() % (sizeof(alphabet) - 1)];
+        else if (n % 4 == 3)
+            s[rand() % (cchEnc + 1)] = '\0';
+        BIDFree(enc);
+
+        out = NULL;
+        err = _BIDBase64UrlDecode(s, &out, &outLen);
+        refErr = refDecode(s, refOut, &refLen);
+
+        if (err != refErr ||
+            (err == BID_S_OK &&
+             (outLen != refLen || memcmp(out, refOut, outLen) != 0))) {
+            fprintf(stderr, "mismatch decoding \"%s\": %d/%d\n", s, err, refErr);
+            failures++;
+        } else if (n % 4 < 2 &&
+                   (err != BID_S_OK || outLen != len || memcmp(out, in, len) != 0)) {
+            fprintf(stderr, "round trip failed for \"%s\"\n", s);
+            failures++;
+        }
+        BIDFree(out);
+    }
+
+    return failures;
+}
+
+static double
+elapsed(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void
+benchmark(unsigned int iterations)
+{
+    unsigned char in[1024], out[1024], *pOut;
+    char *enc;
+    size_t i, cchEnc, outLen;
+    unsigned int n;
+    clock_t start;
+
+    for (i = 0; i < sizeof(in); i++)
+        in[i] = rand() & 0xff;
+
+    _BIDBase64UrlEncode(in, sizeof(in), &enc, &cchEnc);
+
+    start = clock();
+    for (n = 0; n < iterations; n++)
+        refDecode(enc, out, &outLen);
+    printf("reference decode: %.1f MB/s\n", iterations * cchEnc / elapsed(start) / 1e6);
+
+    start = clock();
+    for (n = 0; n < iterations; n++) {
+        pOut = out;
+        outLen = sizeof(out);
+        _BIDBase64UrlDecode(enc, &pOut, &outLen);
+    }
+    printf("decode:           %.1f MB/s\n", iterations * cchEnc / elapsed(start) / 1e6);
+
+    BIDFree(enc);
+
+    start = clock();
+    for (n = 0; n < iterations; n++) {
+        _BIDBase64UrlEncode(in, sizeof(in), &enc, &cchEnc);
+        BIDFree(enc);
+    }
+    printf("encode:           %.1f MB/s\n", iterations * sizeof(in) / elapsed(start) / 1e6);
+}
+
 int main(int argc, char *argv[])
 {
     BIDError err;
@@ -80,5 +270,12 @@ int main(int argc, char *argv[])
         fprintf(stderr, "(should fail) Error %d\n", err);
 
     BIDFree(data);
+
+    if (fuzzEquivalence(100000) != 0)
+        exit(1);
+
+    if (argc > 1 && strcmp(argv[1], "-b") == 0)
+        benchmark(100000);
+
     exit(err);
 }
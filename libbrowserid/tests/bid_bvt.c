@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * Batch verification test: each assertion in a batch gets its own
+ * result, an assertion repeated within a batch or across concurrent
+ * batches is accepted exactly once, and assertions sharing an issuer
+ * all verify against the one authority document.
+ */
+
+#define TEST_AUDIENCE           "https://rp.example.com"
+#define TEST_ISSUER             "example.com"
+#define TEST_SUBJECT            "user@example.com"
+#define TEST_SHARED_ASSERTIONS  32
+#define TEST_THREADS            4
+
+static char
+DsaPublicKey[] =
+"{\"algorithm\":\"DS\",\"version\":\"2012.08.15\",\"y\":\"EgxmUUA4YD/wNDJH3mX+QTIiIwDtn2cAaCkXr0HGKFN3eTuoOqt6iCvTXEkFZCSIog9ml6wKIasJO8mcT+ZVD+40oD+CXKeRJ7LXPnpSuB5rSvgUxEtVY4/8wWra5RnhoHn8BOgb6tq/zOn9EEV6nE6h/t4rVb/dLW1QTono1Q8=\",\"p\":\"/2AEg9tqv8W0Xqt4WUs1M9VQ2fG/Kpkqeo2qbcNPgEWtTm4MQp0zTu6q79fiPUgQvgDkzBSSy6MluoH/LVpbMFqNF+s79KBqNJ05LgDTKXRKUXk4A0ToKhjEeTNDj4keIq7vgS1pyPdeMmy3DqAAw/d239vWBGOMLvcX/CbQLhc=\",\"q\":\"4h4E+RHR7XmRAI7Kqzv3dZhDCcM=\",\"g\":\"xSpKD/O35h/fGGfOhBODaaYVT0r6kpZuPIJ+Jc+mz1CLkOXeQZ4TN+B6Lp4qPNXepwTRdfjr9q85fWnhELlq+xfHoDJZMp5IKbDQO7x4lrFbSt5T4TCFjMNNliaaqJBB9AkTbHJCo4iVydW8ytTzia8dekvROYvQct/6iWIzOXo=\"}";
+
+static char
+DsaSecretKey[] = "{\"algorithm\":\"DS\",\"version\":\"2012.08.15\",\"x\":\"rwzgsSIrU6h+BleE/2wDM7sZZtk=\",\"p\":\"/2AEg9tqv8W0Xqt4WUs1M9VQ2fG/Kpkqeo2qbcNPgEWtTm4MQp0zTu6q79fiPUgQvgDkzBSSy6MluoH/LVpbMFqNF+s79KBqNJ05LgDTKXRKUXk4A0ToKhjEeTNDj4keIq7vgS1pyPdeMmy3DqAAw/d239vWBGOMLvcX/CbQLhc=\",\"q\":\"4h4E+RHR7XmRAI7Kqzv3dZhDCcM=\",\"g\":\"xSpKD/O35h/fGGfOhBODaaYVT0r6kpZuPIJ+Jc+mz1CLkOXeQZ4TN+B6Lp4qPNXepwTRdfjr9q85fWnhELlq+xfHoDJZMp5IKbDQO7x4lrFbSt5T4TCFjMNNliaaqJBB9AkTbHJCo4iVydW8ytTzia8dekvROYvQct/6iWIzOXo=\"}";
+
+static int cFailures;
+
+static void
+CheckError(const char *szTest, BIDError err, BIDError expected)
+{
+    const char *s1, *s2;
+
+    if (err == expected)
+        return;
+
+    BIDErrorToString(err, &s1);
+    BIDErrorToString(expected, &s2);
+    fprintf(stderr, "%s: got %s[%d], expected %s[%d]\n", szTest, s1, err, s2, expected);
+    cFailures++;
+}
+
+/*
+ * Sign payload with the test key. The same key is used for the issuer
+ * and the user, since only the batch handling is under test.
+ */
+static BIDError
+SignPayload(BIDContext context, json_t *payload, char **pszJwt)
+{
+    BIDError err;
+    BIDJWT jwt = NULL;
+    json_t *secret = NULL;
+    size_t cchJwt;
+
+    *pszJwt = NULL;
+
+    secret = json_loads(DsaSecretKey, 0, NULL);
+    if (secret == NULL) {
+        err = BID_S_INVALID_JSON;
+        goto cleanup;
+    }
+
+    jwt = BIDCalloc(1, sizeof(*jwt));
+    if (jwt == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    jwt->Payload = json_incref(payload);
+
+    err = _BIDMakeSignature(context, jwt, secret, NULL, NULL, pszJwt, &cchJwt);
+
+cleanup:
+    json_decref(secret);
+    _BIDReleaseJWT(context, jwt);
+
+    return err;
+}
+
+/*
+ * Make a backed assertion for TEST_SUBJECT; the expiry time in
+ * milliseconds also makes each assertion distinct.
+ */
+static BIDError
+MakeAssertion(
+    BIDContext context,
+    const char *szAudience,
+    json_int_t expiryTime,
+    char **pszAssertion)
+{
+    BIDError err;
+    json_t *cert = NULL, *assertion = NULL;
+    char *szCert = NULL, *szAssertion = NULL;
+
+    *pszAssertion = NULL;
+
+    cert = json_pack("{s:s, s:I, s:o, s:{s:s}}",
+                     "iss", TEST_ISSUER,
+                     "exp", (json_int_t)(time(NULL) + 86400) * 1000,
+                     "public-key", json_loads(DsaPublicKey, 0, NULL),
+                     "principal", "email", TEST_SUBJECT);
+    assertion = json_pack("{s:s, s:I}", "aud", szAudience, "exp", expiryTime);
+    if (cert == NULL || assertion == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    err = SignPayload(context, cert, &szCert);
+    BID_BAIL_ON_ERROR(err);
+
+    err = SignPayload(context, assertion, &szAssertion);
+    BID_BAIL_ON_ERROR(err);
+
+    *pszAssertion = BIDMalloc(strlen(szCert) + 1 + strlen(szAssertion) + 1);
+    if (*pszAssertion == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    sprintf(*pszAssertion, "%s~%s", szCert, szAssertion);
+
+cleanup:
+    json_decref(cert);
+    json_decref(assertion);
+    BIDFree(szCert);
+    BIDFree(szAssertion);
+
+    return err;
+}
+
+/*
+ * Put a current authority document for TEST_ISSUER in the authority
+ * cache, so that nothing is retrieved from the network.
+ */
+static BIDError
+CacheAuthority(BIDContext context)
+{
+    BIDError err;
+    BIDCache authorityCache = NULL;
+    json_t *authority;
+
+    err = BIDGetContextParam(context, BID_PARAM_AUTHORITY_CACHE, (void **)&authorityCache);
+    if (err != BID_S_OK)
+        return err;
+
+    authority = json_pack("{s:o, s:I}",
+                          "public-key", json_loads(DsaPublicKey, 0, NULL),
+                          "exp", (json_int_t)(time(NULL) + 86400) * 1000);
+    if (authority == NULL)
+        return BID_S_NO_MEMORY;
+
+    err = _BIDSetCacheObject(context, authorityCache, TEST_ISSUER, authority);
+
+    json_decref(authority);
+
+    return err;
+}
+
+static BIDError
+VerifyBatch(
+    BIDContext context,
+    size_t cAssertions,
+    const char **rgszAssertions,
+    BIDError *rgErrors)
+{
+    BIDError err;
+    BIDIdentity *rgIdentities;
+    const char **rgszAudiences;
+    time_t *rgExpiryTimes;
+    uint32_t *rgulRetFlags;
+    const char *szSubject;
+    size_t i;
+
+    rgIdentities = BIDCalloc(cAssertions, sizeof(BIDIdentity));
+    rgszAudiences = BIDCalloc(cAssertions, sizeof(char *));
+    rgExpiryTimes = BIDCalloc(cAssertions, sizeof(time_t));
+    rgulRetFlags = BIDCalloc(cAssertions, sizeof(uint32_t));
+    if (rgIdentities == NULL || rgszAudiences == NULL ||
+        rgExpiryTimes == NULL || rgulRetFlags == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    for (i = 0; i < cAssertions; i++)
+        rgszAudiences[i] = TEST_AUDIENCE;
+
+    err = BIDVerifyAssertions(context, BID_C_NO_REPLAY_CACHE, cAssertions,
+                              rgszAssertions, rgszAudiences, time(NULL), 0,
+                              rgErrors, rgIdentities, rgExpiryTimes, rgulRetFlags);
+    BID_BAIL_ON_ERROR(err);
+
+    for (i = 0; i < cAssertions; i++) {
+        if (rgErrors[i] != BID_S_OK) {
+            CheckError("rejected identity", rgIdentities[i] == BID_C_NO_IDENTITY
+                       ? BID_S_OK : BID_S_INVALID_PARAMETER, BID_S_OK);
+            continue;
+        }
+
+        szSubject = NULL;
+        BIDGetIdentitySubject(context, rgIdentities[i], &szSubject);
+        if (szSubject == NULL || strcmp(szSubject, TEST_SUBJECT) != 0) {
+            fprintf(stderr, "assertion %zu: subject %s, expected %s\n", i,
+                    szSubject ? szSubject : "(null)", TEST_SUBJECT);
+            cFailures++;
+        }
+    }
+
+cleanup:
+    if (rgIdentities != NULL) {
+        for (i = 0; i < cAssertions; i++) {
+            if (rgIdentities[i] != BID_C_NO_IDENTITY)
+                BIDReleaseIdentity(context, rgIdentities[i]);
+        }
+    }
+    BIDFree(rgIdentities);
+    BIDFree(rgszAudiences);
+    BIDFree(rgExpiryTimes);
+    BIDFree(rgulRetFlags);
+
+    return err;
+}
+
+static void
+TestMixedBatch(BIDContext context)
+{
+    static const int rgDuplicates[] = { 0, 2, 5 };
+    BIDError err;
+    char *szA = NULL, *szB = NULL, *szExpired = NULL, *szWrongAudience = NULL;
+    const char *rgszAssertions[8];
+    BIDError rgErrors[8];
+    json_int_t expiryTime = (json_int_t)(time(NULL) + 300) * 1000;
+    int cAccepted, i;
+
+    if (MakeAssertion(context, TEST_AUDIENCE, expiryTime, &szA) != BID_S_OK ||
+        MakeAssertion(context, TEST_AUDIENCE, expiryTime + 1, &szB) != BID_S_OK ||
+        MakeAssertion(context, TEST_AUDIENCE, (json_int_t)(time(NULL) - 3600) * 1000,
+                      &szExpired) != BID_S_OK ||
+        MakeAssertion(context, "https://other.example.com", expiryTime + 2,
+                      &szWrongAudience) != BID_S_OK) {
+        CheckError("make assertions", BID_S_NO_MEMORY, BID_S_OK);
+        goto cleanup;
+    }
+
+    rgszAssertions[0] = szA;
+    rgszAssertions[1] = "garbage";
+    rgszAssertions[2] = szA;
+    rgszAssertions[3] = szB;
+    rgszAssertions[4] = szExpired;
+    rgszAssertions[5] = szA;
+    rgszAssertions[6] = szWrongAudience;
+    rgszAssertions[7] = NULL;
+
+    err = VerifyBatch(context, 8, rgszAssertions, rgErrors);
+    CheckError("mixed batch", err, BID_S_OK);
+    if (err != BID_S_OK)
+        goto cleanup;
+
+    /* which copy is accepted depends on the workers' scheduling */
+    for (i = 0, cAccepted = 0; i < 3; i++) {
+        if (rgErrors[rgDuplicates[i]] == BID_S_OK)
+            cAccepted++;
+        else
+            CheckError("mixed batch: duplicate", rgErrors[rgDuplicates[i]],
+                       BID_S_REPLAYED_ASSERTION);
+    }
+    if (cAccepted != 1) {
+        fprintf(stderr, "mixed batch: duplicate accepted %d times\n", cAccepted);
+        cFailures++;
+    }
+
+    CheckError("mixed batch: garbage", rgErrors[1], BID_S_INVALID_JSON_WEB_TOKEN);
+    CheckError("mixed batch: same issuer", rgErrors[3], BID_S_OK);
+    CheckError("mixed batch: expired", rgErrors[4], BID_S_EXPIRED_ASSERTION);
+    CheckError("mixed batch: audience", rgErrors[6], BID_S_BAD_AUDIENCE);
+    CheckError("mixed batch: missing", rgErrors[7], BID_S_INVALID_PARAMETER);
+
+    /* a later batch sees the replay cache entries of this one */
+    rgszAssertions[0] = szB;
+
+    err = VerifyBatch(context, 1, rgszAssertions, rgErrors);
+    CheckError("later batch", err, BID_S_OK);
+    CheckError("later batch: replay", rgErrors[0], BID_S_REPLAYED_ASSERTION);
+
+cleanup:
+    BIDFree(szA);
+    BIDFree(szB);
+    BIDFree(szExpired);
+    BIDFree(szWrongAudience);
+}
+
+struct BatchThreadArgs {
+    BIDContext Context;
+    const char **rgszAssertions;
+    BIDError rgErrors[TEST_SHARED_ASSERTIONS];
+};
+
+static void *
+BatchThread(void *arg)
+{
+    struct BatchThreadArgs *args = (struct BatchThreadArgs *)arg;
+
+    return (void *)(intptr_t)VerifyBatch(args->Context, TEST_SHARED_ASSERTIONS,
+                                         args->rgszAssertions, args->rgErrors);
+}
+
+/*
+ * Several threads verify the same batch of assertions from one issuer at
+ * once: every assertion is valid, but each is accepted by one thread only.
+ */
+static void
+TestConcurrentBatches(BIDContext context)
+{
+    char *rgszAssertions[TEST_SHARED_ASSERTIONS];
+    struct BatchThreadArgs args[TEST_THREADS];
+    pthread_t threads[TEST_THREADS];
+    json_int_t expiryTime = (json_int_t)(time(NULL) + 600) * 1000;
+    int cStarted = 0, cAccepted, i, j;
+    void *ret;
+
+    memset(rgszAssertions, 0, sizeof(rgszAssertions));
+
+    for (i = 0; i < TEST_SHARED_ASSERTIONS; i++) {
+        if (MakeAssertion(context, TEST_AUDIENCE, expiryTime + i, &rgszAssertions[i]) != BID_S_OK) {
+            CheckError("make shared assertions", BID_S_NO_MEMORY, BID_S_OK);
+            goto cleanup;
+        }
+    }
+
+    for (i = 0; i < TEST_THREADS; i++) {
+        args[i].Context = context;
+        args[i].rgszAssertions = (const char **)rgszAssertions;
+
+        if (pthread_create(&threads[i], NULL, BatchThread, &args[i]) != 0) {
+            CheckError("start batch thread", BID_S_NO_MEMORY, BID_S_OK);
+            break;
+        }
+        cStarted++;
+    }
+
+    for (i = 0; i < cStarted; i++) {
+        pthread_join(threads[i], &ret);
+        CheckError("concurrent batch", (BIDError)(intptr_t)ret, BID_S_OK);
+    }
+
+    if (cStarted != TEST_THREADS)
+        goto cleanup;
+
+    for (j = 0; j < TEST_SHARED_ASSERTIONS; j++) {
+        for (i = 0, cAccepted = 0; i < TEST_THREADS; i++) {
+            if (args[i].rgErrors[j] == BID_S_OK)
+                cAccepted++;
+            else
+                CheckError("concurrent batch: replay", args[i].rgErrors[j],
+                           BID_S_REPLAYED_ASSERTION);
+        }
+
+        if (cAccepted != 1) {
+            fprintf(stderr, "concurrent batch: assertion %d accepted %d times\n",
+                    j, cAccepted);
+            cFailures++;
+        }
+    }
+
+cleanup:
+    for (i = 0; i < TEST_SHARED_ASSERTIONS; i++)
+        BIDFree(rgszAssertions[i]);
+}
+
+int main(int argc BID_UNUSED, char *argv[] BID_UNUSED)
+{
+    BIDError err;
+    BIDContext context = NULL;
+    unsigned long cAuthorityRejections, cRejections;
+    const char *s;
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_RP | BID_CONTEXT_REPLAY_CACHE |
+                            BID_CONTEXT_AUTHORITY_CACHE | BID_CONTEXT_THREAD_SAFE,
+                            NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(context, BID_PARAM_REPLAY_CACHE_NAME, "memory:");
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(context, BID_PARAM_AUTHORITY_CACHE_NAME, "memory:");
+    BID_BAIL_ON_ERROR(err);
+
+    err = CacheAuthority(context);
+    BID_BAIL_ON_ERROR(err);
+
+    BIDGetVerifyRejections(context, BID_VERIFY_STAGE_AUTHORITY, &cAuthorityRejections);
+
+    TestMixedBatch(context);
+    TestConcurrentBatches(context);
+
+    /* every assertion shared the cached issuer */
+    BIDGetVerifyRejections(context, BID_VERIFY_STAGE_AUTHORITY, &cRejections);
+    if (cRejections != cAuthorityRejections) {
+        fprintf(stderr, "%lu assertions rejected by authority\n",
+                cRejections - cAuthorityRejections);
+        cFailures++;
+    }
+
+    if (cFailures != 0)
+        err = BID_S_INVALID_ASSERTION;
+    else
+        printf("Batch verification tests passed\n");
+
+cleanup:
+    BIDReleaseContext(context);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
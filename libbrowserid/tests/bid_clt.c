@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * Context cloning test: clones share the caches of their template, but
+ * a clone of a template without a ticket cache gets the default ticket
+ * cache of the user cloning it. On platforms that choose the default
+ * ticket cache by XDG_RUNTIME_DIR, two users are simulated by changing
+ * it between clones.
+ */
+
+#define TEST_CONTEXT_OPTIONS    (BID_CONTEXT_USER_AGENT | BID_CONTEXT_REAUTH)
+
+static int cFailures;
+
+static void
+CheckError(const char *szTest, BIDError err, BIDError expected)
+{
+    const char *s1, *s2;
+
+    if (err == expected)
+        return;
+
+    BIDErrorToString(err, &s1);
+    BIDErrorToString(expected, &s2);
+    fprintf(stderr, "%s: got %s[%d], expected %s[%d]\n", szTest, s1, err, s2, expected);
+    cFailures++;
+}
+
+static void
+CheckCacheName(const char *szTest, BIDContext context, const char *szExpected)
+{
+    BIDError err;
+    const char *szCacheName = NULL;
+
+    err = BIDGetContextParam(context, BID_PARAM_TICKET_CACHE_NAME, (void **)&szCacheName);
+    CheckError(szTest, err, BID_S_OK);
+
+    if (szCacheName == NULL || strcmp(szCacheName, szExpected) != 0) {
+        fprintf(stderr, "%s: ticket cache is %s, expected %s\n", szTest,
+                szCacheName ? szCacheName : "(null)", szExpected);
+        cFailures++;
+    }
+}
+
+/*
+ * Return, in szCacheName, the name of the default ticket cache under the
+ * current environment.
+ */
+static BIDError
+GetDefaultCacheName(char *szCacheName, size_t cchCacheName)
+{
+    BIDError err;
+    BIDContext context = BID_C_NO_CONTEXT;
+    const char *szName;
+
+    err = BIDAcquireContext(NULL, TEST_CONTEXT_OPTIONS | BID_CONTEXT_TICKET_CACHE,
+                            NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDGetContextParam(context, BID_PARAM_TICKET_CACHE_NAME, (void **)&szName);
+    BID_BAIL_ON_ERROR(err);
+
+    snprintf(szCacheName, cchCacheName, "%s", szName);
+
+cleanup:
+    BIDReleaseContext(context);
+
+    return err;
+}
+
+static BIDError
+CloneContext(BIDContext templateContext, BIDContext *pContext)
+{
+    return BIDCloneContext(templateContext, TEST_CONTEXT_OPTIONS | BID_CONTEXT_TICKET_CACHE,
+                           pContext);
+}
+
+static BIDError
+GetTicket(BIDContext context, const char *szKey)
+{
+    BIDError err;
+    BIDCache ticketCache = NULL;
+    json_t *value = NULL;
+
+    err = BIDGetContextParam(context, BID_PARAM_TICKET_CACHE, (void **)&ticketCache);
+    if (err != BID_S_OK)
+        return err;
+
+    err = _BIDGetCacheObject(context, ticketCache, szKey, &value);
+
+    json_decref(value);
+
+    return err;
+}
+
+static BIDError
+PutTicket(BIDContext context, const char *szKey)
+{
+    BIDError err;
+    BIDCache ticketCache = NULL;
+    json_t *value;
+
+    err = BIDGetContextParam(context, BID_PARAM_TICKET_CACHE, (void **)&ticketCache);
+    if (err != BID_S_OK)
+        return err;
+
+    value = json_object();
+    if (value == NULL)
+        return BID_S_NO_MEMORY;
+
+    err = _BIDSetCacheObject(context, ticketCache, szKey, value);
+
+    json_decref(value);
+
+    return err;
+}
+
+static void
+RemoveCache(const char *szCacheName)
+{
+    if (strncmp(szCacheName, "file:", 5) == 0)
+        szCacheName += 5;
+
+    if (szCacheName[0] == '/')
+        unlink(szCacheName);
+}
+
+int main(int argc BID_UNUSED, char *argv[] BID_UNUSED)
+{
+    BIDError err;
+    BIDContext templateContext = BID_C_NO_CONTEXT;
+    BIDContext sharedTemplate = BID_C_NO_CONTEXT;
+    BIDContext clone1 = BID_C_NO_CONTEXT, clone2 = BID_C_NO_CONTEXT;
+    BIDContext clone3 = BID_C_NO_CONTEXT, clone4 = BID_C_NO_CONTEXT;
+    char szDir1[] = "/tmp/bid_clt.XXXXXX";
+    char szDir2[] = "/tmp/bid_clt.XXXXXX";
+    char szCacheName1[PATH_MAX] = "", szCacheName2[PATH_MAX] = "";
+    const char *s;
+
+    if (mkdtemp(szDir1) == NULL || mkdtemp(szDir2) == NULL) {
+        err = BID_S_CACHE_OPEN_ERROR;
+        goto cleanup;
+    }
+
+    err = BIDAcquireContext(NULL, TEST_CONTEXT_OPTIONS, NULL, &templateContext);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDCloneContext(templateContext, BID_CONTEXT_USER_AGENT | BID_CONTEXT_TICKET_CACHE,
+                          &clone1);
+    CheckError("ticket cache without reauth", err, BID_S_INVALID_PARAMETER);
+
+    err = BIDCloneContext(templateContext, TEST_CONTEXT_OPTIONS | BID_CONTEXT_REPLAY_CACHE,
+                          &clone1);
+    CheckError("replay cache not in template", err, BID_S_INVALID_PARAMETER);
+
+    /* the first user */
+    setenv("XDG_RUNTIME_DIR", szDir1, 1);
+
+    err = GetDefaultCacheName(szCacheName1, sizeof(szCacheName1));
+    BID_BAIL_ON_ERROR(err);
+
+    err = CloneContext(templateContext, &clone1);
+    CheckError("first user clone", err, BID_S_OK);
+    CheckCacheName("first user clone", clone1, szCacheName1);
+
+    err = PutTicket(clone1, "ticket1");
+    CheckError("first user store", err, BID_S_OK);
+
+    /* the second user */
+    setenv("XDG_RUNTIME_DIR", szDir2, 1);
+
+    err = GetDefaultCacheName(szCacheName2, sizeof(szCacheName2));
+    BID_BAIL_ON_ERROR(err);
+
+    err = CloneContext(templateContext, &clone2);
+    CheckError("second user clone", err, BID_S_OK);
+    CheckCacheName("second user clone", clone2, szCacheName2);
+
+#ifndef __APPLE__
+    if (strcmp(szCacheName1, szCacheName2) == 0) {
+        fprintf(stderr, "users share ticket cache %s\n", szCacheName1);
+        cFailures++;
+    }
+
+    err = PutTicket(clone2, "ticket3");
+    CheckError("second user store", err, BID_S_OK);
+
+    err = GetTicket(clone2, "ticket1");
+    CheckError("second user lookup", err, BID_S_CACHE_KEY_NOT_FOUND);
+#endif
+
+    err = GetTicket(clone1, "ticket1");
+    CheckError("first user lookup", err, BID_S_OK);
+
+    /* a template with a ticket cache shares it with its clones */
+    err = BIDAcquireContext(NULL, TEST_CONTEXT_OPTIONS | BID_CONTEXT_TICKET_CACHE,
+                            NULL, &sharedTemplate);
+    BID_BAIL_ON_ERROR(err);
+
+    setenv("XDG_RUNTIME_DIR", szDir1, 1);
+
+    err = CloneContext(sharedTemplate, &clone3);
+    CheckError("shared clone", err, BID_S_OK);
+    CheckCacheName("shared clone", clone3, szCacheName2);
+
+    err = PutTicket(clone3, "ticket2");
+    CheckError("shared store", err, BID_S_OK);
+
+    err = CloneContext(sharedTemplate, &clone4);
+    CheckError("second shared clone", err, BID_S_OK);
+
+    err = GetTicket(clone4, "ticket2");
+    CheckError("shared lookup", err, BID_S_OK);
+
+    err = GetTicket(clone2, "ticket2");
+    CheckError("template cache lookup", err, BID_S_OK);
+
+    if (cFailures != 0)
+        err = BID_S_CACHE_KEY_NOT_FOUND;
+    else
+        printf("Context clone tests passed\n");
+
+cleanup:
+    BIDReleaseContext(clone1);
+    BIDReleaseContext(clone2);
+    BIDReleaseContext(clone3);
+    BIDReleaseContext(clone4);
+    BIDReleaseContext(templateContext);
+    BIDReleaseContext(sharedTemplate);
+    RemoveCache(szCacheName1);
+    RemoveCache(szCacheName2);
+    rmdir(szDir1);
+    rmdir(szDir2);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
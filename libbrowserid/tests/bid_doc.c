@@ -40,12 +40,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include "browserid.h"
 #include "bid_private.h"
 
 /*
  * Test authority document retrieval.
+ *
+ * Usage: bid_doc [hostname [iterations [config]]]
+ *
+ * With an iteration count, the well-known document is fetched repeatedly
+ * to exercise connection reuse; set https-ca-certificate in the config
+ * to the CA of a local HTTPS server to test against it.
  */
 int main(int argc, char *argv[])
 {
@@ -53,19 +60,51 @@ int main(int argc, char *argv[])
     BIDContext context = NULL;
     BIDAuthority authority = NULL;
     BIDJWK pkey = NULL;
+    const char *szHostname = "login.persona.org";
+    const char *szConfig = NULL;
     const char *s;
+    int i, cIterations = 0;
+    struct timeval start, end;
 
-    err = BIDAcquireContext(NULL, BID_CONTEXT_RP | BID_CONTEXT_VERIFY_REMOTE, NULL, &context);
+    if (argc > 1)
+        szHostname = argv[1];
+    if (argc > 2)
+        cIterations = atoi(argv[2]);
+    if (argc > 3)
+        szConfig = argv[3];
+
+    err = BIDAcquireContext(szConfig, BID_CONTEXT_RP | BID_CONTEXT_VERIFY_REMOTE, NULL, &context);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDAcquireAuthority(context, "login.persona.org", time(NULL), &authority);
+    err = _BIDAcquireAuthority(context, szHostname, time(NULL), &authority);
     BID_BAIL_ON_ERROR(err);
 
     err = _BIDGetAuthorityPublicKey(context, authority, &pkey);
     BID_BAIL_ON_ERROR(err);
 
-    err = _BIDIssuerIsAuthoritative(context, "padl.com", "login.persona.org", time(NULL));
-    BID_BAIL_ON_ERROR(err);
+    if (argc == 1) {
+        err = _BIDIssuerIsAuthoritative(context, "padl.com", "login.persona.org", time(NULL));
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    gettimeofday(&start, NULL);
+
+    for (i = 0; i < cIterations; i++) {
+        json_t *doc = NULL;
+
+        err = _BIDRetrieveDocument(context, szHostname, BID_WELL_KNOWN_URL, NULL, &doc, NULL);
+        BID_BAIL_ON_ERROR(err);
+
+        json_decref(doc);
+    }
+
+    gettimeofday(&end, NULL);
+
+    if (cIterations != 0) {
+        printf("%d fetches from %s, %.3f ms per fetch\n", cIterations, szHostname,
+               ((end.tv_sec - start.tv_sec) * 1000.0 +
+                (end.tv_usec - start.tv_usec) / 1000.0) / cIterations);
+    }
 
 cleanup:
     json_decref(pkey);
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <openssl/crypto.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * ECDH key pool test: keys are never handed out twice, pools are filled
+ * per curve in the background, the background refill makes OpenSSL safe
+ * for concurrent use even though the context is not thread-safe, and a
+ * forked child neither deadlocks on the pool nor uses keys inherited from
+ * its parent.
+ */
+
+#define TEST_WAIT_SECONDS       30
+#define TEST_FORKS              16
+
+static int cFailures;
+
+static void
+CheckError(const char *szTest, BIDError err, BIDError expected)
+{
+    const char *s1, *s2;
+
+    if (err == expected)
+        return;
+
+    BIDErrorToString(err, &s1);
+    BIDErrorToString(expected, &s2);
+    fprintf(stderr, "%s: got %s[%d], expected %s[%d]\n", szTest, s1, err, s2, expected);
+    cFailures++;
+}
+
+static size_t
+PoolCount(BIDContext context, json_t *params, size_t *pcMaxKeys)
+{
+    size_t cKeys = 0, cMaxKeys = 0;
+
+    _BIDGetECDHKeyPoolStatistics(context, params, &cKeys, &cMaxKeys);
+
+    if (pcMaxKeys != NULL)
+        *pcMaxKeys = cMaxKeys;
+
+    return cKeys;
+}
+
+/*
+ * Wait for the refill thread to fill the pool.
+ */
+static void
+WaitForPool(const char *szTest, BIDContext context, json_t *params)
+{
+    size_t cMaxKeys;
+    int i;
+
+    for (i = 0; i < TEST_WAIT_SECONDS * 100; i++) {
+        if (PoolCount(context, params, &cMaxKeys) == cMaxKeys)
+            return;
+        usleep(10000);
+    }
+
+    fprintf(stderr, "%s: pool holds %zu of %zu keys\n", szTest,
+            PoolCount(context, params, NULL), cMaxKeys);
+    cFailures++;
+}
+
+/*
+ * Generate a key and return its public X coordinate, or NULL.
+ */
+static char *
+GenerateKey(const char *szTest, BIDContext context, json_t *params)
+{
+    BIDError err;
+    BIDJWK key = NULL;
+    char *szX = NULL;
+
+    err = _BIDGenerateECDHKey(context, params, &key);
+    CheckError(szTest, err, BID_S_OK);
+
+    if (err == BID_S_OK)
+        szX = strdup(json_string_value(json_object_get(key, "x")));
+
+    json_decref(key);
+
+    return szX;
+}
+
+/*
+ * The context is not thread-safe, so the locking callbacks are only
+ * installed once a refill is started.
+ */
+static void
+TestLockingCallbacks(BIDContext context, json_t *params)
+{
+    char *szX;
+
+    if (CRYPTO_get_locking_callback() != NULL) {
+        fprintf(stderr, "locking: callbacks installed before refill\n");
+        cFailures++;
+        return;
+    }
+
+    szX = GenerateKey("locking", context, params);
+    free(szX);
+
+    if (CRYPTO_get_locking_callback() == NULL) {
+        fprintf(stderr, "locking: refill started without locking callbacks\n");
+        cFailures++;
+    }
+
+    WaitForPool("locking: refill", context, params);
+}
+
+static void
+TestPerCurve(BIDContext context, json_t *p256, json_t *p384)
+{
+    char *szX;
+
+    if (PoolCount(context, p256, NULL) != 0 || PoolCount(context, p384, NULL) != 0) {
+        fprintf(stderr, "curve: pools filled before use\n");
+        cFailures++;
+    }
+
+    /* the first key is generated inline */
+    szX = GenerateKey("curve: P-256", context, p256);
+    free(szX);
+
+    WaitForPool("curve: P-256 refill", context, p256);
+
+    if (PoolCount(context, p384, NULL) != 0) {
+        fprintf(stderr, "curve: P-384 pool filled by P-256 use\n");
+        cFailures++;
+    }
+
+    szX = GenerateKey("curve: P-384", context, p384);
+    free(szX);
+
+    WaitForPool("curve: P-384 refill", context, p384);
+}
+
+static void
+TestDepletion(BIDContext context, json_t *params)
+{
+    size_t cMaxKeys, cKeys, i, j;
+    char **rgszX;
+
+    PoolCount(context, params, &cMaxKeys);
+
+    /* take more keys than the pool holds, so some are generated inline */
+    cKeys = 2 * cMaxKeys + 1;
+    rgszX = calloc(cKeys, sizeof(char *));
+    if (rgszX == NULL)
+        return;
+
+    for (i = 0; i < cKeys; i++)
+        rgszX[i] = GenerateKey("depletion", context, params);
+
+    for (i = 0; i < cKeys; i++) {
+        for (j = i + 1; j < cKeys; j++) {
+            if (rgszX[i] != NULL && rgszX[j] != NULL && strcmp(rgszX[i], rgszX[j]) == 0) {
+                fprintf(stderr, "depletion: keys %zu and %zu are the same\n", i, j);
+                cFailures++;
+            }
+        }
+    }
+
+    for (i = 0; i < cKeys; i++)
+        free(rgszX[i]);
+    free(rgszX);
+
+    WaitForPool("depletion: refill", context, params);
+}
+
+/*
+ * The parent's next pooled key must not be the child's first key.
+ */
+static void
+TestForkKeys(BIDContext context, json_t *params)
+{
+    size_t cMaxKeys;
+    int fds[2];
+    pid_t pid;
+    char szChildX[256] = { 0 };
+    char *szX;
+    int status;
+    ssize_t cbRead;
+
+    WaitForPool("fork: fill", context, params);
+
+    if (pipe(fds) != 0)
+        return;
+
+    pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+
+        if (PoolCount(context, params, &cMaxKeys) != 0)
+            _exit(1);
+
+        szX = GenerateKey("fork: child", context, params);
+        if (szX == NULL)
+            _exit(1);
+
+        write(fds[1], szX, strlen(szX));
+        _exit(0);
+    }
+
+    close(fds[1]);
+
+    if (PoolCount(context, params, &cMaxKeys) != cMaxKeys) {
+        fprintf(stderr, "fork: parent pool was emptied\n");
+        cFailures++;
+    }
+
+    szX = GenerateKey("fork: parent", context, params);
+
+    cbRead = read(fds[0], szChildX, sizeof(szChildX) - 1);
+    close(fds[0]);
+
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || cbRead <= 0) {
+        fprintf(stderr, "fork: child failed\n");
+        cFailures++;
+    } else if (szX != NULL && strcmp(szX, szChildX) == 0) {
+        fprintf(stderr, "fork: parent and child used the same key\n");
+        cFailures++;
+    }
+
+    free(szX);
+}
+
+/*
+ * Fork while the refill thread is running; the child must be able to
+ * take the pool lock.
+ */
+static void
+TestForkRefill(BIDContext context, json_t *params)
+{
+    pid_t pid;
+    char *szX;
+    int i, status;
+
+    for (i = 0; i < TEST_FORKS; i++) {
+        szX = GenerateKey("fork refill: parent", context, params);
+        free(szX);
+
+        pid = fork();
+        if (pid == 0) {
+            alarm(TEST_WAIT_SECONDS);
+            szX = GenerateKey("fork refill: child", context, params);
+            _exit(szX == NULL);
+        }
+
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "fork refill: child %d failed\n", i);
+            cFailures++;
+        }
+    }
+}
+
+int main(int argc BID_UNUSED, char *argv[] BID_UNUSED)
+{
+    BIDError err;
+    BIDContext context = NULL;
+    json_t *p256 = NULL, *p384 = NULL, *p521 = NULL;
+    const char *s;
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_USER_AGENT | BID_CONTEXT_ECDH_KEYEX, NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    p256 = json_pack("{s:s, s:s}", "kty", "EC", "crv", BID_ECDH_CURVE_P256);
+    p384 = json_pack("{s:s, s:s}", "kty", "EC", "crv", BID_ECDH_CURVE_P384);
+    p521 = json_pack("{s:s, s:s}", "kty", "EC", "crv", BID_ECDH_CURVE_P521);
+    if (p256 == NULL || p384 == NULL || p521 == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    TestLockingCallbacks(context, p521);
+    TestPerCurve(context, p256, p384);
+    TestDepletion(context, p256);
+    TestForkKeys(context, p256);
+    TestForkRefill(context, p384);
+
+    if (cFailures != 0)
+        err = BID_S_INVALID_ASSERTION;
+
+cleanup:
+    json_decref(p256);
+    json_decref(p384);
+    json_decref(p521);
+    BIDReleaseContext(context);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
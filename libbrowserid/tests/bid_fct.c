@@ -45,7 +45,7 @@
 #include "bid_private.h"
 
 /*
- * File cache test
+ * File cache test; optionally takes a cache name, e.g. log:test.log
  */
 
 int main(int argc, char *argv[])
@@ -67,7 +67,7 @@ int main(int argc, char *argv[])
     _BIDJsonObjectSet(context, k, "baz", json_string("12345678"), BID_JSON_FLAG_CONSUME_REF);
     _BIDJsonObjectSet(context, k, "bat", json_string("This is a test"), BID_JSON_FLAG_CONSUME_REF);
 
-    err = _BIDAcquireCache(context, "test.json", 0, &cache);
+    err = _BIDAcquireCache(context, argc > 1 ? argv[1] : "test.json", 0, &cache);
     BID_BAIL_ON_ERROR(err);
 
     err = _BIDInitializeCache(context, cache);
@@ -81,9 +81,19 @@ int main(int argc, char *argv[])
     err = _BIDSetCacheObject(context, cache, "another_cache_object", k);
     BID_BAIL_ON_ERROR(err);
 
+    err = _BIDAddCacheObject(context, cache, "foo", k);
+    if (err == BID_S_CACHE_KEY_EXISTS)
+        err = BID_S_OK;
+    else if (err == BID_S_OK)
+        err = BID_S_INVALID_USAGE;
+    BID_BAIL_ON_ERROR(err);
+
     err = _BIDRemoveCacheObject(context, cache, "foo");
     BID_BAIL_ON_ERROR(err);
 
+    err = _BIDAddCacheObject(context, cache, "foo", j);
+    BID_BAIL_ON_ERROR(err);
+
     err = _BIDGetCacheObject(context, cache, "another_cache_object", &z);
     if (err == BID_S_OK)
         _BIDOutputDebugJson(z);
@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * Claims scanner test: the audience and validity period are found in
+ * the raw payload where possible, malformed or oversized payloads are
+ * left to the full parse, and either way the assertion is rejected with
+ * the same error.
+ */
+
+#define TEST_AUDIENCE           "https://rp.example.com"
+#define TEST_TIME               1700000000
+
+static int cFailures;
+
+static void
+CheckError(const char *szTest, BIDError err, BIDError expected)
+{
+    const char *s1, *s2;
+
+    if (err == expected)
+        return;
+
+    BIDErrorToString(err, &s1);
+    BIDErrorToString(expected, &s2);
+    fprintf(stderr, "%s: got %s[%d], expected %s[%d]\n", szTest, s1, err, s2, expected);
+    cFailures++;
+}
+
+static void
+Check(const char *szTest, int bResult)
+{
+    if (!bResult) {
+        fprintf(stderr, "%s: failed\n", szTest);
+        cFailures++;
+    }
+}
+
+static BIDError
+AppendEncoded(const char *szData, size_t cbData, char *szBuffer, size_t *pcchBuffer)
+{
+    BIDError err;
+    char *szEncoded = NULL;
+    size_t cchEncoded;
+
+    err = _BIDBase64UrlEncode((const unsigned char *)szData, cbData, &szEncoded, &cchEncoded);
+    if (err != BID_S_OK)
+        return err;
+
+    memcpy(szBuffer + *pcchBuffer, szEncoded, cchEncoded);
+    *pcchBuffer += cchEncoded;
+    szBuffer[*pcchBuffer] = '\0';
+
+    BIDFree(szEncoded);
+
+    return BID_S_OK;
+}
+
+/*
+ * Make an unsigned <cert>~<assertion> with the given assertion payload.
+ */
+static BIDError
+MakeBackedAssertion(const char *szPayload, char **pszAssertion)
+{
+    BIDError err;
+    const char *szHeader = "{\"alg\":\"RS256\"}";
+    size_t cchAssertion = 0;
+    char *szAssertion;
+
+    *pszAssertion = NULL;
+
+    szAssertion = BIDMalloc(2 * (strlen(szHeader) * 2 + strlen(szPayload) + 16) + 32);
+    if (szAssertion == NULL)
+        return BID_S_NO_MEMORY;
+
+    err = AppendEncoded(szHeader, strlen(szHeader), szAssertion, &cchAssertion);
+    BID_BAIL_ON_ERROR(err);
+    strcpy(&szAssertion[cchAssertion], ".");
+    cchAssertion++;
+    err = AppendEncoded("{}", 2, szAssertion, &cchAssertion);
+    BID_BAIL_ON_ERROR(err);
+    strcpy(&szAssertion[cchAssertion], ".AAAA~");
+    cchAssertion += 6;
+
+    err = AppendEncoded(szHeader, strlen(szHeader), szAssertion, &cchAssertion);
+    BID_BAIL_ON_ERROR(err);
+    strcpy(&szAssertion[cchAssertion], ".");
+    cchAssertion++;
+    err = AppendEncoded(szPayload, strlen(szPayload), szAssertion, &cchAssertion);
+    BID_BAIL_ON_ERROR(err);
+    strcpy(&szAssertion[cchAssertion], ".AAAA");
+
+    *pszAssertion = szAssertion;
+    szAssertion = NULL;
+
+cleanup:
+    BIDFree(szAssertion);
+
+    return err;
+}
+
+static BIDError
+ScanClaims(
+    BIDContext context,
+    const char *szPayload,
+    struct BIDJWTClaimsDesc *claims)
+{
+    BIDError err;
+    BIDBackedAssertion backedAssertion = NULL;
+    char *szAssertion = NULL;
+
+    memset(claims, 0, sizeof(*claims));
+
+    err = MakeBackedAssertion(szPayload, &szAssertion);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDUnpackBackedAssertionInternal(context, szAssertion,
+                                            BID_JWT_FLAG_LAZY_PAYLOAD, &backedAssertion);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDGetJWTClaims(context, backedAssertion->Assertion, claims);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    _BIDReleaseBackedAssertion(context, backedAssertion);
+    BIDFree(szAssertion);
+
+    return err;
+}
+
+static BIDError
+VerifyPayload(BIDContext context, const char *szPayload)
+{
+    BIDError err;
+    BIDIdentity identity = BID_C_NO_IDENTITY;
+    char *szAssertion = NULL;
+    time_t expiryTime;
+    uint32_t ulRetFlags;
+
+    err = MakeBackedAssertion(szPayload, &szAssertion);
+    if (err != BID_S_OK)
+        return err;
+
+    err = BIDVerifyAssertion(context, BID_C_NO_REPLAY_CACHE, szAssertion, TEST_AUDIENCE,
+                             NULL, 0, TEST_TIME, 0, &identity, &expiryTime, &ulRetFlags);
+
+    BIDReleaseIdentity(context, identity);
+    BIDFree(szAssertion);
+
+    return err;
+}
+
+static void
+TestWellFormed(BIDContext context)
+{
+    BIDError err;
+    struct BIDJWTClaimsDesc claims;
+
+    err = ScanClaims(context,
+                     "{ \"principal\": {\"email\": \"lukeh@padl.com\", \"x\": [1, {\"aud\": \"y\"}]},\n"
+                     "  \"aud\" : \"" TEST_AUDIENCE "\", \"exp\": 1700000060000,\n"
+                     "  \"iat\": 1699999990000, \"nbf\": -1000 }",
+                     &claims);
+    CheckError("well-formed", err, BID_S_OK);
+    Check("well-formed present", claims.Present == BID_JWT_CLAIM_ALL);
+    Check("well-formed opaque", claims.Opaque == 0);
+    Check("well-formed audience",
+          claims.Audience != NULL && strcmp(claims.Audience, TEST_AUDIENCE) == 0);
+    Check("well-formed times",
+          claims.Expiry == 1700000060 && claims.IssuedAt == 1699999990 && claims.NotBefore == -1);
+
+    err = ScanClaims(context, "{}", &claims);
+    CheckError("empty object", err, BID_S_OK);
+    Check("empty object present", claims.Present == 0 && claims.Opaque == 0);
+
+    /* claims the scanner cannot interpret are marked opaque */
+    err = ScanClaims(context, "{\"aud\":\"https:\\/\\/rp.example.com\",\"exp\":1.7e12}", &claims);
+    CheckError("escaped audience", err, BID_S_OK);
+    Check("escaped audience opaque",
+          claims.Opaque == (BID_JWT_CLAIM_AUD | BID_JWT_CLAIM_EXP) && claims.Audience == NULL);
+
+    err = ScanClaims(context, "{\"\\u0061ud\":\"x\"}", &claims);
+    CheckError("escaped key", err, BID_S_OK);
+    Check("escaped key opaque", claims.Opaque == BID_JWT_CLAIM_ALL);
+
+    err = ScanClaims(context, "{\"exp\":12345678901234567890123}", &claims);
+    CheckError("long integer", err, BID_S_OK);
+    Check("long integer opaque", claims.Opaque == BID_JWT_CLAIM_EXP);
+
+    err = ScanClaims(context, "{\"aud\":[\"" TEST_AUDIENCE "\"]}", &claims);
+    CheckError("audience array", err, BID_S_OK);
+    Check("audience array missing",
+          claims.Present == BID_JWT_CLAIM_AUD && claims.Audience == NULL && claims.Opaque == 0);
+}
+
+static void
+TestMalformed(BIDContext context)
+{
+    static const char *rgszMalformed[] = {
+        "{\"aud\":\"x\"",
+        "{\"aud\" \"x\"}",
+        "{\"aud\":\"x\",}",
+        "{\"aud\":\"x}",
+        "{aud:\"x\"}",
+        "{\"exp\":1]",
+        "{\"a\":{\"b\":[1,2}",
+        "{\"a\":}",
+        "{\"a\":\"\\",
+        " ",
+        NULL
+    };
+    BIDError err;
+    struct BIDJWTClaimsDesc claims;
+    size_t i;
+
+    for (i = 0; rgszMalformed[i] != NULL; i++) {
+        err = ScanClaims(context, rgszMalformed[i], &claims);
+        CheckError(rgszMalformed[i], err, BID_S_INVALID_JSON);
+
+        /* the full parse rejects them too */
+        err = VerifyPayload(context, rgszMalformed[i]);
+        CheckError(rgszMalformed[i], err, BID_S_INVALID_JSON);
+    }
+
+    /* valid JSON, but the payload must be an object */
+    err = ScanClaims(context, "[\"aud\"]", &claims);
+    CheckError("array", err, BID_S_INVALID_JSON);
+
+    err = VerifyPayload(context, "[\"aud\"]");
+    CheckError("array", err, BID_S_MISSING_AUDIENCE);
+}
+
+/*
+ * A payload too large for the thread arena is not scanned, but the
+ * checks made after the full parse reject it in the same way.
+ */
+static void
+TestOversized(BIDContext context)
+{
+    BIDError err;
+    struct BIDJWTClaimsDesc claims;
+    size_t cchPadding = BID_THREAD_ARENA_MAX;
+    char *szPayload;
+    char *p;
+
+    szPayload = BIDMalloc(cchPadding + 128);
+    if (szPayload == NULL) {
+        CheckError("oversized", BID_S_NO_MEMORY, BID_S_OK);
+        return;
+    }
+
+    p = szPayload;
+    p += sprintf(p, "{\"aud\":\"%s\",\"exp\":%lld000,\"pad\":\"",
+                 TEST_AUDIENCE, (long long)TEST_TIME - 3600);
+    memset(p, 'A', cchPadding);
+    p += cchPadding;
+    strcpy(p, "\"}");
+
+    err = ScanClaims(context, szPayload, &claims);
+    CheckError("oversized scan", err, BID_S_BUFFER_TOO_LONG);
+
+    err = VerifyPayload(context, szPayload);
+    CheckError("oversized expired", err, BID_S_EXPIRED_ASSERTION);
+
+    p = szPayload;
+    p += sprintf(p, "{\"aud\":\"https://other.example.com\",\"exp\":%lld000,\"pad\":\"",
+                 (long long)TEST_TIME + 3600);
+    memset(p, 'A', cchPadding);
+    p += cchPadding;
+    strcpy(p, "\"}");
+
+    err = VerifyPayload(context, szPayload);
+    CheckError("oversized audience", err, BID_S_BAD_AUDIENCE);
+
+    BIDFree(szPayload);
+}
+
+/* the scanner and the full parse reach the same verdict */
+static void
+TestRejections(BIDContext context)
+{
+    BIDError err;
+    char szPayload[256];
+
+    snprintf(szPayload, sizeof(szPayload), "{\"aud\":\"%s\",\"exp\":%lld000}",
+             TEST_AUDIENCE, (long long)TEST_TIME - 3600);
+    err = VerifyPayload(context, szPayload);
+    CheckError("expired", err, BID_S_EXPIRED_ASSERTION);
+
+    snprintf(szPayload, sizeof(szPayload), "{\"aud\":\"https:\\/\\/rp.example.com\",\"exp\":%lld000}",
+             (long long)TEST_TIME - 3600);
+    err = VerifyPayload(context, szPayload);
+    CheckError("expired, escaped audience", err, BID_S_EXPIRED_ASSERTION);
+
+    snprintf(szPayload, sizeof(szPayload), "{\"aud\":\"https://other.example.com\",\"exp\":%lld000}",
+             (long long)TEST_TIME + 3600);
+    err = VerifyPayload(context, szPayload);
+    CheckError("bad audience", err, BID_S_BAD_AUDIENCE);
+
+    snprintf(szPayload, sizeof(szPayload), "{\"exp\":%lld000}", (long long)TEST_TIME + 3600);
+    err = VerifyPayload(context, szPayload);
+    CheckError("missing audience", err, BID_S_MISSING_AUDIENCE);
+}
+
+int main(int argc BID_UNUSED, char *argv[] BID_UNUSED)
+{
+    BIDError err;
+    BIDContext context = NULL;
+    const char *s;
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_RP, NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    TestWellFormed(context);
+    TestMalformed(context);
+    TestOversized(context);
+    TestRejections(context);
+
+    if (cFailures != 0)
+        err = BID_S_INVALID_ASSERTION;
+
+cleanup:
+    BIDReleaseContext(context);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * Public key cache test: a key is parsed once however often it is used,
+ * equivalent keys share an entry, and a cached key can be used at once
+ * by threads whose contexts were not acquired as thread safe.
+ */
+
+#define TEST_THREADS            4
+#define TEST_THREAD_VERIFIES    250
+
+static char
+DsaPublicKey[] =
+"{\"algorithm\":\"DS\",\"version\":\"2012.08.15\",\"y\":\"EgxmUUA4YD/wNDJH3mX+QTIiIwDtn2cAaCkXr0HGKFN3eTuoOqt6iCvTXEkFZCSIog9ml6wKIasJO8mcT+ZVD+40oD+CXKeRJ7LXPnpSuB5rSvgUxEtVY4/8wWra5RnhoHn8BOgb6tq/zOn9EEV6nE6h/t4rVb/dLW1QTono1Q8=\",\"p\":\"/2AEg9tqv8W0Xqt4WUs1M9VQ2fG/Kpkqeo2qbcNPgEWtTm4MQp0zTu6q79fiPUgQvgDkzBSSy6MluoH/LVpbMFqNF+s79KBqNJ05LgDTKXRKUXk4A0ToKhjEeTNDj4keIq7vgS1pyPdeMmy3DqAAw/d239vWBGOMLvcX/CbQLhc=\",\"q\":\"4h4E+RHR7XmRAI7Kqzv3dZhDCcM=\",\"g\":\"xSpKD/O35h/fGGfOhBODaaYVT0r6kpZuPIJ+Jc+mz1CLkOXeQZ4TN+B6Lp4qPNXepwTRdfjr9q85fWnhELlq+xfHoDJZMp5IKbDQO7x4lrFbSt5T4TCFjMNNliaaqJBB9AkTbHJCo4iVydW8ytTzia8dekvROYvQct/6iWIzOXo=\"}";
+
+static char
+DsaSecretKey[] = "{\"algorithm\":\"DS\",\"version\":\"2012.08.15\",\"x\":\"rwzgsSIrU6h+BleE/2wDM7sZZtk=\",\"p\":\"/2AEg9tqv8W0Xqt4WUs1M9VQ2fG/Kpkqeo2qbcNPgEWtTm4MQp0zTu6q79fiPUgQvgDkzBSSy6MluoH/LVpbMFqNF+s79KBqNJ05LgDTKXRKUXk4A0ToKhjEeTNDj4keIq7vgS1pyPdeMmy3DqAAw/d239vWBGOMLvcX/CbQLhc=\",\"q\":\"4h4E+RHR7XmRAI7Kqzv3dZhDCcM=\",\"g\":\"xSpKD/O35h/fGGfOhBODaaYVT0r6kpZuPIJ+Jc+mz1CLkOXeQZ4TN+B6Lp4qPNXepwTRdfjr9q85fWnhELlq+xfHoDJZMp5IKbDQO7x4lrFbSt5T4TCFjMNNliaaqJBB9AkTbHJCo4iVydW8ytTzia8dekvROYvQct/6iWIzOXo=\"}";
+
+static int cFailures;
+
+static void
+CheckError(const char *szTest, BIDError err, BIDError expected)
+{
+    const char *s1, *s2;
+
+    if (err == expected)
+        return;
+
+    BIDErrorToString(err, &s1);
+    BIDErrorToString(expected, &s2);
+    fprintf(stderr, "%s: got %s[%d], expected %s[%d]\n", szTest, s1, err, s2, expected);
+    cFailures++;
+}
+
+/*
+ * Check that the cache counts have moved by the expected amounts since
+ * *pHits and *pMisses were last updated.
+ */
+static void
+CheckStatistics(
+    const char *szTest,
+    BIDContext context,
+    uint64_t *pHits,
+    uint64_t *pMisses,
+    uint64_t cExpectedHits,
+    uint64_t cExpectedMisses)
+{
+    uint64_t hits, misses;
+
+    _BIDGetKeyCacheStatistics(context, &hits, &misses);
+
+    if (hits - *pHits != cExpectedHits || misses - *pMisses != cExpectedMisses) {
+        fprintf(stderr, "%s: %llu hits and %llu misses, expected %llu and %llu\n", szTest,
+                (unsigned long long)(hits - *pHits), (unsigned long long)(misses - *pMisses),
+                (unsigned long long)cExpectedHits, (unsigned long long)cExpectedMisses);
+        cFailures++;
+    }
+
+    *pHits = hits;
+    *pMisses = misses;
+}
+
+static BIDError
+VerifyJWT(BIDContext context, const char *szJwt, const char *szPublicKey)
+{
+    BIDError err;
+    BIDJWT jwt = NULL;
+    json_t *public = NULL;
+
+    public = json_loads(szPublicKey, 0, NULL);
+    if (public == NULL)
+        return BID_S_INVALID_JSON;
+
+    err = _BIDParseJWT(context, szJwt, &jwt);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDVerifySignature(context, jwt, public);
+
+cleanup:
+    json_decref(public);
+    _BIDReleaseJWT(context, jwt);
+
+    return err;
+}
+
+static void *
+VerifyThread(void *arg)
+{
+    BIDError err;
+    BIDContext context = BID_C_NO_CONTEXT;
+    const char *szJwt = (const char *)arg;
+    int i;
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_RP, NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    for (i = 0; i < TEST_THREAD_VERIFIES; i++) {
+        err = VerifyJWT(context, szJwt, DsaPublicKey);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+cleanup:
+    BIDReleaseContext(context);
+
+    return (void *)(intptr_t)err;
+}
+
+static BIDError
+SignJWT(BIDContext context, char **pszJwt)
+{
+    BIDError err;
+    BIDJWT jwt = NULL;
+    json_t *secret = NULL;
+    size_t cchJwt;
+
+    secret = json_loads(DsaSecretKey, 0, NULL);
+    if (secret == NULL)
+        return BID_S_INVALID_JSON;
+
+    jwt = BIDCalloc(1, sizeof(*jwt));
+    if (jwt == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    jwt->Payload = json_pack("{s:s, s:i}", "iss", "joe", "exp", 1300819380);
+
+    err = _BIDMakeSignature(context, jwt, secret, NULL, NULL, pszJwt, &cchJwt);
+
+cleanup:
+    json_decref(secret);
+    _BIDReleaseJWT(context, jwt);
+
+    return err;
+}
+
+int main(int argc BID_UNUSED, char *argv[] BID_UNUSED)
+{
+    BIDError err;
+    BIDContext context = NULL;
+    char *szJwt = NULL;
+    char *szPublicKey = NULL;
+    json_t *public = NULL;
+    pthread_t threads[TEST_THREADS];
+    uint64_t hits = 0, misses = 0;
+    size_t cchJwt;
+    void *ret;
+    int i;
+    const char *s;
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_RP, NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = SignJWT(context, &szJwt);
+    BID_BAIL_ON_ERROR(err);
+
+    _BIDGetKeyCacheStatistics(context, &hits, &misses);
+
+    err = VerifyJWT(context, szJwt, DsaPublicKey);
+    CheckError("first verify", err, BID_S_OK);
+    CheckStatistics("first verify", context, &hits, &misses, 0, 1);
+
+    for (i = 0; i < 9; i++) {
+        err = VerifyJWT(context, szJwt, DsaPublicKey);
+        CheckError("repeated verify", err, BID_S_OK);
+    }
+    CheckStatistics("repeated verify", context, &hits, &misses, 9, 0);
+
+    /* members other than the key parameters do not distinguish keys */
+    public = json_loads(DsaPublicKey, 0, NULL);
+    json_object_set_new(public, "kid", json_string("test"));
+    szPublicKey = json_dumps(public, JSON_COMPACT);
+
+    err = VerifyJWT(context, szJwt, szPublicKey);
+    CheckError("equivalent key", err, BID_S_OK);
+    CheckStatistics("equivalent key", context, &hits, &misses, 1, 0);
+
+    /* a bad signature is still checked with the cached key */
+    cchJwt = strlen(szJwt);
+    szJwt[cchJwt - 2] = (szJwt[cchJwt - 2] == 'A') ? 'B' : 'A';
+
+    err = VerifyJWT(context, szJwt, DsaPublicKey);
+    CheckError("bad signature", err, BID_S_INVALID_SIGNATURE);
+    CheckStatistics("bad signature", context, &hits, &misses, 1, 0);
+
+    szJwt[cchJwt - 2] = (szJwt[cchJwt - 2] == 'A') ? 'B' : 'A';
+
+    for (i = 0; i < TEST_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, VerifyThread, szJwt) != 0) {
+            err = BID_S_NO_MEMORY;
+            goto cleanup;
+        }
+    }
+
+    for (i = 0; i < TEST_THREADS; i++) {
+        pthread_join(threads[i], &ret);
+        CheckError("thread verify", (BIDError)(intptr_t)ret, BID_S_OK);
+    }
+    CheckStatistics("thread verify", context, &hits, &misses,
+                    TEST_THREADS * TEST_THREAD_VERIFIES, 0);
+
+    if (cFailures != 0)
+        err = BID_S_CRYPTO_ERROR;
+    else
+        printf("Key cache tests passed\n");
+
+cleanup:
+    BIDReleaseContext(context);
+    BIDFree(szJwt);
+    BIDFree(szPublicKey);
+    json_decref(public);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * Log cache test: a malformed record in the journal is skipped and then
+ * compacted away, rather than making the cache unreadable.
+ */
+
+static BIDError
+AppendToJournal(const char *szFileName, const char *szData)
+{
+    FILE *fp;
+
+    fp = fopen(szFileName, "a");
+    if (fp == NULL)
+        return BID_S_CACHE_WRITE_ERROR;
+
+    fputs(szData, fp);
+    fclose(fp);
+
+    return BID_S_OK;
+}
+
+static int
+JournalContains(const char *szFileName, const char *szData)
+{
+    FILE *fp;
+    char buf[1024];
+    int bFound = 0;
+
+    fp = fopen(szFileName, "r");
+    if (fp == NULL)
+        return 0;
+
+    while (!bFound && fgets(buf, sizeof(buf), fp) != NULL)
+        bFound = (strstr(buf, szData) != NULL);
+
+    fclose(fp);
+
+    return bFound;
+}
+
+int main(int argc, char *argv[])
+{
+    BIDError err;
+    BIDCache cache = NULL;
+    BIDContext context = NULL;
+    const char *s;
+    const char *szFileName = argc > 1 ? argv[1] : "test.log";
+    char szCacheName[1024];
+    json_t *j = NULL;
+    json_t *z = NULL;
+
+    snprintf(szCacheName, sizeof(szCacheName), "log:%s", szFileName);
+
+    err = BIDAcquireContext(NULL, 0, NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    j = json_string("bar");
+
+    err = _BIDAcquireCache(context, szCacheName, 0, &cache);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDInitializeCache(context, cache);
+    if (err == BID_S_CACHE_ALREADY_EXISTS)
+        err = BID_S_OK;
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDSetCacheObject(context, cache, "foo", j);
+    BID_BAIL_ON_ERROR(err);
+
+    /* complete records that are not valid JSON, or not valid records */
+    err = AppendToJournal(szFileName, "{\"k\":\"foo\",\"v\":garbage\n[1,2,3]\n");
+    BID_BAIL_ON_ERROR(err);
+
+    _BIDReleaseCache(context, cache);
+    cache = NULL;
+
+    err = _BIDAcquireCache(context, szCacheName, 0, &cache);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDGetCacheObject(context, cache, "foo", &z);
+    BID_BAIL_ON_ERROR(err);
+
+    if (!json_equal(j, z)) {
+        err = BID_S_CACHE_READ_ERROR;
+        goto cleanup;
+    }
+
+    /* the next write compacts the malformed records away */
+    err = _BIDSetCacheObject(context, cache, "baz", j);
+    BID_BAIL_ON_ERROR(err);
+
+    if (JournalContains(szFileName, "garbage") || JournalContains(szFileName, "[1,2,3]")) {
+        err = BID_S_CACHE_WRITE_ERROR;
+        goto cleanup;
+    }
+
+    printf("Malformed journal records skipped and compacted\n");
+
+    err = _BIDDestroyCache(context, cache);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    _BIDReleaseCache(context, cache);
+    BIDReleaseContext(context);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    json_decref(j);
+    json_decref(z);
+
+    exit(err);
+}
@@ -0,0 +1,483 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * Memory-mapped cache test: entries spanning continuation slots, reuse of
+ * expired slots, reclaiming removed entries, growing a full table and
+ * adding the same keys from several processes at once. Optionally takes
+ * a file name.
+ */
+
+#define TEST_SLOTS              64      /* the smallest table */
+#define TEST_SLOT_SIZE          1024
+#define TEST_CHILDREN           4
+#define TEST_CONCURRENT_KEYS    200
+
+static int cFailures;
+
+static void
+CheckError(const char *szTest, BIDError err, BIDError expected)
+{
+    const char *s1, *s2;
+
+    if (err == expected)
+        return;
+
+    BIDErrorToString(err, &s1);
+    BIDErrorToString(expected, &s2);
+    fprintf(stderr, "%s: got %s[%d], expected %s[%d]\n", szTest, s1, err, s2, expected);
+    cFailures++;
+}
+
+static void
+Check(const char *szTest, int bCondition)
+{
+    if (!bCondition) {
+        fprintf(stderr, "%s: failed\n", szTest);
+        cFailures++;
+    }
+}
+
+static BIDError
+AcquireContext(BIDContext *pContext)
+{
+    BIDError err;
+    BIDContext context = BID_C_NO_CONTEXT;
+
+    err = BIDAcquireContext(NULL, 0, NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(context, BID_PARAM_CONFIG_NAME, "memory:");
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDSetCacheObject(context, context->Config, "mmapcacheslots",
+                             json_integer(TEST_SLOTS));
+    BID_BAIL_ON_ERROR(err);
+
+    *pContext = context;
+    context = BID_C_NO_CONTEXT;
+
+cleanup:
+    BIDReleaseContext(context);
+
+    return err;
+}
+
+/*
+ * Make a value of about cbValue bytes that expires at expiryTime.
+ */
+static json_t *
+MakeValue(BIDContext context, size_t cbValue, time_t expiryTime, char ch)
+{
+    json_t *value = json_object();
+    char *sz = BIDMalloc(cbValue + 1);
+
+    memset(sz, ch, cbValue);
+    sz[cbValue] = '\0';
+
+    _BIDJsonObjectSet(context, value, "v", json_string(sz), BID_JSON_FLAG_CONSUME_REF);
+    _BIDSetJsonTimestampValue(context, value, "exp", expiryTime);
+
+    BIDFree(sz);
+
+    return value;
+}
+
+static BIDError
+CheckValue(BIDContext context, BIDCache cache, const char *szKey, json_t *expected)
+{
+    BIDError err;
+    json_t *value = NULL;
+
+    err = _BIDGetCacheObject(context, cache, szKey, &value);
+    if (err == BID_S_OK && !json_equal(value, expected))
+        err = BID_S_CACHE_READ_ERROR;
+
+    json_decref(value);
+
+    return err;
+}
+
+/*
+ * Count the slots in the table, and find the longest run of slots that
+ * are not empty, which is the longest a lookup can probe.
+ */
+static uint64_t
+CountSlots(const char *szFileName, uint64_t *pcLongestRun)
+{
+    struct stat sb;
+    uint64_t cSlots, s, cRun = 0;
+    uint32_t state;
+    int fd;
+
+    *pcLongestRun = 0;
+
+    fd = open(szFileName, O_RDONLY);
+    if (fd < 0 || fstat(fd, &sb) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+
+    cSlots = sb.st_size / TEST_SLOT_SIZE - 1;
+
+    /* go round twice for runs that wrap */
+    for (s = 0; s < 2 * cSlots; s++) {
+        if (pread(fd, &state, sizeof(state), (s % cSlots + 1) * TEST_SLOT_SIZE) != sizeof(state))
+            break;
+
+        cRun = (state != 0) ? cRun + 1 : 0;
+        if (cRun > *pcLongestRun)
+            *pcLongestRun = cRun;
+    }
+
+    close(fd);
+
+    return cSlots;
+}
+
+static BIDError
+ResetCache(BIDContext context, BIDCache cache)
+{
+    BIDError err;
+
+    err = _BIDDestroyCache(context, cache);
+    if (err == BID_S_CACHE_NOT_FOUND)
+        err = BID_S_OK;
+    if (err == BID_S_OK)
+        err = _BIDInitializeCache(context, cache);
+
+    return err;
+}
+
+static void
+TestContinuation(BIDContext context, BIDCache cache, time_t now)
+{
+    BIDError err;
+    json_t *big = MakeValue(context, 3000, now + 3600, 'b');
+    json_t *bigger = MakeValue(context, 10000, now + 3600, 'B');
+    json_t *small = MakeValue(context, 16, now + 3600, 's');
+    json_t *huge = MakeValue(context, 20000, now + 3600, 'h');
+    char szKey[32];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        snprintf(szKey, sizeof(szKey), "neighbour-%d", i);
+        err = _BIDSetCacheObject(context, cache, szKey, small);
+        CheckError("continuation: set neighbour", err, BID_S_OK);
+    }
+
+    err = _BIDSetCacheObject(context, cache, "run", big);
+    CheckError("continuation: set", err, BID_S_OK);
+    err = CheckValue(context, cache, "run", big);
+    CheckError("continuation: get", err, BID_S_OK);
+
+    err = _BIDSetCacheObject(context, cache, "run", bigger);
+    CheckError("continuation: grow", err, BID_S_OK);
+    err = CheckValue(context, cache, "run", bigger);
+    CheckError("continuation: get grown", err, BID_S_OK);
+
+    err = _BIDSetCacheObject(context, cache, "run", small);
+    CheckError("continuation: shrink", err, BID_S_OK);
+    err = CheckValue(context, cache, "run", small);
+    CheckError("continuation: get shrunk", err, BID_S_OK);
+
+    err = _BIDSetCacheObject(context, cache, "run", huge);
+    CheckError("continuation: too long", err, BID_S_BUFFER_TOO_LONG);
+
+    err = _BIDRemoveCacheObject(context, cache, "run");
+    CheckError("continuation: remove", err, BID_S_OK);
+    err = CheckValue(context, cache, "run", small);
+    CheckError("continuation: get removed", err, BID_S_CACHE_KEY_NOT_FOUND);
+
+    for (i = 0; i < 4; i++) {
+        snprintf(szKey, sizeof(szKey), "neighbour-%d", i);
+        err = CheckValue(context, cache, szKey, small);
+        CheckError("continuation: get neighbour", err, BID_S_OK);
+    }
+
+    json_decref(big);
+    json_decref(bigger);
+    json_decref(small);
+    json_decref(huge);
+}
+
+static void
+TestExpiryReuse(BIDContext context, BIDCache cache, const char *szFileName, time_t now)
+{
+    BIDError err;
+    json_t *expired = MakeValue(context, 16, now - 3600, 'e');
+    json_t *live = MakeValue(context, 16, now + 3600, 'l');
+    uint64_t cLongestRun;
+    char szKey[32];
+    int i;
+
+    err = ResetCache(context, cache);
+    CheckError("expiry: reset", err, BID_S_OK);
+
+    for (i = 0; i < TEST_SLOTS - 8; i++) {
+        snprintf(szKey, sizeof(szKey), "expired-%d", i);
+        err = _BIDAddCacheObject(context, cache, szKey, expired);
+        CheckError("expiry: add expired", err, BID_S_OK);
+    }
+
+    /* an expired entry does not prevent the key being added again */
+    err = _BIDAddCacheObject(context, cache, "expired-0", live);
+    CheckError("expiry: add over expired", err, BID_S_OK);
+    err = _BIDAddCacheObject(context, cache, "expired-0", live);
+    CheckError("expiry: add over live", err, BID_S_CACHE_KEY_EXISTS);
+
+    for (i = 0; i < TEST_SLOTS / 4; i++) {
+        snprintf(szKey, sizeof(szKey), "live-%d", i);
+        err = _BIDAddCacheObject(context, cache, szKey, live);
+        CheckError("expiry: add live", err, BID_S_OK);
+    }
+
+    for (i = 0; i < TEST_SLOTS / 4; i++) {
+        snprintf(szKey, sizeof(szKey), "live-%d", i);
+        err = CheckValue(context, cache, szKey, live);
+        CheckError("expiry: get live", err, BID_S_OK);
+    }
+
+    /* the expired slots were reused rather than the table grown */
+    Check("expiry: table size", CountSlots(szFileName, &cLongestRun) == TEST_SLOTS);
+
+    json_decref(expired);
+    json_decref(live);
+}
+
+static void
+TestReclaim(BIDContext context, BIDCache cache, const char *szFileName, time_t now)
+{
+    BIDError err;
+    json_t *live = MakeValue(context, 16, now + 3600, 'l');
+    json_t *value = NULL;
+    uint64_t cLongestRun;
+    char szKey[32];
+    int i;
+
+    err = ResetCache(context, cache);
+    CheckError("reclaim: reset", err, BID_S_OK);
+
+    for (i = 0; i < 50 * TEST_SLOTS; i++) {
+        snprintf(szKey, sizeof(szKey), "churn-%d", i);
+        err = _BIDAddCacheObject(context, cache, szKey, live);
+        CheckError("reclaim: add", err, BID_S_OK);
+        err = _BIDRemoveCacheObject(context, cache, szKey);
+        CheckError("reclaim: remove", err, BID_S_OK);
+    }
+
+    err = _BIDGetCacheObject(context, cache, "churn-0", &value);
+    CheckError("reclaim: get removed", err, BID_S_CACHE_KEY_NOT_FOUND);
+
+    /* tombstones are reclaimed, so misses still end at an empty slot */
+    Check("reclaim: table size", CountSlots(szFileName, &cLongestRun) == TEST_SLOTS);
+    Check("reclaim: empty slots", cLongestRun < TEST_SLOTS / 2);
+
+    json_decref(live);
+}
+
+static void
+TestFullWindow(BIDContext context, BIDCache cache, const char *szFileName, time_t now)
+{
+    BIDError err;
+    json_t *live = MakeValue(context, 16, now + 3600, 'l');
+    json_t *big = MakeValue(context, 2500, now + 3600, 'b');
+    uint64_t cLongestRun;
+    char szKey[32];
+    int i;
+
+    err = ResetCache(context, cache);
+    CheckError("full: reset", err, BID_S_OK);
+
+    /* more entries than slots, so the table must grow */
+    for (i = 0; i < 4 * TEST_SLOTS; i++) {
+        snprintf(szKey, sizeof(szKey), "full-%d", i);
+        err = _BIDAddCacheObject(context, cache, szKey, (i % 8) ? live : big);
+        CheckError("full: add", err, BID_S_OK);
+    }
+
+    for (i = 0; i < 4 * TEST_SLOTS; i++) {
+        snprintf(szKey, sizeof(szKey), "full-%d", i);
+        err = CheckValue(context, cache, szKey, (i % 8) ? live : big);
+        CheckError("full: get", err, BID_S_OK);
+    }
+
+    Check("full: table grown", CountSlots(szFileName, &cLongestRun) > 4 * TEST_SLOTS);
+
+    json_decref(live);
+    json_decref(big);
+}
+
+/*
+ * Each child adds the same keys, starting at a different one; exactly
+ * one add of each key should succeed. Returns the number that did.
+ */
+static int
+ConcurrentAddChild(const char *szCacheName, int child, time_t now)
+{
+    BIDError err;
+    BIDContext context = BID_C_NO_CONTEXT;
+    BIDCache cache = BID_C_NO_REPLAY_CACHE;
+    json_t *live = NULL;
+    char szKey[32];
+    int i, cAdded = 0;
+
+    err = AcquireContext(&context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDAcquireCache(context, szCacheName, 0, &cache);
+    BID_BAIL_ON_ERROR(err);
+
+    live = MakeValue(context, 16 + child, now + 3600, 'c');
+
+    for (i = 0; i < TEST_CONCURRENT_KEYS; i++) {
+        int k = (i + child * TEST_CONCURRENT_KEYS / TEST_CHILDREN) % TEST_CONCURRENT_KEYS;
+
+        snprintf(szKey, sizeof(szKey), "concurrent-%d", k);
+        err = _BIDAddCacheObject(context, cache, szKey, live);
+        if (err == BID_S_OK)
+            cAdded++;
+        else if (err != BID_S_CACHE_KEY_EXISTS)
+            goto cleanup;
+    }
+
+    err = BID_S_OK;
+
+cleanup:
+    json_decref(live);
+    _BIDReleaseCache(context, cache);
+    BIDReleaseContext(context);
+
+    return err == BID_S_OK ? cAdded : 255;
+}
+
+static void
+TestConcurrentAdd(BIDContext context, BIDCache cache, const char *szCacheName, time_t now)
+{
+    BIDError err;
+    pid_t pids[TEST_CHILDREN];
+    json_t *value = NULL;
+    char szKey[32];
+    int i, status, cAdded = 0;
+
+    err = ResetCache(context, cache);
+    CheckError("concurrent: reset", err, BID_S_OK);
+
+    for (i = 0; i < TEST_CHILDREN; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0)
+            _exit(ConcurrentAddChild(szCacheName, i, now));
+        Check("concurrent: fork", pids[i] > 0);
+    }
+
+    for (i = 0; i < TEST_CHILDREN; i++) {
+        if (pids[i] > 0 && waitpid(pids[i], &status, 0) == pids[i] && WIFEXITED(status)) {
+            Check("concurrent: child", WEXITSTATUS(status) != 255);
+            cAdded += WEXITSTATUS(status);
+        }
+    }
+
+    Check("concurrent: each key added once", cAdded == TEST_CONCURRENT_KEYS);
+
+    for (i = 0; i < TEST_CONCURRENT_KEYS; i++) {
+        snprintf(szKey, sizeof(szKey), "concurrent-%d", i);
+        err = _BIDGetCacheObject(context, cache, szKey, &value);
+        CheckError("concurrent: get", err, BID_S_OK);
+        json_decref(value);
+        value = NULL;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    BIDError err;
+    BIDContext context = NULL;
+    BIDCache cache = NULL;
+    const char *szFileName = argc > 1 ? argv[1] : "test.mmap";
+    char szCacheName[1024];
+    time_t now = time(NULL);
+    const char *s;
+
+    snprintf(szCacheName, sizeof(szCacheName), "mmap:%s", szFileName);
+
+    err = AcquireContext(&context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDAcquireCache(context, szCacheName, 0, &cache);
+    BID_BAIL_ON_ERROR(err);
+
+    err = ResetCache(context, cache);
+    BID_BAIL_ON_ERROR(err);
+
+    TestContinuation(context, cache, now);
+    TestExpiryReuse(context, cache, szFileName, now);
+    TestReclaim(context, cache, szFileName, now);
+    TestFullWindow(context, cache, szFileName, now);
+    TestConcurrentAdd(context, cache, szCacheName, now);
+
+    if (cFailures != 0)
+        err = BID_S_CACHE_WRITE_ERROR;
+    else
+        printf("Memory-mapped cache tests passed\n");
+
+    _BIDDestroyCache(context, cache);
+
+cleanup:
+    _BIDReleaseCache(context, cache);
+    BIDReleaseContext(context);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * Bulk purge test: on each backend that implements PurgeObjects, purging
+ * a cache must leave the same entries as removing them one at a time with
+ * the fallback walk, and the result must survive reopening the cache.
+ */
+
+#define TEST_ENTRIES            40
+
+static int cFailures;
+
+static void
+CheckError(const char *szTest, BIDError err, BIDError expected)
+{
+    const char *s1, *s2;
+
+    if (err == expected)
+        return;
+
+    BIDErrorToString(err, &s1);
+    BIDErrorToString(expected, &s2);
+    fprintf(stderr, "%s: got %s[%d], expected %s[%d]\n", szTest, s1, err, s2, expected);
+    cFailures++;
+}
+
+static void
+Check(const char *szTest, int bCondition)
+{
+    if (!bCondition) {
+        fprintf(stderr, "%s: failed\n", szTest);
+        cFailures++;
+    }
+}
+
+static BIDError
+AcquireContext(BIDContext *pContext)
+{
+    BIDError err;
+    BIDContext context = BID_C_NO_CONTEXT;
+
+    err = BIDAcquireContext(NULL, 0, NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(context, BID_PARAM_CONFIG_NAME, "memory:");
+    BID_BAIL_ON_ERROR(err);
+
+    /* the smallest table, so that the mapped cache also has to grow */
+    err = _BIDSetCacheObject(context, context->Config, "mmapcacheslots", json_integer(64));
+    BID_BAIL_ON_ERROR(err);
+
+    *pContext = context;
+    context = BID_C_NO_CONTEXT;
+
+cleanup:
+    BIDReleaseContext(context);
+
+    return err;
+}
+
+static BIDError
+AcquireEmptyCache(BIDContext context, const char *szCacheName, BIDCache *pCache)
+{
+    BIDError err;
+
+    err = _BIDAcquireCache(context, szCacheName, 0, pCache);
+    if (err != BID_S_OK)
+        return err;
+
+    /* left over from an earlier run, or not there at all */
+    _BIDDestroyCache(context, *pCache);
+
+    err = _BIDInitializeCache(context, *pCache);
+    if (err == BID_S_CACHE_ALREADY_EXISTS)
+        err = BID_S_OK;
+
+    return err;
+}
+
+static BIDError
+SetCacheValue(BIDContext context, BIDCache cache, const char *szKey, int n)
+{
+    BIDError err;
+    json_t *value = json_object();
+
+    err = _BIDJsonObjectSet(context, value, "n", json_integer(n),
+                            BID_JSON_FLAG_REQUIRED | BID_JSON_FLAG_CONSUME_REF);
+    if (err == BID_S_OK)
+        err = _BIDSetCacheObject(context, cache, szKey, value);
+
+    json_decref(value);
+
+    return err;
+}
+
+/*
+ * Store entries, then replace and remove a few of them, so that the
+ * journal of the log backend holds more than one record per key.
+ */
+static void
+PopulateCache(BIDContext context, BIDCache cache)
+{
+    BIDError err;
+    char szKey[32];
+    int i;
+
+    for (i = 0; i < TEST_ENTRIES; i++) {
+        snprintf(szKey, sizeof(szKey), "key-%d", i);
+        err = SetCacheValue(context, cache, szKey, i);
+        CheckError("populate: set", err, BID_S_OK);
+    }
+
+    for (i = 0; i < TEST_ENTRIES; i += 4) {
+        snprintf(szKey, sizeof(szKey), "key-%d", i);
+        err = SetCacheValue(context, cache, szKey, i + 1);
+        CheckError("populate: replace", err, BID_S_OK);
+    }
+
+    for (i = 1; i < TEST_ENTRIES; i += 10) {
+        snprintf(szKey, sizeof(szKey), "key-%d", i);
+        err = _BIDRemoveCacheObject(context, cache, szKey);
+        CheckError("populate: remove", err, BID_S_OK);
+    }
+}
+
+/*
+ * Purge entries whose value is a multiple of three, counting the
+ * entries that the predicate was asked about.
+ */
+static int
+PurgeMultipleOfThreeP(
+    BIDContext context BID_UNUSED,
+    BIDCache cache BID_UNUSED,
+    const char *szKey BID_UNUSED,
+    json_t *j,
+    void *data)
+{
+    int *pcCalls = data;
+
+    (*pcCalls)++;
+
+    return json_integer_value(json_object_get(j, "n")) % 3 == 0;
+}
+
+static BIDError
+RemoveMultipleOfThreeCB(
+    BIDContext context,
+    BIDCache cache,
+    const char *szKey,
+    json_t *j,
+    void *data)
+{
+    if (PurgeMultipleOfThreeP(context, cache, szKey, j, data))
+        _BIDRemoveCacheObject(context, cache, szKey);
+
+    return BID_S_OK;
+}
+
+static BIDError
+CollectCacheObjectsCB(
+    BIDContext context BID_UNUSED,
+    BIDCache cache BID_UNUSED,
+    const char *szKey,
+    json_t *j,
+    void *data)
+{
+    return json_object_set(data, szKey, j) < 0 ? BID_S_NO_MEMORY : BID_S_OK;
+}
+
+static json_t *
+CollectCacheObjects(BIDContext context, BIDCache cache)
+{
+    json_t *contents = json_object();
+
+    _BIDPerformCacheObjects(context, cache, CollectCacheObjectsCB, contents);
+
+    return contents;
+}
+
+static void
+TestPurge(BIDContext context, const char *szScheme, const char *szFileName)
+{
+    BIDError err;
+    BIDCache purged = NULL, walked = NULL;
+    char szPurgedName[1024], szWalkedName[1024], szTest[64];
+    json_t *purgedContents = NULL, *walkedContents = NULL;
+    void *iter;
+    int cPurgeCalls = 0, cWalkCalls = 0;
+    int bPersistent = (szFileName != NULL);
+
+    if (bPersistent) {
+        snprintf(szPurgedName, sizeof(szPurgedName), "%s:%s.purged", szScheme, szFileName);
+        snprintf(szWalkedName, sizeof(szWalkedName), "%s:%s.walked", szScheme, szFileName);
+    } else {
+        snprintf(szPurgedName, sizeof(szPurgedName), "%s:", szScheme);
+        snprintf(szWalkedName, sizeof(szWalkedName), "%s:", szScheme);
+    }
+
+    snprintf(szTest, sizeof(szTest), "%s: acquire", szScheme);
+    err = AcquireEmptyCache(context, szPurgedName, &purged);
+    CheckError(szTest, err, BID_S_OK);
+    BID_BAIL_ON_ERROR(err);
+
+    err = AcquireEmptyCache(context, szWalkedName, &walked);
+    CheckError(szTest, err, BID_S_OK);
+    BID_BAIL_ON_ERROR(err);
+
+    PopulateCache(context, purged);
+    PopulateCache(context, walked);
+
+    err = _BIDPurgeCache(context, purged, PurgeMultipleOfThreeP, &cPurgeCalls);
+    snprintf(szTest, sizeof(szTest), "%s: purge", szScheme);
+    CheckError(szTest, err, BID_S_OK);
+
+    err = _BIDPerformCacheObjects(context, walked, RemoveMultipleOfThreeCB, &cWalkCalls);
+    snprintf(szTest, sizeof(szTest), "%s: walk", szScheme);
+    CheckError(szTest, err, BID_S_OK);
+
+    snprintf(szTest, sizeof(szTest), "%s: predicate calls", szScheme);
+    Check(szTest, cPurgeCalls == cWalkCalls);
+
+    if (bPersistent) {
+        _BIDReleaseCache(context, purged);
+        purged = NULL;
+
+        err = _BIDAcquireCache(context, szPurgedName, 0, &purged);
+        snprintf(szTest, sizeof(szTest), "%s: reopen", szScheme);
+        CheckError(szTest, err, BID_S_OK);
+        BID_BAIL_ON_ERROR(err);
+    }
+
+    purgedContents = CollectCacheObjects(context, purged);
+    walkedContents = CollectCacheObjects(context, walked);
+
+    snprintf(szTest, sizeof(szTest), "%s: same entries", szScheme);
+    Check(szTest, json_equal(purgedContents, walkedContents));
+
+    snprintf(szTest, sizeof(szTest), "%s: entries left", szScheme);
+    Check(szTest, json_object_size(purgedContents) != 0 &&
+                  json_object_size(purgedContents) < (size_t)cPurgeCalls);
+
+    for (iter = json_object_iter(purgedContents);
+         iter != NULL;
+         iter = json_object_iter_next(purgedContents, iter)) {
+        json_t *j = json_object_iter_value(iter);
+
+        snprintf(szTest, sizeof(szTest), "%s: %s kept", szScheme, json_object_iter_key(iter));
+        Check(szTest, json_integer_value(json_object_get(j, "n")) % 3 != 0);
+    }
+
+cleanup:
+    if (purged != NULL) {
+        if (bPersistent)
+            _BIDDestroyCache(context, purged);
+        _BIDReleaseCache(context, purged);
+    }
+    if (walked != NULL) {
+        if (bPersistent)
+            _BIDDestroyCache(context, walked);
+        _BIDReleaseCache(context, walked);
+    }
+    json_decref(purgedContents);
+    json_decref(walkedContents);
+}
+
+int main(int argc, char *argv[])
+{
+    BIDError err;
+    BIDContext context = NULL;
+    const char *szFileName = argc > 1 ? argv[1] : "test-purge";
+    const char *s;
+
+    err = AcquireContext(&context);
+    BID_BAIL_ON_ERROR(err);
+
+    TestPurge(context, "memory", NULL);
+    TestPurge(context, "file", szFileName);
+    TestPurge(context, "log", szFileName);
+    TestPurge(context, "mmap", szFileName);
+
+    if (cFailures != 0)
+        err = BID_S_CACHE_WRITE_ERROR;
+    else
+        printf("Cache purge tests passed\n");
+
+cleanup:
+    BIDReleaseContext(context);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
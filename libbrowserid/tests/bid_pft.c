@@ -0,0 +1,594 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * Prefetch and coalescing test: concurrent lookups of an authority share
+ * one fetch, a queued background refresh never holds up a lookup that
+ * needs it, asynchronous work is bounded, and prefetch callbacks run on
+ * a worker thread with the library's own context.
+ */
+
+#define TEST_AUDIENCE           "https://rp.example.com"
+#define TEST_ISSUER             "example.com"
+#define TEST_SUBJECT            "user@example.com"
+#define TEST_THREADS            4
+
+static char
+DsaPublicKey[] =
+"{\"algorithm\":\"DS\",\"version\":\"2012.08.15\",\"y\":\"EgxmUUA4YD/wNDJH3mX+QTIiIwDtn2cAaCkXr0HGKFN3eTuoOqt6iCvTXEkFZCSIog9ml6wKIasJO8mcT+ZVD+40oD+CXKeRJ7LXPnpSuB5rSvgUxEtVY4/8wWra5RnhoHn8BOgb6tq/zOn9EEV6nE6h/t4rVb/dLW1QTono1Q8=\",\"p\":\"/2AEg9tqv8W0Xqt4WUs1M9VQ2fG/Kpkqeo2qbcNPgEWtTm4MQp0zTu6q79fiPUgQvgDkzBSSy6MluoH/LVpbMFqNF+s79KBqNJ05LgDTKXRKUXk4A0ToKhjEeTNDj4keIq7vgS1pyPdeMmy3DqAAw/d239vWBGOMLvcX/CbQLhc=\",\"q\":\"4h4E+RHR7XmRAI7Kqzv3dZhDCcM=\",\"g\":\"xSpKD/O35h/fGGfOhBODaaYVT0r6kpZuPIJ+Jc+mz1CLkOXeQZ4TN+B6Lp4qPNXepwTRdfjr9q85fWnhELlq+xfHoDJZMp5IKbDQO7x4lrFbSt5T4TCFjMNNliaaqJBB9AkTbHJCo4iVydW8ytTzia8dekvROYvQct/6iWIzOXo=\"}";
+
+static char
+DsaSecretKey[] = "{\"algorithm\":\"DS\",\"version\":\"2012.08.15\",\"x\":\"rwzgsSIrU6h+BleE/2wDM7sZZtk=\",\"p\":\"/2AEg9tqv8W0Xqt4WUs1M9VQ2fG/Kpkqeo2qbcNPgEWtTm4MQp0zTu6q79fiPUgQvgDkzBSSy6MluoH/LVpbMFqNF+s79KBqNJ05LgDTKXRKUXk4A0ToKhjEeTNDj4keIq7vgS1pyPdeMmy3DqAAw/d239vWBGOMLvcX/CbQLhc=\",\"q\":\"4h4E+RHR7XmRAI7Kqzv3dZhDCcM=\",\"g\":\"xSpKD/O35h/fGGfOhBODaaYVT0r6kpZuPIJ+Jc+mz1CLkOXeQZ4TN+B6Lp4qPNXepwTRdfjr9q85fWnhELlq+xfHoDJZMp5IKbDQO7x4lrFbSt5T4TCFjMNNliaaqJBB9AkTbHJCo4iVydW8ytTzia8dekvROYvQct/6iWIzOXo=\"}";
+
+static int cFailures;
+
+static void
+CheckError(const char *szTest, BIDError err, BIDError expected)
+{
+    const char *s1, *s2;
+
+    if (err == expected)
+        return;
+
+    BIDErrorToString(err, &s1);
+    BIDErrorToString(expected, &s2);
+    fprintf(stderr, "%s: got %s[%d], expected %s[%d]\n", szTest, s1, err, s2, expected);
+    cFailures++;
+}
+
+/*
+ * Sign payload with the test key. The same key is used for the issuer
+ * and the user, since only the prefetching is under test.
+ */
+static BIDError
+SignPayload(BIDContext context, json_t *payload, char **pszJwt)
+{
+    BIDError err;
+    BIDJWT jwt = NULL;
+    json_t *secret = NULL;
+    size_t cchJwt;
+
+    *pszJwt = NULL;
+
+    secret = json_loads(DsaSecretKey, 0, NULL);
+    if (secret == NULL) {
+        err = BID_S_INVALID_JSON;
+        goto cleanup;
+    }
+
+    jwt = BIDCalloc(1, sizeof(*jwt));
+    if (jwt == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    jwt->Payload = json_incref(payload);
+
+    err = _BIDMakeSignature(context, jwt, secret, NULL, NULL, pszJwt, &cchJwt);
+
+cleanup:
+    json_decref(secret);
+    _BIDReleaseJWT(context, jwt);
+
+    return err;
+}
+
+/*
+ * Make a backed assertion for TEST_SUBJECT; the expiry time in
+ * milliseconds also makes each assertion distinct.
+ */
+static BIDError
+MakeAssertion(
+    BIDContext context,
+    const char *szAudience,
+    json_int_t expiryTime,
+    char **pszAssertion)
+{
+    BIDError err;
+    json_t *cert = NULL, *assertion = NULL;
+    char *szCert = NULL, *szAssertion = NULL;
+
+    *pszAssertion = NULL;
+
+    cert = json_pack("{s:s, s:I, s:o, s:{s:s}}",
+                     "iss", TEST_ISSUER,
+                     "exp", (json_int_t)(time(NULL) + 86400) * 1000,
+                     "public-key", json_loads(DsaPublicKey, 0, NULL),
+                     "principal", "email", TEST_SUBJECT);
+    assertion = json_pack("{s:s, s:I}", "aud", szAudience, "exp", expiryTime);
+    if (cert == NULL || assertion == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    err = SignPayload(context, cert, &szCert);
+    BID_BAIL_ON_ERROR(err);
+
+    err = SignPayload(context, assertion, &szAssertion);
+    BID_BAIL_ON_ERROR(err);
+
+    *pszAssertion = BIDMalloc(strlen(szCert) + 1 + strlen(szAssertion) + 1);
+    if (*pszAssertion == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    sprintf(*pszAssertion, "%s~%s", szCert, szAssertion);
+
+cleanup:
+    json_decref(cert);
+    json_decref(assertion);
+    BIDFree(szCert);
+    BIDFree(szAssertion);
+
+    return err;
+}
+
+
+/*
+ * Put an authority document for szHostname, expiring at expiryTime, in
+ * the authority cache.
+ */
+static BIDError
+CacheAuthority(BIDContext context, const char *szHostname, time_t expiryTime)
+{
+    BIDError err;
+    BIDCache authorityCache = NULL;
+    json_t *authority;
+
+    err = BIDGetContextParam(context, BID_PARAM_AUTHORITY_CACHE, (void **)&authorityCache);
+    if (err != BID_S_OK)
+        return err;
+
+    authority = json_pack("{s:o, s:I}",
+                          "public-key", json_loads(DsaPublicKey, 0, NULL),
+                          "exp", (json_int_t)expiryTime * 1000);
+    if (authority == NULL)
+        return BID_S_NO_MEMORY;
+
+    err = _BIDSetCacheObject(context, authorityCache, szHostname, authority);
+
+    json_decref(authority);
+
+    return err;
+}
+
+/*
+ * A local server that accepts connections and closes each one, unanswered,
+ * after a short delay, so that every fetch from it fails but takes long
+ * enough for concurrent lookups to overlap it. It counts the fetches.
+ */
+static struct {
+    int Socket;
+    char szHostname[32];
+    unsigned long cConnections;
+    pthread_t Thread;
+} Server;
+
+static void *
+ServerThread(void *arg BID_UNUSED)
+{
+    int s;
+
+    while ((s = accept(Server.Socket, NULL, NULL)) >= 0) {
+        BID_ATOMIC_INCREMENT(&Server.cConnections);
+        usleep(300000);
+        close(s);
+    }
+
+    return NULL;
+}
+
+static BIDError
+StartServer(void)
+{
+    struct sockaddr_in sin;
+    socklen_t cbSin = sizeof(sin);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    Server.Socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (Server.Socket < 0 ||
+        bind(Server.Socket, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+        listen(Server.Socket, 16) != 0 ||
+        getsockname(Server.Socket, (struct sockaddr *)&sin, &cbSin) != 0)
+        return BID_S_HTTP_ERROR;
+
+    snprintf(Server.szHostname, sizeof(Server.szHostname),
+             "127.0.0.1:%d", ntohs(sin.sin_port));
+
+    if (pthread_create(&Server.Thread, NULL, ServerThread, NULL) != 0)
+        return BID_S_NO_MEMORY;
+
+    return BID_S_OK;
+}
+
+static void
+StopServer(void)
+{
+    shutdown(Server.Socket, SHUT_RDWR);
+    close(Server.Socket);
+    pthread_join(Server.Thread, NULL);
+}
+
+static void
+CheckFetches(const char *szTest, unsigned long cExpected)
+{
+    unsigned long cConnections = BID_ATOMIC_INCREMENT(&Server.cConnections) - 1;
+
+    BID_ATOMIC_DECREMENT(&Server.cConnections); /* read it atomically */
+
+    if (cConnections != cExpected) {
+        fprintf(stderr, "%s: %lu fetches, expected %lu\n", szTest, cConnections, cExpected);
+        cFailures++;
+    }
+}
+
+/*
+ * Holds the lookup threads until they have all started.
+ */
+static struct {
+    pthread_mutex_t Mutex;
+    pthread_cond_t Cond;
+    int cWaiting;
+} Gate = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+
+struct AcquireArgs {
+    BIDContext Context;
+    BIDError Error;
+};
+
+static void *
+AcquireThread(void *arg)
+{
+    struct AcquireArgs *args = (struct AcquireArgs *)arg;
+    BIDAuthority authority = NULL;
+
+    pthread_mutex_lock(&Gate.Mutex);
+    Gate.cWaiting++;
+    pthread_cond_broadcast(&Gate.Cond);
+    while (Gate.cWaiting < TEST_THREADS)
+        pthread_cond_wait(&Gate.Cond, &Gate.Mutex);
+    pthread_mutex_unlock(&Gate.Mutex);
+
+    args->Error = _BIDAcquireAuthority(args->Context, Server.szHostname,
+                                       time(NULL), &authority);
+    if (authority != NULL)
+        _BIDReleaseAuthority(args->Context, authority);
+
+    return NULL;
+}
+
+/*
+ * Concurrent lookups of an uncached authority share one fetch, and its
+ * failure is cached for the lookups that follow.
+ */
+static void
+TestCoalescedFetch(BIDContext context)
+{
+    pthread_t threads[TEST_THREADS];
+    struct AcquireArgs args[TEST_THREADS];
+    int i;
+
+    for (i = 0; i < TEST_THREADS; i++) {
+        args[i].Context = context;
+        args[i].Error = BID_S_OK;
+
+        if (pthread_create(&threads[i], NULL, AcquireThread, &args[i]) != 0) {
+            CheckError("coalesced fetch: start thread", BID_S_NO_MEMORY, BID_S_OK);
+            exit(BID_S_NO_MEMORY);
+        }
+    }
+
+    for (i = 0; i < TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        if (args[i].Error == BID_S_OK)
+            CheckError("coalesced fetch", args[i].Error, BID_S_HTTP_ERROR);
+    }
+
+    CheckFetches("coalesced fetch", 1);
+}
+
+/*
+ * Work items that occupy the worker pool until released.
+ */
+static struct {
+    pthread_mutex_t Mutex;
+    pthread_cond_t Cond;
+    int cStarted;
+    int cDone;
+    int bRelease;
+} Workers = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0 };
+
+static void
+BlockingWork(void *arg BID_UNUSED)
+{
+    pthread_mutex_lock(&Workers.Mutex);
+    Workers.cStarted++;
+    pthread_cond_broadcast(&Workers.Cond);
+    while (!Workers.bRelease)
+        pthread_cond_wait(&Workers.Cond, &Workers.Mutex);
+    Workers.cDone++;
+    pthread_cond_broadcast(&Workers.Cond);
+    pthread_mutex_unlock(&Workers.Mutex);
+}
+
+static void
+CountedWork(void *arg BID_UNUSED)
+{
+    pthread_mutex_lock(&Workers.Mutex);
+    Workers.cDone++;
+    pthread_cond_broadcast(&Workers.Cond);
+    pthread_mutex_unlock(&Workers.Mutex);
+}
+
+static void
+PrefetchCallback(BIDContext context BID_UNUSED, BIDError err BID_UNUSED, void *arg)
+{
+    *((int *)arg) = 1;
+}
+
+/*
+ * With every worker busy, a stale authority's refresh stays queued. A
+ * lookup that cannot use the stale document performs that fetch itself
+ * rather than waiting for it, and the queued refresh is then skipped.
+ * Work beyond the queue limit is refused.
+ */
+static void
+TestQueuedRefresh(BIDContext context)
+{
+    BIDError err;
+    BIDAuthority authority = NULL;
+    time_t now = time(NULL);
+    int i, cQueued, cExpected, bCalled = 0;
+    char *szAssertion = NULL;
+
+    for (i = 0; i < BID_MAX_WORKER_THREADS; i++) {
+        err = _BIDRunAsync(context, BlockingWork, NULL);
+        CheckError("queued refresh: block worker", err, BID_S_OK);
+    }
+
+    pthread_mutex_lock(&Workers.Mutex);
+    while (Workers.cStarted < BID_MAX_WORKER_THREADS)
+        pthread_cond_wait(&Workers.Cond, &Workers.Mutex);
+    pthread_mutex_unlock(&Workers.Mutex);
+
+    err = CacheAuthority(context, Server.szHostname, now - BID_AUTHORITY_STALE_WINDOW / 2);
+    CheckError("queued refresh: cache stale authority", err, BID_S_OK);
+
+    /* within the stale window, so queues a refresh */
+    err = _BIDAcquireAuthority(context, Server.szHostname, now, &authority);
+    CheckError("queued refresh: stale authority", err, BID_S_OK);
+    if (authority != NULL)
+        _BIDReleaseAuthority(context, authority);
+    authority = NULL;
+
+    /* beyond the stale window, so needs the refreshed document */
+    err = _BIDAcquireAuthority(context, Server.szHostname,
+                               now + 2 * BID_AUTHORITY_STALE_WINDOW, &authority);
+    if (err == BID_S_OK) {
+        CheckError("queued refresh: expired authority", err, BID_S_HTTP_ERROR);
+        _BIDReleaseAuthority(context, authority);
+    }
+
+    CheckFetches("queued refresh", 2);
+
+    /* the refresh is still queued */
+    for (cQueued = 0; cQueued < BID_MAX_QUEUED_WORK; cQueued++) {
+        err = _BIDRunAsync(context, CountedWork, NULL);
+        if (err != BID_S_OK)
+            break;
+    }
+    CheckError("queue limit", err, BID_S_WORK_QUEUE_FULL);
+    if (cQueued != BID_MAX_QUEUED_WORK - 1) {
+        fprintf(stderr, "queue limit: queued %d, expected %d\n",
+                cQueued, BID_MAX_QUEUED_WORK - 1);
+        cFailures++;
+    }
+
+    err = MakeAssertion(context, TEST_AUDIENCE,
+                        (json_int_t)(now + 300) * 1000, &szAssertion);
+    CheckError("queue limit: make assertion", err, BID_S_OK);
+    if (err == BID_S_OK) {
+        err = BIDPrefetchAuthorities(context, szAssertion, now, 0,
+                                     PrefetchCallback, &bCalled);
+        CheckError("queue limit: prefetch", err, BID_S_WORK_QUEUE_FULL);
+    }
+
+    cExpected = BID_MAX_WORKER_THREADS + cQueued;
+
+    pthread_mutex_lock(&Workers.Mutex);
+    Workers.bRelease = 1;
+    pthread_cond_broadcast(&Workers.Cond);
+    while (Workers.cDone < cExpected)
+        pthread_cond_wait(&Workers.Cond, &Workers.Mutex);
+    pthread_mutex_unlock(&Workers.Mutex);
+
+    /* give the skipped refresh a chance to misbehave */
+    usleep(500000);
+
+    CheckFetches("skipped refresh", 2);
+
+    if (bCalled) {
+        fprintf(stderr, "queue limit: refused prefetch called back\n");
+        cFailures++;
+    }
+
+    BIDFree(szAssertion);
+}
+
+/*
+ * A prefetch calls back once, on a worker thread, with a context other
+ * than the caller's, which may be released as soon as the prefetch has
+ * been queued.
+ */
+static struct {
+    pthread_mutex_t Mutex;
+    pthread_cond_t Cond;
+    int cCalls;
+    BIDError Error;
+    BIDContext Context;
+    pthread_t Thread;
+} Prefetch = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void
+CountingPrefetchCallback(BIDContext context, BIDError err, void *arg BID_UNUSED)
+{
+    pthread_mutex_lock(&Prefetch.Mutex);
+    Prefetch.cCalls++;
+    Prefetch.Error = err;
+    Prefetch.Context = context;
+    Prefetch.Thread = pthread_self();
+    pthread_cond_broadcast(&Prefetch.Cond);
+    pthread_mutex_unlock(&Prefetch.Mutex);
+}
+
+static void
+TestPrefetch(BIDContext context)
+{
+    BIDError err;
+    BIDContext callerContext = BID_C_NO_CONTEXT;
+    char *szAssertion = NULL;
+    time_t now = time(NULL);
+
+    err = BIDCloneContext(context, BID_CONTEXT_RP | BID_CONTEXT_AUTHORITY_CACHE,
+                          &callerContext);
+    CheckError("prefetch: clone context", err, BID_S_OK);
+    BID_BAIL_ON_ERROR(err);
+
+    err = CacheAuthority(callerContext, TEST_ISSUER, now + 86400);
+    CheckError("prefetch: cache authority", err, BID_S_OK);
+    BID_BAIL_ON_ERROR(err);
+
+    err = MakeAssertion(callerContext, TEST_AUDIENCE,
+                        (json_int_t)(now + 300) * 1000, &szAssertion);
+    CheckError("prefetch: make assertion", err, BID_S_OK);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDPrefetchAuthorities(callerContext, szAssertion, now, 0,
+                                 CountingPrefetchCallback, NULL);
+    CheckError("prefetch", err, BID_S_OK);
+    BID_BAIL_ON_ERROR(err);
+
+    pthread_mutex_lock(&Prefetch.Mutex);
+    BIDReleaseContext(callerContext);
+    while (Prefetch.cCalls == 0)
+        pthread_cond_wait(&Prefetch.Cond, &Prefetch.Mutex);
+    pthread_mutex_unlock(&Prefetch.Mutex);
+
+    CheckError("prefetch: callback", Prefetch.Error, BID_S_OK);
+    if (Prefetch.Context == callerContext || Prefetch.Context == BID_C_NO_CONTEXT) {
+        fprintf(stderr, "prefetch: callback passed caller's context\n");
+        cFailures++;
+    }
+    if (pthread_equal(Prefetch.Thread, pthread_self())) {
+        fprintf(stderr, "prefetch: callback ran on caller's thread\n");
+        cFailures++;
+    }
+
+    callerContext = BID_C_NO_CONTEXT;
+
+    /* exactly once */
+    usleep(100000);
+    if (Prefetch.cCalls != 1) {
+        fprintf(stderr, "prefetch: called back %d times\n", Prefetch.cCalls);
+        cFailures++;
+    }
+
+cleanup:
+    if (callerContext != BID_C_NO_CONTEXT)
+        BIDReleaseContext(callerContext);
+    BIDFree(szAssertion);
+}
+
+int main(int argc BID_UNUSED, char *argv[] BID_UNUSED)
+{
+    BIDError err;
+    BIDContext context = NULL;
+    const char *s;
+
+    /* a coalescing regression would otherwise hang */
+    alarm(60);
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_RP | BID_CONTEXT_AUTHORITY_CACHE |
+                            BID_CONTEXT_THREAD_SAFE, NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(context, BID_PARAM_AUTHORITY_CACHE_NAME, "memory:");
+    BID_BAIL_ON_ERROR(err);
+
+    err = StartServer();
+    BID_BAIL_ON_ERROR(err);
+
+    TestCoalescedFetch(context);
+    TestQueuedRefresh(context);
+    TestPrefetch(context);
+
+    StopServer();
+
+    if (cFailures != 0)
+        err = BID_S_INVALID_ASSERTION;
+    else
+        printf("Prefetch tests passed\n");
+
+cleanup:
+    BIDReleaseContext(context);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * Replay cache expiry test: entries are kept until the clock skew has
+ * passed after their assertions expire, and a full cache refuses new
+ * entries rather than evicting live ones.
+ */
+
+#define TEST_SKEW               300
+
+static int cFailures;
+
+static void
+CheckError(const char *szTest, BIDError err, BIDError expected)
+{
+    const char *s1, *s2;
+
+    if (err == expected)
+        return;
+
+    BIDErrorToString(err, &s1);
+    BIDErrorToString(expected, &s2);
+    fprintf(stderr, "%s: got %s[%d], expected %s[%d]\n", szTest, s1, err, s2, expected);
+    cFailures++;
+}
+
+/*
+ * Record an assertion that expires at expiryTime, as verified at
+ * verificationTime, replacing any existing entry unless bCheckReplay
+ * is set.
+ */
+static BIDError
+RecordReplayCache(
+    BIDContext context,
+    const char *szAssertion,
+    time_t expiryTime,
+    time_t verificationTime,
+    int bCheckReplay)
+{
+    BIDError err;
+    BIDIdentity identity = BID_C_NO_IDENTITY;
+
+    err = _BIDAllocIdentity(context, NULL, &identity);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDSetJsonTimestampValue(context, identity->Attributes, "exp", expiryTime);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDSetJsonTimestampValue(context, identity->PrivateAttributes, "a-exp", expiryTime);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDUpdateReplayCache(context, BID_C_NO_REPLAY_CACHE, identity,
+                                szAssertion, verificationTime, 0, bCheckReplay);
+
+cleanup:
+    BIDReleaseIdentity(context, identity);
+
+    return err;
+}
+
+static BIDError
+UpdateReplayCache(
+    BIDContext context,
+    const char *szAssertion,
+    time_t expiryTime,
+    time_t verificationTime)
+{
+    return RecordReplayCache(context, szAssertion, expiryTime, verificationTime, 1);
+}
+
+static BIDError
+RemoveReplayCache(
+    BIDContext context,
+    const char *szAssertion)
+{
+    BIDError err;
+    json_t *digest = NULL;
+
+    err = _BIDDigestAssertion(context, szAssertion, &digest);
+    if (err == BID_S_OK)
+        err = _BIDRemoveCacheObject(context, context->ReplayCache, json_string_value(digest));
+
+    json_decref(digest);
+
+    return err;
+}
+
+static void
+TestSkew(BIDContext context, time_t now)
+{
+    BIDError err;
+
+    err = UpdateReplayCache(context, "skew-A", now - 100, now - 200);
+    CheckError("skew: insert A", err, BID_S_OK);
+
+    /* A expired 100 seconds ago, which is inside the skew */
+    err = UpdateReplayCache(context, "skew-B", now + 3600, now);
+    CheckError("skew: insert B", err, BID_S_OK);
+
+    err = _BIDCheckReplayCache(context, BID_C_NO_REPLAY_CACHE, "skew-A");
+    CheckError("skew: check A", err, BID_S_REPLAYED_ASSERTION);
+
+    err = UpdateReplayCache(context, "skew-A", now - 100, now);
+    CheckError("skew: replay A", err, BID_S_REPLAYED_ASSERTION);
+
+    /* once the skew has passed, A is evicted */
+    err = UpdateReplayCache(context, "skew-C", now + 3600, now + TEST_SKEW);
+    CheckError("skew: insert C", err, BID_S_OK);
+
+    err = _BIDCheckReplayCache(context, BID_C_NO_REPLAY_CACHE, "skew-A");
+    CheckError("skew: check evicted A", err, BID_S_OK);
+
+    err = _BIDCheckReplayCache(context, BID_C_NO_REPLAY_CACHE, "skew-B");
+    CheckError("skew: check B", err, BID_S_REPLAYED_ASSERTION);
+}
+
+static void
+TestCapacity(BIDContext context, time_t now)
+{
+    BIDError err;
+
+    context->ReplayCacheMaxEntries = 4;
+
+    /* skew-B and skew-C are still live */
+    err = UpdateReplayCache(context, "full-A", now + 3600, now);
+    CheckError("full: insert A", err, BID_S_OK);
+
+    err = UpdateReplayCache(context, "full-B", now + 3600, now);
+    CheckError("full: insert B", err, BID_S_OK);
+
+    err = UpdateReplayCache(context, "full-C", now + 3600, now);
+    CheckError("full: insert C", err, BID_S_CACHE_FULL);
+
+    err = _BIDCheckReplayCache(context, BID_C_NO_REPLAY_CACHE, "full-C");
+    CheckError("full: check C", err, BID_S_OK);
+
+    /* no live entry was evicted to make room */
+    err = _BIDCheckReplayCache(context, BID_C_NO_REPLAY_CACHE, "skew-B");
+    CheckError("full: check skew-B", err, BID_S_REPLAYED_ASSERTION);
+
+    err = _BIDCheckReplayCache(context, BID_C_NO_REPLAY_CACHE, "full-A");
+    CheckError("full: check A", err, BID_S_REPLAYED_ASSERTION);
+
+    err = UpdateReplayCache(context, "full-A", now + 3600, now);
+    CheckError("full: replay A", err, BID_S_REPLAYED_ASSERTION);
+
+    /* expired entries make room once the skew has passed */
+    err = UpdateReplayCache(context, "full-C", now + 7200, now + 3600 + TEST_SKEW + 1);
+    CheckError("full: insert C later", err, BID_S_OK);
+
+    err = _BIDCheckReplayCache(context, BID_C_NO_REPLAY_CACHE, "full-C");
+    CheckError("full: check C later", err, BID_S_REPLAYED_ASSERTION);
+}
+
+/*
+ * Replaced, removed and purged entries no longer count towards the limit.
+ */
+static void
+TestLiveCount(BIDContext context, time_t now)
+{
+    BIDError err;
+    int i;
+
+    err = _BIDPurgeReplayCache(context, context->ReplayCache, now + 86400);
+    CheckError("live: purge all", err, BID_S_OK);
+
+    context->ReplayCacheMaxEntries = 2;
+
+    err = UpdateReplayCache(context, "live-A", now + 3600, now);
+    CheckError("live: insert A", err, BID_S_OK);
+
+    for (i = 0; i < 16; i++) {
+        err = RecordReplayCache(context, "live-A", now + 3600 + i, now, 0);
+        CheckError("live: replace A", err, BID_S_OK);
+    }
+
+    err = UpdateReplayCache(context, "live-B", now + 3600, now);
+    CheckError("live: insert B", err, BID_S_OK);
+
+    err = UpdateReplayCache(context, "live-C", now + 3600, now);
+    CheckError("live: insert C", err, BID_S_CACHE_FULL);
+
+    err = RemoveReplayCache(context, "live-B");
+    CheckError("live: remove B", err, BID_S_OK);
+
+    err = UpdateReplayCache(context, "live-C", now + 3600, now);
+    CheckError("live: insert C after remove", err, BID_S_OK);
+
+    err = _BIDPurgeReplayCache(context, context->ReplayCache, now + 86400);
+    CheckError("live: purge again", err, BID_S_OK);
+
+    err = UpdateReplayCache(context, "live-D", now + 3600, now);
+    CheckError("live: insert D after purge", err, BID_S_OK);
+
+    err = UpdateReplayCache(context, "live-E", now + 3600, now);
+    CheckError("live: insert E after purge", err, BID_S_OK);
+
+    err = UpdateReplayCache(context, "live-A", now + 3600, now);
+    CheckError("live: insert A after purge", err, BID_S_CACHE_FULL);
+
+    err = UpdateReplayCache(context, "live-D", now + 3600, now);
+    CheckError("live: replay D", err, BID_S_REPLAYED_ASSERTION);
+}
+
+int main(int argc BID_UNUSED, char *argv[] BID_UNUSED)
+{
+    BIDError err;
+    BIDContext context = NULL;
+    uint32_t ulSkew = TEST_SKEW;
+    time_t now = time(NULL);
+    const char *s;
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_RP | BID_CONTEXT_REPLAY_CACHE, NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(context, BID_PARAM_REPLAY_CACHE_NAME, "memory:");
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(context, BID_PARAM_SKEW, &ulSkew);
+    BID_BAIL_ON_ERROR(err);
+
+    TestSkew(context, now);
+    TestCapacity(context, now);
+    TestLiveCount(context, now);
+
+    if (cFailures != 0)
+        err = BID_S_INVALID_ASSERTION;
+
+cleanup:
+    BIDReleaseContext(context);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * Reauthentication ticket table test: tickets are served from memory
+ * while the replay cache has not been changed elsewhere, including when
+ * verification records authenticators in it, and are not used once they
+ * have been removed from the cache, through this handle or another, or
+ * have expired.
+ */
+
+#define TEST_AUDIENCE           "host/rp.example.com"
+
+static int cFailures;
+
+static void
+CheckError(const char *szTest, BIDError err, BIDError expected)
+{
+    const char *s1, *s2;
+
+    if (err == expected)
+        return;
+
+    BIDErrorToString(err, &s1);
+    BIDErrorToString(expected, &s2);
+    fprintf(stderr, "%s: got %s[%d], expected %s[%d]\n", szTest, s1, err, s2, expected);
+    cFailures++;
+}
+
+/*
+ * Check that the hit and miss counts have moved by the expected amounts
+ * since they were last sampled.
+ */
+static void
+CheckStatistics(
+    const char *szTest,
+    BIDContext context,
+    uint64_t *pHits,
+    uint64_t *pMisses,
+    uint64_t cExpectedHits,
+    uint64_t cExpectedMisses)
+{
+    uint64_t hits, misses;
+
+    _BIDGetReauthTicketStatistics(context, &hits, &misses);
+
+    if (hits - *pHits != cExpectedHits || misses - *pMisses != cExpectedMisses) {
+        fprintf(stderr, "%s: %llu hits and %llu misses, expected %llu and %llu\n", szTest,
+                (unsigned long long)(hits - *pHits), (unsigned long long)(misses - *pMisses),
+                (unsigned long long)cExpectedHits, (unsigned long long)cExpectedMisses);
+        cFailures++;
+    }
+
+    *pHits = hits;
+    *pMisses = misses;
+}
+
+/*
+ * Store a ticket in the replay cache, as _BIDUpdateReplayCache does, and
+ * return its ARK.
+ */
+static BIDError
+StoreTicket(
+    BIDContext context,
+    BIDReplayCache replayCache,
+    const char *szTicket,
+    time_t issueTime,
+    time_t expiryTime,
+    BIDSecretHandle *pArk)
+{
+    BIDError err;
+    unsigned char rgbArk[32];
+    json_t *cred = NULL;
+    json_t *ark = NULL;
+    time_t lastChanged = 0;
+    size_t i;
+
+    *pArk = NULL;
+
+    for (i = 0; i < sizeof(rgbArk); i++)
+        rgbArk[i] = (unsigned char)(rand() & 0xFF);
+
+    err = _BIDImportSecretKeyData(context, rgbArk, sizeof(rgbArk), pArk);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDExportSecretKey(context, *pArk, &ark);
+    BID_BAIL_ON_ERROR(err);
+
+    cred = json_pack("{s:s, s:s, s:O}", "sub", "lukeh@padl.com", "aud", TEST_AUDIENCE, "ark", ark);
+    if (cred == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    _BIDSetJsonTimestampValue(context, cred, "iat", issueTime);
+    _BIDSetJsonTimestampValue(context, cred, "exp", expiryTime);
+    _BIDSetJsonTimestampValue(context, cred, "a-exp", expiryTime);
+
+    _BIDGetCacheLastChangedTime(context, replayCache, &lastChanged);
+
+    err = _BIDSetCacheObject(context, replayCache, szTicket, cred);
+    BID_BAIL_ON_ERROR(err);
+
+    _BIDInvalidateReauthTicket(context, replayCache, szTicket);
+    _BIDNoteReauthTicketCacheChange(context, replayCache, lastChanged);
+
+    err = _BIDCacheReauthTicket(context, replayCache, szTicket, cred);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    json_decref(cred);
+    json_decref(ark);
+
+    return err;
+}
+
+/*
+ * Make an authenticator for a ticket, signed with its ARK.
+ */
+static BIDError
+MakeAuthenticator(
+    BIDContext context,
+    const char *szTicket,
+    BIDSecretHandle ark,
+    time_t verificationTime,
+    char **pszAssertion)
+{
+    BIDError err;
+    struct BIDBackedAssertionDesc backedAssertion = { 0 };
+    BIDJWT ap = NULL;
+    json_t *nonce = NULL;
+
+    ap = BIDCalloc(1, sizeof(*ap));
+    if (ap == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    err = _BIDGenerateNonce(context, &nonce);
+    BID_BAIL_ON_ERROR(err);
+
+    ap->Payload = json_pack("{s:s, s:{s:s}, s:O}", "aud", TEST_AUDIENCE,
+                            "tkt", "tid", szTicket, "nonce", nonce);
+    if (ap->Payload == NULL) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    _BIDSetJsonTimestampValue(context, ap->Payload, "exp", verificationTime + 300);
+
+    backedAssertion.Assertion = ap;
+
+    err = _BIDPackBackedAssertion(context, &backedAssertion, NULL, ark, NULL, pszAssertion);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    _BIDReleaseJWT(context, ap);
+    json_decref(nonce);
+
+    return err;
+}
+
+/*
+ * Make an authenticator for a ticket and verify it.
+ */
+static BIDError
+VerifyTicket(
+    BIDContext context,
+    const char *szTicket,
+    BIDSecretHandle ark,
+    time_t verificationTime)
+{
+    BIDError err;
+    BIDBackedAssertion assertion = NULL;
+    BIDIdentity identity = BID_C_NO_IDENTITY;
+    char *szAssertion = NULL;
+    uint32_t ulRetFlags = 0;
+
+    err = MakeAuthenticator(context, szTicket, ark, verificationTime, &szAssertion);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDUnpackBackedAssertion(context, szAssertion, &assertion);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDVerifyReauthAssertion(context, BID_C_NO_REPLAY_CACHE, assertion,
+                                    verificationTime, &identity, &ulRetFlags);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    BIDReleaseIdentity(context, identity);
+    _BIDReleaseBackedAssertion(context, assertion);
+    BIDFree(szAssertion);
+
+    return err;
+}
+
+static void
+TestHitAndMiss(BIDContext context, time_t now)
+{
+    BIDError err;
+    BIDSecretHandle ark = NULL;
+    uint64_t hits = 0, misses = 0;
+
+    _BIDGetReauthTicketStatistics(context, &hits, &misses);
+
+    err = StoreTicket(context, context->ReplayCache, "tkt-hit", now, now + 3600, &ark);
+    CheckError("hit: store", err, BID_S_OK);
+
+    /* the ticket was stored by this process, so it need not be read back */
+    err = VerifyTicket(context, "tkt-hit", ark, now);
+    CheckError("hit: verify", err, BID_S_OK);
+    CheckStatistics("hit: first use", context, &hits, &misses, 1, 0);
+
+    err = VerifyTicket(context, "tkt-hit", ark, now);
+    CheckError("hit: verify again", err, BID_S_OK);
+    CheckStatistics("hit: second use", context, &hits, &misses, 1, 0);
+
+    err = VerifyTicket(context, "tkt-unknown", ark, now);
+    CheckError("miss: verify", err, BID_S_INVALID_ASSERTION);
+    CheckStatistics("miss", context, &hits, &misses, 0, 1);
+
+    _BIDDestroySecret(context, ark);
+}
+
+static void
+TestRevocation(BIDContext context, BIDReplayCache otherCache, time_t now)
+{
+    BIDError err;
+    BIDSecretHandle ark1 = NULL, ark2 = NULL;
+
+    err = StoreTicket(context, context->ReplayCache, "tkt-revoked", now, now + 3600, &ark1);
+    CheckError("revocation: store", err, BID_S_OK);
+
+    err = StoreTicket(context, context->ReplayCache, "tkt-revoked-other", now, now + 3600, &ark2);
+    CheckError("revocation: store other", err, BID_S_OK);
+
+    sleep(1);
+
+    err = VerifyTicket(context, "tkt-revoked", ark1, now);
+    CheckError("revocation: verify", err, BID_S_OK);
+
+    err = VerifyTicket(context, "tkt-revoked-other", ark2, now);
+    CheckError("revocation: verify other", err, BID_S_OK);
+
+    /* removed through this handle */
+    err = _BIDRemoveCacheObject(context, context->ReplayCache, "tkt-revoked");
+    CheckError("revocation: remove", err, BID_S_OK);
+
+    err = VerifyTicket(context, "tkt-revoked", ark1, now);
+    CheckError("revocation: verify removed", err, BID_S_INVALID_ASSERTION);
+
+    /* removed through another handle, as by another process */
+    err = _BIDRemoveCacheObject(context, otherCache, "tkt-revoked-other");
+    CheckError("revocation: remove other", err, BID_S_OK);
+
+    err = VerifyTicket(context, "tkt-revoked-other", ark2, now);
+    CheckError("revocation: verify removed other", err, BID_S_INVALID_ASSERTION);
+
+    _BIDDestroySecret(context, ark1);
+    _BIDDestroySecret(context, ark2);
+}
+
+/*
+ * Each verification records the authenticator in the replay cache, in the
+ * same second as the ticket was used; that must not invalidate the ticket.
+ */
+static void
+TestVerifyAssertion(BIDContext context, time_t now)
+{
+    BIDError err;
+    BIDSecretHandle ark = NULL;
+    BIDIdentity identity = BID_C_NO_IDENTITY;
+    char *szAssertion = NULL;
+    uint64_t hits = 0, misses = 0;
+    time_t expiryTime;
+    uint32_t ulRetFlags;
+    int i;
+
+    _BIDGetReauthTicketStatistics(context, &hits, &misses);
+
+    err = StoreTicket(context, context->ReplayCache, "tkt-verify", now, now + 3600, &ark);
+    CheckError("verify assertion: store", err, BID_S_OK);
+
+    for (i = 0; i < 4; i++) {
+        err = MakeAuthenticator(context, "tkt-verify", ark, now, &szAssertion);
+        CheckError("verify assertion: make", err, BID_S_OK);
+
+        err = BIDVerifyAssertion(context, BID_C_NO_REPLAY_CACHE, szAssertion, TEST_AUDIENCE,
+                                 NULL, 0, now, BID_VERIFY_FLAG_REAUTH, &identity, &expiryTime,
+                                 &ulRetFlags);
+        CheckError("verify assertion: verify", err, BID_S_OK);
+        CheckStatistics("verify assertion: use", context, &hits, &misses, 1, 0);
+
+        /* and the authenticator itself cannot be replayed */
+        BIDReleaseIdentity(context, identity);
+        identity = BID_C_NO_IDENTITY;
+
+        err = BIDVerifyAssertion(context, BID_C_NO_REPLAY_CACHE, szAssertion, TEST_AUDIENCE,
+                                 NULL, 0, now, BID_VERIFY_FLAG_REAUTH, &identity, &expiryTime,
+                                 &ulRetFlags);
+        CheckError("verify assertion: replay", err, BID_S_REPLAYED_ASSERTION);
+        CheckStatistics("verify assertion: replay", context, &hits, &misses, 0, 0);
+
+        BIDReleaseIdentity(context, identity);
+        identity = BID_C_NO_IDENTITY;
+        BIDFree(szAssertion);
+        szAssertion = NULL;
+    }
+
+    /* a change made elsewhere is still noticed */
+    sleep(1);
+
+    err = _BIDRemoveCacheObject(context, context->ReplayCache, "tkt-verify");
+    CheckError("verify assertion: remove", err, BID_S_OK);
+
+    err = MakeAuthenticator(context, "tkt-verify", ark, now, &szAssertion);
+    CheckError("verify assertion: make", err, BID_S_OK);
+
+    err = BIDVerifyAssertion(context, BID_C_NO_REPLAY_CACHE, szAssertion, TEST_AUDIENCE,
+                             NULL, 0, now, BID_VERIFY_FLAG_REAUTH, &identity, &expiryTime,
+                             &ulRetFlags);
+    CheckError("verify assertion: verify removed", err, BID_S_INVALID_ASSERTION);
+    CheckStatistics("verify assertion: removed", context, &hits, &misses, 0, 1);
+
+    BIDReleaseIdentity(context, identity);
+    BIDFree(szAssertion);
+    _BIDDestroySecret(context, ark);
+}
+
+static void
+TestExpiry(BIDContext context, time_t now)
+{
+    BIDError err;
+    BIDSecretHandle ark = NULL;
+
+    err = StoreTicket(context, context->ReplayCache, "tkt-expiry", now, now + 60, &ark);
+    CheckError("expiry: store", err, BID_S_OK);
+
+    err = VerifyTicket(context, "tkt-expiry", ark, now);
+    CheckError("expiry: verify", err, BID_S_OK);
+
+    err = VerifyTicket(context, "tkt-expiry", ark, now + 60 + context->Skew + 1);
+    CheckError("expiry: verify expired", err, BID_S_EXPIRED_ASSERTION);
+
+    _BIDDestroySecret(context, ark);
+}
+
+int main(int argc, char *argv[])
+{
+    BIDError err;
+    BIDContext context = NULL;
+    BIDReplayCache otherCache = BID_C_NO_REPLAY_CACHE;
+    char szCacheName[BUFSIZ];
+    time_t now = time(NULL);
+    const char *s;
+
+    if (argc > 1)
+        snprintf(szCacheName, sizeof(szCacheName), "file:%s", argv[1]);
+    else
+        snprintf(szCacheName, sizeof(szCacheName), "file:/tmp/bid_rtt.%d.json", (int)getpid());
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_RP | BID_CONTEXT_REPLAY_CACHE | BID_CONTEXT_REAUTH,
+                            NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(context, BID_PARAM_REPLAY_CACHE_NAME, szCacheName);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDAcquireReplayCache(context, szCacheName, &otherCache);
+    BID_BAIL_ON_ERROR(err);
+
+    TestHitAndMiss(context, now);
+    TestRevocation(context, otherCache, now);
+    TestVerifyAssertion(context, now);
+    TestExpiry(context, now);
+
+    if (cFailures != 0)
+        err = BID_S_INVALID_ASSERTION;
+
+cleanup:
+    if (context != NULL)
+        _BIDDestroyCache(context, context->ReplayCache);
+    BIDReleaseReplayCache(context, otherCache);
+    BIDReleaseContext(context);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
@@ -186,7 +186,7 @@ TestRsaSignVerify(BIDContext context)
     jwt = BIDCalloc(1, sizeof(*jwt));
     jwt->Payload = json_incref(plaintext);
 
-    err = _BIDMakeSignature(context, jwt, secret, NULL, &encodedData, &encodedDataLen);
+    err = _BIDMakeSignature(context, jwt, secret, NULL, NULL, &encodedData, &encodedDataLen);
     BID_BAIL_ON_ERROR(err);
 
     printf("Signed JWT:\n%s\n", encodedData);
@@ -247,7 +247,7 @@ TestDsaSignVerify(BIDContext context, const char *PublicKey, const char *SecretK
     jwt = BIDCalloc(1, sizeof(*jwt));
     jwt->Payload = json_incref(plaintext);
 
-    err = _BIDMakeSignature(context, jwt, secret, NULL, &encodedData, &encodedDataLen);
+    err = _BIDMakeSignature(context, jwt, secret, NULL, NULL, &encodedData, &encodedDataLen);
     BID_BAIL_ON_ERROR(err);
 
     printf("Signed JWT:\n%s\n", encodedData);
@@ -269,6 +269,62 @@ cleanup:
     return err;
 }
 
+static BIDError
+TestSecretSignVerify(BIDContext context)
+{
+    BIDError err = BID_S_OK;
+    BIDSecretHandle secretHandle = NULL;
+    json_t *plaintext = NULL;
+    json_error_t error;
+    BIDJWT jwt = NULL;
+    BIDJWT verify = NULL;
+    char *encodedData = NULL;
+    size_t encodedDataLen;
+    unsigned char key[32];
+
+    memset(key, 0x5A, sizeof(key));
+
+    err = _BIDImportSecretKeyData(context, key, sizeof(key), &secretHandle);
+    BID_BAIL_ON_ERROR(err);
+
+    plaintext = json_loads(SamplePlaintext, 0, &error);
+    if (plaintext == NULL) {
+        err = BID_S_INVALID_JSON;
+        goto cleanup;
+    }
+
+    jwt = BIDCalloc(1, sizeof(*jwt));
+    jwt->Payload = json_incref(plaintext);
+
+    err = _BIDMakeSignature(context, jwt, NULL, secretHandle, NULL, &encodedData, &encodedDataLen);
+    BID_BAIL_ON_ERROR(err);
+
+    printf("Signed JWT:\n%s\n", encodedData);
+
+    err = _BIDParseJWT(context, encodedData, &verify);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDVerifySecretKeySignature(context, verify, secretHandle);
+    BID_BAIL_ON_ERROR(err);
+
+    verify->Signature[0] ^= 1;
+
+    if (_BIDVerifySecretKeySignature(context, verify, secretHandle) != BID_S_INVALID_SIGNATURE) {
+        err = BID_S_CRYPTO_ERROR;
+        goto cleanup;
+    }
+
+cleanup:
+    if (secretHandle != NULL)
+        _BIDDestroySecret(context, secretHandle);
+    json_decref(plaintext);
+    _BIDReleaseJWT(context, jwt);
+    _BIDReleaseJWT(context, verify);
+    BIDFree(encodedData);
+
+    return err;
+}
+
 int main(int argc, char *argv[])
 {
     BIDError err;
@@ -278,6 +334,7 @@ int main(int argc, char *argv[])
     BID_BAIL_ON_ERROR(err);
 
     printf("Test DSA sign = ERROR %d\n", TestDsaSignVerify(context, DsaPublicKey, DsaSecretKey));
+    printf("Test secret sign = ERROR %d\n", TestSecretSignVerify(context));
 #if 0
     printf("Test RSA sign = ERROR %d\n", TestRsaSignVerify(context));
 #endif
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * Ticket cache key test: tickets are found by audience alone and by
+ * audience and subject, keys are unambiguous when components contain the
+ * separator, and a ticket is never returned for another audience.
+ */
+
+static int cFailures;
+
+static void
+CheckError(const char *szTest, BIDError err, BIDError expected)
+{
+    const char *s1, *s2;
+
+    if (err == expected)
+        return;
+
+    BIDErrorToString(err, &s1);
+    BIDErrorToString(expected, &s2);
+    fprintf(stderr, "%s: got %s[%d], expected %s[%d]\n", szTest, s1, err, s2, expected);
+    cFailures++;
+}
+
+/*
+ * Store a ticket for szAudience and szSubject under the key for
+ * szKeyAudience and szKeySubject, which may differ to simulate a
+ * colliding or corrupt entry.
+ */
+static BIDError
+StoreTicket(
+    BIDContext context,
+    const char *szKeyAudience,
+    const char *szKeySubject,
+    const char *szAudience,
+    const char *szSubject)
+{
+    BIDError err;
+    const char *szCurve;
+    char *szCacheKey = NULL;
+    json_t *cred;
+
+    cred = json_pack("{s:s, s:s, s:{s:s}}", "aud", szAudience, "sub", szSubject,
+                     "tkt", "tid", szSubject);
+    if (cred == NULL)
+        return BID_S_NO_MEMORY;
+
+    err = BIDGetContextParam(context, BID_PARAM_ECDH_CURVE, (void **)&szCurve);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDMakeTicketCacheKey(context, szCurve, szKeyAudience, szKeySubject, &szCacheKey);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDSetCacheObject(context, context->TicketCache, szCacheKey, cred);
+    BID_BAIL_ON_ERROR(err);
+
+cleanup:
+    json_decref(cred);
+    BIDFree(szCacheKey);
+
+    return err;
+}
+
+/*
+ * Look up a ticket and check which subject it belongs to.
+ */
+static void
+CheckFind(
+    const char *szTest,
+    BIDContext context,
+    const char *szAudience,
+    const char *szIdentityName,
+    const char *szExpectedSubject)
+{
+    BIDError err;
+    json_t *cred = NULL;
+    const char *szSubject;
+
+    err = _BIDFindTicketInCache(context, context->TicketCache,
+                                szAudience, szIdentityName, &cred);
+    if (szExpectedSubject == NULL) {
+        CheckError(szTest, err, BID_S_CACHE_KEY_NOT_FOUND);
+    } else {
+        CheckError(szTest, err, BID_S_OK);
+
+        szSubject = json_string_value(json_object_get(cred, "sub"));
+        if (err == BID_S_OK &&
+            (szSubject == NULL || strcmp(szSubject, szExpectedSubject) != 0)) {
+            fprintf(stderr, "%s: found ticket for %s, expected %s\n", szTest,
+                    szSubject ? szSubject : "(null)", szExpectedSubject);
+            cFailures++;
+        }
+    }
+
+    json_decref(cred);
+}
+
+static void
+TestKeyedLookup(BIDContext context)
+{
+    StoreTicket(context, "host/a.example.com", "alice@example.com",
+                "host/a.example.com", "alice@example.com");
+    StoreTicket(context, "host/a.example.com", "bob@example.com",
+                "host/a.example.com", "bob@example.com");
+    StoreTicket(context, "host/a.example.com", NULL,
+                "host/a.example.com", "bob@example.com");
+
+    CheckFind("keyed: alice", context, "host/a.example.com", "alice@example.com", "alice@example.com");
+    CheckFind("keyed: bob", context, "host/a.example.com", "bob@example.com", "bob@example.com");
+    CheckFind("keyed: default", context, "host/a.example.com", NULL, "bob@example.com");
+    CheckFind("keyed: unknown", context, "host/a.example.com", "carol@example.com", NULL);
+    CheckFind("keyed: other audience", context, "host/b.example.com", NULL, NULL);
+}
+
+static void
+TestDefaultLookup(BIDContext context)
+{
+    /* a cache written before tickets were keyed by subject */
+    StoreTicket(context, "host/c.example.com", NULL,
+                "host/c.example.com", "carol@example.com");
+
+    CheckFind("default: named", context, "host/c.example.com", "carol@example.com", "carol@example.com");
+    CheckFind("default: other name", context, "host/c.example.com", "dave@example.com", NULL);
+    CheckFind("default: unnamed", context, "host/c.example.com", NULL, "carol@example.com");
+}
+
+static void
+TestSeparators(BIDContext context)
+{
+    const char *szCurve;
+    char *szKey1 = NULL, *szKey2 = NULL, *szKey3 = NULL;
+
+    BIDGetContextParam(context, BID_PARAM_ECDH_CURVE, (void **)&szCurve);
+
+    /* the audience a$b with subject c, and audience a with subject b$c */
+    _BIDMakeTicketCacheKey(context, szCurve, "a$b", "c", &szKey1);
+    _BIDMakeTicketCacheKey(context, szCurve, "a", "b$c", &szKey2);
+    _BIDMakeTicketCacheKey(context, szCurve, "a%24b", "c", &szKey3);
+
+    if (szKey1 == NULL || szKey2 == NULL || szKey3 == NULL ||
+        strcmp(szKey1, szKey2) == 0 || strcmp(szKey1, szKey3) == 0) {
+        fprintf(stderr, "separators: keys %s, %s and %s are not distinct\n",
+                szKey1 ? szKey1 : "(null)", szKey2 ? szKey2 : "(null)",
+                szKey3 ? szKey3 : "(null)");
+        cFailures++;
+    }
+
+    StoreTicket(context, "a$b", "c", "a$b", "c");
+    StoreTicket(context, "a", "b$c", "a", "b$c");
+
+    CheckFind("separators: a$b", context, "a$b", "c", "c");
+    CheckFind("separators: a", context, "a", "b$c", "b$c");
+    CheckFind("separators: crossed", context, "a$b", "b$c", NULL);
+
+    BIDFree(szKey1);
+    BIDFree(szKey2);
+    BIDFree(szKey3);
+}
+
+static void
+TestAudienceMismatch(BIDContext context)
+{
+    /* an entry found under a key must also name the requested audience */
+    StoreTicket(context, "host/d.example.com", "erin@example.com",
+                "host/e.example.com", "erin@example.com");
+    StoreTicket(context, "host/d.example.com", NULL,
+                "host/e.example.com", "erin@example.com");
+
+    CheckFind("audience: keyed", context, "host/d.example.com", "erin@example.com", NULL);
+    CheckFind("audience: default", context, "host/d.example.com", NULL, NULL);
+}
+
+int main(int argc BID_UNUSED, char *argv[] BID_UNUSED)
+{
+    BIDError err;
+    BIDContext context = NULL;
+    uint32_t ulOptions;
+    const char *s;
+
+    ulOptions = BID_CONTEXT_USER_AGENT | BID_CONTEXT_REAUTH | BID_CONTEXT_ECDH_KEYEX;
+
+    err = BIDAcquireContext(NULL, ulOptions, NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(context, BID_PARAM_TICKET_CACHE_NAME, "memory:");
+    BID_BAIL_ON_ERROR(err);
+
+    TestKeyedLookup(context);
+    TestDefaultLookup(context);
+    TestSeparators(context);
+    TestAudienceMismatch(context);
+
+    if (cFailures != 0)
+        err = BID_S_INVALID_ASSERTION;
+
+cleanup:
+    BIDReleaseContext(context);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * Rejection counter test: assertions are rejected at the expected stage,
+ * both when verified by the RP and when the initiator verifies an RP
+ * response token, and counts are shared between a context and its clones.
+ */
+
+#define TEST_AUDIENCE           "https://rp.example.com"
+#define TEST_CERT               "{\"principal\":{\"email\":\"lukeh@padl.com\"}}"
+
+static int cFailures;
+
+static void
+CheckError(const char *szTest, BIDError err, BIDError expected)
+{
+    const char *s1, *s2;
+
+    if (err == expected)
+        return;
+
+    BIDErrorToString(err, &s1);
+    BIDErrorToString(expected, &s2);
+    fprintf(stderr, "%s: got %s[%d], expected %s[%d]\n", szTest, s1, err, s2, expected);
+    cFailures++;
+}
+
+/*
+ * Check that the counts have moved by rgcExpected since rgcRejections
+ * was last updated.
+ */
+static void
+CheckRejections(
+    const char *szTest,
+    BIDContext context,
+    unsigned long rgcRejections[BID_VERIFY_STAGE_MAX],
+    const unsigned long rgcExpected[BID_VERIFY_STAGE_MAX])
+{
+    unsigned long cRejections;
+    int stage;
+
+    for (stage = 0; stage < BID_VERIFY_STAGE_MAX; stage++) {
+        BIDGetVerifyRejections(context, (BIDVerifyStage)stage, &cRejections);
+
+        if (cRejections - rgcRejections[stage] != rgcExpected[stage]) {
+            fprintf(stderr, "%s: stage %d rejected %lu, expected %lu\n", szTest, stage,
+                    cRejections - rgcRejections[stage], rgcExpected[stage]);
+            cFailures++;
+        }
+
+        rgcRejections[stage] = cRejections;
+    }
+}
+
+static BIDError
+AppendJWT(const char *szPayload, char *szBuffer, size_t *pcchBuffer)
+{
+    BIDError err;
+    const char *szHeader = "{\"alg\":\"RS256\"}";
+    char *szEncoded = NULL;
+    size_t cchEncoded;
+
+    err = _BIDBase64UrlEncode((const unsigned char *)szHeader, strlen(szHeader),
+                              &szEncoded, &cchEncoded);
+    if (err != BID_S_OK)
+        return err;
+
+    *pcchBuffer += sprintf(szBuffer + *pcchBuffer, "%s.", szEncoded);
+    BIDFree(szEncoded);
+
+    err = _BIDBase64UrlEncode((const unsigned char *)szPayload, strlen(szPayload),
+                              &szEncoded, &cchEncoded);
+    if (err != BID_S_OK)
+        return err;
+
+    *pcchBuffer += sprintf(szBuffer + *pcchBuffer, "%s.AAAA", szEncoded);
+    BIDFree(szEncoded);
+
+    return BID_S_OK;
+}
+
+/*
+ * Make an unsigned assertion, backed by a certificate with the payload
+ * szCert if it is not NULL.
+ */
+static const char *
+MakeAssertion(const char *szCert, const char *szFormat, time_t expiryTime)
+{
+    static char szAssertion[1024];
+    char szPayload[256];
+    size_t cchAssertion = 0;
+
+    snprintf(szPayload, sizeof(szPayload), szFormat, (long long)expiryTime * 1000);
+
+    if (szCert != NULL) {
+        AppendJWT(szCert, szAssertion, &cchAssertion);
+        szAssertion[cchAssertion++] = '~';
+    }
+    AppendJWT(szPayload, szAssertion, &cchAssertion);
+
+    return szAssertion;
+}
+
+static BIDError
+VerifyAssertion(BIDContext context, const char *szAssertion, time_t verificationTime)
+{
+    BIDError err;
+    BIDIdentity identity = BID_C_NO_IDENTITY;
+    time_t expiryTime;
+    uint32_t ulRetFlags;
+
+    err = BIDVerifyAssertion(context, BID_C_NO_REPLAY_CACHE, szAssertion, TEST_AUDIENCE,
+                             NULL, 0, verificationTime, 0, &identity, &expiryTime, &ulRetFlags);
+
+    BIDReleaseIdentity(context, identity);
+
+    return err;
+}
+
+static BIDError
+VerifyResponseToken(BIDContext context, const char *szResponseToken)
+{
+    BIDError err;
+    BIDIdentity identity = BID_C_NO_IDENTITY;
+    json_t *payload = NULL;
+    uint32_t ulRetFlags;
+
+    err = _BIDAllocIdentity(context, NULL, &identity);
+    if (err != BID_S_OK)
+        return err;
+
+    err = BIDVerifyRPResponseToken(context, identity, szResponseToken, TEST_AUDIENCE,
+                                   0, &payload, &ulRetFlags);
+
+    json_decref(payload);
+    BIDReleaseIdentity(context, identity);
+
+    return err;
+}
+
+static void
+TestRelyingParty(BIDContext context, unsigned long rgcRejections[BID_VERIFY_STAGE_MAX])
+{
+    static const unsigned long rgcParse[]     = { 2, 0, 0, 0, 0 };
+    static const unsigned long rgcClaims[]    = { 0, 2, 0, 0, 0 };
+    static const unsigned long rgcReplay[]    = { 0, 0, 1, 0, 0 };
+    static const unsigned long rgcAuthority[] = { 0, 0, 0, 1, 0 };
+    static const unsigned long rgcSignature[] = { 0, 0, 0, 0, 1 };
+    BIDError err;
+    const char *szAssertion;
+    json_t *digest = NULL;
+    time_t now = time(NULL);
+
+    err = VerifyAssertion(context, "garbage", now);
+    CheckError("no JWT", err, BID_S_INVALID_JSON_WEB_TOKEN);
+    err = VerifyAssertion(context, MakeAssertion(TEST_CERT, "{\"aud\":\"x\",\"exp\":%lld", now), now);
+    CheckError("malformed payload", err, BID_S_INVALID_JSON);
+    CheckRejections("parse", context, rgcRejections, rgcParse);
+
+    err = VerifyAssertion(context, MakeAssertion(TEST_CERT, "{\"aud\":\"" TEST_AUDIENCE "\",\"exp\":%lld}", now - 3600), now);
+    CheckError("expired", err, BID_S_EXPIRED_ASSERTION);
+    err = VerifyAssertion(context, MakeAssertion(TEST_CERT, "{\"aud\":\"https://other.example.com\",\"exp\":%lld}", now + 3600), now);
+    CheckError("bad audience", err, BID_S_BAD_AUDIENCE);
+    CheckRejections("claims", context, rgcRejections, rgcClaims);
+
+    err = VerifyAssertion(context, MakeAssertion(NULL, "{\"aud\":\"" TEST_AUDIENCE "\",\"exp\":%lld}", now + 3600), now);
+    CheckError("no certificate", err, BID_S_INVALID_ASSERTION);
+    CheckRejections("no certificate", context, rgcRejections, rgcSignature);
+
+    szAssertion = MakeAssertion(TEST_CERT, "{\"aud\":\"" TEST_AUDIENCE "\",\"exp\":%lld}", now + 3600);
+
+    err = VerifyAssertion(context, szAssertion, now);
+    CheckError("missing issuer", err, BID_S_MISSING_ISSUER);
+    CheckRejections("authority", context, rgcRejections, rgcAuthority);
+
+    err = _BIDDigestAssertion(context, szAssertion, &digest);
+    if (err == BID_S_OK)
+        err = _BIDSetCacheObject(context, context->ReplayCache, json_string_value(digest), json_object());
+    CheckError("replay cache", err, BID_S_OK);
+
+    err = VerifyAssertion(context, szAssertion, now);
+    CheckError("replayed", err, BID_S_REPLAYED_ASSERTION);
+    CheckRejections("replay", context, rgcRejections, rgcReplay);
+
+    json_decref(digest);
+}
+
+static void
+TestResponseToken(BIDContext context, unsigned long rgcRejections[BID_VERIFY_STAGE_MAX])
+{
+    static const unsigned long rgcParse[]     = { 1, 0, 0, 0, 0 };
+    static const unsigned long rgcClaims[]    = { 0, 1, 0, 0, 0 };
+    static const unsigned long rgcSignature[] = { 0, 0, 0, 0, 1 };
+    BIDError err;
+    time_t now = time(NULL);
+
+    err = VerifyResponseToken(context, "garbage");
+    CheckError("response no JWT", err, BID_S_INVALID_JSON_WEB_TOKEN);
+    CheckRejections("response parse", context, rgcRejections, rgcParse);
+
+    err = VerifyResponseToken(context, MakeAssertion(NULL, "{\"exp\":%lld}", now - 3600));
+    CheckError("response expired", err, BID_S_EXPIRED_ASSERTION);
+    CheckRejections("response claims", context, rgcRejections, rgcClaims);
+
+    /* without a session key or certificate nothing can verify it */
+    err = VerifyResponseToken(context, MakeAssertion(NULL, "{\"exp\":%lld}", now + 3600));
+    CheckError("response no key", err, BID_S_NO_KEY);
+    CheckRejections("response signature", context, rgcRejections, rgcSignature);
+}
+
+int main(int argc BID_UNUSED, char *argv[] BID_UNUSED)
+{
+    static const unsigned long rgcClone[] = { 1, 1, 0, 0, 0 };
+    BIDError err;
+    BIDContext context = NULL;
+    BIDContext clone = NULL;
+    BIDContext initiator = NULL;
+    unsigned long rgcRejections[BID_VERIFY_STAGE_MAX] = { 0 };
+    unsigned long rgcInitiatorRejections[BID_VERIFY_STAGE_MAX] = { 0 };
+    time_t now = time(NULL);
+    const char *s;
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_RP | BID_CONTEXT_REPLAY_CACHE, NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDSetContextParam(context, BID_PARAM_REPLAY_CACHE_NAME, "memory:");
+    BID_BAIL_ON_ERROR(err);
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_USER_AGENT, NULL, &initiator);
+    BID_BAIL_ON_ERROR(err);
+
+    TestRelyingParty(context, rgcRejections);
+    TestResponseToken(initiator, rgcInitiatorRejections);
+
+    /* a clone counts into the template */
+    err = BIDCloneContext(context, BID_CONTEXT_RP | BID_CONTEXT_REPLAY_CACHE, &clone);
+    BID_BAIL_ON_ERROR(err);
+
+    VerifyAssertion(clone, "garbage", now);
+    VerifyAssertion(clone, MakeAssertion(TEST_CERT, "{\"aud\":\"x\",\"exp\":%lld}", now + 3600), now);
+    CheckRejections("clone", context, rgcRejections, rgcClone);
+
+    if (cFailures != 0)
+        err = BID_S_INVALID_ASSERTION;
+
+cleanup:
+    BIDReleaseContext(clone);
+    BIDReleaseContext(initiator);
+    BIDReleaseContext(context);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include "browserid.h"
+#include "bid_private.h"
+
+/*
+ * X.509 trust store cache test: a store is reloaded when its CA file
+ * changes, and chains verified against the old store are not reused.
+ * The CA file's mtime is set explicitly so the test does not depend
+ * on the filesystem timestamp granularity.
+ */
+
+static int cFailures;
+
+static void
+CheckError(const char *szTest, BIDError err, BIDError expected)
+{
+    const char *s1, *s2;
+
+    if (err == expected)
+        return;
+
+    BIDErrorToString(err, &s1);
+    BIDErrorToString(expected, &s2);
+    fprintf(stderr, "%s: got %s[%d], expected %s[%d]\n", szTest, s1, err, s2, expected);
+    cFailures++;
+}
+
+static EVP_PKEY *
+MakeKey(void)
+{
+    EVP_PKEY *pkey;
+    RSA *rsa;
+    BIGNUM *e;
+
+    pkey = EVP_PKEY_new();
+    rsa = RSA_new();
+    e = BN_new();
+
+    if (pkey == NULL || rsa == NULL || e == NULL ||
+        BN_set_word(e, RSA_F4) != 1 ||
+        RSA_generate_key_ex(rsa, 1024, e, NULL) != 1 ||
+        EVP_PKEY_assign_RSA(pkey, rsa) != 1) {
+        EVP_PKEY_free(pkey);
+        RSA_free(rsa);
+        pkey = NULL;
+    }
+
+    BN_free(e);
+
+    return pkey;
+}
+
+/*
+ * Make a certificate for key, signed by issuerKey and named by
+ * issuerCert (or self-signed if issuerCert is NULL).
+ */
+static X509 *
+MakeCert(
+    const char *szSubject,
+    int bCA,
+    EVP_PKEY *key,
+    X509 *issuerCert,
+    EVP_PKEY *issuerKey)
+{
+    X509 *x509;
+    X509_NAME *name;
+    X509_EXTENSION *ext;
+    static long serial;
+
+    x509 = X509_new();
+    if (x509 == NULL)
+        return NULL;
+
+    X509_set_version(x509, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), ++serial);
+    X509_gmtime_adj(X509_get_notBefore(x509), -3600);
+    X509_gmtime_adj(X509_get_notAfter(x509), 86400);
+    X509_set_pubkey(x509, key);
+
+    name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (const unsigned char *)szSubject, -1, -1, 0);
+    X509_set_issuer_name(x509, issuerCert != NULL ?
+                         X509_get_subject_name(issuerCert) : name);
+
+    ext = X509V3_EXT_conf_nid(NULL, NULL, NID_basic_constraints,
+                              bCA ? "critical,CA:TRUE" : "critical,CA:FALSE");
+    if (ext != NULL) {
+        X509_add_ext(x509, ext, -1);
+        X509_EXTENSION_free(ext);
+    }
+
+    if (X509_sign(x509, issuerCert != NULL ? issuerKey : key, EVP_sha256()) == 0) {
+        X509_free(x509);
+        return NULL;
+    }
+
+    return x509;
+}
+
+static BIDError
+MakeCertChain(BIDContext context BID_UNUSED, X509 *leafCert, json_t **pCertChain)
+{
+    BIDError err;
+    unsigned char *pbData = NULL, *p;
+    char *szCert = NULL;
+    size_t cchCert;
+    int cbData;
+
+    *pCertChain = NULL;
+
+    cbData = i2d_X509(leafCert, NULL);
+    if (cbData <= 0)
+        return BID_S_CRYPTO_ERROR;
+
+    pbData = BIDMalloc(cbData);
+    if (pbData == NULL)
+        return BID_S_NO_MEMORY;
+
+    p = pbData;
+    i2d_X509(leafCert, &p);
+
+    err = _BIDBase64UrlEncode(pbData, cbData, &szCert, &cchCert);
+    BID_BAIL_ON_ERROR(err);
+
+    *pCertChain = json_array();
+    if (*pCertChain == NULL ||
+        json_array_append_new(*pCertChain, json_string(szCert)) != 0) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+cleanup:
+    BIDFree(pbData);
+    BIDFree(szCert);
+
+    return err;
+}
+
+/*
+ * Replace the contents of szCAFile with caCert and give it the
+ * modification time mtime.
+ */
+static BIDError
+WriteCAFile(const char *szCAFile, X509 *caCert, time_t mtime)
+{
+    FILE *fp;
+    struct timeval tv[2];
+    int bWritten;
+
+    fp = fopen(szCAFile, "w");
+    if (fp == NULL)
+        return BID_S_CACHE_OPEN_ERROR;
+
+    bWritten = PEM_write_X509(fp, caCert);
+
+    if (fclose(fp) != 0 || !bWritten)
+        return BID_S_CACHE_WRITE_ERROR;
+
+    tv[0].tv_sec = tv[1].tv_sec = mtime;
+    tv[0].tv_usec = tv[1].tv_usec = 0;
+
+    if (utimes(szCAFile, tv) != 0)
+        return BID_S_CACHE_WRITE_ERROR;
+
+    return BID_S_OK;
+}
+
+int main(int argc BID_UNUSED, char *argv[] BID_UNUSED)
+{
+    BIDError err;
+    BIDContext context = NULL;
+    EVP_PKEY *caKey = NULL, *otherCAKey = NULL, *leafKey = NULL;
+    X509 *caCert = NULL, *otherCACert = NULL, *leafCert = NULL;
+    json_t *certChain = NULL;
+    json_t *certParams = NULL;
+    char szCAFile[] = "/tmp/bid_xct.XXXXXX";
+    time_t mtime = time(NULL) - 3600;
+    int fd;
+    const char *s;
+
+    fd = mkstemp(szCAFile);
+    if (fd < 0) {
+        err = BID_S_CACHE_OPEN_ERROR;
+        goto cleanup;
+    }
+    close(fd);
+
+    err = BIDAcquireContext(NULL, BID_CONTEXT_RP, NULL, &context);
+    BID_BAIL_ON_ERROR(err);
+
+    caKey = MakeKey();
+    otherCAKey = MakeKey();
+    leafKey = MakeKey();
+    if (caKey == NULL || otherCAKey == NULL || leafKey == NULL) {
+        err = BID_S_CRYPTO_ERROR;
+        goto cleanup;
+    }
+
+    caCert = MakeCert("Test CA", 1, caKey, NULL, NULL);
+    otherCACert = MakeCert("Other Test CA", 1, otherCAKey, NULL, NULL);
+    leafCert = MakeCert("Test Leaf", 0, leafKey, caCert, caKey);
+    if (caCert == NULL || otherCACert == NULL || leafCert == NULL) {
+        err = BID_S_CRYPTO_ERROR;
+        goto cleanup;
+    }
+
+    err = MakeCertChain(context, leafCert, &certChain);
+    BID_BAIL_ON_ERROR(err);
+
+    certParams = json_object();
+    if (certParams == NULL ||
+        json_object_set_new(certParams, "ca-certificate", json_string(szCAFile)) != 0) {
+        err = BID_S_NO_MEMORY;
+        goto cleanup;
+    }
+
+    err = WriteCAFile(szCAFile, otherCACert, mtime);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDValidateX509CertChain(context, certChain, certParams, time(NULL));
+    CheckError("untrusted issuer", err, BID_S_UNTRUSTED_X509_CERT);
+
+    /* a new CA file is picked up once its mtime changes */
+    err = WriteCAFile(szCAFile, caCert, mtime + 10);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDValidateX509CertChain(context, certChain, certParams, time(NULL));
+    CheckError("reloaded store", err, BID_S_OK);
+
+    err = _BIDValidateX509CertChain(context, certChain, certParams, time(NULL));
+    CheckError("cached chain", err, BID_S_OK);
+
+    /* the cached chain is not used against a reloaded store */
+    err = WriteCAFile(szCAFile, otherCACert, mtime + 20);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDValidateX509CertChain(context, certChain, certParams, time(NULL));
+    CheckError("invalidated chain", err, BID_S_UNTRUSTED_X509_CERT);
+
+    /* an unchanged mtime means the cached store is used */
+    err = WriteCAFile(szCAFile, caCert, mtime + 20);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDValidateX509CertChain(context, certChain, certParams, time(NULL));
+    CheckError("unchanged mtime", err, BID_S_UNTRUSTED_X509_CERT);
+
+    err = WriteCAFile(szCAFile, caCert, mtime + 30);
+    BID_BAIL_ON_ERROR(err);
+
+    err = _BIDValidateX509CertChain(context, certChain, certParams, time(NULL));
+    CheckError("reloaded store again", err, BID_S_OK);
+
+    if (cFailures != 0)
+        err = BID_S_CRYPTO_ERROR;
+    else
+        printf("X.509 store cache tests passed\n");
+
+cleanup:
+    BIDReleaseContext(context);
+    json_decref(certChain);
+    json_decref(certParams);
+    X509_free(caCert);
+    X509_free(otherCACert);
+    X509_free(leafCert);
+    EVP_PKEY_free(caKey);
+    EVP_PKEY_free(otherCAKey);
+    EVP_PKEY_free(leafKey);
+    unlink(szCAFile);
+
+    if (err != BID_S_OK) {
+        BIDErrorToString(err, &s);
+        fprintf(stderr, "libbrowserid error %s[%d]\n", s, err);
+    }
+
+    exit(err);
+}
@@ -79,6 +79,12 @@ gssBidExportSecContext(OM_uint32 *minor,
             goto cleanup;
     }
 
+    /*
+     * Per-message services do not take the context mutex, so hold the
+     * receive window steady until it has been sized and written.
+     */
+    GSSBID_MUTEX_LOCK(&ctx->seqMutex);
+
     length  = 16;                               /* version, state, flags, */
     length += 4 + ctx->mechanismUsed->length;   /* mechanismUsed */
     length += 12 + key.length;                  /* rfc3961Key.value */
@@ -91,6 +97,7 @@ gssBidExportSecContext(OM_uint32 *minor,
 
     token->value = GSSBID_MALLOC(length);
     if (token->value == NULL) {
+        GSSBID_MUTEX_UNLOCK(&ctx->seqMutex);
         major = GSS_S_FAILURE;
         *minor = ENOMEM;
         goto cleanup;
@@ -113,11 +120,14 @@ gssBidExportSecContext(OM_uint32 *minor,
     p = store_buffer(&acceptorName,        p, FALSE);
 
     store_uint64_be(ctx->expiryTime,       &p[0]);
-    store_uint64_be(ctx->sendSeq,          &p[8]);
+    store_uint64_be(GSSBID_ATOMIC_LOAD64(&ctx->sendSeq), &p[8]);
     store_uint64_be(ctx->recvSeq,          &p[16]);
     p += 24;
 
     major = sequenceExternalize(minor, ctx->seqState, &p, &length);
+
+    GSSBID_MUTEX_UNLOCK(&ctx->seqMutex);
+
     if (GSS_ERROR(major))
         goto cleanup;
 
@@ -68,8 +68,6 @@ gss_get_mic(OM_uint32 *minor,
     message_token->value = NULL;
     message_token->length = 0;
 
-    GSSBID_MUTEX_LOCK(&ctx->mutex);
-
     if (!CTX_IS_ESTABLISHED(ctx)) {
         major = GSS_S_NO_CONTEXT;
         *minor = GSSBID_CONTEXT_INCOMPLETE;
@@ -90,7 +88,5 @@ gss_get_mic(OM_uint32 *minor,
     *message_token = iov[1].buffer;
 
 cleanup:
-    GSSBID_MUTEX_UNLOCK(&ctx->mutex);
-
     return major;
 }
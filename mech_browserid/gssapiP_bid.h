@@ -197,6 +197,15 @@ struct gss_cred_id_struct
 
 #define CTX_IS_ESTABLISHED(ctx)             ((ctx)->state == GSSBID_STATE_ESTABLISHED)
 
+/*
+ * Once a context is established, per-message services do not take the
+ * context mutex: the send sequence number is reserved atomically, the
+ * receive window has its own lock (seqMutex) and crypto handles are
+ * borrowed from a pool, so that threads sharing a context can protect
+ * messages in parallel.
+ */
+#define GSSBID_CRYPTO_POOL_SIZE             8
+
 #ifdef HAVE_HEIMDAL_VERSION
 struct gss_ctx_id_t_desc_struct
 #else
@@ -211,10 +220,30 @@ struct gss_ctx_id_struct
     krb5_cksumtype checksumType;
     krb5_enctype encryptionType;
     krb5_keyblock rfc3961Key;
+    /*
+     * Keyed crypto state, precomputed from rfc3961Key. A handle may not
+     * be used by two threads at once, so each message borrows one from
+     * this pool (see gssBidAcquireRfc3961Crypto()).
+     */
+    GSSBID_MUTEX rfc3961CryptoMutex;
+    int rfc3961CryptoCount;
+#ifdef HAVE_HEIMDAL_VERSION
+    krb5_crypto rfc3961Crypto[GSSBID_CRYPTO_POOL_SIZE];
+#else
+    krb5_key rfc3961Crypto[GSSBID_CRYPTO_POOL_SIZE];
+#endif
+    struct gss_bid_rfc3961_lengths {
+        size_t header;
+        size_t trailer;
+        size_t checksum;
+        size_t padding;
+        size_t blockSize;
+    } rfc3961Lengths;
     gss_name_t initiatorName;
     gss_name_t acceptorName;
     time_t expiryTime;
     uint64_t sendSeq, recvSeq;
+    GSSBID_MUTEX seqMutex;
     void *seqState;
     gss_cred_id_t cred;
     BIDContext bidContext;
@@ -202,6 +202,12 @@ gssBidImportContext(OM_uint32 *minor,
     if (GSS_ERROR(major))
         return major;
 
+    if (ctx->encryptionType != ENCTYPE_NULL) {
+        major = gssBidInitRfc3961Crypto(minor, ctx);
+        if (GSS_ERROR(major))
+            return major;
+    }
+
     /* Initiator name OID matches the context mechanism, so it's not encoded */
     major = importName(minor, ctx->mechanismUsed, &p, &remain, &ctx->initiatorName);
     if (GSS_ERROR(major))
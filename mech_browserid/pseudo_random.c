@@ -76,6 +76,8 @@ gssBidPseudoRandom(OM_uint32 *minor,
     ssize_t desired_output_len = prf_out->length;
 #ifdef HAVE_HEIMDAL_VERSION
     krb5_crypto krbCrypto = NULL;
+#else
+    krb5_key krbCrypto = NULL;
 #endif
 
     *minor = 0;
@@ -111,11 +113,12 @@ gssBidPseudoRandom(OM_uint32 *minor,
         goto cleanup;
     }
 
-#ifdef HAVE_HEIMDAL_VERSION
-    code = krb5_crypto_init(krbContext, &ctx->rfc3961Key, 0, &krbCrypto);
-    if (code != 0)
+    if (GSS_ERROR(gssBidAcquireRfc3961Crypto(&tmpMinor, ctx, &krbCrypto))) {
+        code = tmpMinor;
         goto cleanup;
-#else
+    }
+
+#ifndef HAVE_HEIMDAL_VERSION
     t.length = prflen;
     t.data = GSSBID_MALLOC(t.length);
     if (t.data == NULL) {
@@ -133,7 +136,7 @@ gssBidPseudoRandom(OM_uint32 *minor,
 #ifdef HAVE_HEIMDAL_VERSION
         code = krb5_crypto_prf(krbContext, krbCrypto, &ns, &t);
 #else
-        code = krb5_c_prf(krbContext, &ctx->rfc3961Key, &ns, &t);
+        code = krb5_k_prf(krbContext, krbCrypto, &ns, &t);
 #endif
         if (code != 0)
             goto cleanup;
@@ -152,9 +155,8 @@ cleanup:
         memset(ns.data, 0, ns.length);
         GSSBID_FREE(ns.data);
     }
+    gssBidReleaseRfc3961Crypto(ctx, krbCrypto);
 #ifdef HAVE_HEIMDAL_VERSION
-    if (krbCrypto != NULL)
-        krb5_crypto_destroy(krbContext, krbCrypto);
     krb5_data_free(&t);
 #else
     if (t.data != NULL) {
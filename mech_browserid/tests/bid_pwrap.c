@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gssapiP_bid.h"
+
+/*
+ * Wrap and unwrap concurrently on a pair of contexts shared by several
+ * threads, which the per-message services allow without the context
+ * mutex. Every token must get its own sequence number and unwrap to its
+ * message, and the receive window must record every token it accepted.
+ */
+
+#ifndef ENCTYPE_AES128_CTS_HMAC_SHA1_96
+#define ENCTYPE_AES128_CTS_HMAC_SHA1_96 17
+#endif
+
+#define TEST_THREADS            8
+#define TEST_MESSAGES           512     /* per thread */
+#define TEST_TOKENS             (TEST_THREADS * TEST_MESSAGES)
+#define TEST_MESSAGE_LENGTH     64
+#define TEST_WINDOW             1024    /* the default replay window */
+
+/* util_tld.c is not linked in; each thread needs its own krb5_context */
+struct gss_bid_thread_local_data *
+gssBidGetThreadLocalData(void)
+{
+    static __thread struct gss_bid_thread_local_data tld;
+
+    return &tld;
+}
+
+struct token {
+    uint64_t seqnum;
+    char message[TEST_MESSAGE_LENGTH];
+    gss_buffer_desc wrapped;
+};
+
+struct threadArgs {
+    gss_ctx_id_t ctx;
+    int thread;
+    struct token *tokens;
+    OM_uint32 major, minor;
+};
+
+static struct token tokens[TEST_TOKENS];
+
+static OM_uint32
+makeContext(OM_uint32 *minor, int isInitiator, gss_ctx_id_t *pCtx)
+{
+    OM_uint32 major;
+    gss_ctx_id_t ctx;
+    unsigned char sessionKey[16];
+
+    memset(sessionKey, 'K', sizeof(sessionKey));
+
+    ctx = (gss_ctx_id_t)GSSBID_CALLOC(1, sizeof(*ctx));
+    if (ctx == NULL) {
+        *minor = ENOMEM;
+        return GSS_S_FAILURE;
+    }
+
+    GSSBID_MUTEX_INIT(&ctx->mutex);
+    GSSBID_MUTEX_INIT(&ctx->seqMutex);
+    GSSBID_MUTEX_INIT(&ctx->rfc3961CryptoMutex);
+    ctx->state = GSSBID_STATE_ESTABLISHED;
+    if (isInitiator)
+        ctx->flags |= CTX_FLAG_INITIATOR;
+    ctx->gssFlags = GSS_C_INTEG_FLAG | GSS_C_CONF_FLAG |
+                    GSS_C_SEQUENCE_FLAG | GSS_C_REPLAY_FLAG;
+    ctx->encryptionType = ENCTYPE_AES128_CTS_HMAC_SHA1_96;
+
+    major = gssBidDeriveRfc3961Key(minor, sessionKey, sizeof(sessionKey),
+                                   ctx->encryptionType, &ctx->rfc3961Key);
+    if (GSS_ERROR(major))
+        return major;
+
+    major = rfc3961ChecksumTypeForKey(minor, &ctx->rfc3961Key,
+                                      &ctx->checksumType);
+    if (GSS_ERROR(major))
+        return major;
+
+    major = gssBidInitRfc3961Crypto(minor, ctx);
+    if (GSS_ERROR(major))
+        return major;
+
+    major = sequenceInit(minor, &ctx->seqState, 0, TRUE, TRUE, TRUE, 0);
+    if (GSS_ERROR(major))
+        return major;
+
+    *pCtx = ctx;
+
+    return GSS_S_COMPLETE;
+}
+
+static void
+releaseContext(gss_ctx_id_t ctx)
+{
+    OM_uint32 tmpMinor;
+    krb5_context krbContext;
+
+    if (ctx == GSS_C_NO_CONTEXT)
+        return;
+
+    gssBidKerberosInit(&tmpMinor, &krbContext);
+    gssBidDestroyRfc3961Crypto(krbContext, ctx);
+    krb5_free_keyblock_contents(krbContext, &ctx->rfc3961Key);
+    sequenceFree(&tmpMinor, &ctx->seqState);
+    GSSBID_MUTEX_DESTROY(&ctx->rfc3961CryptoMutex);
+    GSSBID_MUTEX_DESTROY(&ctx->seqMutex);
+    GSSBID_MUTEX_DESTROY(&ctx->mutex);
+    GSSBID_FREE(ctx);
+}
+
+static void *
+wrapThread(void *arg)
+{
+    struct threadArgs *args = (struct threadArgs *)arg;
+    struct token *token;
+    gss_buffer_desc message;
+    int i, confState;
+
+    for (i = 0; i < TEST_MESSAGES; i++) {
+        token = &args->tokens[args->thread * TEST_MESSAGES + i];
+
+        snprintf(token->message, sizeof(token->message),
+                 "thread %d message %d", args->thread, i);
+        message.length = sizeof(token->message);
+        message.value = token->message;
+
+        args->major = gss_wrap(&args->minor, args->ctx, TRUE, GSS_C_QOP_DEFAULT,
+                               &message, &confState, &token->wrapped);
+        if (GSS_ERROR(args->major))
+            break;
+
+        /* SND_SEQ follows TOK_ID, Flags, Filler, EC and RRC */
+        token->seqnum = load_uint64_be((unsigned char *)token->wrapped.value + 8);
+    }
+
+    return NULL;
+}
+
+static void *
+unwrapThread(void *arg)
+{
+    struct threadArgs *args = (struct threadArgs *)arg;
+    struct token *token;
+    gss_buffer_desc unwrapped = GSS_C_EMPTY_BUFFER;
+    int i, confState;
+
+    /* interleaved, so that the threads' tokens arrive roughly in order */
+    for (i = args->thread; i < TEST_TOKENS; i += TEST_THREADS) {
+        token = &args->tokens[i];
+
+        args->major = gss_unwrap(&args->minor, args->ctx, &token->wrapped,
+                                 &unwrapped, &confState, NULL);
+        if (GSS_ERROR(args->major))
+            break;
+
+        if (!confState ||
+            unwrapped.length != sizeof(token->message) ||
+            memcmp(unwrapped.value, token->message, sizeof(token->message)) != 0) {
+            fprintf(stderr, "token %llu unwrapped to the wrong message\n",
+                    (unsigned long long)token->seqnum);
+            args->major = GSS_S_BAD_SIG;
+            break;
+        }
+
+        gss_release_buffer(&args->minor, &unwrapped);
+    }
+
+    gss_release_buffer(&args->minor, &unwrapped);
+
+    return NULL;
+}
+
+static OM_uint32
+runThreads(OM_uint32 *minor, gss_ctx_id_t ctx, void *(*fn)(void *))
+{
+    pthread_t threads[TEST_THREADS];
+    struct threadArgs args[TEST_THREADS];
+    OM_uint32 major = GSS_S_COMPLETE;
+    int i, cThreads;
+
+    *minor = 0;
+
+    for (cThreads = 0; cThreads < TEST_THREADS; cThreads++) {
+        args[cThreads].ctx = ctx;
+        args[cThreads].thread = cThreads;
+        args[cThreads].tokens = tokens;
+        args[cThreads].major = GSS_S_COMPLETE;
+        args[cThreads].minor = 0;
+
+        if (pthread_create(&threads[cThreads], NULL, fn, &args[cThreads]) != 0) {
+            major = GSS_S_FAILURE;
+            *minor = GSSBID_GET_LAST_ERROR();
+            break;
+        }
+    }
+
+    for (i = 0; i < cThreads; i++) {
+        pthread_join(threads[i], NULL);
+
+        if (GSS_ERROR(args[i].major) && !GSS_ERROR(major)) {
+            major = args[i].major;
+            *minor = args[i].minor;
+        }
+    }
+
+    return major;
+}
+
+static int
+compareSeqnums(const void *a, const void *b)
+{
+    uint64_t x = ((const struct token *)a)->seqnum;
+    uint64_t y = ((const struct token *)b)->seqnum;
+
+    return (x > y) - (x < y);
+}
+
+int main(int argc GSSBID_UNUSED, char *argv[] GSSBID_UNUSED)
+{
+    OM_uint32 major, minor;
+    gss_ctx_id_t initiatorCtx = GSS_C_NO_CONTEXT;
+    gss_ctx_id_t acceptorCtx = GSS_C_NO_CONTEXT;
+    uint64_t seqnum;
+    int i;
+
+    major = makeContext(&minor, TRUE, &initiatorCtx);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    major = makeContext(&minor, FALSE, &acceptorCtx);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    major = runThreads(&minor, initiatorCtx, wrapThread);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    /* each token reserved its own sequence number, and none was skipped */
+    qsort(tokens, TEST_TOKENS, sizeof(tokens[0]), compareSeqnums);
+
+    for (i = 0; i < TEST_TOKENS; i++) {
+        if (tokens[i].seqnum != (uint64_t)i) {
+            fprintf(stderr, "token %d has sequence number %llu\n",
+                    i, (unsigned long long)tokens[i].seqnum);
+            major = GSS_S_FAILURE;
+            goto cleanup;
+        }
+    }
+
+    GSSBID_ASSERT(initiatorCtx->sendSeq == TEST_TOKENS);
+
+    major = runThreads(&minor, acceptorCtx, unwrapThread);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    /*
+     * Every token in the final window arrived while it was in the window,
+     * so its bit must have been set; an update lost to a race would let
+     * it be replayed.
+     */
+    for (seqnum = TEST_TOKENS - TEST_WINDOW; seqnum < TEST_TOKENS; seqnum++) {
+        if (sequenceCheck(&minor, &acceptorCtx->seqState, seqnum) != GSS_S_DUPLICATE_TOKEN) {
+            fprintf(stderr, "token %llu could be replayed\n",
+                    (unsigned long long)seqnum);
+            major = GSS_S_DUPLICATE_TOKEN;
+        }
+    }
+
+    GSSBID_ASSERT(initiatorCtx->rfc3961CryptoCount <= GSSBID_CRYPTO_POOL_SIZE);
+    GSSBID_ASSERT(acceptorCtx->rfc3961CryptoCount <= GSSBID_CRYPTO_POOL_SIZE);
+
+    if (major == GSS_S_COMPLETE)
+        printf("%d tokens wrapped and unwrapped by %d threads\n",
+               TEST_TOKENS, TEST_THREADS);
+
+cleanup:
+    for (i = 0; i < TEST_TOKENS; i++)
+        gss_release_buffer(&minor, &tokens[i].wrapped);
+    releaseContext(initiatorCtx);
+    releaseContext(acceptorCtx);
+
+    if (major != GSS_S_COMPLETE)
+        fprintf(stderr, "Error %08x/%d\n", major, minor);
+
+    exit(major != GSS_S_COMPLETE ? 1 : 0);
+}
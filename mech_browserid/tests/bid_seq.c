@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gssapiP_bid.h"
+
+/*
+ * Test the sliding-window sequence number bitmap in util_ordering.c,
+ * which is compiled into this program; see the Makefile.
+ *
+ * Usage: bid_seq
+ */
+
+static int cFailures;
+
+static void
+checkToken(void **seqState, uint64_t seqnum, OM_uint32 expected)
+{
+    OM_uint32 major, minor;
+
+    major = sequenceCheck(&minor, seqState, seqnum);
+    if (major != expected) {
+        fprintf(stderr, "sequence number %llu: expected %08x, got %08x\n",
+                (unsigned long long)seqnum, expected, major);
+        cFailures++;
+    }
+}
+
+static void *
+makeQueue(uint64_t seqnum, int doSequence, int wideNums, uint32_t window)
+{
+    OM_uint32 major, minor;
+    void *seqState = NULL;
+
+    major = sequenceInit(&minor, &seqState, seqnum, TRUE, doSequence,
+                         wideNums, window);
+    GSSBID_ASSERT(major == GSS_S_COMPLETE);
+
+    return seqState;
+}
+
+static void
+freeQueue(void *seqState)
+{
+    OM_uint32 minor;
+
+    sequenceFree(&minor, &seqState);
+}
+
+/* in-order tokens are accepted once; replays and old tokens are not */
+static void
+testDuplicates(void)
+{
+    void *seqState = makeQueue(0, TRUE, TRUE, 0);
+    uint64_t i;
+
+    for (i = 0; i < 200; i++)
+        checkToken(&seqState, i, GSS_S_COMPLETE);
+
+    checkToken(&seqState, 199, GSS_S_DUPLICATE_TOKEN);
+    checkToken(&seqState, 0, GSS_S_DUPLICATE_TOKEN);
+    checkToken(&seqState, 64, GSS_S_DUPLICATE_TOKEN);
+
+    /* a gap is reported, and the missing token is accepted once */
+    checkToken(&seqState, 202, GSS_S_GAP_TOKEN);
+    checkToken(&seqState, 200, GSS_S_UNSEQ_TOKEN);
+    checkToken(&seqState, 200, GSS_S_DUPLICATE_TOKEN);
+    checkToken(&seqState, 203, GSS_S_COMPLETE);
+
+    freeQueue(seqState);
+}
+
+/* tokens just inside the window are accepted, those just outside are not */
+static void
+testWindowEdge(uint32_t window)
+{
+    void *seqState;
+    uint64_t newest = 4 * window;
+
+    /* replay detection only, so in-window tokens complete */
+    seqState = makeQueue(0, FALSE, TRUE, window);
+
+    checkToken(&seqState, 0, GSS_S_COMPLETE);
+    checkToken(&seqState, newest, GSS_S_COMPLETE);
+    checkToken(&seqState, newest - window + 1, GSS_S_COMPLETE);
+    checkToken(&seqState, newest - window + 1, GSS_S_DUPLICATE_TOKEN);
+    checkToken(&seqState, newest - window, GSS_S_OLD_TOKEN);
+    checkToken(&seqState, newest - window - 1, GSS_S_OLD_TOKEN);
+
+    freeQueue(seqState);
+
+    /* with sequencing, tokens outside the window are out of sequence */
+    seqState = makeQueue(0, TRUE, TRUE, window);
+
+    checkToken(&seqState, 0, GSS_S_COMPLETE);
+    checkToken(&seqState, newest, GSS_S_GAP_TOKEN);
+    checkToken(&seqState, newest - window + 1, GSS_S_UNSEQ_TOKEN);
+    checkToken(&seqState, newest - window, GSS_S_UNSEQ_TOKEN);
+
+    freeQueue(seqState);
+}
+
+/*
+ * A jump of more than one word must clear the ring slots of every
+ * skipped sequence number, including those cleared a whole word at a
+ * time, without clearing those of tokens still in the window.
+ */
+static void
+testWindowJump(uint64_t jump)
+{
+    void *seqState = makeQueue(0, FALSE, TRUE, 256);
+    uint64_t i, newest;
+
+    for (i = 0; i < 256; i++)
+        checkToken(&seqState, i, GSS_S_COMPLETE);
+
+    newest = 255 + jump;
+    checkToken(&seqState, newest, GSS_S_COMPLETE);
+
+    for (i = newest - 255; i < 256; i++)
+        checkToken(&seqState, i, GSS_S_DUPLICATE_TOKEN);
+    for (i = 256; i < newest - 255; i++)
+        checkToken(&seqState, i, GSS_S_OLD_TOKEN);
+    for (i = (jump > 255) ? newest - 255 : 256; i < newest; i++)
+        checkToken(&seqState, i, GSS_S_COMPLETE);
+    for (i = (jump > 255) ? newest - 255 : 256; i <= newest; i++)
+        checkToken(&seqState, i, GSS_S_DUPLICATE_TOKEN);
+
+    freeQueue(seqState);
+}
+
+/* 32-bit sequence numbers wrap without losing replay state */
+static void
+testWrap(void)
+{
+    void *seqState = makeQueue(0xfffffff0UL, TRUE, FALSE, 64);
+    uint64_t i;
+
+    for (i = 0xfffffff0UL; i <= 0x10000000fULL; i++)
+        checkToken(&seqState, i & 0xffffffffUL, GSS_S_COMPLETE);
+
+    checkToken(&seqState, 0xfffffffeUL, GSS_S_DUPLICATE_TOKEN);
+    checkToken(&seqState, 0x00000001UL, GSS_S_DUPLICATE_TOKEN);
+
+    freeQueue(seqState);
+}
+
+/* exported state behaves identically once imported */
+static void
+testExternalize(uint32_t window, size_t cbExpected)
+{
+    OM_uint32 major, minor;
+    void *seqState = makeQueue(1000, FALSE, TRUE, window);
+    void *importedState = NULL;
+    unsigned char *buf, *p;
+    size_t cbBuf, cbRemain;
+    uint64_t newest = 1000 + 5000;
+
+    checkToken(&seqState, 1000, GSS_S_COMPLETE);
+    checkToken(&seqState, newest, GSS_S_COMPLETE);
+    checkToken(&seqState, newest - 2, GSS_S_COMPLETE);
+
+    cbBuf = sequenceSize(seqState);
+    GSSBID_ASSERT(cbBuf == cbExpected);
+
+    buf = malloc(cbBuf);
+    GSSBID_ASSERT(buf != NULL);
+
+    p = buf;
+    cbRemain = cbBuf;
+    major = sequenceExternalize(&minor, seqState, &p, &cbRemain);
+    GSSBID_ASSERT(major == GSS_S_COMPLETE);
+    GSSBID_ASSERT(cbRemain == 0 && p == buf + cbBuf);
+
+    /* truncated state is rejected */
+    p = buf;
+    cbRemain = cbBuf - 1;
+    major = sequenceInternalize(&minor, &importedState, &p, &cbRemain);
+    GSSBID_ASSERT(major == GSS_S_DEFECTIVE_TOKEN);
+    GSSBID_ASSERT(importedState == NULL);
+
+    p = buf;
+    cbRemain = cbBuf;
+    major = sequenceInternalize(&minor, &importedState, &p, &cbRemain);
+    GSSBID_ASSERT(major == GSS_S_COMPLETE);
+    GSSBID_ASSERT(cbRemain == 0 && p == buf + cbBuf);
+    GSSBID_ASSERT(sequenceSize(importedState) == cbBuf);
+
+    checkToken(&importedState, newest, GSS_S_DUPLICATE_TOKEN);
+    checkToken(&importedState, newest - 2, GSS_S_DUPLICATE_TOKEN);
+    checkToken(&importedState, newest - 1, GSS_S_COMPLETE);
+    checkToken(&importedState, 1000, GSS_S_OLD_TOKEN);
+    checkToken(&importedState, newest + 1, GSS_S_COMPLETE);
+
+    free(buf);
+    freeQueue(seqState);
+    freeQueue(importedState);
+}
+
+/* a context without sequence state round-trips to one without it */
+static void
+testExternalizeNull(void)
+{
+    OM_uint32 major, minor;
+    void *importedState = &importedState;
+    unsigned char buf[64], *p = buf;
+    size_t cbRemain = sizeof(buf);
+
+    major = sequenceExternalize(&minor, NULL, &p, &cbRemain);
+    GSSBID_ASSERT(major == GSS_S_COMPLETE);
+    GSSBID_ASSERT((size_t)(p - buf) == sequenceSize(NULL));
+
+    p = buf;
+    cbRemain = sequenceSize(NULL);
+    major = sequenceInternalize(&minor, &importedState, &p, &cbRemain);
+    GSSBID_ASSERT(major == GSS_S_COMPLETE);
+    GSSBID_ASSERT(importedState == NULL && cbRemain == 0);
+}
+
+int main(int argc GSSBID_UNUSED, char *argv[] GSSBID_UNUSED)
+{
+    testDuplicates();
+
+    testWindowEdge(64);
+    testWindowEdge(1024);
+    testWindowEdge(4096);
+
+    testWindowJump(1);
+    testWindowJump(63);
+    testWindowJump(65);
+    testWindowJump(130);
+    testWindowJump(255);
+    testWindowJump(1000);
+
+    testWrap();
+
+    /* the header is 32 bytes, followed by one bit per window slot */
+    testExternalize(64, 32 + 8);
+    testExternalize(100, 32 + 16);      /* rounded up to 128 */
+    testExternalize(4096, 32 + 512);
+    testExternalize(0, 32 + 128);       /* the default of 1024 */
+    testExternalizeNull();
+
+    if (cFailures != 0)
+        fprintf(stderr, "%d sequence checks failed\n", cFailures);
+
+    exit(cFailures != 0 ? 1 : 0);
+}
@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2013 PADL Software Pty Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Redistributions in any form must be accompanied by information on
+ *    how to obtain complete source code for the libbrowserid software
+ *    and any accompanying software that uses the libbrowserid software.
+ *    The source code must either be included in the distribution or be
+ *    available for no more than the cost of distribution plus a nominal
+ *    fee, and must be freely redistributable under reasonable conditions.
+ *    For an executable file, complete source code means the source code
+ *    for all modules it contains. It does not include source code for
+ *    modules or files that typically accompany the major components of
+ *    the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED BY PADL SOFTWARE ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, OR
+ * NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL PADL SOFTWARE
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "gssapiP_bid.h"
+
+/*
+ * Benchmark gss_wrap()/gss_unwrap() on a pair of contexts sharing a
+ * fixed key, and check that the steady state allocates nothing beyond
+ * the output token.
+ *
+ * The message protection sources are compiled into this program with
+ * GSSBID_MALLOC and friends pointing at the counting allocator below;
+ * see the Makefile.
+ *
+ * Usage: bid_wrap [iterations [message-length]]
+ */
+
+#ifndef ENCTYPE_AES128_CTS_HMAC_SHA1_96
+#define ENCTYPE_AES128_CTS_HMAC_SHA1_96 17
+#endif
+
+static size_t cAllocs;
+
+void *
+bidTestMalloc(size_t size)
+{
+    cAllocs++;
+    return malloc(size);
+}
+
+void *
+bidTestCalloc(size_t count, size_t size)
+{
+    cAllocs++;
+    return calloc(count, size);
+}
+
+void *
+bidTestRealloc(void *ptr, size_t size)
+{
+    cAllocs++;
+    return realloc(ptr, size);
+}
+
+/* util_tld.c is not linked in; a single thread only needs a krb5_context */
+struct gss_bid_thread_local_data *
+gssBidGetThreadLocalData(void)
+{
+    static struct gss_bid_thread_local_data tld;
+
+    return &tld;
+}
+
+static OM_uint32
+makeContext(OM_uint32 *minor, int isInitiator, gss_ctx_id_t *pCtx)
+{
+    OM_uint32 major;
+    gss_ctx_id_t ctx;
+    unsigned char sessionKey[16];
+
+    memset(sessionKey, 'K', sizeof(sessionKey));
+
+    ctx = (gss_ctx_id_t)GSSBID_CALLOC(1, sizeof(*ctx));
+    if (ctx == NULL) {
+        *minor = ENOMEM;
+        return GSS_S_FAILURE;
+    }
+
+    GSSBID_MUTEX_INIT(&ctx->mutex);
+    GSSBID_MUTEX_INIT(&ctx->seqMutex);
+    GSSBID_MUTEX_INIT(&ctx->rfc3961CryptoMutex);
+    ctx->state = GSSBID_STATE_ESTABLISHED;
+    if (isInitiator)
+        ctx->flags |= CTX_FLAG_INITIATOR;
+    ctx->gssFlags = GSS_C_INTEG_FLAG | GSS_C_CONF_FLAG |
+                    GSS_C_SEQUENCE_FLAG | GSS_C_REPLAY_FLAG;
+    ctx->encryptionType = ENCTYPE_AES128_CTS_HMAC_SHA1_96;
+
+    major = gssBidDeriveRfc3961Key(minor, sessionKey, sizeof(sessionKey),
+                                   ctx->encryptionType, &ctx->rfc3961Key);
+    if (GSS_ERROR(major))
+        return major;
+
+    major = rfc3961ChecksumTypeForKey(minor, &ctx->rfc3961Key,
+                                      &ctx->checksumType);
+    if (GSS_ERROR(major))
+        return major;
+
+    major = gssBidInitRfc3961Crypto(minor, ctx);
+    if (GSS_ERROR(major))
+        return major;
+
+    major = sequenceInit(minor, &ctx->seqState, 0, TRUE, TRUE, TRUE, 0);
+    if (GSS_ERROR(major))
+        return major;
+
+    *pCtx = ctx;
+
+    return GSS_S_COMPLETE;
+}
+
+static void
+releaseContext(gss_ctx_id_t ctx)
+{
+    OM_uint32 tmpMinor;
+    krb5_context krbContext;
+
+    if (ctx == GSS_C_NO_CONTEXT)
+        return;
+
+    gssBidKerberosInit(&tmpMinor, &krbContext);
+    gssBidDestroyRfc3961Crypto(krbContext, ctx);
+    krb5_free_keyblock_contents(krbContext, &ctx->rfc3961Key);
+    sequenceFree(&tmpMinor, &ctx->seqState);
+    GSSBID_MUTEX_DESTROY(&ctx->rfc3961CryptoMutex);
+    GSSBID_MUTEX_DESTROY(&ctx->seqMutex);
+    GSSBID_MUTEX_DESTROY(&ctx->mutex);
+    GSSBID_FREE(ctx);
+}
+
+int main(int argc, char *argv[])
+{
+    OM_uint32 major, minor;
+    gss_ctx_id_t initiatorCtx = GSS_C_NO_CONTEXT;
+    gss_ctx_id_t acceptorCtx = GSS_C_NO_CONTEXT;
+    gss_buffer_desc message = GSS_C_EMPTY_BUFFER;
+    gss_buffer_desc wrapped = GSS_C_EMPTY_BUFFER;
+    gss_buffer_desc unwrapped = GSS_C_EMPTY_BUFFER;
+    int i, cIterations = 100000, confState;
+    size_t cWrapAllocs = 0, cUnwrapAllocs = 0, cbMessage = 1024;
+    struct timeval start, end;
+
+    if (argc > 1)
+        cIterations = atoi(argv[1]);
+    if (argc > 2)
+        cbMessage = atoi(argv[2]);
+
+    major = makeContext(&minor, TRUE, &initiatorCtx);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    major = makeContext(&minor, FALSE, &acceptorCtx);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    message.length = cbMessage;
+    message.value = malloc(message.length);
+    if (message.value == NULL) {
+        major = GSS_S_FAILURE;
+        minor = ENOMEM;
+        goto cleanup;
+    }
+    memset(message.value, 'M', message.length);
+
+    gettimeofday(&start, NULL);
+
+    for (i = 0; i < cIterations; i++) {
+        size_t cAllocsBefore = cAllocs;
+
+        major = gss_wrap(&minor, initiatorCtx, TRUE, GSS_C_QOP_DEFAULT,
+                         &message, &confState, &wrapped);
+        if (GSS_ERROR(major))
+            goto cleanup;
+
+        cWrapAllocs += cAllocs - cAllocsBefore;
+        cAllocsBefore = cAllocs;
+
+        major = gss_unwrap(&minor, acceptorCtx, &wrapped, &unwrapped,
+                           &confState, NULL);
+        if (GSS_ERROR(major))
+            goto cleanup;
+
+        cUnwrapAllocs += cAllocs - cAllocsBefore;
+
+        GSSBID_ASSERT(confState);
+        GSSBID_ASSERT(unwrapped.length == message.length);
+        GSSBID_ASSERT(memcmp(unwrapped.value, message.value, message.length) == 0);
+
+        gss_release_buffer(&minor, &wrapped);
+        gss_release_buffer(&minor, &unwrapped);
+    }
+
+    gettimeofday(&end, NULL);
+
+    /* the output token is the only allocation each way */
+    GSSBID_ASSERT(cWrapAllocs == (size_t)cIterations);
+    GSSBID_ASSERT(cUnwrapAllocs == (size_t)cIterations);
+
+    if (cIterations != 0) {
+        printf("%d wrap/unwrap round trips of %zu bytes, %.3f us per round trip\n",
+               cIterations, cbMessage,
+               ((end.tv_sec - start.tv_sec) * 1000000.0 +
+                (end.tv_usec - start.tv_usec)) / cIterations);
+        printf("%zu allocations per wrap, %zu per unwrap\n",
+               cWrapAllocs / cIterations, cUnwrapAllocs / cIterations);
+    }
+
+cleanup:
+    gss_release_buffer(&minor, &wrapped);
+    gss_release_buffer(&minor, &unwrapped);
+    free(message.value);
+    releaseContext(initiatorCtx);
+    releaseContext(acceptorCtx);
+
+    if (GSS_ERROR(major))
+        fprintf(stderr, "Error %08x/%d\n", major, minor);
+
+    exit(GSS_ERROR(major) ? 1 : 0);
+}
@@ -61,8 +61,6 @@ gss_unwrap(OM_uint32 *minor,
 
     *minor = 0;
 
-    GSSBID_MUTEX_LOCK(&ctx->mutex);
-
     if (!CTX_IS_ESTABLISHED(ctx)) {
         major = GSS_S_NO_CONTEXT;
         *minor = GSSBID_CONTEXT_INCOMPLETE;
@@ -86,7 +84,5 @@ gss_unwrap(OM_uint32 *minor,
     }
 
 cleanup:
-    GSSBID_MUTEX_UNLOCK(&ctx->mutex);
-
     return major;
 }
@@ -67,11 +67,6 @@
 static OM_uint32
 unwrapToken(OM_uint32 *minor,
             gss_ctx_id_t ctx,
-#ifdef HAVE_HEIMDAL_VERSION
-            krb5_crypto krbCrypto,
-#else
-            krb5_keyblock *unused GSSBID_UNUSED,
-#endif
             int *conf_state,
             gss_qop_t *qop_state,
             gss_iov_buffer_desc *iov,
@@ -92,7 +87,9 @@ unwrapToken(OM_uint32 *minor,
     int conf_flag = 0;
     krb5_context krbContext;
 #ifdef HAVE_HEIMDAL_VERSION
-    int freeCrypto = (krbCrypto == NULL);
+    krb5_crypto krbCrypto = NULL;
+#else
+    krb5_key krbCrypto = NULL;
 #endif
 
     GSSBID_KRB_INIT(&krbContext);
@@ -142,14 +139,11 @@ unwrapToken(OM_uint32 *minor,
         goto cleanup;
     }
 
-#ifdef HAVE_HEIMDAL_VERSION
-    if (krbCrypto == NULL) {
-        code = krb5_crypto_init(krbContext, &ctx->rfc3961Key,
-                                ETYPE_NULL, &krbCrypto);
-        if (code != 0)
-            goto cleanup;
-    }
-#endif
+    major = gssBidAcquireRfc3961Crypto(&code, ctx, &krbCrypto);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    major = GSS_S_FAILURE;
 
     if (toktype == TOK_TYPE_WRAP) {
         size_t krbTrailerLen;
@@ -163,12 +157,8 @@ unwrapToken(OM_uint32 *minor,
         rrc = load_uint16_be(ptr + 6);
         seqnum = load_uint64_be(ptr + 8);
 
-        code = krbCryptoLength(krbContext, KRB_CRYPTO_CONTEXT(ctx),
-                               conf_flag ? KRB5_CRYPTO_TYPE_TRAILER :
-                                           KRB5_CRYPTO_TYPE_CHECKSUM,
-                               &krbTrailerLen);
-        if (code != 0)
-            goto cleanup;
+        krbTrailerLen = conf_flag ? ctx->rfc3961Lengths.trailer
+                                  : ctx->rfc3961Lengths.checksum;
 
         /* Deal with RRC */
         if (trailer == NULL) {
@@ -194,7 +184,7 @@ unwrapToken(OM_uint32 *minor,
             /* Decrypt */
             code = gssBidDecrypt(krbContext,
                                  ((ctx->gssFlags & GSS_C_DCE_STYLE) != 0),
-                                 ec, rrc, KRB_CRYPTO_CONTEXT(ctx), keyUsage,
+                                 ec, rrc, krbCrypto, keyUsage,
                                  iov, iov_count);
             if (code != 0) {
                 major = GSS_S_BAD_SIG;
@@ -225,7 +215,7 @@ unwrapToken(OM_uint32 *minor,
             store_uint16_be(0, ptr + 6);
 
             code = gssBidVerify(krbContext, ctx->checksumType, rrc,
-                                KRB_CRYPTO_CONTEXT(ctx), keyUsage,
+                                krbCrypto, keyUsage,
                                 iov, iov_count, &valid);
             if (code != 0 || valid == FALSE) {
                 major = GSS_S_BAD_SIG;
@@ -233,7 +223,9 @@ unwrapToken(OM_uint32 *minor,
             }
         }
 
+        GSSBID_MUTEX_LOCK(&ctx->seqMutex);
         major = sequenceCheck(&code, &ctx->seqState, seqnum);
+        GSSBID_MUTEX_UNLOCK(&ctx->seqMutex);
         if (GSS_ERROR(major))
             goto cleanup;
     } else if (toktype == TOK_TYPE_MIC) {
@@ -253,13 +245,15 @@ unwrapToken(OM_uint32 *minor,
          */
         code = gssBidVerify(krbContext, ctx->checksumType,
                             trailer != NULL ? 0 : header->buffer.length - 16,
-                            KRB_CRYPTO_CONTEXT(ctx), keyUsage,
+                            krbCrypto, keyUsage,
                             iov, iov_count, &valid);
         if (code != 0 || valid == FALSE) {
             major = GSS_S_BAD_SIG;
             goto cleanup;
         }
+        GSSBID_MUTEX_LOCK(&ctx->seqMutex);
         major = sequenceCheck(&code, &ctx->seqState, seqnum);
+        GSSBID_MUTEX_UNLOCK(&ctx->seqMutex);
         if (GSS_ERROR(major))
             goto cleanup;
     } else if (toktype == TOK_TYPE_DELETE_CONTEXT) {
@@ -282,11 +276,8 @@ defective:
     major = GSS_S_DEFECTIVE_TOKEN;
 
 cleanup:
+    gssBidReleaseRfc3961Crypto(ctx, krbCrypto);
     *minor = code;
-#ifdef HAVE_HEIMDAL_VERSION
-    if (freeCrypto && krbCrypto != NULL)
-        krb5_crypto_destroy(krbContext, krbCrypto);
-#endif
 
     return major;
 }
@@ -294,6 +285,7 @@ cleanup:
 int
 rotateLeft(void *ptr, size_t bufsiz, size_t rc)
 {
+    unsigned char tbufScratch[64]; /* RRC is at most EC + 16 + trailer */
     void *tbuf;
 
     if (bufsiz == 0)
@@ -302,14 +294,19 @@ rotateLeft(void *ptr, size_t bufsiz, size_t rc)
     if (rc == 0)
         return 0;
 
-    tbuf = GSSBID_MALLOC(rc);
-    if (tbuf == NULL)
-        return ENOMEM;
+    if (rc <= sizeof(tbufScratch)) {
+        tbuf = tbufScratch;
+    } else {
+        tbuf = GSSBID_MALLOC(rc);
+        if (tbuf == NULL)
+            return ENOMEM;
+    }
 
     memcpy(tbuf, ptr, rc);
     memmove(ptr, (char *)ptr + rc, bufsiz - rc);
     memcpy((char *)ptr + bufsiz - rc, tbuf, rc);
-    GSSBID_FREE(tbuf);
+    if (tbuf != tbufScratch)
+        GSSBID_FREE(tbuf);
 
     return 0;
 }
@@ -329,17 +326,12 @@ unwrapStream(OM_uint32 *minor,
 {
     unsigned char *ptr;
     OM_uint32 code = 0, major = GSS_S_FAILURE;
-    krb5_context krbContext;
     int conf_req_flag;
     int i = 0, j;
+    gss_iov_buffer_desc tiovScratch[GSSBID_IOV_SCRATCH_COUNT];
     gss_iov_buffer_desc *tiov = NULL;
     gss_iov_buffer_t stream, data = NULL;
     gss_iov_buffer_t theader, tdata = NULL, tpadding, ttrailer;
-#ifdef HAVE_HEIMDAL_VERSION
-    krb5_crypto krbCrypto = NULL;
-#endif
-
-    GSSBID_KRB_INIT(&krbContext);
 
     GSSBID_ASSERT(toktype == TOK_TYPE_WRAP);
 
@@ -359,11 +351,16 @@ unwrapStream(OM_uint32 *minor,
     ptr = (unsigned char *)stream->buffer.value;
     ptr += 2; /* skip token type */
 
-    tiov = (gss_iov_buffer_desc *)GSSBID_CALLOC((size_t)iov_count + 2,
-                                                sizeof(gss_iov_buffer_desc));
-    if (tiov == NULL) {
-        code = ENOMEM;
-        goto cleanup;
+    if ((size_t)iov_count + 2 <= GSSBID_IOV_SCRATCH_COUNT) {
+        tiov = tiovScratch;
+        memset(tiov, 0, ((size_t)iov_count + 2) * sizeof(gss_iov_buffer_desc));
+    } else {
+        tiov = (gss_iov_buffer_desc *)GSSBID_CALLOC((size_t)iov_count + 2,
+                                                    sizeof(gss_iov_buffer_desc));
+        if (tiov == NULL) {
+            code = ENOMEM;
+            goto cleanup;
+        }
     }
 
     /* HEADER */
@@ -406,12 +403,6 @@ unwrapStream(OM_uint32 *minor,
     ttrailer = &tiov[i++];
     ttrailer->type = GSS_IOV_BUFFER_TYPE_TRAILER;
 
-#ifdef HAVE_HEIMDAL_VERSION
-    code = krb5_crypto_init(krbContext, &ctx->rfc3961Key, ETYPE_NULL, &krbCrypto);
-    if (code != 0)
-        goto cleanup;
-#endif
-
     {
         size_t ec, rrc;
         size_t krbHeaderLen = 0;
@@ -430,21 +421,13 @@ unwrapStream(OM_uint32 *minor,
         }
 
         if (conf_req_flag) {
-            code = krbCryptoLength(krbContext, KRB_CRYPTO_CONTEXT(ctx),
-                                    KRB5_CRYPTO_TYPE_HEADER, &krbHeaderLen);
-            if (code != 0)
-                goto cleanup;
+            krbHeaderLen = ctx->rfc3961Lengths.header;
             theader->buffer.length += krbHeaderLen; /* length validated later */
         }
 
         /* no PADDING for CFX, EC is used instead */
-        code = krbCryptoLength(krbContext, KRB_CRYPTO_CONTEXT(ctx),
-                               conf_req_flag
-                                  ? KRB5_CRYPTO_TYPE_TRAILER
-                                  : KRB5_CRYPTO_TYPE_CHECKSUM,
-                               &krbTrailerLen);
-        if (code != 0)
-            goto cleanup;
+        krbTrailerLen = conf_req_flag ? ctx->rfc3961Lengths.trailer
+                                      : ctx->rfc3961Lengths.checksum;
 
         ttrailer->buffer.length = ec + (conf_req_flag ? 16 : 0 /* E(Header) */) +
                                   krbTrailerLen;
@@ -486,7 +469,7 @@ unwrapStream(OM_uint32 *minor,
 
     GSSBID_ASSERT(i <= iov_count + 2);
 
-    major = unwrapToken(&code, ctx, KRB_CRYPTO_CONTEXT(ctx),
+    major = unwrapToken(&code, ctx,
                         conf_state, qop_state, tiov, i, toktype);
     if (major == GSS_S_COMPLETE) {
         *data = *tdata;
@@ -498,12 +481,8 @@ unwrapStream(OM_uint32 *minor,
     }
 
 cleanup:
-    if (tiov != NULL)
+    if (tiov != NULL && tiov != tiovScratch)
         GSSBID_FREE(tiov);
-#ifdef HAVE_HEIMDAL_VERSION
-    if (krbCrypto != NULL)
-        krb5_crypto_destroy(krbContext, krbCrypto);
-#endif
 
     *minor = code;
 
@@ -531,7 +510,6 @@ gssBidUnwrapOrVerifyMIC(OM_uint32 *minor,
                              iov, iov_count, toktype);
     } else {
         major = unwrapToken(minor, ctx,
-                            NULL, /* krbCrypto */
                             conf_state, qop_state,
                             iov, iov_count, toktype);
     }
@@ -556,8 +534,6 @@ gss_unwrap_iov(OM_uint32 *minor,
 
     *minor = 0;
 
-    GSSBID_MUTEX_LOCK(&ctx->mutex);
-
     if (!CTX_IS_ESTABLISHED(ctx)) {
         major = GSS_S_NO_CONTEXT;
         *minor = GSSBID_CONTEXT_INCOMPLETE;
@@ -570,7 +546,5 @@ gss_unwrap_iov(OM_uint32 *minor,
         goto cleanup;
 
 cleanup:
-    GSSBID_MUTEX_UNLOCK(&ctx->mutex);
-
     return major;
 }
@@ -187,7 +187,7 @@ gssBidSign(krb5_context context,
 #ifdef HAVE_HEIMDAL_VERSION
            krb5_crypto crypto,
 #else
-           krb5_keyblock *key,
+           krb5_key key,
 #endif
            krb5_keyusage sign_usage,
            gss_iov_buffer_desc *iov,
@@ -200,7 +200,7 @@ gssBidVerify(krb5_context context,
 #ifdef HAVE_HEIMDAL_VERSION
              krb5_crypto crypto,
 #else
-             krb5_keyblock *key,
+             krb5_key key,
 #endif
              krb5_keyusage sign_usage,
              gss_iov_buffer_desc *iov,
@@ -335,13 +335,22 @@ gssBidSetCredCFDictionary(OM_uint32 *minor,
 #endif
 
 /* util_crypt.c */
+
+/*
+ * Number of IOV elements that the message protection routines keep on
+ * the stack before falling back to the heap. This covers gss_wrap(),
+ * gss_unwrap(), gss_get_mic() and gss_verify_mic(), as well as most
+ * IOV callers.
+ */
+#define GSSBID_IOV_SCRATCH_COUNT        16
+
 int
 gssBidEncrypt(krb5_context context, int dce_style, size_t ec,
               size_t rrc,
 #ifdef HAVE_HEIMDAL_VERSION
               krb5_crypto crypto,
 #else
-              krb5_keyblock *key,
+              krb5_key key,
 #endif
               int usage,
               gss_iov_buffer_desc *iov, int iov_count);
@@ -352,7 +361,7 @@ gssBidDecrypt(krb5_context context, int dce_style, size_t ec,
 #ifdef HAVE_HEIMDAL_VERSION
               krb5_crypto crypto,
 #else
-              krb5_keyblock *key,
+              krb5_key key,
 #endif
               int usage,
               gss_iov_buffer_desc *iov, int iov_count);
@@ -419,8 +428,6 @@ gssBidDeriveRfc3961Key(OM_uint32 *minor,
 #define KRB_KT_ENT_KEYBLOCK(e)  (&(e)->keyblock)
 #define KRB_KT_ENT_FREE(c, e)   krb5_kt_free_entry((c), (e))
 
-#define KRB_CRYPTO_CONTEXT(ctx) (krbCrypto)
-
 #define KRB_DATA_INIT(d)        krb5_data_zero((d))
 
 #define KRB_CHECKSUM_TYPE(c)    ((c)->cksumtype)
@@ -449,8 +456,6 @@ gssBidDeriveRfc3961Key(OM_uint32 *minor,
 #define KRB_KT_ENT_KEYBLOCK(e)  (&(e)->key)
 #define KRB_KT_ENT_FREE(c, e)   krb5_free_keytab_entry_contents((c), (e))
 
-#define KRB_CRYPTO_CONTEXT(ctx) (&(ctx)->rfc3961Key)
-
 #define KRB_DATA_INIT(d)        do {        \
         (d)->magic = KV5M_DATA;             \
         (d)->length = 0;                    \
@@ -497,7 +502,7 @@ krbCryptoLength(krb5_context krbContext,
 #ifdef HAVE_HEIMDAL_VERSION
                 krb5_crypto krbCrypto,
 #else
-                krb5_keyblock *key,
+                krb5_key key,
 #endif
                 int type,
                 size_t *length);
@@ -507,7 +512,7 @@ krbPaddingLength(krb5_context krbContext,
 #ifdef HAVE_HEIMDAL_VERSION
                  krb5_crypto krbCrypto,
 #else
-                 krb5_keyblock *key,
+                 krb5_key key,
 #endif
                  size_t dataLength,
                  size_t *padLength);
@@ -517,10 +522,36 @@ krbBlockSize(krb5_context krbContext,
 #ifdef HAVE_HEIMDAL_VERSION
                  krb5_crypto krbCrypto,
 #else
-                 krb5_keyblock *key,
+                 krb5_key key,
 #endif
                  size_t *blockSize);
 
+OM_uint32
+gssBidInitRfc3961Crypto(OM_uint32 *minor, gss_ctx_id_t ctx);
+
+void
+gssBidDestroyRfc3961Crypto(krb5_context krbContext, gss_ctx_id_t ctx);
+
+OM_uint32
+gssBidAcquireRfc3961Crypto(OM_uint32 *minor,
+                           gss_ctx_id_t ctx,
+#ifdef HAVE_HEIMDAL_VERSION
+                           krb5_crypto *pKrbCrypto);
+#else
+                           krb5_key *pKrbCrypto);
+#endif
+
+void
+gssBidReleaseRfc3961Crypto(gss_ctx_id_t ctx,
+#ifdef HAVE_HEIMDAL_VERSION
+                           krb5_crypto krbCrypto);
+#else
+                           krb5_key krbCrypto);
+#endif
+
+size_t
+rfc3961PaddingLength(gss_ctx_id_t ctx, size_t dataLength);
+
 krb5_error_code
 krbEnctypeToString(krb5_context krbContext,
                    krb5_enctype enctype,
@@ -744,7 +775,8 @@ sequenceCheck(OM_uint32 *minor, void **vqueue, uint64_t seqnum);
 
 OM_uint32
 sequenceInit(OM_uint32 *minor, void **vqueue, uint64_t seqnum,
-             int do_replay, int do_sequence, int wide_nums);
+             int do_replay, int do_sequence, int wide_nums,
+             uint32_t window);
 
 /* util_sm.c */
 enum gss_bid_state {
@@ -827,6 +859,11 @@ verifyTokenHeader(OM_uint32 *minor,
 #define GSSBID_MUTEX_UNLOCK(m)          LeaveCriticalSection((m))
 #define GSSBID_ONCE_LEAVE		do { return TRUE; } while (0)
 
+#define GSSBID_ATOMIC_FETCH_INCREMENT64(p)  \
+                                        ((uint64_t)InterlockedExchangeAdd64((volatile LONGLONG *)(p), 1))
+#define GSSBID_ATOMIC_LOAD64(p)         \
+                                        ((uint64_t)InterlockedCompareExchange64((volatile LONGLONG *)(p), 0, 0))
+
 /* Thread-local is handled separately */
 
 #define GSSBID_THREAD_ONCE              INIT_ONCE
@@ -846,6 +883,11 @@ verifyTokenHeader(OM_uint32 *minor,
 #define GSSBID_MUTEX_LOCK(m)            pthread_mutex_lock((m))
 #define GSSBID_MUTEX_UNLOCK(m)          pthread_mutex_unlock((m))
 
+#define GSSBID_ATOMIC_FETCH_INCREMENT64(p)  \
+                                        __sync_fetch_and_add((p), 1)
+#define GSSBID_ATOMIC_LOAD64(p)         \
+                                        __sync_fetch_and_add((p), 0)
+
 #define GSSBID_THREAD_KEY               pthread_key_t
 #define GSSBID_KEY_CREATE(k, d)         pthread_key_create((k), (d))
 #define GSSBID_GETSPECIFIC(k)           pthread_getspecific((k))
@@ -64,7 +64,7 @@ gssBidChecksum(krb5_context context,
 #ifdef HAVE_HEIMDAL_VERSION
                krb5_crypto crypto,
 #else
-               krb5_keyblock *crypto,
+               krb5_key crypto,
 #endif
                krb5_keyusage sign_usage,
                gss_iov_buffer_desc *iov,
@@ -75,6 +75,7 @@ gssBidChecksum(krb5_context context,
     krb5_error_code code;
     gss_iov_buffer_desc *header;
     gss_iov_buffer_desc *trailer;
+    krb5_crypto_iov kiovScratch[GSSBID_IOV_SCRATCH_COUNT];
     krb5_crypto_iov *kiov;
     size_t kiov_count;
     int i = 0, j;
@@ -102,9 +103,13 @@ gssBidChecksum(krb5_context context,
         return KRB5_BAD_MSIZE;
 
     kiov_count = 2 + iov_count;
-    kiov = (krb5_crypto_iov *)GSSBID_MALLOC(kiov_count * sizeof(krb5_crypto_iov));
-    if (kiov == NULL)
-        return ENOMEM;
+    if (kiov_count <= GSSBID_IOV_SCRATCH_COUNT) {
+        kiov = kiovScratch;
+    } else {
+        kiov = (krb5_crypto_iov *)GSSBID_MALLOC(kiov_count * sizeof(krb5_crypto_iov));
+        if (kiov == NULL)
+            return ENOMEM;
+    }
 
     /* Checksum over ( Data | Header ) */
 
@@ -146,17 +151,18 @@ gssBidChecksum(krb5_context context,
     if (verify) {
         krb5_boolean kvalid = FALSE;
 
-        code = krb5_c_verify_checksum_iov(context, type, crypto,
+        code = krb5_k_verify_checksum_iov(context, type, crypto,
                                           sign_usage, kiov, kiov_count, &kvalid);
 
         *valid = kvalid;
     } else {
-        code = krb5_c_make_checksum_iov(context, type, crypto,
+        code = krb5_k_make_checksum_iov(context, type, crypto,
                                         sign_usage, kiov, kiov_count);
     }
 #endif /* HAVE_HEIMDAL_VERSION */
 
-    GSSBID_FREE(kiov);
+    if (kiov != kiovScratch)
+        GSSBID_FREE(kiov);
 
     return code;
 }
@@ -168,7 +174,7 @@ gssBidSign(krb5_context context,
 #ifdef HAVE_HEIMDAL_VERSION
            krb5_crypto crypto,
 #else
-           krb5_keyblock *crypto,
+           krb5_key crypto,
 #endif
            krb5_keyusage sign_usage,
            gss_iov_buffer_desc *iov,
@@ -185,7 +191,7 @@ gssBidVerify(krb5_context context,
 #ifdef HAVE_HEIMDAL_VERSION
              krb5_crypto crypto,
 #else
-             krb5_keyblock *crypto,
+             krb5_key crypto,
 #endif
              krb5_keyusage sign_usage,
              gss_iov_buffer_desc *iov,
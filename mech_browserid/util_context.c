@@ -36,6 +36,82 @@
 
 #include "gssapiP_bid.h"
 
+/*
+ * Per-process template BrowserID contexts, indexed by isInitiator. These
+ * are acquired once, so that the configuration file is parsed and the
+ * caches opened only once; each GSS context gets a cheap clone. They are
+ * never rebuilt, because a new template would open new caches and lose
+ * the state of any memory replay cache, so configuration changes need a
+ * restart. Clones count verification rejections against the template.
+ *
+ * The initiator template has no ticket cache: the default one is chosen
+ * by the calling user's uid and environment, so each clone acquires its
+ * own rather than sharing that of whichever user came first.
+ */
+static BIDContext bidTemplateContexts[2];
+static GSSBID_THREAD_ONCE bidInitiatorTemplateOnce = GSSBID_ONCE_INITIALIZER;
+static GSSBID_THREAD_ONCE bidAcceptorTemplateOnce = GSSBID_ONCE_INITIALIZER;
+
+static uint32_t
+bidContextParams(int isInitiator)
+{
+    uint32_t contextParams = BID_CONTEXT_GSS | BID_CONTEXT_REAUTH;
+
+    if (isInitiator)
+        contextParams |= BID_CONTEXT_USER_AGENT | BID_CONTEXT_TICKET_CACHE;
+    else
+        contextParams |= BID_CONTEXT_RP | BID_CONTEXT_AUTHORITY_CACHE | BID_CONTEXT_REPLAY_CACHE;
+
+    return contextParams;
+}
+
+static void
+acquireTemplateContext(int isInitiator)
+{
+    BIDError err;
+
+    err = BIDAcquireContext(GSSBID_CONFIG_FILE,
+                            bidContextParams(isInitiator) & ~BID_CONTEXT_TICKET_CACHE,
+                            NULL, &bidTemplateContexts[isInitiator]);
+    if (err != BID_S_OK)
+        bidTemplateContexts[isInitiator] = BID_C_NO_CONTEXT;
+}
+
+static GSSBID_ONCE_CALLBACK(acquireInitiatorTemplateContext)
+{
+    acquireTemplateContext(1);
+    GSSBID_ONCE_LEAVE;
+}
+
+static GSSBID_ONCE_CALLBACK(acquireAcceptorTemplateContext)
+{
+    acquireTemplateContext(0);
+    GSSBID_ONCE_LEAVE;
+}
+
+/*
+ * Clone a BrowserID context from the template, falling back to acquiring
+ * a new one if the template could not be created.
+ */
+static BIDError
+bidAcquireContext(int isInitiator,
+                  uint32_t contextParams,
+                  BIDContext *pBidContext)
+{
+    BIDContext templateContext;
+
+    if (isInitiator)
+        GSSBID_ONCE(&bidInitiatorTemplateOnce, acquireInitiatorTemplateContext);
+    else
+        GSSBID_ONCE(&bidAcceptorTemplateOnce, acquireAcceptorTemplateContext);
+
+    templateContext = bidTemplateContexts[isInitiator ? 1 : 0];
+    if (templateContext == BID_C_NO_CONTEXT)
+        return BIDAcquireContext(GSSBID_CONFIG_FILE, contextParams, NULL, pBidContext);
+
+    return BIDCloneContext(templateContext, contextParams, pBidContext);
+}
+
 OM_uint32
 gssBidAllocContext(OM_uint32 *minor,
                    int isInitiator,
@@ -57,7 +133,9 @@ gssBidAllocContext(OM_uint32 *minor,
         goto cleanup;
     }
 
-    if (GSSBID_MUTEX_INIT(&ctx->mutex) != 0) {
+    if (GSSBID_MUTEX_INIT(&ctx->mutex) != 0 ||
+        GSSBID_MUTEX_INIT(&ctx->seqMutex) != 0 ||
+        GSSBID_MUTEX_INIT(&ctx->rfc3961CryptoMutex) != 0) {
         major = GSS_S_FAILURE;
         *minor = GSSBID_GET_LAST_ERROR();
         goto cleanup;
@@ -88,15 +166,11 @@ gssBidAllocContext(OM_uint32 *minor,
         }
     }
 
-    contextParams = BID_CONTEXT_GSS | BID_CONTEXT_REAUTH;
+    contextParams = bidContextParams(isInitiator);
     if (ctx->encryptionType != ENCTYPE_NULL)
         contextParams |= BID_CONTEXT_ECDH_KEYEX;
-    if (isInitiator)
-        contextParams |= BID_CONTEXT_USER_AGENT | BID_CONTEXT_TICKET_CACHE;
-    else
-        contextParams |= BID_CONTEXT_RP | BID_CONTEXT_AUTHORITY_CACHE | BID_CONTEXT_REPLAY_CACHE;
 
-    err = BIDAcquireContext(GSSBID_CONFIG_FILE, contextParams, NULL, &ctx->bidContext);
+    err = bidAcquireContext(isInitiator, contextParams, &ctx->bidContext);
     if (err != BID_S_OK) {
         major = gssBidMapError(minor, err);
         goto cleanup;
@@ -163,6 +237,7 @@ gssBidReleaseContext(OM_uint32 *minor,
         BIDReleaseContext(ctx->bidContext);
     }
 
+    gssBidDestroyRfc3961Crypto(krbContext, ctx);
     krb5_free_keyblock_contents(krbContext, &ctx->rfc3961Key);
     gssBidReleaseName(&tmpMinor, &ctx->initiatorName);
     gssBidReleaseName(&tmpMinor, &ctx->acceptorName);
@@ -174,6 +249,8 @@ gssBidReleaseContext(OM_uint32 *minor,
     gss_release_buffer(&tmpMinor, &ctx->initiatorCtx.serverHash);
     gss_release_buffer(&tmpMinor, &ctx->initiatorCtx.serverCert);
 
+    GSSBID_MUTEX_DESTROY(&ctx->rfc3961CryptoMutex);
+    GSSBID_MUTEX_DESTROY(&ctx->seqMutex);
     GSSBID_MUTEX_DESTROY(&ctx->mutex);
 
     memset(ctx, 0, sizeof(*ctx));
@@ -277,6 +354,36 @@ gssBidContextTime(OM_uint32 *minor,
     return GSS_S_COMPLETE;
 }
 
+/*
+ * Size of the replay and sequence detection window, from the
+ * replay_window appdefault; zero selects the default.
+ */
+static uint32_t
+gssBidGetReplayWindow(void)
+{
+    OM_uint32 tmpMinor;
+    krb5_context krbContext;
+    char *szWindow = NULL;
+    uint32_t window = 0;
+
+    if (GSS_ERROR(gssBidKerberosInit(&tmpMinor, &krbContext)))
+        return 0;
+
+    krb5_appdefault_string(krbContext, "browserid_gss",
+                           NULL, "replay_window", "", &szWindow);
+
+    if (szWindow != NULL) {
+        window = (uint32_t)strtoul(szWindow, NULL, 10);
+#ifdef HAVE_HEIMDAL_VERSION
+        krb5_xfree(szWindow);
+#else
+        krb5_free_default_realm(krbContext, szWindow);
+#endif
+    }
+
+    return window;
+}
+
 /*
  * Mark an acceptor context as ready for cryptographic operations
  */
@@ -330,13 +437,18 @@ gssBidContextReady(OM_uint32 *minor, gss_ctx_id_t ctx, gss_cred_id_t cred)
                                           &ctx->checksumType);
         if (GSS_ERROR(major))
             return major;
+
+        major = gssBidInitRfc3961Crypto(minor, ctx);
+        if (GSS_ERROR(major))
+            return major;
     }
 
     major = sequenceInit(minor,
                          &ctx->seqState, ctx->recvSeq,
                          ((ctx->gssFlags & GSS_C_REPLAY_FLAG) != 0),
                          ((ctx->gssFlags & GSS_C_SEQUENCE_FLAG) != 0),
-                         TRUE);
+                         TRUE,
+                         gssBidGetReplayWindow());
     if (GSS_ERROR(major))
         return major;
 
@@ -93,11 +93,11 @@ mapIov(krb5_context context, int dce_style, size_t ec, size_t rrc,
 #ifdef HAVE_HEIMDAL_VERSION
        krb5_crypto crypto,
 #else
-       krb5_keyblock *crypto,
+       krb5_key crypto,
 #endif
        gss_iov_buffer_desc *iov,
-       int iov_count, krb5_crypto_iov **pkiov,
-       size_t *pkiov_count)
+       int iov_count, krb5_crypto_iov *kiovScratch,
+       krb5_crypto_iov **pkiov, size_t *pkiov_count)
 {
     gss_iov_buffer_t header;
     gss_iov_buffer_t trailer;
@@ -149,9 +149,13 @@ mapIov(krb5_context context, int dce_style, size_t ec, size_t rrc,
         return KRB5_BAD_MSIZE;
 
     kiov_count = 3 + iov_count;
-    kiov = (krb5_crypto_iov *)GSSBID_MALLOC(kiov_count * sizeof(krb5_crypto_iov));
-    if (kiov == NULL)
-        return ENOMEM;
+    if (kiov_count <= GSSBID_IOV_SCRATCH_COUNT) {
+        kiov = kiovScratch;
+    } else {
+        kiov = (krb5_crypto_iov *)GSSBID_MALLOC(kiov_count * sizeof(krb5_crypto_iov));
+        if (kiov == NULL)
+            return ENOMEM;
+    }
 
     /*
      * The krb5 header is located at the end of the GSS header.
@@ -207,7 +211,7 @@ gssBidEncrypt(krb5_context context,
 #ifdef HAVE_HEIMDAL_VERSION
               krb5_crypto crypto,
 #else
-              krb5_keyblock *crypto,
+              krb5_key crypto,
 #endif
               int usage,
               gss_iov_buffer_desc *iov,
@@ -215,23 +219,24 @@ gssBidEncrypt(krb5_context context,
 {
     krb5_error_code code;
     size_t kiov_count;
+    krb5_crypto_iov kiovScratch[GSSBID_IOV_SCRATCH_COUNT];
     krb5_crypto_iov *kiov = NULL;
 
     code = mapIov(context, dce_style, ec, rrc, crypto,
-                  iov, iov_count, &kiov, &kiov_count);
+                  iov, iov_count, kiovScratch, &kiov, &kiov_count);
     if (code != 0)
         goto cleanup;
 
 #ifdef HAVE_HEIMDAL_VERSION
     code = krb5_encrypt_iov_ivec(context, crypto, usage, kiov, kiov_count, NULL);
 #else
-    code = krb5_c_encrypt_iov(context, crypto, usage, NULL, kiov, kiov_count);
+    code = krb5_k_encrypt_iov(context, crypto, usage, NULL, kiov, kiov_count);
 #endif
     if (code != 0)
         goto cleanup;
 
 cleanup:
-    if (kiov != NULL)
+    if (kiov != NULL && kiov != kiovScratch)
         GSSBID_FREE(kiov);
 
     return code;
@@ -245,7 +250,7 @@ gssBidDecrypt(krb5_context context,
 #ifdef HAVE_HEIMDAL_VERSION
               krb5_crypto crypto,
 #else
-              krb5_keyblock *crypto,
+              krb5_key crypto,
 #endif
               int usage,
               gss_iov_buffer_desc *iov,
@@ -253,21 +258,22 @@ gssBidDecrypt(krb5_context context,
 {
     krb5_error_code code;
     size_t kiov_count;
-    krb5_crypto_iov *kiov;
+    krb5_crypto_iov kiovScratch[GSSBID_IOV_SCRATCH_COUNT];
+    krb5_crypto_iov *kiov = NULL;
 
     code = mapIov(context, dce_style, ec, rrc, crypto,
-                  iov, iov_count, &kiov, &kiov_count);
+                  iov, iov_count, kiovScratch, &kiov, &kiov_count);
     if (code != 0)
         goto cleanup;
 
 #ifdef HAVE_HEIMDAL_VERSION
     code = krb5_decrypt_iov_ivec(context, crypto, usage, kiov, kiov_count, NULL);
 #else
-    code = krb5_c_decrypt_iov(context, crypto, usage, NULL, kiov, kiov_count);
+    code = krb5_k_decrypt_iov(context, crypto, usage, NULL, kiov, kiov_count);
 #endif
 
 cleanup:
-    if (kiov != NULL)
+    if (kiov != NULL && kiov != kiovScratch)
         GSSBID_FREE(kiov);
 
     return code;
@@ -282,7 +282,7 @@ krbCryptoLength(krb5_context krbContext,
 #ifdef HAVE_HEIMDAL_VERSION
                 krb5_crypto krbCrypto,
 #else
-                krb5_keyblock *key,
+                krb5_key key,
 #endif
                 int type,
                 size_t *length)
@@ -293,7 +293,7 @@ krbCryptoLength(krb5_context krbContext,
     unsigned int len;
     krb5_error_code code;
 
-    code = krb5_c_crypto_length(krbContext, KRB_KEY_TYPE(key), type, &len);
+    code = krb5_c_crypto_length(krbContext, krb5_k_key_enctype(krbContext, key), type, &len);
     if (code == 0)
         *length = (size_t)len;
 
@@ -306,7 +306,7 @@ krbPaddingLength(krb5_context krbContext,
 #ifdef HAVE_HEIMDAL_VERSION
                  krb5_crypto krbCrypto,
 #else
-                 krb5_keyblock *key,
+                 krb5_key key,
 #endif
                  size_t dataLength,
                  size_t *padLength)
@@ -336,7 +336,8 @@ krbPaddingLength(krb5_context krbContext,
 #else
     unsigned int pad;
 
-    code = krb5_c_padding_length(krbContext, KRB_KEY_TYPE(key), dataLength, &pad);
+    code = krb5_c_padding_length(krbContext, krb5_k_key_enctype(krbContext, key),
+                                 dataLength, &pad);
     if (code == 0)
         *padLength = (size_t)pad;
 
@@ -349,17 +350,208 @@ krbBlockSize(krb5_context krbContext,
 #ifdef HAVE_HEIMDAL_VERSION
                  krb5_crypto krbCrypto,
 #else
-                 krb5_keyblock *key,
+                 krb5_key key,
 #endif
                  size_t *blockSize)
 {
 #ifdef HAVE_HEIMDAL_VERSION
     return krb5_crypto_getblocksize(krbContext, krbCrypto, blockSize);
 #else
-    return krb5_c_block_size(krbContext, KRB_KEY_TYPE(key), blockSize);
+    return krb5_c_block_size(krbContext, krb5_k_key_enctype(krbContext, key), blockSize);
 #endif
 }
 
+static krb5_error_code
+createRfc3961Crypto(krb5_context krbContext,
+                    gss_ctx_id_t ctx,
+#ifdef HAVE_HEIMDAL_VERSION
+                    krb5_crypto *pKrbCrypto)
+{
+    return krb5_crypto_init(krbContext, &ctx->rfc3961Key, ETYPE_NULL, pKrbCrypto);
+}
+#else
+                    krb5_key *pKrbCrypto)
+{
+    return krb5_k_create_key(krbContext, &ctx->rfc3961Key, pKrbCrypto);
+}
+#endif
+
+static void
+destroyRfc3961Crypto(krb5_context krbContext,
+#ifdef HAVE_HEIMDAL_VERSION
+                     krb5_crypto krbCrypto)
+{
+    krb5_crypto_destroy(krbContext, krbCrypto);
+}
+#else
+                     krb5_key krbCrypto)
+{
+    krb5_k_free_key(krbContext, krbCrypto);
+}
+#endif
+
+/*
+ * Create the keyed crypto state for a context's RFC 3961 key and cache
+ * the lengths used to size tokens, so that per-message operations neither
+ * reschedule the key nor requery the enctype. The crypto state also caches
+ * the usage-specific derived keys once they have been used.
+ */
+OM_uint32
+gssBidInitRfc3961Crypto(OM_uint32 *minor, gss_ctx_id_t ctx)
+{
+    krb5_error_code code;
+    krb5_context krbContext;
+    struct gss_bid_rfc3961_lengths *lengths = &ctx->rfc3961Lengths;
+#ifdef HAVE_HEIMDAL_VERSION
+    krb5_crypto krbCrypto;
+#else
+    krb5_key krbCrypto;
+#endif
+
+    GSSBID_KRB_INIT(&krbContext);
+
+    gssBidDestroyRfc3961Crypto(krbContext, ctx);
+
+    code = createRfc3961Crypto(krbContext, ctx, &krbCrypto);
+    if (code != 0)
+        goto cleanup;
+
+    ctx->rfc3961Crypto[ctx->rfc3961CryptoCount++] = krbCrypto;
+
+    code = krbCryptoLength(krbContext, krbCrypto,
+                           KRB5_CRYPTO_TYPE_HEADER, &lengths->header);
+    if (code != 0)
+        goto cleanup;
+
+    code = krbCryptoLength(krbContext, krbCrypto,
+                           KRB5_CRYPTO_TYPE_TRAILER, &lengths->trailer);
+    if (code != 0)
+        goto cleanup;
+
+    code = krbCryptoLength(krbContext, krbCrypto,
+                           KRB5_CRYPTO_TYPE_CHECKSUM, &lengths->checksum);
+    if (code != 0)
+        goto cleanup;
+
+    code = krbCryptoLength(krbContext, krbCrypto,
+                           KRB5_CRYPTO_TYPE_PADDING, &lengths->padding);
+    if (code != 0)
+        goto cleanup;
+
+    code = krbBlockSize(krbContext, krbCrypto, &lengths->blockSize);
+    if (code != 0)
+        goto cleanup;
+
+cleanup:
+    if (code != 0)
+        gssBidDestroyRfc3961Crypto(krbContext, ctx);
+
+    *minor = code;
+
+    return (code == 0) ? GSS_S_COMPLETE : GSS_S_FAILURE;
+}
+
+void
+gssBidDestroyRfc3961Crypto(krb5_context krbContext, gss_ctx_id_t ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->rfc3961CryptoCount; i++) {
+        destroyRfc3961Crypto(krbContext, ctx->rfc3961Crypto[i]);
+        ctx->rfc3961Crypto[i] = NULL;
+    }
+
+    ctx->rfc3961CryptoCount = 0;
+    memset(&ctx->rfc3961Lengths, 0, sizeof(ctx->rfc3961Lengths));
+}
+
+/*
+ * Borrow a crypto handle for a single message. An idle handle is taken
+ * from the context's pool if there is one; otherwise, because another
+ * thread is using the context concurrently, a new one is created.
+ */
+OM_uint32
+gssBidAcquireRfc3961Crypto(OM_uint32 *minor,
+                           gss_ctx_id_t ctx,
+#ifdef HAVE_HEIMDAL_VERSION
+                           krb5_crypto *pKrbCrypto)
+#else
+                           krb5_key *pKrbCrypto)
+#endif
+{
+    krb5_error_code code;
+    krb5_context krbContext;
+
+    *pKrbCrypto = NULL;
+
+    GSSBID_MUTEX_LOCK(&ctx->rfc3961CryptoMutex);
+    if (ctx->rfc3961CryptoCount > 0) {
+        ctx->rfc3961CryptoCount--;
+        *pKrbCrypto = ctx->rfc3961Crypto[ctx->rfc3961CryptoCount];
+        ctx->rfc3961Crypto[ctx->rfc3961CryptoCount] = NULL;
+    }
+    GSSBID_MUTEX_UNLOCK(&ctx->rfc3961CryptoMutex);
+
+    if (*pKrbCrypto != NULL) {
+        *minor = 0;
+        return GSS_S_COMPLETE;
+    }
+
+    GSSBID_KRB_INIT(&krbContext);
+
+    code = createRfc3961Crypto(krbContext, ctx, pKrbCrypto);
+
+    *minor = code;
+
+    return (code == 0) ? GSS_S_COMPLETE : GSS_S_FAILURE;
+}
+
+/*
+ * Return a borrowed crypto handle to the context's pool, destroying it
+ * if the pool is full.
+ */
+void
+gssBidReleaseRfc3961Crypto(gss_ctx_id_t ctx,
+#ifdef HAVE_HEIMDAL_VERSION
+                           krb5_crypto krbCrypto)
+#else
+                           krb5_key krbCrypto)
+#endif
+{
+    OM_uint32 tmpMinor;
+    krb5_context krbContext;
+
+    if (krbCrypto == NULL)
+        return;
+
+    GSSBID_MUTEX_LOCK(&ctx->rfc3961CryptoMutex);
+    if (ctx->rfc3961CryptoCount < GSSBID_CRYPTO_POOL_SIZE) {
+        ctx->rfc3961Crypto[ctx->rfc3961CryptoCount++] = krbCrypto;
+        krbCrypto = NULL;
+    }
+    GSSBID_MUTEX_UNLOCK(&ctx->rfc3961CryptoMutex);
+
+    if (krbCrypto != NULL &&
+        gssBidKerberosInit(&tmpMinor, &krbContext) == GSS_S_COMPLETE)
+        destroyRfc3961Crypto(krbContext, krbCrypto);
+}
+
+/*
+ * Equivalent to krbPaddingLength(), but using the cached lengths.
+ */
+size_t
+rfc3961PaddingLength(gss_ctx_id_t ctx, size_t dataLength)
+{
+    size_t paddingLength = ctx->rfc3961Lengths.padding;
+
+    dataLength += ctx->rfc3961Lengths.header;
+
+    if (paddingLength == 0 || (dataLength % paddingLength) == 0)
+        return 0;
+
+    return paddingLength - (dataLength % paddingLength);
+}
+
 krb5_error_code
 krbEnctypeToString(
 #ifdef HAVE_HEIMDAL_VERSION
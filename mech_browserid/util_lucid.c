@@ -73,7 +73,7 @@ gssBidExportLucidSecContext(OM_uint32 *minor,
     if (code != 0)
         goto cleanup;
 
-    code = krb5_store_int32(sp, ctx->sendSeq);
+    code = krb5_store_int32(sp, GSSBID_ATOMIC_LOAD64(&ctx->sendSeq));
     if (code != 0)
         goto cleanup;
 
@@ -140,7 +140,7 @@ cleanup:
         lctx->endtime = KRB_TIME_FOREVER;
     else
         lctx->endtime = ctx->expiryTime;
-    lctx->send_seq = ctx->sendSeq;
+    lctx->send_seq = GSSBID_ATOMIC_LOAD64(&ctx->sendSeq);
     lctx->recv_seq = ctx->recvSeq;
     lctx->protocol = 1;
 
@@ -53,64 +53,94 @@
 
 /*
  * Functions to check sequence numbers for replay and sequencing
+ *
+ * Received sequence numbers are tracked in a sliding window bitmap, after
+ * RFC 6479: the bitmap is a ring indexed by sequence number, so that an
+ * in-order token touches a single bit and advancing the window clears
+ * whole words at a time.
  */
 
+#include <stddef.h>
+
 #include "gssapiP_bid.h"
 
-#define QUEUE_LENGTH 20
+#define SEQ_WORD_BITS       64
+#define SEQ_WINDOW_MIN      SEQ_WORD_BITS
+#define SEQ_WINDOW_MAX      65536
+#define SEQ_WINDOW_DEFAULT  1024
 
 typedef struct _queue {
     int do_replay;
     int do_sequence;
-    int start;
-    int length;
+    uint32_t window;
     uint64_t firstnum;
-    /* Stored as deltas from firstnum.  This way, the high bit won't
+    /* Stored relative to firstnum.  This way, the high bit won't
        overflow unless we've actually gone through 2**n messages, or
        gotten something *way* out of sequence.  */
-    uint64_t elem[QUEUE_LENGTH];
+    uint64_t next;
     /* All ones for 64-bit sequence numbers; 32 ones for 32-bit
        sequence numbers.  */
     uint64_t mask;
+    /* window bits, one per sequence number in [next - window, next) */
+    uint64_t bitmap[1];
 } queue;
 
-/* rep invariant:
- *  - the queue is a circular queue.  The first element (q->elem[q->start])
- * is the oldest.  The last element is the newest.
- */
+/* flags, window, firstnum, next, mask */
+#define QHEADER_SIZE        (4 + 4 + 8 + 8 + 8)
 
-#define QSIZE(q) (sizeof((q)->elem)/sizeof((q)->elem[0]))
-#define QELEM(q,i) ((q)->elem[(i)%QSIZE(q)])
+#define QWORDS(window)      ((window) / SEQ_WORD_BITS)
+#define QSIZE(window)       (offsetof(queue, bitmap) + \
+                             QWORDS(window) * sizeof(uint64_t))
 
-static void
-queue_insert(queue *q, int after, uint64_t seqnum)
-{
-    /* insert.  this is not the fastest way, but it's easy, and it's
-       optimized for insert at end, which is the common case */
-    int i;
-
-    /* common case: at end, after == q->start+q->length-1 */
+#define QWORD(q, n)         ((q)->bitmap[((n) % (q)->window) / SEQ_WORD_BITS])
+#define QBIT(n)             ((uint64_t)1 << ((n) % SEQ_WORD_BITS))
 
-    /* move all the elements (after,last] up one slot */
+static uint32_t
+queue_window_size(uint32_t window)
+{
+    uint32_t size;
 
-    for (i = q->start + q->length - 1; i > after; i--)
-        QELEM(q,i+1) = QELEM(q,i);
+    if (window == 0)
+        window = SEQ_WINDOW_DEFAULT;
+    else if (window < SEQ_WINDOW_MIN)
+        window = SEQ_WINDOW_MIN;
+    else if (window > SEQ_WINDOW_MAX)
+        window = SEQ_WINDOW_MAX;
 
-    /* fill in slot after+1 */
+    /* round up to a power of two, so the ring survives 32-bit wrap */
+    for (size = SEQ_WINDOW_MIN; size < window; size <<= 1)
+        ;
 
-    QELEM(q,after+1) = seqnum;
+    return size;
+}
 
-    /* Either increase the length by one, or move the starting point up
-       one (deleting the first element, which got bashed above), as
-       appropriate. */
+/*
+ * Slide the window forward so that seqnum is its newest entry, clearing
+ * the slots that now represent sequence numbers not yet received.
+ */
+static void
+queue_advance(queue *q, uint64_t seqnum)
+{
+    uint64_t n = ((seqnum - q->next) & q->mask) + 1;
+    uint64_t i = q->next;
 
-    if (q->length == QSIZE(q)) {
-        q->start++;
-        if (q->start == QSIZE(q))
-            q->start = 0;
+    if (n >= q->window) {
+        memset(q->bitmap, 0, QWORDS(q->window) * sizeof(uint64_t));
     } else {
-        q->length++;
+        while (n != 0) {
+            if ((i % SEQ_WORD_BITS) == 0 && n >= SEQ_WORD_BITS) {
+                QWORD(q, i) = 0;
+                i += SEQ_WORD_BITS;
+                n -= SEQ_WORD_BITS;
+            } else {
+                QWORD(q, i) &= ~(QBIT(i));
+                i++;
+                n--;
+            }
+        }
     }
+
+    q->next = (seqnum + 1) & q->mask;
 }
 
 OM_uint32
@@ -119,11 +149,14 @@ sequenceInit(OM_uint32 *minor,
              uint64_t seqnum,
              int do_replay,
              int do_sequence,
-             int wide_nums)
+             int wide_nums,
+             uint32_t window)
 {
     queue *q;
 
-    q = (queue *)GSSBID_CALLOC(1, sizeof(queue));
+    window = queue_window_size(window);
+
+    q = (queue *)GSSBID_CALLOC(1, QSIZE(window));
     if (q == NULL) {
         *minor = ENOMEM;
         return GSS_S_FAILURE;
@@ -131,12 +164,11 @@ sequenceInit(OM_uint32 *minor,
 
     q->do_replay = do_replay;
     q->do_sequence = do_sequence;
+    q->window = window;
     q->mask = wide_nums ? ~(uint64_t)0 : 0xffffffffUL;
 
-    q->start = 0;
-    q->length = 1;
     q->firstnum = seqnum;
-    q->elem[q->start] = ((uint64_t)0 - 1) & q->mask;
+    q->next = 0;
 
     *vqueue = (void *)q;
 
@@ -149,14 +181,13 @@ sequenceCheck(OM_uint32 *minor,
               uint64_t seqnum)
 {
     queue *q;
-    int i;
-    uint64_t expected;
+    uint64_t ahead, behind;
 
     *minor = 0;
 
     q = (queue *) (*vqueue);
 
-    if (!q->do_replay && !q->do_sequence)
+    if (q == NULL || (!q->do_replay && !q->do_sequence))
         return GSS_S_COMPLETE;
 
     /* All checks are done relative to the initial sequence number, to
@@ -168,68 +199,43 @@ sequenceCheck(OM_uint32 *minor,
        2**32 messages sent with 32-bit sequence numbers.  */
     seqnum &= q->mask;
 
-    /* rule 1: expected sequence number */
+    ahead = (seqnum - q->next) & q->mask;
 
-    expected = (QELEM(q,q->start+q->length-1)+1) & q->mask;
-    if (seqnum == expected) {
-        queue_insert(q, q->start+q->length-1, seqnum);
-        return GSS_S_COMPLETE;
-    }
+    /* rule 1 + 2: expected or greater sequence number (top bit of
+       the difference clear, giving 2**31 or 2**63 numbers "new") */
 
-    /* rule 2: > expected sequence number */
+    if ((ahead & (1 + (q->mask >> 1))) == 0) {
+        queue_advance(q, seqnum);
+        QWORD(q, seqnum) |= QBIT(seqnum);
 
-    if ((seqnum > expected)) {
-        queue_insert(q, q->start+q->length-1, seqnum);
-        if (q->do_replay && !q->do_sequence)
+        if (ahead == 0 || (q->do_replay && !q->do_sequence))
             return GSS_S_COMPLETE;
         else
             return GSS_S_GAP_TOKEN;
     }
 
-    /* rule 3: seqnum < seqnum(first) */
-
-    if ((seqnum < QELEM(q,q->start)) &&
-        /* Is top bit of whatever width we're using set?
+    /* rule 3: older than the window, or than the first token */
 
-           We used to check for greater than or equal to firstnum, but
-           (1) we've since switched to compute values relative to
-           firstnum, so the lowest we can have is 0, and (2) the effect
-           of the original scheme was highly dependent on whether
-           firstnum was close to either side of 0.  (Consider
-           firstnum==0xFFFFFFFE and we miss three packets; the next
-           packet is *new* but would look old.)
+    behind = (q->next - 1 - seqnum) & q->mask;
 
-           This check should give us 2**31 or 2**63 messages "new", and
-           just as many "old".  That's not quite right either.  */
-        (seqnum & (1 + (q->mask >> 1)))
-    ) {
+    if (behind >= q->window || behind >= q->next) {
         if (q->do_replay && !q->do_sequence)
             return GSS_S_OLD_TOKEN;
         else
             return GSS_S_UNSEQ_TOKEN;
     }
 
-    /* rule 4+5: seqnum in [seqnum(first),seqnum(last)]  */
-
-    else {
-        if (seqnum == QELEM(q,q->start+q->length - 1))
-            return GSS_S_DUPLICATE_TOKEN;
-
-        for (i = q->start; i < q->start + q->length - 1; i++) {
-            if (seqnum == QELEM(q,i))
-                return GSS_S_DUPLICATE_TOKEN;
-            if ((seqnum > QELEM(q,i)) && (seqnum < QELEM(q,i+1))) {
-                queue_insert(q, i, seqnum);
-                if (q->do_replay && !q->do_sequence)
-                    return GSS_S_COMPLETE;
-                else
-                    return GSS_S_UNSEQ_TOKEN;
-            }
-        }
-    }
+    /* rule 4+5: within the window */
 
-    /* this should never happen */
-    return GSS_S_FAILURE;
+    if (QWORD(q, seqnum) & QBIT(seqnum))
+        return GSS_S_DUPLICATE_TOKEN;
+
+    QWORD(q, seqnum) |= QBIT(seqnum);
+
+    if (q->do_replay && !q->do_sequence)
+        return GSS_S_COMPLETE;
+    else
+        return GSS_S_UNSEQ_TOKEN;
 }
 
 OM_uint32
@@ -248,12 +254,17 @@ sequenceFree(OM_uint32 *minor, void **vqueue)
 }
 
 /*
- * These support functions are for the serialization routines
+ * These support functions are for the serialization routines. The
+ * window is encoded in network byte order, so exported contexts can
+ * be imported on hosts of either endianness.
  */
 size_t
-sequenceSize(void *vqueue GSSBID_UNUSED)
+sequenceSize(void *vqueue)
 {
-    return sizeof(queue);
+    queue *q = (queue *)vqueue;
+
+    return QHEADER_SIZE +
+        (q != NULL ? QWORDS(q->window) * sizeof(uint64_t) : 0);
 }
 
 OM_uint32
@@ -262,16 +273,35 @@ sequenceExternalize(OM_uint32 *minor,
                     unsigned char **buf,
                     size_t *lenremain)
 {
-    if (*lenremain < sizeof(queue)) {
+    queue *q = (queue *)vqueue;
+    unsigned char *p = *buf;
+    size_t size = sequenceSize(vqueue);
+    uint32_t i;
+
+    if (*lenremain < size) {
         *minor = GSSBID_WRONG_SIZE;
         return GSS_S_FAILURE;
     }
-    if (vqueue != NULL)
-        memcpy(*buf, vqueue, sizeof(queue));
-    else
-        memset(*buf, 0, sizeof(queue));
-    *buf += sizeof(queue);
-    *lenremain -= sizeof(queue);
+
+    if (q != NULL) {
+        store_uint32_be((q->do_replay ? 1 : 0) | (q->do_sequence ? 2 : 0), &p[0]);
+        store_uint32_be(q->window,      &p[4]);
+        store_uint64_be(q->firstnum,    &p[8]);
+        store_uint64_be(q->next,        &p[16]);
+        store_uint64_be(q->mask,        &p[24]);
+        p += QHEADER_SIZE;
+
+        for (i = 0; i < QWORDS(q->window); i++) {
+            store_uint64_be(q->bitmap[i], p);
+            p += sizeof(uint64_t);
+        }
+    } else {
+        memset(p, 0, QHEADER_SIZE);
+        p += QHEADER_SIZE;
+    }
+
+    *buf = p;
+    *lenremain -= size;
 
     return 0;
 }
@@ -282,22 +312,65 @@ sequenceInternalize(OM_uint32 *minor,
                     unsigned char **buf,
                     size_t *lenremain)
 {
-    void *q;
+    queue *q;
+    unsigned char *p = *buf;
+    uint32_t flags, window, i;
+    size_t size;
 
-    if (*lenremain < sizeof(queue)) {
+    *vqueue = NULL;
+
+    if (*lenremain < QHEADER_SIZE) {
         *minor = GSSBID_TOK_TRUNC;
         return GSS_S_DEFECTIVE_TOKEN;
     }
 
-    q = GSSBID_MALLOC(sizeof(queue));
-    if (q == NULL) {
-        *minor = ENOMEM;
-        return GSS_S_FAILURE;
+    flags  = load_uint32_be(&p[0]);
+    window = load_uint32_be(&p[4]);
+
+    if (window == 0) {
+        /* no sequence state was exported */
+        size = QHEADER_SIZE;
+        q = NULL;
+    } else {
+        if (window != queue_window_size(window)) {
+            *minor = GSSBID_WRONG_SIZE;
+            return GSS_S_DEFECTIVE_TOKEN;
+        }
+
+        size = QHEADER_SIZE + QWORDS(window) * sizeof(uint64_t);
+        if (*lenremain < size) {
+            *minor = GSSBID_TOK_TRUNC;
+            return GSS_S_DEFECTIVE_TOKEN;
+        }
+
+        q = (queue *)GSSBID_MALLOC(QSIZE(window));
+        if (q == NULL) {
+            *minor = ENOMEM;
+            return GSS_S_FAILURE;
+        }
+
+        q->do_replay   = ((flags & 1) != 0);
+        q->do_sequence = ((flags & 2) != 0);
+        q->window      = window;
+        q->firstnum    = load_uint64_be(&p[8]);
+        q->next        = load_uint64_be(&p[16]);
+        q->mask        = load_uint64_be(&p[24]);
+        p += QHEADER_SIZE;
+
+        if (q->mask != ~(uint64_t)0 && q->mask != 0xffffffffUL) {
+            GSSBID_FREE(q);
+            *minor = GSSBID_WRONG_SIZE;
+            return GSS_S_DEFECTIVE_TOKEN;
+        }
+
+        for (i = 0; i < QWORDS(window); i++) {
+            q->bitmap[i] = load_uint64_be(p);
+            p += sizeof(uint64_t);
+        }
     }
 
-    memcpy(q, *buf, sizeof(queue));
-    *buf += sizeof(queue);
-    *lenremain -= sizeof(queue);
+    *buf += size;
+    *lenremain -= size;
     *vqueue = q;
 
     *minor = 0;
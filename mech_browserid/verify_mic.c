@@ -67,12 +67,8 @@ gss_verify_mic(OM_uint32 *minor,
     iov[1].type = GSS_IOV_BUFFER_TYPE_HEADER;
     iov[1].buffer = *message_token;
 
-    GSSBID_MUTEX_LOCK(&ctx->mutex);
-
     major = gssBidUnwrapOrVerifyMIC(minor, ctx, &conf_state, qop_state,
                                     iov, 2, TOK_TYPE_MIC);
 
-    GSSBID_MUTEX_UNLOCK(&ctx->mutex);
-
     return major;
 }
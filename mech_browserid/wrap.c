@@ -61,8 +61,6 @@ gss_wrap(OM_uint32 *minor,
 
     *minor = 0;
 
-    GSSBID_MUTEX_LOCK(&ctx->mutex);
-
     if (!CTX_IS_ESTABLISHED(ctx)) {
         major = GSS_S_NO_CONTEXT;
         *minor = GSSBID_CONTEXT_INCOMPLETE;
@@ -76,8 +74,6 @@ gss_wrap(OM_uint32 *minor,
         goto cleanup;
 
 cleanup:
-    GSSBID_MUTEX_UNLOCK(&ctx->mutex);
-
     return major;
 }
 
@@ -99,10 +99,14 @@ gssBidWrapOrGetMIC(OM_uint32 *minor,
     size_t rrc = 0;
     size_t gssHeaderLen, gssTrailerLen;
     size_t dataLen, assocDataLen;
+    uint64_t seqnum;
     krb5_context krbContext;
 #ifdef HAVE_HEIMDAL_VERSION
     krb5_crypto krbCrypto = NULL;
+#else
+    krb5_key krbCrypto = NULL;
 #endif
+    OM_uint32 major;
 
     if (ctx->encryptionType == ENCTYPE_NULL) {
         *minor = GSSBID_KEY_UNAVAILABLE;
@@ -137,39 +141,23 @@ gssBidWrapOrGetMIC(OM_uint32 *minor,
 
     trailer = gssBidLocateIov(iov, iov_count, GSS_IOV_BUFFER_TYPE_TRAILER);
 
-#ifdef HAVE_HEIMDAL_VERSION
-    code = krb5_crypto_init(krbContext, &ctx->rfc3961Key, ETYPE_NULL, &krbCrypto);
-    if (code != 0)
-        goto cleanup;
-#endif
+    major = gssBidAcquireRfc3961Crypto(minor, ctx, &krbCrypto);
+    if (GSS_ERROR(major))
+        return major;
 
     if (toktype == TOK_TYPE_WRAP && conf_req_flag) {
         size_t krbHeaderLen, krbTrailerLen, krbPadLen;
         size_t ec = 0, confDataLen = dataLen - assocDataLen;
 
-        code = krbCryptoLength(krbContext, KRB_CRYPTO_CONTEXT(ctx),
-                               KRB5_CRYPTO_TYPE_HEADER, &krbHeaderLen);
-        if (code != 0)
-            goto cleanup;
-
-        code = krbPaddingLength(krbContext, KRB_CRYPTO_CONTEXT(ctx),
-                                confDataLen + 16 /* E(Header) */,
-                                &krbPadLen);
-        if (code != 0)
-            goto cleanup;
+        krbHeaderLen = ctx->rfc3961Lengths.header;
+        krbTrailerLen = ctx->rfc3961Lengths.trailer;
+        krbPadLen = rfc3961PaddingLength(ctx, confDataLen + 16 /* E(Header) */);
 
-        if (krbPadLen == 0 && (ctx->gssFlags & GSS_C_DCE_STYLE)) {
-            code = krbBlockSize(krbContext, KRB_CRYPTO_CONTEXT(ctx), &ec);
-            if (code != 0)
-                goto cleanup;
-        } else
+        if (krbPadLen == 0 && (ctx->gssFlags & GSS_C_DCE_STYLE))
+            ec = ctx->rfc3961Lengths.blockSize;
+        else
             ec = krbPadLen;
 
-        code = krbCryptoLength(krbContext, KRB_CRYPTO_CONTEXT(ctx),
-                               KRB5_CRYPTO_TYPE_TRAILER, &krbTrailerLen);
-        if (code != 0)
-            goto cleanup;
-
         gssHeaderLen = 16 /* Header */ + krbHeaderLen;
         gssTrailerLen = ec + 16 /* E(Header) */ + krbTrailerLen;
 
@@ -211,7 +199,9 @@ gssBidWrapOrGetMIC(OM_uint32 *minor,
         store_uint16_be(ec, outbuf + 4);
         /* RRC */
         store_uint16_be(0, outbuf + 6);
-        store_uint64_be(ctx->sendSeq, outbuf + 8);
+        /* reserve sequence number; concurrent callers get distinct ones */
+        seqnum = GSSBID_ATOMIC_FETCH_INCREMENT64(&ctx->sendSeq);
+        store_uint64_be(seqnum, outbuf + 8);
 
         /*
          * EC | copy of header to be encrypted, located in
@@ -227,24 +217,18 @@ gssBidWrapOrGetMIC(OM_uint32 *minor,
 
         code = gssBidEncrypt(krbContext,
                              ((ctx->gssFlags & GSS_C_DCE_STYLE) != 0),
-                             ec, rrc, KRB_CRYPTO_CONTEXT(ctx),
+                             ec, rrc, krbCrypto,
                              keyUsage, iov, iov_count);
         if (code != 0)
             goto cleanup;
 
         /* RRC */
         store_uint16_be(rrc, outbuf + 6);
-
-        ctx->sendSeq++;
     } else if (toktype == TOK_TYPE_WRAP && !conf_req_flag) {
     wrap_with_checksum:
 
         gssHeaderLen = 16;
-
-        code = krbCryptoLength(krbContext, KRB_CRYPTO_CONTEXT(ctx),
-                               KRB5_CRYPTO_TYPE_CHECKSUM, &gssTrailerLen);
-        if (code != 0)
-            goto cleanup;
+        gssTrailerLen = ctx->rfc3961Lengths.checksum;
 
         GSSBID_ASSERT(gssTrailerLen <= 0xFFFF);
 
@@ -291,16 +275,16 @@ gssBidWrapOrGetMIC(OM_uint32 *minor,
             store_uint16_be(0xFFFF, outbuf + 4);
             store_uint16_be(0xFFFF, outbuf + 6);
         }
-        store_uint64_be(ctx->sendSeq, outbuf + 8);
+        /* reserve sequence number; concurrent callers get distinct ones */
+        seqnum = GSSBID_ATOMIC_FETCH_INCREMENT64(&ctx->sendSeq);
+        store_uint64_be(seqnum, outbuf + 8);
 
         code = gssBidSign(krbContext, ctx->checksumType, rrc,
-                          KRB_CRYPTO_CONTEXT(ctx), keyUsage,
+                          krbCrypto, keyUsage,
                           iov, iov_count);
         if (code != 0)
             goto cleanup;
 
-        ctx->sendSeq++;
-
         if (toktype == TOK_TYPE_WRAP) {
             /* Fix up EC field */
             store_uint16_be(gssTrailerLen, outbuf + 4);
@@ -324,10 +308,7 @@ gssBidWrapOrGetMIC(OM_uint32 *minor,
 cleanup:
     if (code != 0)
         gssBidReleaseIov(iov, iov_count);
-#ifdef HAVE_HEIMDAL_VERSION
-    if (krbCrypto != NULL)
-        krb5_crypto_destroy(krbContext, krbCrypto);
-#endif
+    gssBidReleaseRfc3961Crypto(ctx, krbCrypto);
 
     *minor = code;
 
@@ -357,8 +338,6 @@ gss_wrap_iov(OM_uint32 *minor,
 
     *minor = 0;
 
-    GSSBID_MUTEX_LOCK(&ctx->mutex);
-
     if (!CTX_IS_ESTABLISHED(ctx)) {
         major = GSS_S_NO_CONTEXT;
         *minor = GSSBID_CONTEXT_INCOMPLETE;
@@ -371,7 +350,5 @@ gss_wrap_iov(OM_uint32 *minor,
         goto cleanup;
 
 cleanup:
-    GSSBID_MUTEX_UNLOCK(&ctx->mutex);
-
     return major;
 }
@@ -76,13 +76,8 @@ gssBidWrapIovLength(OM_uint32 *minor,
     size_t dataLength, assocDataLength;
     size_t gssHeaderLen, gssPadLen, gssTrailerLen;
     size_t krbHeaderLen = 0, krbTrailerLen = 0, krbPadLen = 0;
-    krb5_error_code code;
-    krb5_context krbContext;
     int dce_style;
     size_t ec;
-#ifdef HAVE_HEIMDAL_VERSION
-    krb5_crypto krbCrypto = NULL;
-#endif
 
     if (qop_req != GSS_C_QOP_DEFAULT) {
         *minor = GSSBID_UNKNOWN_QOP;
@@ -94,8 +89,6 @@ gssBidWrapIovLength(OM_uint32 *minor,
         return GSS_S_UNAVAILABLE;
     }
 
-    GSSBID_KRB_INIT(&krbContext);
-
     header = gssBidLocateIov(iov, iov_count, GSS_IOV_BUFFER_TYPE_HEADER);
     if (header == NULL) {
         *minor = GSSBID_MISSING_IOV;
@@ -123,28 +116,11 @@ gssBidWrapIovLength(OM_uint32 *minor,
 
     gssPadLen = gssTrailerLen = 0;
 
-#ifdef HAVE_HEIMDAL_VERSION
-    code = krb5_crypto_init(krbContext, &ctx->rfc3961Key, ETYPE_NULL, &krbCrypto);
-    if (code != 0)
-        return code;
-#endif
-
-    code = krbCryptoLength(krbContext, KRB_CRYPTO_CONTEXT(ctx),
-                           conf_req_flag ?
-                                KRB5_CRYPTO_TYPE_TRAILER : KRB5_CRYPTO_TYPE_CHECKSUM,
-                           &krbTrailerLen);
-    if (code != 0) {
-        *minor = code;
-        return GSS_S_FAILURE;
-    }
-
     if (conf_req_flag) {
-        code = krbCryptoLength(krbContext, KRB_CRYPTO_CONTEXT(ctx),
-                               KRB5_CRYPTO_TYPE_HEADER, &krbHeaderLen);
-        if (code != 0) {
-            *minor = code;
-            return GSS_S_FAILURE;
-        }
+        krbHeaderLen = ctx->rfc3961Lengths.header;
+        krbTrailerLen = ctx->rfc3961Lengths.trailer;
+    } else {
+        krbTrailerLen = ctx->rfc3961Lengths.checksum;
     }
 
     gssHeaderLen = 16; /* Header */
@@ -152,21 +128,12 @@ gssBidWrapIovLength(OM_uint32 *minor,
         gssHeaderLen += krbHeaderLen; /* Kerb-Header */
         gssTrailerLen = 16 /* E(Header) */ + krbTrailerLen; /* Kerb-Trailer */
 
-        code = krbPaddingLength(krbContext, KRB_CRYPTO_CONTEXT(ctx),
-                                dataLength - assocDataLength + 16 /* E(Header) */,
-                                &krbPadLen);
-        if (code != 0) {
-            *minor = code;
-            return GSS_S_FAILURE;
-        }
+        krbPadLen = rfc3961PaddingLength(ctx,
+                                         dataLength - assocDataLength + 16 /* E(Header) */);
 
         if (krbPadLen == 0 && dce_style) {
             /* Windows rejects AEAD tokens with non-zero EC */
-            code = krbBlockSize(krbContext, KRB_CRYPTO_CONTEXT(ctx), &ec);
-            if (code != 0) {
-                *minor = code;
-                return GSS_S_FAILURE;
-            }
+            ec = ctx->rfc3961Lengths.blockSize;
         } else
             ec = krbPadLen;
 
@@ -214,8 +181,6 @@ gss_wrap_iov_length(OM_uint32 *minor,
 
     *minor = 0;
 
-    GSSBID_MUTEX_LOCK(&ctx->mutex);
-
     if (!CTX_IS_ESTABLISHED(ctx)) {
         major = GSS_S_NO_CONTEXT;
         *minor = GSSBID_CONTEXT_INCOMPLETE;
@@ -228,7 +193,5 @@ gss_wrap_iov_length(OM_uint32 *minor,
         goto cleanup;
 
 cleanup:
-    GSSBID_MUTEX_UNLOCK(&ctx->mutex);
-
     return major;
 }